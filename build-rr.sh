@@ -38,11 +38,12 @@ helpme ()
 {
 
 	printf "Usage: $0 [-d destdir] [-j num] [-k] [-o objdir] [-q]\n"
-	printf "\t[-s srcdir] hw|xen|sel4 [build] [install] [-- buildrump.sh opts]\n"
+	printf "\t[-s srcdir] [-t] hw|xen|sel4 [build] [install] [-- buildrump.sh opts]\n"
 	printf "\n"
 	printf "\t-d: destination base directory, used by \"install\".\n"
 	printf "\t-j: run <num> make jobs simultaneously.\n"
-	printf "\t-q: quiet(er) build.  option may be specified twice.\n\n"
+	printf "\t-q: quiet(er) build.  option may be specified twice.\n"
+	printf "\t-t: compile in scheduler and hot path event tracing.\n\n"
 	printf "\tThe default actions are \"build\" and \"install\"\n\n"
 
 	printf "Expert-only options:\n"
@@ -99,6 +100,7 @@ parseargs ()
 	STDJ=-j4
 	EXTSRC=
 	MAKE_SILENT=
+	TRACE=no
 
 	DObuild=false
 	DOinstall=false
@@ -116,7 +118,7 @@ parseargs ()
 	DOpci=false
 
 	orignargs=$#
-	while getopts '?d:hj:ko:qs:' opt; do
+	while getopts '?d:hj:ko:qs:t' opt; do
 		case "$opt" in
 		'j')
 			[ -z "$(echo ${OPTARG} | tr -d '[0-9]')" ] \
@@ -140,6 +142,9 @@ parseargs ()
 			BUILD_QUIET=${BUILD_QUIET:=-}q
 			MAKE_SILENT=-s
 			;;
+		't')
+			TRACE=yes
+			;;
 		'h'|'?')
 			helpme
 			exit 1
@@ -491,6 +496,7 @@ makeconfig ()
 	echo "TOOLTUPLE=${quote}${TOOLTUPLE}${quote}" >> ${1}
 	echo "KERNONLY=${quote}${KERNONLY}${quote}" >> ${1}
 	echo "PLATFORM=${quote}${PLATFORM}${quote}" >> ${1}
+	echo "CONFIG_TRACE=${quote}${TRACE}${quote}" >> ${1}
 
 	echo "RRDEST=${quote}${RRDEST}${quote}" >> ${1}
 	echo "RROBJ=${quote}${RROBJ}${quote}" >> ${1}
@@ -27,6 +27,10 @@ ifndef NOGCCERROR
 CFLAGS+= -Werror
 endif
 
+ifeq (${CONFIG_TRACE},yes)
+CPPFLAGS+= -DBMK_TRACE
+endif
+
 LDFLAGS.x86_64.hw= -z max-page-size=0x1000
 
 ifeq (${BUILDRR},true)
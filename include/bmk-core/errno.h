@@ -41,6 +41,7 @@
 #define BMK_EBADF		9
 #define BMK_ENOMEM		12
 #define BMK_EBUSY		16
+#define BMK_EEXIST		17
 #define BMK_EINVAL		22
 #define BMK_EROFS		30
 #define BMK_ETIMEDOUT		60
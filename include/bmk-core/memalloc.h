@@ -58,14 +58,16 @@
  *      out of memory, it will notify the rump kernel to free up some
  *	memory.
  *
- *   TODO: figure out if we want to support the case where USER allocates
- *	and then frees a lot of memory (will require changes to the allocator)
+ * When USER (or anyone else) allocates and then frees a lot of memory,
+ * slabs which become completely free are returned to the page allocator.
  */
 
 enum bmk_memwho {
 	BMK_MEMWHO_WIREDBMK,
 	BMK_MEMWHO_RUMPKERN,
-	BMK_MEMWHO_USER
+	BMK_MEMWHO_USER,
+
+	BMK_MEMWHO_MAX
 };
 
 void	bmk_memalloc_init(void);
@@ -73,11 +75,14 @@ void	bmk_memalloc_init(void);
 void *  bmk_memalloc(unsigned long, unsigned long, enum bmk_memwho);
 void *  bmk_memcalloc(unsigned long, unsigned long, enum bmk_memwho);
 void    bmk_memfree(void *, enum bmk_memwho);
+unsigned long bmk_memalloc_usable(void *, enum bmk_memwho);
 
 void *  bmk_memrealloc_user(void *, unsigned long);
 
 void *  bmk_xmalloc_bmk(unsigned long);
 
+unsigned long bmk_memalloc_drain(void);
+
 /* diagnostic */
 void	bmk_memalloc_printstats(void);
 
@@ -26,6 +26,9 @@
 #ifndef _BMK_CORE_PGALLOC_H_
 #define _BMK_CORE_PGALLOC_H_
 
+/* max number of discontiguous ranges bmk_pgalloc_loadmem() takes */
+#define BMK_PGALLOC_MAXRANGES 16
+
 void		bmk_pgalloc_loadmem(unsigned long, unsigned long);
 
 void *		bmk_pgalloc(int);
@@ -34,6 +37,21 @@ void		bmk_pgfree(void *, int);
 
 void		bmk_pgalloc_dumpstats(void);
 
+/*
+ * Memory pressure.  The level is WARN while the memory used is above
+ * the high watermark, CRIT after an allocation has failed, and goes
+ * back to NONE when usage drops below the low watermark.
+ */
+#define BMK_PGALLOC_PRESSURE_NONE	0
+#define BMK_PGALLOC_PRESSURE_WARN	1
+#define BMK_PGALLOC_PRESSURE_CRIT	2
+
+#define BMK_PGALLOC_MAXHOOKS 4
+
+int		bmk_pgalloc_pressure(void);
+void		bmk_pgalloc_setwatermarks(unsigned long, unsigned long);
+int		bmk_pgalloc_addhook(void (*)(void *, int), void *);
+
 #define bmk_pgalloc_one() bmk_pgalloc(0)
 #define bmk_pgfree_one(p) bmk_pgfree(p, 0)
 
@@ -34,10 +34,20 @@ void bmk_platform_halt(const char *) __attribute__((noreturn));
 
 void		bmk_platform_cpu_block(bmk_time_t);
 
+/*
+ * Arm the time slice timer of the current CPU to call bmk_sched_slice()
+ * from its interrupt at the given time, or disarm it for 0.  Returns
+ * BMK_ENOSYS if the platform has no such timer.
+ */
+int		bmk_platform_cpu_slicetimer(bmk_time_t);
+
 bmk_time_t	bmk_platform_cpu_clock_monotonic(void);
 bmk_time_t	bmk_platform_cpu_clock_epochoffset(void);
 
 unsigned long	bmk_platform_splhigh(void);
 void		bmk_platform_splx(unsigned long);
 
+int		bmk_platform_intr_dump(void (*)(void *, const char *,
+			unsigned long), void *);
+
 #endif /* _BMK_CORE_PLATFORM_H_ */
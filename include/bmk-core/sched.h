@@ -40,8 +40,56 @@ struct bmk_tcb {
 struct bmk_thread;
 
 void	bmk_sched_startmain(void (*)(void *), void *) __attribute__((noreturn));
+void	bmk_sched_initcpus(int, void (*)(int));
+void	bmk_sched_startcpu(int) __attribute__((noreturn));
+int	bmk_sched_ncpu(void);
+int	bmk_sched_curcpu(void);
+
+/*
+ * Scheduling classes, most urgent first.  A runnable thread is
+ * always picked from the most urgent non-empty class, and threads
+ * of the same class run in FIFO order.
+ */
+#define BMK_SCHED_PRI_INTR	0	/* interrupt delivery */
+#define BMK_SCHED_PRI_SOFTINT	1	/* rump kernel softints */
+#define BMK_SCHED_PRI_KERN	2	/* other kernel threads */
+#define BMK_SCHED_PRI_USER	3	/* application threads */
+#define BMK_SCHED_NPRI		4
 
 void	bmk_sched_yield(void);
+void	bmk_sched_preempt(void);
+void	bmk_sched_setquantum(bmk_time_t);
+void	bmk_sched_slice(void);
+void	bmk_sched_setpri(struct bmk_thread *, int);
+int	bmk_sched_getpri(struct bmk_thread *);
+
+/*
+ * CPU time accounting, in nanoseconds.  A thread is charged for the
+ * time from being switched to until it enters the scheduler again.
+ * Blocking is a voluntary context switch, yielding and preemption
+ * are involuntary ones.  A CPU's time is split into idle time and
+ * run time per scheduling class; the interrupt class is what the
+ * CPU spent on handling interrupts.
+ */
+struct bmk_sched_threadstat {
+	bmk_time_t bts_runtime;
+	unsigned long bts_nvcsw;
+	unsigned long bts_nivcsw;
+};
+
+struct bmk_sched_cpustat {
+	bmk_time_t bcs_idletime;
+	bmk_time_t bcs_runtime[BMK_SCHED_NPRI];
+	unsigned long bcs_nswitch;
+	unsigned long bcs_nvcsw;
+	unsigned long bcs_nivcsw;
+};
+
+void	bmk_sched_threadstat(struct bmk_thread *,
+			     struct bmk_sched_threadstat *);
+void	bmk_sched_cpustat(int, struct bmk_sched_cpustat *);
+int	bmk_sched_acct_dump(void (*)(void *, const char *, unsigned long),
+			    void *);
 
 void	bmk_sched_dumpqueue(void);
 
@@ -51,6 +99,9 @@ struct bmk_thread *bmk_sched_create(const char *, void *, int,
 struct bmk_thread *bmk_sched_create_withtls(const char *, void *, int,
 				    void (*)(void *), void *,
 				    void *, unsigned long, void *);
+struct bmk_thread *bmk_sched_create_oncpu(const char *, void *, int,
+				    void (*)(void *), void *,
+				    void *, unsigned long, int);
 void	bmk_sched_join(struct bmk_thread *);
 void	bmk_sched_exit(void) __attribute__((__noreturn__));
 void	bmk_sched_exit_withtls(void) __attribute__((__noreturn__));
@@ -61,6 +112,7 @@ void	bmk_sched_blockprepare_timeout(bmk_time_t);
 int	bmk_sched_block(void);
 
 void	bmk_sched_wake(struct bmk_thread *);
+void	bmk_sched_wake_many(struct bmk_thread **, int);
 
 
 void	bmk_sched_suspend(struct bmk_thread *);
@@ -83,6 +135,9 @@ extern __thread struct bmk_thread *bmk_current;
 
 int *bmk_sched_geterrno(void);
 const char 	*bmk_sched_threadname(struct bmk_thread *);
+#ifdef BMK_TRACE
+void	bmk_sched_trace_names(void);
+#endif
 
 void	bmk_cpu_sched_bouncer(void);
 void	bmk_cpu_sched_switch(void *, void *);
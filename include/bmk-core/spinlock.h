@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#ifndef _BMK_CORE_SPINLOCK_H_
+#define _BMK_CORE_SPINLOCK_H_
+
+/*
+ * Simple test-and-test-and-set spinlocks.  They do not block
+ * interrupts; a lock which is also taken from interrupt context must
+ * be acquired at splhigh.  Never hold a spinlock across a call which
+ * can block the current thread.
+ */
+struct bmk_spinlock {
+	unsigned int bsl_locked;
+};
+
+#define BMK_SPINLOCK_INITIALIZER { 0 }
+
+static inline void
+bmk_cpu_relax(void)
+{
+
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline void
+bmk_spin_init(struct bmk_spinlock *l)
+{
+
+	l->bsl_locked = 0;
+}
+
+static inline int
+bmk_spin_trylock(struct bmk_spinlock *l)
+{
+
+	return __atomic_exchange_n(&l->bsl_locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void
+bmk_spin_lock(struct bmk_spinlock *l)
+{
+
+	while (!bmk_spin_trylock(l)) {
+		while (__atomic_load_n(&l->bsl_locked, __ATOMIC_RELAXED))
+			bmk_cpu_relax();
+	}
+}
+
+static inline void
+bmk_spin_unlock(struct bmk_spinlock *l)
+{
+
+	__atomic_store_n(&l->bsl_locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline int
+bmk_spin_held(struct bmk_spinlock *l)
+{
+
+	return __atomic_load_n(&l->bsl_locked, __ATOMIC_RELAXED) != 0;
+}
+
+#endif /* _BMK_CORE_SPINLOCK_H_ */
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#ifndef _BMK_CORE_TRACE_H_
+#define _BMK_CORE_TRACE_H_
+
+#include <bmk-core/types.h>
+
+/*
+ * Event trace buffer.  The hooks and the buffer (trace.c) are compiled
+ * in only if BMK_TRACE is defined (build-rr.sh -t); otherwise the
+ * calls below expand to nothing and bmk_trace_dump() does not exist.
+ * Event numbers are part of the dump format, so append only.
+ */
+enum bmk_trace_event {
+	BMK_TRACE_NONE = 0,
+	BMK_TRACE_SWITCH,	/* arg0 = prev thread, arg1 = next thread */
+	BMK_TRACE_BLOCK,	/* arg0 = wakeup deadline		*/
+	BMK_TRACE_WAKE,		/* arg0 = woken thread			*/
+	BMK_TRACE_THREAD,	/* tr_thread = thread, args = name	*/
+	BMK_TRACE_EXIT,		/* current thread exits			*/
+	BMK_TRACE_RUMPSCHED,	/* arg0 = nlocks			*/
+	BMK_TRACE_RUMPUNSCHED,	/* arg0 = nlocks			*/
+	BMK_TRACE_INTR,		/* arg0 = pending interrupt bits	*/
+	BMK_TRACE_INTREND,	/* interrupt handling done		*/
+	BMK_TRACE_PGALLOC,	/* arg0 = order, arg1 = address		*/
+	BMK_TRACE_PGFREE,	/* arg0 = order, arg1 = address		*/
+	BMK_TRACE_MEMALLOC,	/* arg0 = size, arg1 = address		*/
+	BMK_TRACE_MEMFREE,	/* arg1 = address			*/
+	BMK_TRACE_USER,		/* free for ad-hoc instrumentation	*/
+	BMK_TRACE_NEVENTS
+};
+
+struct bmk_trace_rec {
+	unsigned long tr_seq;		/* slot sequence, 0 if torn	*/
+	uint64_t tr_ts;			/* TSC (x86) or nanoseconds	*/
+	unsigned long tr_thread;	/* bmk_current at record time	*/
+	unsigned long tr_event;
+	uint64_t tr_arg[2];
+};
+
+#ifdef BMK_TRACE
+#define bmk_trace(ev, a0, a1)						\
+	bmk_trace_record(ev, (uint64_t)(unsigned long)(a0),		\
+	    (uint64_t)(unsigned long)(a1))
+
+void	bmk_trace_init(void);
+void	bmk_trace_record(enum bmk_trace_event, uint64_t, uint64_t);
+void	bmk_trace_name(const void *, const char *);
+void	bmk_trace_enable(int);
+
+typedef void (*bmk_trace_output_fn)(void *, const char *, unsigned long);
+int	bmk_trace_dump(bmk_trace_output_fn, void *);
+#else
+#define bmk_trace(ev, a0, a1) do { } while (/*CONSTCOND*/0)
+#define bmk_trace_init() do { } while (/*CONSTCOND*/0)
+#define bmk_trace_name(thr, name) do { } while (/*CONSTCOND*/0)
+#define bmk_trace_enable(enable) do { } while (/*CONSTCOND*/0)
+#endif
+
+#endif /* _BMK_CORE_TRACE_H_ */
@@ -30,6 +30,9 @@ int rumprun_platform_rumpuser_init(void);
 #define LIBRUMPUSER
 #include <rump/rumpuser.h>
 
+#include <bmk-core/sched.h>
+#include <bmk-core/trace.h>
+
 extern struct rumpuser_hyperup rumpuser__hyp;
 
 static inline void
@@ -37,11 +40,15 @@ rumpkern_unsched(int *nlocks, void *interlock)
 {
 
 	rumpuser__hyp.hyp_backend_unschedule(0, nlocks, interlock);
+	bmk_trace(BMK_TRACE_RUMPUNSCHED, *nlocks, 0);
 }
 
 static inline void
 rumpkern_sched(int nlocks, void *interlock)
 {
 
+	bmk_trace(BMK_TRACE_RUMPSCHED, nlocks, 0);
+	/* we hold no rump CPU here, a good place to let others run */
+	bmk_sched_preempt();
 	rumpuser__hyp.hyp_backend_schedule(nlocks, interlock);
 }
@@ -42,6 +42,10 @@ void *	rumprun_get_finished(void);
 
 void	rumprun_reboot(void) __attribute__((noreturn));
 
+int	rumprun_trace_dump(const char *);
+int	rumprun_acct_dump(const char *);
+int	rumprun_intr_dump(const char *);
+
 /* XXX: this prototype shouldn't be here (if it should exist at all) */
 void	rumprun_daemon(void);
 
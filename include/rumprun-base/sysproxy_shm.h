@@ -0,0 +1,72 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Layout of the memory region shared with a colocated sysproxy
+ * client, as set up by RUMPRUN_SYSPROXY=shm://<addr>,<size>.
+ *
+ * The region starts with struct rumprun_spshm.  It is followed by
+ * two byte rings which carry exactly the frames the socket transports
+ * carry, and by a data arena.  Syscall arguments which the client
+ * places in the arena are copied in and out with plain memcpy()
+ * instead of copyin/copyout requests.
+ *
+ * To connect, the client waits for RUMPRUN_SPSHM_IDLE, stores the
+ * address it has the region mapped at in sh_clientbase and sets
+ * RUMPRUN_SPSHM_CONNECT.  The server resets the rings, puts the
+ * banner in the response ring and sets RUMPRUN_SPSHM_CONNECTED.
+ * Either side ends the session by setting RUMPRUN_SPSHM_DISCONNECT;
+ * the server goes back to RUMPRUN_SPSHM_IDLE once it is done.
+ *
+ * Ring positions count bytes and only ever increase.  The producer
+ * advances sr_head after writing data, the consumer advances sr_tail
+ * after reading it.
+ */
+
+#ifndef _RUMPRUN_BASE_SYSPROXY_SHM_H_
+#define _RUMPRUN_BASE_SYSPROXY_SHM_H_
+
+#include <stdint.h>
+
+#define RUMPRUN_SPSHM_MAGIC	0x72737073
+#define RUMPRUN_SPSHM_VERSION	1
+
+#define RUMPRUN_SPSHM_IDLE		0
+#define RUMPRUN_SPSHM_CONNECT		1
+#define RUMPRUN_SPSHM_CONNECTED		2
+#define RUMPRUN_SPSHM_DISCONNECT	3
+
+/* size of each ring, the arena gets the rest */
+#define RUMPRUN_SPSHM_RINGSIZE	(64*1024)
+
+struct rumprun_spshm_ring {
+	uint64_t sr_off;		/* data offset from region start */
+	uint64_t sr_size;		/* power of two */
+	volatile uint64_t sr_head __attribute__((aligned(64)));
+	volatile uint64_t sr_tail __attribute__((aligned(64)));
+};
+
+struct rumprun_spshm {
+	uint32_t sh_magic;
+	uint32_t sh_version;
+	volatile uint32_t sh_state;
+	uint32_t sh_pad;
+	uint64_t sh_clientbase;
+
+	uint64_t sh_arenaoff;
+	uint64_t sh_arenasize;
+
+	struct rumprun_spshm_ring sh_req;	/* client to server */
+	struct rumprun_spshm_ring sh_resp;	/* server to client */
+};
+
+#endif /* _RUMPRUN_BASE_SYSPROXY_SHM_H_ */
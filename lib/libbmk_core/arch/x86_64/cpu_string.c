@@ -0,0 +1,243 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * x86_64 versions of bmk_memcpy() and bmk_memset().
+ *
+ * Copies up to 16 bytes are done inline and copies up to 64 bytes
+ * out of line, both with overlapping scalar moves.  Larger ones use
+ * "rep movsq/stosq" for the bulk and an overlapping scalar move for
+ * the tail, or "rep movsb/stosb" from ERMS_THRESHOLD up if the CPU
+ * advertises fast string operations (ERMS).
+ *
+ * Only general purpose registers may be used: these routines are
+ * called from interrupt handlers, and the interrupt entry code does
+ * not save the FPU/SSE state of the interrupted thread.  The file is
+ * compiled with -mno-sse so that the compiler does not vectorize it.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/string.h>
+
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) u64u;
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) u32u;
+typedef uint16_t __attribute__((__may_alias__, __aligned__(1))) u16u;
+
+/* use rep movsb/stosb for sizes above this, if ERMS is available */
+#define ERMS_THRESHOLD 2048
+
+/* -1 until CPUID has been checked */
+static int has_erms = -1;
+
+static void
+cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *regs)
+{
+
+	__asm__ __volatile__(
+		"cpuid"
+		: "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]), "=d" (regs[3])
+		: "0" (leaf), "2" (subleaf)
+	);
+}
+
+static int
+erms(void)
+{
+	uint32_t regs[4];
+	int rv = 0;
+
+	if (__builtin_expect(has_erms >= 0, 1))
+		return has_erms;
+
+	cpuid(0, 0, regs);
+	if (regs[0] >= 7) {
+		cpuid(7, 0, regs);
+		rv = (regs[1] & (1<<9)) != 0;
+	}
+	return has_erms = rv;
+}
+
+static inline void
+rep_movsb(void *d, const void *s, unsigned long n)
+{
+
+	__asm__ __volatile__(
+		"rep movsb"
+		: "+D" (d), "+S" (s), "+c" (n)
+		:
+		: "memory"
+	);
+}
+
+static inline void
+rep_movsq(void *d, const void *s, unsigned long n)
+{
+
+	__asm__ __volatile__(
+		"rep movsq"
+		: "+D" (d), "+S" (s), "+c" (n)
+		:
+		: "memory"
+	);
+}
+
+static inline void
+rep_stosb(void *d, int c, unsigned long n)
+{
+
+	__asm__ __volatile__(
+		"rep stosb"
+		: "+D" (d), "+c" (n)
+		: "a" (c)
+		: "memory"
+	);
+}
+
+static inline void
+rep_stosq(void *d, uint64_t v, unsigned long n)
+{
+
+	__asm__ __volatile__(
+		"rep stosq"
+		: "+D" (d), "+c" (n)
+		: "a" (v)
+		: "memory"
+	);
+}
+
+/*
+ * Called only for n > 16.  All loads are done before the stores,
+ * and the last word is an overlapping move ending exactly at the
+ * end of the range.
+ */
+static void
+memcpy_large(void *d, const void *s, unsigned long n)
+{
+	char *dp = d;
+	const char *sp = s;
+	uint64_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+	if (n <= 32) {
+		t0 = *(const u64u *)sp;
+		t1 = *(const u64u *)(sp + 8);
+		t2 = *(const u64u *)(sp + n - 16);
+		t3 = *(const u64u *)(sp + n - 8);
+		*(u64u *)dp = t0;
+		*(u64u *)(dp + 8) = t1;
+		*(u64u *)(dp + n - 16) = t2;
+		*(u64u *)(dp + n - 8) = t3;
+	} else if (n <= 64) {
+		t0 = *(const u64u *)sp;
+		t1 = *(const u64u *)(sp + 8);
+		t2 = *(const u64u *)(sp + 16);
+		t3 = *(const u64u *)(sp + 24);
+		t4 = *(const u64u *)(sp + n - 32);
+		t5 = *(const u64u *)(sp + n - 24);
+		t6 = *(const u64u *)(sp + n - 16);
+		t7 = *(const u64u *)(sp + n - 8);
+		*(u64u *)dp = t0;
+		*(u64u *)(dp + 8) = t1;
+		*(u64u *)(dp + 16) = t2;
+		*(u64u *)(dp + 24) = t3;
+		*(u64u *)(dp + n - 32) = t4;
+		*(u64u *)(dp + n - 24) = t5;
+		*(u64u *)(dp + n - 16) = t6;
+		*(u64u *)(dp + n - 8) = t7;
+	} else if (n >= ERMS_THRESHOLD && erms()) {
+		rep_movsb(d, s, n);
+	} else {
+		t0 = *(const u64u *)(sp + n - 8);
+		rep_movsq(d, s, n / 8);
+		*(u64u *)(dp + n - 8) = t0;
+	}
+}
+
+static void
+memset_large(void *d, int c, unsigned long n)
+{
+	char *dp = d;
+	uint64_t p64;
+
+	if (n >= ERMS_THRESHOLD && erms()) {
+		rep_stosb(d, c, n);
+		return;
+	}
+
+	p64 = 0x0101010101010101ULL * (unsigned char)c;
+	if (n <= 32) {
+		*(u64u *)dp = p64;
+		*(u64u *)(dp + 8) = p64;
+		*(u64u *)(dp + n - 16) = p64;
+		*(u64u *)(dp + n - 8) = p64;
+	} else {
+		rep_stosq(d, p64, n / 8);
+		*(u64u *)(dp + n - 8) = p64;
+	}
+}
+
+void *
+bmk_memcpy(void *d, const void *s, unsigned long n)
+{
+	char *dp = d;
+	const char *sp = s;
+
+	if (__builtin_expect(n > 16, 0)) {
+		memcpy_large(d, s, n);
+	} else if (n >= 8) {
+		uint64_t a = *(const u64u *)sp, b = *(const u64u *)(sp + n - 8);
+
+		*(u64u *)dp = a;
+		*(u64u *)(dp + n - 8) = b;
+	} else if (n >= 4) {
+		uint32_t a = *(const u32u *)sp, b = *(const u32u *)(sp + n - 4);
+
+		*(u32u *)dp = a;
+		*(u32u *)(dp + n - 4) = b;
+	} else if (n >= 2) {
+		uint16_t a = *(const u16u *)sp, b = *(const u16u *)(sp + n - 2);
+
+		*(u16u *)dp = a;
+		*(u16u *)(dp + n - 2) = b;
+	} else if (n) {
+		*dp = *sp;
+	}
+
+	return d;
+}
+
+void *
+bmk_memset(void *d, int c, unsigned long n)
+{
+	char *dp = d;
+	uint64_t p64;
+
+	if (__builtin_expect(n > 16, 0)) {
+		memset_large(d, c, n);
+		return d;
+	}
+
+	p64 = 0x0101010101010101ULL * (unsigned char)c;
+	if (n >= 8) {
+		*(u64u *)dp = p64;
+		*(u64u *)(dp + n - 8) = p64;
+	} else if (n >= 4) {
+		*(u32u *)dp = (uint32_t)p64;
+		*(u32u *)(dp + n - 4) = (uint32_t)p64;
+	} else if (n >= 2) {
+		*(u16u *)dp = (uint16_t)p64;
+		*(u16u *)(dp + n - 2) = (uint16_t)p64;
+	} else if (n) {
+		*dp = (char)c;
+	}
+
+	return d;
+}
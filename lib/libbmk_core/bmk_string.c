@@ -95,31 +95,126 @@ bmk_strncpy(char *d, const char *s, unsigned long n)
 	return orig;
 }
 
+/*
+ * The memory routines below work a word at a time when the pointers
+ * allow it.  Architectures can provide their own versions, in which
+ * case the arch Makefile.inc defines BMK_MD_MEMCPY and/or BMK_MD_MEMSET.
+ */
+typedef unsigned long __attribute__((__may_alias__)) bmk_word_t;
+#define WSIZE sizeof(bmk_word_t)
+#define WMASK (WSIZE-1)
+
+#ifndef BMK_MD_MEMSET
 void *
 bmk_memset(void *b, int c, unsigned long n)
 {
 	unsigned char *v = b;
+	bmk_word_t *w, pattern;
+
+	if (n >= 2*WSIZE) {
+		while ((unsigned long)v & WMASK) {
+			*v++ = (unsigned char)c;
+			n--;
+		}
+
+		pattern = (unsigned char)c;
+		pattern |= pattern << 8;
+		pattern |= pattern << 16;
+		if (WSIZE > 4)
+			pattern |= pattern << 16 << 16;
+
+		for (w = (bmk_word_t *)v; n >= 4*WSIZE; n -= 4*WSIZE, w += 4) {
+			w[0] = pattern;
+			w[1] = pattern;
+			w[2] = pattern;
+			w[3] = pattern;
+		}
+		for (; n >= WSIZE; n -= WSIZE)
+			*w++ = pattern;
+		v = (unsigned char *)w;
+	}
 
 	while (n--)
 		*v++ = (unsigned char)c;
 
 	return b;
 }
+#endif
 
+#ifndef BMK_MD_MEMCPY
 void *
 bmk_memcpy(void *d, const void *src, unsigned long n)
 {
 	unsigned char *dp;
 	const unsigned char *sp;
+	bmk_word_t *dw;
+	const bmk_word_t *sw;
 
 	dp = d;
 	sp = src;
 
+	/*
+	 * Go word-wide if the source and destination can be aligned
+	 * at the same time.  Otherwise we'd need unaligned accesses,
+	 * which not all architectures support.
+	 */
+	if (n >= 2*WSIZE
+	    && (((unsigned long)dp ^ (unsigned long)sp) & WMASK) == 0) {
+		while ((unsigned long)dp & WMASK) {
+			*dp++ = *sp++;
+			n--;
+		}
+
+		dw = (bmk_word_t *)dp;
+		sw = (const bmk_word_t *)sp;
+		for (; n >= 4*WSIZE; n -= 4*WSIZE, dw += 4, sw += 4) {
+			dw[0] = sw[0];
+			dw[1] = sw[1];
+			dw[2] = sw[2];
+			dw[3] = sw[3];
+		}
+		for (; n >= WSIZE; n -= WSIZE)
+			*dw++ = *sw++;
+		dp = (unsigned char *)dw;
+		sp = (const unsigned char *)sw;
+	}
+
 	while (n--)
 		*dp++ = *sp++;
 
 	return d;
 }
+#endif
+
+int
+bmk_memcmp(const void *a, const void *b, unsigned long n)
+{
+	const unsigned char *ap = a, *bp = b;
+	const bmk_word_t *aw, *bw;
+
+	if (n >= 2*WSIZE
+	    && (((unsigned long)ap ^ (unsigned long)bp) & WMASK) == 0) {
+		while ((unsigned long)ap & WMASK) {
+			if (*ap != *bp)
+				return *ap - *bp;
+			ap++, bp++, n--;
+		}
+
+		/* skip equal words, let the byte loop find the difference */
+		aw = (const bmk_word_t *)ap;
+		bw = (const bmk_word_t *)bp;
+		for (; n >= WSIZE && *aw == *bw; n -= WSIZE)
+			aw++, bw++;
+		ap = (const unsigned char *)aw;
+		bp = (const unsigned char *)bw;
+	}
+
+	for (; n; n--, ap++, bp++) {
+		if (*ap != *bp)
+			return *ap - *bp;
+	}
+	return 0;
+}
 
 void *
 bmk_memchr(const void *d, int c, unsigned long n)
@@ -146,3 +241,132 @@ bmk_memrchr(const void *d, int c, unsigned long n)
 	}
 	return NULL;
 }
+
+/*
+ * The rest of this file contains correctness and throughput tests
+ * for the memory routines.
+ */
+
+#ifdef STRING_TESTING
+
+#include <bmk-core/core.h>
+#include <bmk-core/memalloc.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/printf.h>
+
+#define TEST_MAXSIZE (64*1024)
+#define TEST_MAXALIGN 16
+#define TEST_PAD 64
+#define TEST_BYTES (64*1024*1024)
+
+static void
+checkbuf(const unsigned char *p, unsigned long n, unsigned char c)
+{
+
+	while (n--)
+		bmk_assert(*p++ == c);
+}
+
+static void
+testcorrect(unsigned char *src, unsigned char *dst, unsigned long n,
+	unsigned salign, unsigned dalign)
+{
+	unsigned char *s = src + TEST_PAD + salign;
+	unsigned char *d = dst + TEST_PAD + dalign;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		s[i] = (unsigned char)(i*7 + n);
+
+	/* memset, check that we don't scribble outside the range */
+	for (i = 0; i < n + 2*TEST_PAD + TEST_MAXALIGN; i++)
+		dst[i] = 0xa5;
+	bmk_memset(d, 0x5a, n);
+	checkbuf(dst, TEST_PAD + dalign, 0xa5);
+	checkbuf(d, n, 0x5a);
+	checkbuf(d + n, TEST_PAD, 0xa5);
+
+	/* memcpy */
+	bmk_memcpy(d, s, n);
+	checkbuf(dst, TEST_PAD + dalign, 0xa5);
+	for (i = 0; i < n; i++)
+		bmk_assert(d[i] == s[i]);
+	checkbuf(d + n, TEST_PAD, 0xa5);
+
+	/* memcmp, both equal and with a difference at the end */
+	bmk_assert(bmk_memcmp(d, s, n) == 0);
+	if (n) {
+		d[n-1]++;
+		bmk_assert(bmk_memcmp(d, s, n) > 0);
+		bmk_assert(bmk_memcmp(s, d, n) < 0);
+	}
+}
+
+static void
+testspeed(unsigned char *src, unsigned char *dst, unsigned long n,
+	unsigned align)
+{
+	bmk_time_t start, cpytime, settime, cmptime;
+	unsigned long i, iters;
+
+	iters = TEST_BYTES / n;
+
+	start = bmk_platform_cpu_clock_monotonic();
+	for (i = 0; i < iters; i++)
+		bmk_memcpy(dst + align, src + align, n);
+	cpytime = bmk_platform_cpu_clock_monotonic() - start;
+
+	start = bmk_platform_cpu_clock_monotonic();
+	for (i = 0; i < iters; i++)
+		bmk_memset(dst + align, (int)i, n);
+	settime = bmk_platform_cpu_clock_monotonic() - start;
+
+	bmk_memcpy(dst + align, src + align, n);
+	start = bmk_platform_cpu_clock_monotonic();
+	for (i = 0; i < iters; i++)
+		bmk_memcmp(dst + align, src + align, n);
+	cmptime = bmk_platform_cpu_clock_monotonic() - start;
+
+	/* bytes per nanosecond == GB/s, print in MB/s */
+	bmk_printf("%6lu %5u %10llu %10llu %10llu\n", n, align,
+	    (unsigned long long)(1000ULL*iters*n / (cpytime ? cpytime : 1)),
+	    (unsigned long long)(1000ULL*iters*n / (settime ? settime : 1)),
+	    (unsigned long long)(1000ULL*iters*n / (cmptime ? cmptime : 1)));
+}
+
+/* XXX: no prototype */
+void bmk_string_test(void);
+void
+bmk_string_test(void)
+{
+	unsigned char *src, *dst;
+	unsigned long n, bufsize;
+	unsigned sa, da;
+
+	bufsize = TEST_MAXSIZE + 2*TEST_PAD + TEST_MAXALIGN;
+	src = bmk_memalloc(bufsize, 64, BMK_MEMWHO_WIREDBMK);
+	dst = bmk_memalloc(bufsize, 64, BMK_MEMWHO_WIREDBMK);
+	bmk_assert(src != NULL && dst != NULL);
+
+	bmk_printf("string test: checking correctness ... ");
+	for (n = 0; n <= TEST_MAXSIZE; n = n < 256 ? n+1 : n*2 - 1) {
+		for (sa = 0; sa < TEST_MAXALIGN; sa++) {
+			for (da = 0; da < TEST_MAXALIGN; da++) {
+				testcorrect(src, dst, n, sa, da);
+			}
+		}
+	}
+	bmk_printf("ok\n");
+
+	bmk_printf("string test: throughput (MB/s)\n");
+	bmk_printf("%6s %5s %10s %10s %10s\n",
+	    "size", "align", "memcpy", "memset", "memcmp");
+	for (n = 1; n <= TEST_MAXSIZE; n *= 4) {
+		testspeed(src, dst, n, 0);
+		testspeed(src, dst, n, 3);
+	}
+
+	bmk_memfree(src, BMK_MEMWHO_WIREDBMK);
+	bmk_memfree(dst, BMK_MEMWHO_WIREDBMK);
+}
+#endif /* STRING_TESTING */
@@ -34,11 +34,22 @@
  *
  * This is a very fast storage allocator.  It allocates blocks of a small 
  * number of different sizes, and keeps free lists of each size.  Blocks that
- * don't exactly fit are passed up to the next larger size.  In this 
- * implementation, the available sizes are 2^n-4 (or 2^n-10) bytes long.
- * This is designed for use in a virtual memory environment.
+ * don't exactly fit are passed up to the next larger size.
  *
  * Modified for bmk by Antti Kantee over 30 years later.
+ *
+ * The size classes are no longer powers of two.  Small blocks are
+ * carved out of single-page slabs, and the slab header at the start of
+ * each page tells us everything we need to know about a block, so
+ * blocks carry no per-allocation header.  Each slab keeps count of its
+ * free blocks, and slabs which become completely free are returned to
+ * the page allocator.
+ *
+ * User allocations too large for a slab are carved out of arenas in
+ * whole pages ("runs") instead of going to the buddy allocator, which
+ * rounds up to a power of two.  A run can grow in place into free
+ * pages following it and shrink by giving back its tail, so realloc()
+ * rarely needs to copy.
  */
 
 #include <bmk-core/core.h>
@@ -49,121 +60,584 @@
 #include <bmk-core/pgalloc.h>
 #include <bmk-core/printf.h>
 #include <bmk-core/queue.h>
+#include <bmk-core/spinlock.h>
+#include <bmk-core/trace.h>
 
 #include <bmk-pcpu/pcpu.h>
 
-/*
- * Header goes right before the allocated space and holds
- * information about the allocation.  Notably, we support
- * max 4gig alignment.  If you need more, use some other
- * allocator than malloc.
- */
-struct memalloc_hdr {
-	uint32_t	mh_alignpad;	/* padding for alignment */
-	uint16_t	mh_magic;	/* magic number */
-	uint8_t		mh_index;	/* bucket # */
-	uint8_t		mh_who;		/* who allocated */
+struct memalloc_freeblk {
+	struct memalloc_freeblk *next;
 };
-bmk_ctassert(sizeof(struct memalloc_hdr) == 8);
 
-struct memalloc_freeblk {
-	LIST_ENTRY(memalloc_freeblk) entries;
+struct memalloc_arena;
+
+/*
+ * Page header.  Every page which memalloc gets from the page allocator
+ * starts with one of these.  For slabs, the header describes the
+ * blocks in the rest of the page.  For large allocations (served
+ * directly by the page allocator), the header is located in the page
+ * which precedes the returned address, and records where the page
+ * allocation starts.
+ *
+ * Slab blocks are packed against the end of the page.  Since the end
+ * of the page is page-aligned, every block is aligned to the largest
+ * power of two which divides the size of its class.  This allows us to
+ * satisfy alignment requests without any padding.
+ */
+struct memalloc_page {
+	uint16_t	mp_magic;	/* magic number */
+	uint8_t		mp_class;	/* size class #, or CLASS_LARGE */
+	uint8_t		mp_who;		/* who allocated */
+
+	union {
+		struct {
+			uint16_t nfree;		/* # of free blocks */
+			uint16_t nblks;		/* total # of blocks */
+			struct memalloc_freeblk *freelist;
+			LIST_ENTRY(memalloc_page) entries;
+		} slab;
+		struct {
+			int order;		/* page allocator order */
+			void *origin;		/* page allocation start */
+		} large;
+		struct {
+			unsigned long npages;	/* pages in run */
+			struct memalloc_arena *arena;
+		} run;
+	} mp_u;
 };
-LIST_HEAD(freebucket, memalloc_freeblk);
+#define mp_nfree	mp_u.slab.nfree
+#define mp_nblks	mp_u.slab.nblks
+#define mp_freelist	mp_u.slab.freelist
+#define mp_entries	mp_u.slab.entries
+#define mp_order	mp_u.large.order
+#define mp_origin	mp_u.large.origin
+#define mp_npages	mp_u.run.npages
+#define mp_arena	mp_u.run.arena
 
 #define	MAGIC		0xef		/* magic # on accounting info */
 #define UNMAGIC		0x1221		/* magic # != MAGIC */
 #define UNMAGIC2	0x2442		/* magic # != MAGIC/UNMAGIC */
 
-#define MINSHIFT 5
-#define	LOCALBUCKETS (BMK_PCPU_PAGE_SHIFT - MINSHIFT)
-#define MINALIGN 16
-static struct freebucket freebuckets[LOCALBUCKETS];
+#define MINSHIFT 4
+#define MINALIGN (1<<MINSHIFT)
+#define CLASS_LARGE 0xff
+#define CLASS_RUN 0xfe
 
 /*
- * nmalloc[i] is the difference between the number of mallocs and frees
- * for a given block size.
+ * Size classes are spaced four per power of two, up to the size where
+ * only four blocks fit into a slab.  After that, we have two classes
+ * holding three and two blocks per slab, respectively.
  */
-static unsigned nmalloc[LOCALBUCKETS];
+#define SLAB_SPACE \
+    (BMK_PCPU_PAGE_SIZE - sizeof(struct memalloc_page))
+#define MAXCLASSES (4*(BMK_PCPU_PAGE_SHIFT-MINSHIFT)+2)
+static unsigned long classsize[MAXCLASSES];
+static unsigned nclasses;
+static unsigned long maxslabsize;
 
-/* not multicore */
-#define malloc_lock()
-#define malloc_unlock()
+/* size (in MINALIGN units, rounded up) -> smallest fitting class */
+#define SIZE2CLASS_ENTRIES ((SLAB_SPACE>>(MINSHIFT+1))+1)
+static uint8_t size2class[SIZE2CLASS_ENTRIES];
 
-static void *
-morecore(int bucket)
+/*
+ * Number of completely free slabs we keep cached per class before
+ * returning them to the page allocator.  Avoids thrashing pages back
+ * and forth when a single block is repeatedly allocated and freed.
+ */
+#define MAXEMPTY 1
+
+LIST_HEAD(slablist, memalloc_page);
+struct memalloc_cache {
+	struct slablist	mc_partial;	/* slabs with at least one free block */
+	unsigned long	mc_nslabs;	/* total slabs */
+	unsigned long	mc_nempty;	/* slabs with all blocks free */
+	unsigned long	mc_nused;	/* blocks handed out */
+};
+static struct memalloc_cache caches[BMK_MEMWHO_MAX][MAXCLASSES];
+
+/* large allocation and page return accounting */
+static unsigned long nlarge, largekb;
+static unsigned long nslabreturned;
+
+/*
+ * Arenas for page runs.  The first page of an arena holds the
+ * arena header, so there are ARENA_PAGES-1 pages for runs.  Runs are
+ * capped at half an arena; anything bigger is rare enough to go to
+ * the page allocator as before.  One completely free arena is kept
+ * around.
+ */
+#define ARENA_ORDER 9
+#define ARENA_PAGES (1UL<<ARENA_ORDER)
+#define ARENA_MAPBITS (8*sizeof(unsigned long))
+#define ARENA_MAXRUN (ARENA_PAGES/2)
+
+struct memalloc_arena {
+	unsigned long ma_map[ARENA_PAGES/ARENA_MAPBITS]; /* 1 = in use */
+	unsigned long ma_nfree;
+	LIST_ENTRY(memalloc_arena) ma_entries;
+};
+static LIST_HEAD(, memalloc_arena) arenas = LIST_HEAD_INITIALIZER(arenas);
+static unsigned long narenas, narenas_empty;
+static unsigned long nrun, runpages;
+
+/*
+ * One lock for all caches.  The allocator is not used from interrupt
+ * context, so there is no need to go to splhigh.
+ */
+static struct bmk_spinlock malloc_spin = BMK_SPINLOCK_INITIALIZER;
+#define malloc_lock() bmk_spin_lock(&malloc_spin)
+#define malloc_unlock() bmk_spin_unlock(&malloc_spin)
+
+#define addr2page(_addr_) \
+    ((struct memalloc_page *)bmk_trunc_page((unsigned long)(_addr_)))
+
+static struct memalloc_page *
+morecore(enum bmk_memwho who, unsigned class)
 {
-	void *rv;
-	uint8_t *p;
+	struct memalloc_page *mp;
+	struct memalloc_freeblk *frb;
 	unsigned long sz;		/* size of desired block */
 	unsigned long nblks;		/* how many blocks we get */
+	uint8_t *p;
 
-	sz = 1<<(bucket+MINSHIFT);
-	nblks = BMK_PCPU_PAGE_SIZE / sz;
+	sz = classsize[class];
+	nblks = SLAB_SPACE / sz;
 	bmk_assert(nblks > 1);
 
-	if ((p = rv = bmk_pgalloc_one()) == NULL)
+	if ((mp = bmk_pgalloc_one()) == NULL)
 		return NULL;
 
-	/*
-	 * Add new memory allocated to that on
-	 * free list for this hash bucket.  Return one block.
-	 */
-	while (--nblks) {
-		struct memalloc_freeblk *frb;
+	mp->mp_magic = MAGIC;
+	mp->mp_class = class;
+	mp->mp_who = who;
+	mp->mp_nfree = mp->mp_nblks = nblks;
 
-		p += sz;
+	/* pack blocks against the end of the page, see above */
+	mp->mp_freelist = NULL;
+	for (p = (uint8_t *)mp + BMK_PCPU_PAGE_SIZE; nblks; nblks--) {
+		p -= sz;
 		frb = (void *)p;
-		LIST_INSERT_HEAD(&freebuckets[bucket], frb, entries);
+		frb->next = mp->mp_freelist;
+		mp->mp_freelist = frb;
 	}
-	return rv;
+
+	caches[who][class].mc_nslabs++;
+	caches[who][class].mc_nempty++;
+	LIST_INSERT_HEAD(&caches[who][class].mc_partial, mp, mp_entries);
+
+	return mp;
 }
 
 void
 bmk_memalloc_init(void)
 {
-	unsigned i;
+	unsigned long sz, step, i;
+	unsigned who, class;
 
 	bmk_assert(BMK_PCPU_PAGE_SIZE > 0);
-	for (i = 0; i < LOCALBUCKETS; i++) {
-		LIST_INIT(&freebuckets[i]);
+
+	nclasses = 0;
+	for (sz = MINALIGN; sz <= SLAB_SPACE/4; sz += step) {
+		classsize[nclasses++] = sz;
+		step = (1UL << (8*sizeof(sz) - __builtin_clzl(sz) - 1)) / 4;
+		if (step < MINALIGN)
+			step = MINALIGN;
+	}
+	classsize[nclasses++] = (SLAB_SPACE/3) & ~(MINALIGN-1);
+	classsize[nclasses++] = (SLAB_SPACE/2) & ~(MINALIGN-1);
+	bmk_assert(nclasses <= MAXCLASSES);
+	maxslabsize = classsize[nclasses-1];
+
+	for (i = 0, class = 0; i < SIZE2CLASS_ENTRIES; i++) {
+		while (class < nclasses-1 && classsize[class] < i<<MINSHIFT)
+			class++;
+		size2class[i] = class;
+	}
+
+	for (who = 0; who < BMK_MEMWHO_MAX; who++) {
+		for (class = 0; class < nclasses; class++) {
+			LIST_INIT(&caches[who][class].mc_partial);
+		}
 	}
 }
 
+/*
+ * Find the smallest class which fits nbytes and whose blocks are
+ * aligned to at least align.  Returns nclasses if there is none.
+ */
+static unsigned
+findclass(unsigned long nbytes, unsigned long align)
+{
+	unsigned class;
+
+	if (nbytes > maxslabsize)
+		return nclasses;
+
+	class = size2class[(nbytes + MINALIGN-1) >> MINSHIFT];
+	while (class < nclasses && (classsize[class] & (align-1)) != 0)
+		class++;
+	return class;
+}
+
 static void *
-bucketalloc(unsigned bucket)
+slaballoc(enum bmk_memwho who, unsigned class)
 {
+	struct memalloc_cache *mc = &caches[who][class];
+	struct memalloc_page *mp;
 	struct memalloc_freeblk *frb;
 
 	malloc_lock();
 
 	/*
-	 * If nothing in hash bucket right now,
+	 * If there are no slabs with free blocks right now,
 	 * request more memory from the system.
 	 */
-	if ((frb = LIST_FIRST(&freebuckets[bucket])) == NULL) {
-		if ((frb = morecore(bucket)) == NULL) {
+	if ((mp = LIST_FIRST(&mc->mc_partial)) == NULL) {
+		if ((mp = morecore(who, class)) == NULL) {
 			malloc_unlock();
 			return NULL;
 		}
-	} else {
-		LIST_REMOVE(frb, entries);
 	}
 
-	nmalloc[bucket]++;
+	frb = mp->mp_freelist;
+	mp->mp_freelist = frb->next;
+	if (mp->mp_nfree-- == mp->mp_nblks)
+		mc->mc_nempty--;
+	if (mp->mp_nfree == 0)
+		LIST_REMOVE(mp, mp_entries);
+	mc->mc_nused++;
+
 	malloc_unlock();
 
 	return frb;
 }
 
+static void
+slabfree(struct memalloc_page *mp, void *cp)
+{
+	struct memalloc_cache *mc = &caches[mp->mp_who][mp->mp_class];
+	struct memalloc_freeblk *frb = cp;
+
+	malloc_lock();
+
+	frb->next = mp->mp_freelist;
+	mp->mp_freelist = frb;
+	if (mp->mp_nfree++ == 0)
+		LIST_INSERT_HEAD(&mc->mc_partial, mp, mp_entries);
+	mc->mc_nused--;
+
+	/* give completely free slabs back to the page allocator */
+	if (mp->mp_nfree == mp->mp_nblks) {
+		if (mc->mc_nempty >= MAXEMPTY) {
+			LIST_REMOVE(mp, mp_entries);
+			mp->mp_magic = 0;
+			mc->mc_nslabs--;
+			nslabreturned++;
+			bmk_pgfree_one(mp);
+		} else {
+			mc->mc_nempty++;
+		}
+	}
+
+	malloc_unlock();
+}
+
+/*
+ * Allocations which don't fit into a slab go straight to the page
+ * allocator.  The header is placed so that addr2page() on the byte
+ * preceding the returned address finds it.
+ */
+static void *
+largealloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who)
+{
+	struct memalloc_page *mp;
+	unsigned long hdrspace, allocbytes;
+	uint8_t *origin, *rv;
+	int order;
+
+	hdrspace = (sizeof(*mp) + (align-1)) & ~(align-1);
+	allocbytes = hdrspace + nbytes;
+	if (allocbytes < nbytes)
+		return NULL;
+
+	order = 8*sizeof(allocbytes) - __builtin_clzl(allocbytes);
+	if ((allocbytes & (allocbytes-1)) == 0)
+		order--;
+	order -= BMK_PCPU_PAGE_SHIFT;
+	if (order < 0)
+		order = 0;
+
+	if (align < BMK_PCPU_PAGE_SIZE)
+		origin = bmk_pgalloc(order);
+	else
+		origin = bmk_pgalloc_align(order, align);
+	if (origin == NULL)
+		return NULL;
+
+	rv = origin + hdrspace;
+	mp = addr2page(rv-1);
+	mp->mp_magic = MAGIC;
+	mp->mp_class = CLASS_LARGE;
+	mp->mp_who = who;
+	mp->mp_order = order;
+	mp->mp_origin = origin;
+
+	malloc_lock();
+	nlarge++;
+	largekb += (1UL << (order + BMK_PCPU_PAGE_SHIFT)) >> 10;
+	malloc_unlock();
+
+	return rv;
+}
+
+static void
+largefree(struct memalloc_page *mp)
+{
+	int order = mp->mp_order;
+
+	malloc_lock();
+	nlarge--;
+	largekb -= (1UL << (order + BMK_PCPU_PAGE_SHIFT)) >> 10;
+	malloc_unlock();
+
+	mp->mp_magic = 0;
+	bmk_pgfree(mp->mp_origin, order);
+}
+
+static int
+arena_isset(struct memalloc_arena *ma, unsigned long pg)
+{
+
+	return (ma->ma_map[pg / ARENA_MAPBITS] >> (pg % ARENA_MAPBITS)) & 1;
+}
+
+static void
+arena_mark(struct memalloc_arena *ma, unsigned long pg, unsigned long n,
+	int inuse)
+{
+	unsigned long bit, i;
+
+	for (i = 0; i < n; i++, pg++) {
+		bit = 1UL << (pg % ARENA_MAPBITS);
+		if (inuse)
+			ma->ma_map[pg / ARENA_MAPBITS] |= bit;
+		else
+			ma->ma_map[pg / ARENA_MAPBITS] &= ~bit;
+	}
+	if (inuse)
+		ma->ma_nfree -= n;
+	else
+		ma->ma_nfree += n;
+}
+
+/*
+ * Are pages [pg, pg+n) all free?
+ */
+static int
+arena_isfree(struct memalloc_arena *ma, unsigned long pg, unsigned long n)
+{
+
+	if (pg + n > ARENA_PAGES)
+		return 0;
+	for (; n; pg++, n--) {
+		if (arena_isset(ma, pg))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * First fit.  Returns the first page of a free run of n pages, or 0
+ * (the header page, never free) if there is none.
+ */
+static unsigned long
+arena_find(struct memalloc_arena *ma, unsigned long n)
+{
+	unsigned long pg, start, len;
+
+	for (pg = 1, start = 1, len = 0; pg < ARENA_PAGES; pg++) {
+		/* skip full words quickly */
+		if (pg % ARENA_MAPBITS == 0
+		    && ma->ma_map[pg / ARENA_MAPBITS] == ~0UL) {
+			pg += ARENA_MAPBITS-1;
+			len = 0;
+			continue;
+		}
+		if (arena_isset(ma, pg)) {
+			len = 0;
+			continue;
+		}
+		if (len++ == 0)
+			start = pg;
+		if (len == n)
+			return start;
+	}
+	return 0;
+}
+
+/* called with malloc_lock held */
+static struct memalloc_arena *
+arena_create(void)
+{
+	struct memalloc_arena *ma;
+
+	if ((ma = bmk_pgalloc(ARENA_ORDER)) == NULL)
+		return NULL;
+	bmk_memset(ma->ma_map, 0, sizeof(ma->ma_map));
+	ma->ma_map[0] = 1;
+	ma->ma_nfree = ARENA_PAGES-1;
+	LIST_INSERT_HEAD(&arenas, ma, ma_entries);
+	narenas++;
+	narenas_empty++;
+
+	return ma;
+}
+
+static unsigned long
+runhdrspace(unsigned long align)
+{
+
+	return (sizeof(struct memalloc_page) + (align-1)) & ~(align-1);
+}
+
+/*
+ * Allocate a run for nbytes, plus "extra" bytes of headroom if the
+ * run is for a buffer which is growing.  The headroom is capped so
+ * that the run stays within ARENA_MAXRUN-1 pages, which lets two of
+ * the big runs share an arena.  A run goes into the first free
+ * stretch where it could double in place, or if there is none, into
+ * the first one it fits in.
+ */
+static void *
+runalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who,
+	unsigned long extra)
+{
+	struct memalloc_arena *ma;
+	struct memalloc_page *mp;
+	unsigned long hdrspace, nmin, npages, nroom, pg = 0;
+
+	hdrspace = runhdrspace(align);
+	nmin = (hdrspace + nbytes + BMK_PCPU_PAGE_SIZE-1)
+	    >> BMK_PCPU_PAGE_SHIFT;
+	if (nmin > ARENA_MAXRUN)
+		return NULL;
+	npages = (hdrspace + nbytes + extra + BMK_PCPU_PAGE_SIZE-1)
+	    >> BMK_PCPU_PAGE_SHIFT;
+	if (npages > ARENA_MAXRUN/2)
+		npages = nmin < ARENA_MAXRUN ? ARENA_MAXRUN-1 : ARENA_MAXRUN;
+	nroom = 2*npages;
+	if (nroom > ARENA_MAXRUN)
+		nroom = ARENA_MAXRUN;
+
+	malloc_lock();
+	LIST_FOREACH(ma, &arenas, ma_entries) {
+		if (ma->ma_nfree >= nroom && (pg = arena_find(ma, nroom)) != 0)
+			break;
+	}
+	if (ma == NULL) {
+		LIST_FOREACH(ma, &arenas, ma_entries) {
+			if (ma->ma_nfree >= npages
+			    && (pg = arena_find(ma, npages)) != 0)
+				break;
+		}
+	}
+	if (ma == NULL) {
+		if ((ma = arena_create()) == NULL) {
+			malloc_unlock();
+			return NULL;
+		}
+		pg = 1;
+	}
+	if (ma->ma_nfree == ARENA_PAGES-1)
+		narenas_empty--;
+	arena_mark(ma, pg, npages, 1);
+	nrun++;
+	runpages += npages;
+	malloc_unlock();
+
+	mp = (void *)((uint8_t *)ma + (pg << BMK_PCPU_PAGE_SHIFT));
+	mp->mp_magic = MAGIC;
+	mp->mp_class = CLASS_RUN;
+	mp->mp_who = who;
+	mp->mp_npages = npages;
+	mp->mp_arena = ma;
+
+	return (uint8_t *)mp + hdrspace;
+}
+
+static void
+runfree(struct memalloc_page *mp)
+{
+	struct memalloc_arena *ma = mp->mp_arena;
+	unsigned long pg;
+
+	pg = ((unsigned long)mp - (unsigned long)ma) >> BMK_PCPU_PAGE_SHIFT;
+	mp->mp_magic = 0;
+
+	malloc_lock();
+	arena_mark(ma, pg, mp->mp_npages, 0);
+	nrun--;
+	runpages -= mp->mp_npages;
+	if (ma->ma_nfree == ARENA_PAGES-1) {
+		if (narenas_empty >= MAXEMPTY) {
+			LIST_REMOVE(ma, ma_entries);
+			narenas--;
+			bmk_pgfree(ma, ARENA_ORDER);
+		} else {
+			narenas_empty++;
+		}
+	}
+	malloc_unlock();
+}
+
+/*
+ * Try to resize a run in place so that cp can hold nbytes.
+ * Shrinking always works, growing works if the pages after the
+ * run are free.  The tail is given back only if the run shrinks to
+ * an eighth or less, since a buffer trimmed a little is likely to
+ * grow again and its neighbours may take the pages meanwhile.  Returns
+ * 0 on success, non-zero if the caller must move the allocation.
+ */
+static int
+runresize(struct memalloc_page *mp, void *cp, unsigned long nbytes)
+{
+	struct memalloc_arena *ma = mp->mp_arena;
+	unsigned long pg, npages, off;
+	int rv = 0;
+
+	off = (uint8_t *)cp - (uint8_t *)mp;
+	npages = (off + nbytes + BMK_PCPU_PAGE_SIZE-1) >> BMK_PCPU_PAGE_SHIFT;
+	if (npages > ARENA_MAXRUN)
+		return 1;
+	pg = ((unsigned long)mp - (unsigned long)ma) >> BMK_PCPU_PAGE_SHIFT;
+
+	malloc_lock();
+	if (npages <= mp->mp_npages/8) {
+		arena_mark(ma, pg + npages, mp->mp_npages - npages, 0);
+		runpages -= mp->mp_npages - npages;
+		mp->mp_npages = npages;
+	} else if (npages > mp->mp_npages) {
+		if (arena_isfree(ma, pg + mp->mp_npages,
+		    npages - mp->mp_npages)) {
+			arena_mark(ma, pg + mp->mp_npages,
+			    npages - mp->mp_npages, 1);
+			runpages += npages - mp->mp_npages;
+			mp->mp_npages = npages;
+		} else {
+			rv = 1;
+		}
+	}
+	malloc_unlock();
+
+	return rv;
+}
+
 void *
 bmk_memalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who)
 {
-	struct memalloc_hdr *hdr;
+	unsigned class;
 	void *rv;
-	unsigned long allocbytes;
-	unsigned bucket;
-	unsigned long alignpad;
 
 	if (align & (align-1))
 		return NULL;
@@ -171,47 +645,18 @@ bmk_memalloc(unsigned long nbytes, unsigned long align, enum bmk_memwho who)
 		align = MINALIGN;
 	bmk_assert(align <= (1UL<<31));
 
-	/* need at least this many bytes plus header to satisfy alignment */
-	allocbytes = nbytes + ((sizeof(*hdr) + (align-1)) & ~(align-1));
-
-	/*
-	 * Convert amount of memory requested into closest block size
-	 * stored in hash buckets which satisfies request.
-	 * Account for space used per block for accounting.
-	 */
-	if (allocbytes < 1<<MINSHIFT) {
-		bucket = 0;
-	} else {
-		bucket = 8*sizeof(allocbytes)
-		    - __builtin_clzl(allocbytes>>MINSHIFT);
-		if ((allocbytes & (allocbytes-1)) == 0)
-			bucket--;
-	}
-
 	/* handle with page allocator? */
-	if (bucket >= LOCALBUCKETS) {
-		hdr = bmk_pgalloc(bucket+MINSHIFT - BMK_PCPU_PAGE_SHIFT);
+	if ((class = findclass(nbytes, align)) < nclasses) {
+		rv = slaballoc(who, class);
 	} else {
-		hdr = bucketalloc(bucket);
+		rv = NULL;
+		if (who == BMK_MEMWHO_USER && align < BMK_PCPU_PAGE_SIZE)
+			rv = runalloc(nbytes, align, who, 0);
+		if (rv == NULL)
+			rv = largealloc(nbytes, align, who);
 	}
-	if (hdr == NULL)
-		return NULL;
-
-	/* align op before returned memory */
-	rv = (void *)(((unsigned long)(hdr+1) + align - 1) & ~(align - 1));
-	alignpad = (unsigned long)rv - (unsigned long)hdr;
-
-#ifdef MEMALLOC_TESTING
-	bmk_memset(hdr, MAGIC, alignpad);
-#endif
-
-	hdr = ((struct memalloc_hdr *)rv)-1;
-	hdr->mh_magic = MAGIC;
-	hdr->mh_index = bucket;
-	hdr->mh_alignpad = alignpad;
-	hdr->mh_who = who;
-
-  	return rv;
+	bmk_trace(BMK_TRACE_MEMALLOC, nbytes, rv);
+	return rv;
 }
 
 void *
@@ -240,59 +685,77 @@ bmk_memcalloc(unsigned long n, unsigned long size, enum bmk_memwho who)
 	return v;
 }
 
-void
-bmk_memfree(void *cp, enum bmk_memwho who)
-{   
-	struct memalloc_hdr *hdr;
-	struct memalloc_freeblk *frb;
-	unsigned long alignpad;
-	unsigned int index;
-	void *origp;
+/*
+ * Locate and sanity check the page header for an allocation.
+ */
+static struct memalloc_page *
+getpage(void *cp, enum bmk_memwho who, const char *caller)
+{
+	struct memalloc_page *mp;
 
-  	if (cp == NULL)
-  		return;
-	hdr = ((struct memalloc_hdr *)cp)-1;
-	if (hdr->mh_magic != MAGIC) {
+	mp = addr2page((uint8_t *)cp - 1);
+	if (mp->mp_magic != MAGIC) {
 #ifdef MEMALLOC_TESTING
 		bmk_assert(0);
 #else
-		bmk_printf("bmk_memfree: invalid pointer %p\n", cp);
-		return;
+		bmk_printf("%s: invalid pointer %p\n", caller, cp);
+		return NULL;
 #endif
 	}
-	if (hdr->mh_who != who) {
-		bmk_printf("bmk_memfree: mismatch %d vs. %d for %p",
-		    hdr->mh_who, who, cp);
+	if (mp->mp_who != who) {
+		bmk_printf("%s: mismatch %d vs. %d for %p",
+		    caller, mp->mp_who, who, cp);
 		bmk_platform_halt("bmk_memalloc error");
 	}
 
-	index = hdr->mh_index;
-	alignpad = hdr->mh_alignpad;
+	return mp;
+}
 
-	origp = (unsigned char *)cp - alignpad;
+void
+bmk_memfree(void *cp, enum bmk_memwho who)
+{
+	struct memalloc_page *mp;
 
-#ifdef MEMALLOC_TESTING
-	{
-		unsigned long i;
+  	if (cp == NULL)
+  		return;
+	if ((mp = getpage(cp, who, "bmk_memfree")) == NULL)
+		return;
+	bmk_trace(BMK_TRACE_MEMFREE, 0, cp);
+
+	if (mp->mp_class == CLASS_LARGE)
+		largefree(mp);
+	else if (mp->mp_class == CLASS_RUN)
+		runfree(mp);
+	else
+		slabfree(mp, cp);
+}
 
-		for (i = 0;
-		    (unsigned char *)origp + i < (unsigned char *)hdr;
-		    i++) {
-			bmk_assert(*((unsigned char *)origp + i) == MAGIC);
+static unsigned long
+usablesize(struct memalloc_page *mp, void *cp)
+{
 
-		}
+	switch (mp->mp_class) {
+	case CLASS_LARGE:
+		return (1UL << (mp->mp_order + BMK_PCPU_PAGE_SHIFT))
+		    - ((uint8_t *)cp - (uint8_t *)mp->mp_origin);
+	case CLASS_RUN:
+		return (mp->mp_npages << BMK_PCPU_PAGE_SHIFT)
+		    - ((uint8_t *)cp - (uint8_t *)mp);
+	default:
+		return classsize[mp->mp_class];
 	}
-#endif
+}
 
-	if (index >= LOCALBUCKETS) {
-		bmk_pgfree(origp, (index+MINSHIFT) - BMK_PCPU_PAGE_SHIFT);
-	} else {
-		malloc_lock();
-		frb = origp;
-		LIST_INSERT_HEAD(&freebuckets[index], frb, entries);
-		nmalloc[index]--;
-		malloc_unlock();
-	}
+unsigned long
+bmk_memalloc_usable(void *cp, enum bmk_memwho who)
+{
+	struct memalloc_page *mp;
+
+	if (cp == NULL)
+		return 0;
+	if ((mp = getpage(cp, who, "bmk_memalloc_usable")) == NULL)
+		return 0;
+	return usablesize(mp, cp);
 }
 
 /*
@@ -301,15 +764,19 @@ bmk_memfree(void *cp, enum bmk_memwho who)
  *   + nbytes == 0 ==> free
  *   + else ==> realloc
  *
+ * Runs are resized in place when possible.  When a run has to move
+ * to grow, it gets up to 50% headroom over the new size (see
+ * runalloc() for the cap), so that a buffer grown a little at a time
+ * is copied only O(log n) times.
+ *
  * Also, assume that realloc() is always called from POSIX compat code,
  * because nobody sane would use realloc()
  */
 void *
 bmk_memrealloc_user(void *cp, unsigned long nbytes)
-{   
-	struct memalloc_hdr *hdr;
+{
+	struct memalloc_page *mp;
   	unsigned long size;
-	unsigned long alignpad;
 	void *np;
 
 	if (cp == NULL)
@@ -320,59 +787,121 @@ bmk_memrealloc_user(void *cp, unsigned long nbytes)
 		return NULL;
 	}
 
-	hdr = ((struct memalloc_hdr *)cp)-1;
-	size = hdr->mh_index;
-	alignpad = hdr->mh_alignpad;
+	if ((mp = getpage(cp, BMK_MEMWHO_USER, "bmk_memrealloc_user")) == NULL)
+		return NULL;
+	if (mp->mp_class == CLASS_RUN && runresize(mp, cp, nbytes) == 0)
+		return cp;
+	size = usablesize(mp, cp);
 
 	/* don't bother "compacting".  don't like it?  don't use realloc! */
-	if (((1<<(size+MINSHIFT)) - alignpad) >= nbytes)
+	if (size >= nbytes)
 		return cp;
 
 	/* we're gonna need a bigger bucket */
-	np = bmk_memalloc(nbytes, 8, BMK_MEMWHO_USER);
+	np = NULL;
+	if (mp->mp_class == CLASS_RUN)
+		np = runalloc(nbytes, MINALIGN, BMK_MEMWHO_USER, nbytes/2);
+	if (np == NULL)
+		np = bmk_memalloc(nbytes, MINALIGN, BMK_MEMWHO_USER);
 	if (np == NULL)
 		return NULL;
 
-	bmk_memcpy(np, cp, (1<<(size+MINSHIFT)) - alignpad);
+	bmk_memcpy(np, cp, size);
 	bmk_memfree(cp, BMK_MEMWHO_USER);
 	return np;
 }
 
+/*
+ * Give the completely free slabs and arenas kept cached back to the
+ * page allocator.  Called when pages run out; returns the number of
+ * pages freed.
+ */
+unsigned long
+bmk_memalloc_drain(void)
+{
+	struct memalloc_cache *mc;
+	struct memalloc_page *mp, *mp_next;
+	struct memalloc_arena *ma, *ma_next;
+	unsigned long npages = 0;
+	unsigned int i, who;
+
+	malloc_lock();
+	for (who = 0; who < BMK_MEMWHO_MAX; who++) {
+		for (i = 0; i < nclasses; i++) {
+			mc = &caches[who][i];
+			if (mc->mc_nempty == 0)
+				continue;
+			for (mp = LIST_FIRST(&mc->mc_partial); mp; mp = mp_next) {
+				mp_next = LIST_NEXT(mp, mp_entries);
+				if (mp->mp_nfree != mp->mp_nblks)
+					continue;
+				LIST_REMOVE(mp, mp_entries);
+				mp->mp_magic = 0;
+				mc->mc_nslabs--;
+				mc->mc_nempty--;
+				nslabreturned++;
+				bmk_pgfree_one(mp);
+				npages++;
+			}
+		}
+	}
+	for (ma = LIST_FIRST(&arenas); ma; ma = ma_next) {
+		ma_next = LIST_NEXT(ma, ma_entries);
+		if (ma->ma_nfree != ARENA_PAGES-1)
+			continue;
+		LIST_REMOVE(ma, ma_entries);
+		narenas--;
+		narenas_empty--;
+		bmk_pgfree(ma, ARENA_ORDER);
+		npages += ARENA_PAGES;
+	}
+	malloc_unlock();
+
+	return npages;
+}
+
 /*
  * mstats - print out statistics about malloc
  * 
- * Prints two lines of numbers, one showing the length of the free list
- * for each size category, the second showing the number of mallocs -
- * frees for each size category.
+ * Prints one line per size class showing the number of slabs, the
+ * number of blocks in use and free, and the space lost to partially
+ * used slabs, followed by totals and large allocation statistics.
  */
 void
 bmk_memalloc_printstats(void)
 {
-	struct memalloc_freeblk *frb;
-	unsigned long totfree = 0, totused = 0;
-	unsigned int i, j;
+	struct memalloc_cache *mc;
+	unsigned long totfree = 0, totused = 0, totslabs = 0;
+	unsigned long slabs, used, nblks;
+	unsigned int i, who;
 
 	bmk_printf("Memory allocation statistics\n");
-	bmk_printf("size:\t");
-	for (i = 0; i < LOCALBUCKETS; i++) {
-		bmk_printf("%8d", 1<<(i+MINSHIFT));
-	}
-	bmk_printf("\nfree:\t");
-	for (i = 0; i < LOCALBUCKETS; i++) {
-		j = 0;
-		LIST_FOREACH(frb, &freebuckets[i], entries) {
-			j++;
+	bmk_printf("%8s%8s%8s%8s%8s\n", "size", "blk/pg", "slabs",
+	    "used", "free");
+	for (i = 0; i < nclasses; i++) {
+		slabs = used = 0;
+		for (who = 0; who < BMK_MEMWHO_MAX; who++) {
+			mc = &caches[who][i];
+			slabs += mc->mc_nslabs;
+			used += mc->mc_nused;
 		}
-		bmk_printf("%8d", j);
-		totfree += j * (1 << (i + MINSHIFT));
-  	}
-	bmk_printf("\nused:\t");
-	for (i = 0; i < LOCALBUCKETS; i++) {
-		bmk_printf("%8d", nmalloc[i]);
-		totused += nmalloc[i] * (1 << (i + MINSHIFT));
-  	}
-	bmk_printf("\n\tTotal in use: %lukB, total free in buckets: %lukB\n",
+		if (slabs == 0)
+			continue;
+		nblks = SLAB_SPACE / classsize[i];
+		bmk_printf("%8lu%8lu%8lu%8lu%8lu\n", classsize[i], nblks,
+		    slabs, used, slabs*nblks - used);
+		totslabs += slabs;
+		totused += used * classsize[i];
+		totfree += (slabs*nblks - used) * classsize[i];
+	}
+	bmk_printf("\tTotal in use: %lukB, total free in slabs: %lukB\n",
 	    totused/1024, totfree/1024);
+	bmk_printf("\tSlab pages: %lu (%lukB), returned to pgalloc: %lu\n",
+	    totslabs, (totslabs*BMK_PCPU_PAGE_SIZE)/1024, nslabreturned);
+	bmk_printf("\tLarge allocations: %lu (%lukB)\n", nlarge, largekb);
+	bmk_printf("\tPage runs: %lu (%lukB) in %lu arenas (%lukB)\n",
+	    nrun, (runpages*BMK_PCPU_PAGE_SIZE)/1024,
+	    narenas, (narenas*ARENA_PAGES*BMK_PCPU_PAGE_SIZE)/1024);
 }
 
 
@@ -416,7 +945,7 @@ testalloc(unsigned long min, unsigned long max)
 	v = bmk_memalloc(size1, 1<<align, BMK_MEMWHO_USER);
 	if (!v)
 		return NULL;
-	bmk_assert(((uintptr_t)v & (align-1)) == 0);
+	bmk_assert(((uintptr_t)v & ((1<<align)-1)) == 0);
 	bmk_memset(v, UNMAGIC, size1);
 
 	size2 = myrand() % ((max-min)+1) + min;
@@ -467,4 +996,165 @@ bmk_memalloc_test(void)
 		}
 	}
 }
+
+/*
+ * Grow a buffer a little at a time, like a string builder or a
+ * stdio buffer would, and check that the contents survive.  Reports
+ * how often realloc() had to move the buffer and how long it took.
+ */
+#define REALLOC_STEP 1000
+#define REALLOC_MAX (1024*1024)
+
+static void
+realloc_growth(void)
+{
+	bmk_time_t start, end;
+	unsigned long sz, i, nmoves = 0;
+	uint8_t *v = NULL, *nv;
+
+	start = bmk_platform_cpu_clock_monotonic();
+	for (sz = REALLOC_STEP; sz <= REALLOC_MAX; sz += REALLOC_STEP) {
+		nv = bmk_memrealloc_user(v, sz);
+		bmk_assert(nv != NULL);
+		bmk_assert(bmk_memalloc_usable(nv, BMK_MEMWHO_USER) >= sz);
+		if (nv != v && v != NULL)
+			nmoves++;
+		v = nv;
+		bmk_memset(v + sz - REALLOC_STEP, (uint8_t)sz, REALLOC_STEP);
+	}
+	end = bmk_platform_cpu_clock_monotonic();
+
+	for (sz = REALLOC_STEP; sz <= REALLOC_MAX; sz += REALLOC_STEP) {
+		for (i = sz - REALLOC_STEP; i < sz; i++)
+			bmk_assert(v[i] == (uint8_t)sz);
+	}
+
+	/* and shrink it back, which must not move */
+	for (sz -= REALLOC_STEP; sz > 64*REALLOC_STEP; sz -= 64*REALLOC_STEP) {
+		nv = bmk_memrealloc_user(v, sz);
+		bmk_assert(nv == v);
+	}
+	bmk_memfree(v, BMK_MEMWHO_USER);
+
+	bmk_printf("realloc growth to %d bytes: %lu moves, %llu us\n",
+	    REALLOC_MAX, nmoves, (unsigned long long)(end - start) / 1000);
+}
+
+/*
+ * A fixed pseudo-random trace over a set of live buffers of mixed
+ * sizes, from slab-sized to a megabyte.  Buffers are appended to,
+ * truncated, resized to an unrelated size and freed, so runs have
+ * neighbours and cannot always grow in place.  Reports the number
+ * of moves, the bytes copied by them and how long the trace took.
+ */
+#define MIXED_NBUF 128
+#define MIXED_NOPS 100000
+
+/* the low bits of myrand() have short periods */
+static unsigned long
+mixed_rand(void)
+{
+
+	return myrand() >> 8;
+}
+
+static unsigned long
+mixed_size(void)
+{
+
+	switch (mixed_rand() % 8) {
+	case 6:
+		return 8*1024 + mixed_rand() % (120*1024);
+	case 7:
+		return 128*1024 + mixed_rand() % (896*1024);
+	case 4:
+	case 5:
+		return 512 + mixed_rand() % (7*1024 + 512);
+	default:
+		return 1 + mixed_rand() % 512;
+	}
+}
+
+static void
+realloc_mixed(void)
+{
+	static uint8_t *bufs[MIXED_NBUF];
+	static unsigned long sizes[MIXED_NBUF];
+	bmk_time_t start, end;
+	unsigned long sz, keep, nmoves = 0, ncopied = 0;
+	uint8_t *nv;
+	int i, n;
+
+	randstate = 1;
+	start = bmk_platform_cpu_clock_monotonic();
+	for (n = 0; n < MIXED_NOPS; n++) {
+		i = mixed_rand() % MIXED_NBUF;
+		if (bufs[i] != NULL && mixed_rand() % 8 == 0) {
+			bmk_memfree(bufs[i], BMK_MEMWHO_USER);
+			bufs[i] = NULL;
+			continue;
+		}
+
+		if (bufs[i] == NULL) {
+			sz = mixed_size();
+		} else {
+			switch (mixed_rand() % 4) {
+			case 0:
+			case 1:
+				sz = sizes[i] + 1
+				    + mixed_rand() % (sizes[i]/4 + 64);
+				break;
+			case 2:
+				sz = (sizes[i]+1)/2
+				    + mixed_rand() % (sizes[i]/2 + 1);
+				break;
+			default:
+				sz = mixed_size();
+				break;
+			}
+			if (sz > REALLOC_MAX)
+				sz = mixed_size();
+		}
+
+		nv = bmk_memrealloc_user(bufs[i], sz);
+		bmk_assert(nv != NULL);
+		if (bufs[i] != NULL) {
+			keep = sz < sizes[i] ? sz : sizes[i];
+			bmk_assert(nv[0] == (uint8_t)i);
+			bmk_assert(nv[keep-1] == (uint8_t)i);
+			if (nv != bufs[i]) {
+				nmoves++;
+				ncopied += keep;
+			}
+		}
+		if (bufs[i] == NULL)
+			bmk_memset(nv, (uint8_t)i, sz);
+		else if (sz > sizes[i])
+			bmk_memset(nv + sizes[i], (uint8_t)i, sz - sizes[i]);
+		bufs[i] = nv;
+		sizes[i] = sz;
+	}
+	end = bmk_platform_cpu_clock_monotonic();
+
+	bmk_memalloc_printstats();
+	for (i = 0; i < MIXED_NBUF; i++) {
+		bmk_memfree(bufs[i], BMK_MEMWHO_USER);
+		bufs[i] = NULL;
+	}
+
+	bmk_printf("realloc mixed trace, %d ops: %lu moves, %lukB copied, "
+	    "%llu us\n", MIXED_NOPS, nmoves, ncopied/1024,
+	    (unsigned long long)(end - start) / 1000);
+}
+
+/* XXX: no prototype */
+void bmk_memalloc_realloctest(void);
+void
+bmk_memalloc_realloctest(void)
+{
+
+	realloc_growth();
+	bmk_memalloc_printstats();
+	realloc_mixed();
+}
 #endif /* MEMALLOC_TESTING */
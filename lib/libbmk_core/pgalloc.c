@@ -60,12 +60,14 @@
  */
 
 #include <bmk-core/core.h>
+#include <bmk-core/errno.h>
 #include <bmk-core/null.h>
 #include <bmk-core/pgalloc.h>
 #include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
-#include <bmk-core/queue.h>
+#include <bmk-core/spinlock.h>
 #include <bmk-core/string.h>
+#include <bmk-core/trace.h>
 
 #include <bmk-pcpu/pcpu.h>
 
@@ -80,165 +82,294 @@ int bmk_pgalloc_debug = 0;
 
 unsigned long pgalloc_totalkb, pgalloc_usedkb;
 
+#define order2size(_order_) (1UL<<(_order_ + BMK_PCPU_PAGE_SHIFT))
+
 /*
- * The allocation bitmap is offset to the first page loaded, which is
- * nice if someone loads memory starting in high ranges.  Notably,
- * we don't need a pg->va operation since allocation is always done
- * through the freelists in va, and the pgmap is used only as a lookup
- * table for coalescing entries when pages are freed.
+ * Orders of free chunks.  The assumption is that pointer size * NBBY
+ * = va size.  It's a pretty reasonable assumption, except that we
+ * really don't need that much address space.  The order of what most
+ * CPUs implement (48bits) would be more than plenty.  But since the
+ * unused levels don't consume much space, leave it be for now.
  */
-static void *minpage_addr, *maxpage_addr;
-#define va_to_pg(x) \
-    (((unsigned long)x - (unsigned long)minpage_addr)>>BMK_PCPU_PAGE_SHIFT)
-
-#define addr2chunk(_addr_,_offset_) \
-    ((struct chunk *)(((char *)_addr_)+(_offset_)))
-
-#define order2size(_order_) (1UL<<(_order_ + BMK_PCPU_PAGE_SHIFT))
+#define FREELIST_LEVELS (8*(sizeof(void*))-BMK_PCPU_PAGE_SHIFT)
 
 /*
- * ALLOCATION BITMAP
- *  One bit per page of memory. Bit set => page is allocated.
+ * FREE CHUNK BITMAPS
+ *  One bit per naturally aligned chunk of a given order.  Bit set =>
+ *  the chunk is free and is not part of a larger free chunk.  Every
+ *  64 words (32 on ILP32) of bitmap are summarized by one word on
+ *  the next level, with a bit set for every non-zero word below,
+ *  up to a top level of one word.  Finding the lowest set bit is
+ *  therefore a walk down the levels, and setting or clearing a bit
+ *  touches more than one level only when a word changes between
+ *  zero and non-zero.
  */
 
-static unsigned long *alloc_bitmap;
-#define PAGES_PER_MAPWORD (sizeof(unsigned long) * 8)
-bmk_ctassert((PAGES_PER_MAPWORD & (PAGES_PER_MAPWORD-1)) == 0);
+#define BITS_PER_WORD (sizeof(unsigned long) * 8)
+bmk_ctassert((BITS_PER_WORD & (BITS_PER_WORD-1)) == 0);
+bmk_ctassert(FREELIST_LEVELS <= BITS_PER_WORD);
 
-static int
-addr_is_managed(void *addr)
-{
+/* enough for 2^48 bytes worth of pages at order 0 */
+#define PGBITS_MAXLEVELS 6
+
+struct pgbits {
+	unsigned long *pb_map[PGBITS_MAXLEVELS];	/* [0] is the leaves */
+	unsigned long pb_nbits;
+	unsigned long pb_nset;
+	int pb_nlevels;
+};
+
+#define WORDS(_nbits_) (((_nbits_) + BITS_PER_WORD-1) / BITS_PER_WORD)
 
-	return addr >= minpage_addr && addr < maxpage_addr;
+/*
+ * Lay out a bitmap of nbits bits at mem, which must be zeroed.
+ * Returns the number of words used.  Called with mem == NULL to find
+ * out how much memory is needed.
+ */
+static unsigned long
+pgbits_init(struct pgbits *pb, unsigned long nbits, unsigned long *mem)
+{
+	unsigned long n, used = 0;
+	int l = 0;
+
+	n = nbits;
+	do {
+		if (l == PGBITS_MAXLEVELS)
+			bmk_platform_halt("pgalloc: range too large");
+		n = WORDS(n);
+		if (pb) {
+			pb->pb_map[l] = mem + used;
+		}
+		used += n;
+		l++;
+	} while (n > 1);
+
+	if (pb) {
+		pb->pb_nbits = nbits;
+		pb->pb_nset = 0;
+		pb->pb_nlevels = l;
+	}
+	return used;
 }
 
 static int
-allocated_in_map(void *addr)
+pgbits_isset(struct pgbits *pb, unsigned long i)
 {
-	unsigned long pagenum;
 
-	bmk_assert(addr_is_managed(addr));
-	pagenum = va_to_pg(addr);
-	return (alloc_bitmap[pagenum/PAGES_PER_MAPWORD] \
-	    & (1UL<<(pagenum&(PAGES_PER_MAPWORD-1)))) != 0;
+	if (i >= pb->pb_nbits)
+		return 0;
+	return (pb->pb_map[0][i / BITS_PER_WORD]
+	    & (1UL << (i & (BITS_PER_WORD-1)))) != 0;
 }
 
-/*
- * Hint regarding bitwise arithmetic in map_{alloc,free}:
- *  -(1<<n)  sets all bits >= n.
- *  (1<<n)-1 sets all bits <  n.
- * Variable names in map_{alloc,free}:
- *  *_idx == Index into `alloc_bitmap' array.
- *  *_off == Bit offset within an element of the `alloc_bitmap' array.
- */
-
-#define PAGES_TO_MAPOPVARS(va, np)					\
-	unsigned long start, end, curr_idx, end_idx;			\
-	unsigned long first_page = va_to_pg(va);			\
-	curr_idx= first_page / PAGES_PER_MAPWORD;			\
-	start	= first_page & (PAGES_PER_MAPWORD-1);			\
-	end_idx	= (first_page + nr_pages) / PAGES_PER_MAPWORD;		\
-	end	= (first_page + nr_pages) & (PAGES_PER_MAPWORD-1);
-
 static void
-map_alloc(void *virt, unsigned long nr_pages)
+pgbits_set(struct pgbits *pb, unsigned long i)
 {
-	PAGES_TO_MAPOPVARS(virt, nr_pages);
-
-	if (curr_idx == end_idx) {
-		alloc_bitmap[curr_idx] |= ((1UL<<end)-1) & -(1UL<<start);
-	} else {
-		alloc_bitmap[curr_idx] |= -(1UL<<start);
-		while (++curr_idx < end_idx)
-			alloc_bitmap[curr_idx] = ~0UL;
-		alloc_bitmap[curr_idx] |= (1UL<<end)-1;
+	unsigned long *w, old;
+	int l;
+
+	bmk_assert(i < pb->pb_nbits);
+	pb->pb_nset++;
+	for (l = 0; l < pb->pb_nlevels; l++, i /= BITS_PER_WORD) {
+		w = &pb->pb_map[l][i / BITS_PER_WORD];
+		old = *w;
+		*w |= 1UL << (i & (BITS_PER_WORD-1));
+		if (old != 0)
+			break;
 	}
 }
 
 static void
-map_free(void *virt, unsigned long nr_pages)
+pgbits_clr(struct pgbits *pb, unsigned long i)
 {
-	PAGES_TO_MAPOPVARS(virt, nr_pages);
+	unsigned long *w;
+	int l;
+
+	bmk_assert(pgbits_isset(pb, i));
+	pb->pb_nset--;
+	for (l = 0; l < pb->pb_nlevels; l++, i /= BITS_PER_WORD) {
+		w = &pb->pb_map[l][i / BITS_PER_WORD];
+		*w &= ~(1UL << (i & (BITS_PER_WORD-1)));
+		if (*w != 0)
+			break;
+	}
+}
 
-	if (curr_idx == end_idx) {
-		alloc_bitmap[curr_idx] &= -(1UL<<end) | ((1UL<<start)-1);
-	} else {
-		alloc_bitmap[curr_idx] &= (1UL<<start)-1;
-		while (++curr_idx != end_idx)
-			alloc_bitmap[curr_idx] = 0;
-		alloc_bitmap[curr_idx] &= -(1UL<<end);
+/* Return the lowest set bit.  The bitmap must not be empty. */
+static unsigned long
+pgbits_first(struct pgbits *pb)
+{
+	unsigned long i = 0;
+	int l;
+
+	bmk_assert(pb->pb_nset > 0);
+	for (l = pb->pb_nlevels-1; l >= 0; l--) {
+		i = i * BITS_PER_WORD + __builtin_ctzl(pb->pb_map[l][i]);
 	}
+	return i;
 }
 
 /*
- * BINARY BUDDY ALLOCATOR
+ * Memory is loaded as one or more discontiguous ranges.  Every range
+ * has a free chunk bitmap for each order at its start, so the pages
+ * themselves are never written to by the allocator.  Bit i of order
+ * n stands for the chunk at the i'th multiple of its size counting
+ * from the one containing pr_min.  Since the bitmaps say everything
+ * there is to say about free chunks, allocated memory needs no
+ * bookkeeping at all, the caller tells us the order when freeing.
  */
+struct pgrange {
+	unsigned long pr_min, pr_max;	/* managed pages [min,max) */
+	int pr_maxorder;		/* largest chunk which can fit */
+	struct pgbits *pr_free;		/* [0..maxorder] */
+	struct pgbits *pr_pool;		/* huge page pool, or NULL */
+};
+static struct pgrange pgranges[BMK_PGALLOC_MAXRANGES];
+static int npgranges;
 
-#define CHUNKMAGIC 0x11020217
-struct chunk {
-	int level;
-	int magic;
+/* free chunks per order in all ranges, and a bit for every non-zero */
+static unsigned long nfree[FREELIST_LEVELS];
+static unsigned long freeorders;
 
-	LIST_ENTRY(chunk) entries;
-};
+/* protects all of the above, the statistics and the pressure state */
+static struct bmk_spinlock pgalloc_lock = BMK_SPINLOCK_INITIALIZER;
+
+/*
+ * MEMORY PRESSURE
+ *  Memory is under pressure when the amount used rises above the
+ *  high watermark or when an allocation fails, and stays so until
+ *  usage drops below the low watermark.  Hooks are called whenever
+ *  the level changes, so that caches can be shrunk before we run
+ *  out for real.
+ */
+static unsigned long pgalloc_lowkb, pgalloc_highkb;
+static int pgalloc_setwm;
+static int pressure_level = BMK_PGALLOC_PRESSURE_NONE;
+
+static struct {
+	void (*ph_func)(void *, int);
+	void *ph_arg;
+} pressure_hooks[BMK_PGALLOC_MAXHOOKS];
+static int npressure_hooks;
 
 static int
-chunklevel(struct chunk *ch)
+addr_in_range(struct pgrange *r, unsigned long addr)
 {
 
-	bmk_assert(ch->magic == CHUNKMAGIC);
-	return ch->level;
+	return addr >= r->pr_min && addr < r->pr_max;
+}
+
+/* Return the range addr is in, or NULL if the page is not managed. */
+static struct pgrange *
+addr2range(unsigned long addr)
+{
+	int i;
+
+	for (i = 0; i < npgranges; i++) {
+		if (addr_in_range(&pgranges[i], addr))
+			return &pgranges[i];
+	}
+	return NULL;
+}
+
+static unsigned long
+addr2idx(struct pgrange *r, unsigned long addr, int order)
+{
+	int shift = order + BMK_PCPU_PAGE_SHIFT;
+
+	return (addr >> shift) - (r->pr_min >> shift);
+}
+
+static unsigned long
+idx2addr(struct pgrange *r, unsigned long idx, int order)
+{
+	int shift = order + BMK_PCPU_PAGE_SHIFT;
+
+	return (idx + (r->pr_min >> shift)) << shift;
 }
 
 /*
- * Linked lists of free chunks of different powers-of-two in size.
- * The assumption is that pointer size * NBBY = va size.  It's
- * a pretty reasonable assumption, except that we really don't need
- * that much address space.  The order of what most CPUs implement (48bits)
- * would be more than plenty.  But since the unused levels don't consume
- * much space, leave it be for now.
+ * HUGE PAGE POOL
+ *  If the platform maps memory with large pages, keep a stash of
+ *  free chunks of exactly that size and alignment aside from the
+ *  buddy allocator, so that small allocations do not break up every
+ *  large page there is.  Requests of that order are served from the
+ *  pool first.  The pool is given back to the buddy allocator only
+ *  when it cannot otherwise satisfy a request.  Chunks in the pool
+ *  have their bit set in the pool bitmap of their range instead of
+ *  the free bitmap, so that they are never merged, and they are not
+ *  counted as used.
  */
-#define FREELIST_LEVELS (8*(sizeof(void*))-BMK_PCPU_PAGE_SHIFT)
-static LIST_HEAD(, chunk) freelist[FREELIST_LEVELS];
+#ifdef BMK_PCPU_HUGEPAGE_SHIFT
+#define HUGE_ORDER (BMK_PCPU_HUGEPAGE_SHIFT - BMK_PCPU_PAGE_SHIFT)
+static unsigned long hugepool_n, hugepool_target;
+static unsigned long hugepool_hits, hugepool_misses;
 
+static void hugepool_fill(unsigned long);
+#endif
+
+/*
+ * Put a chunk on the free bitmaps, or take one off.
+ * Called with pgalloc_lock held.
+ */
 static void
-freechunk_link(void *addr, int order)
+chunk_link(struct pgrange *r, unsigned long addr, int order)
 {
-	struct chunk *ch = addr;
 
-	ch->level = order;
-	ch->magic = CHUNKMAGIC;
+	bmk_assert((addr & (order2size(order)-1)) == 0);
+	bmk_assert(order <= r->pr_maxorder);
+	pgbits_set(&r->pr_free[order], addr2idx(r, addr, order));
+	if (nfree[order]++ == 0)
+		freeorders |= 1UL << order;
+}
 
-	LIST_INSERT_HEAD(&freelist[order], ch, entries);
+static void
+chunk_unlink(struct pgrange *r, unsigned long addr, int order)
+{
+
+	pgbits_clr(&r->pr_free[order], addr2idx(r, addr, order));
+	if (--nfree[order] == 0)
+		freeorders &= ~(1UL << order);
 }
 
 #ifdef BMK_PGALLOC_DEBUG
-static void __attribute__((used))
-print_allocation(void *start, unsigned nr_pages)
+/* Is the page at addr part of a free chunk, or in the huge page pool? */
+static int
+page_is_free(unsigned long addr)
 {
-	unsigned long addr = (unsigned long)start;
-
-	for (; nr_pages > 0; nr_pages--, addr += BMK_PCPU_PAGE_SIZE) {
-		if (allocated_in_map((void *)addr))
-			bmk_printf("1");
-		else
-			bmk_printf("0");
+	struct pgrange *r;
+	int i;
+
+	r = addr2range(addr);
+	bmk_assert(r != NULL);
+	for (i = 0; i <= r->pr_maxorder; i++) {
+		if (pgbits_isset(&r->pr_free[i], addr2idx(r, addr, i)))
+			return 1;
 	}
-
-	bmk_printf("\n");
+#ifdef HUGE_ORDER
+	if (r->pr_pool
+	    && pgbits_isset(r->pr_pool, addr2idx(r, addr, HUGE_ORDER)))
+		return 1;
+#endif
+	return 0;
 }
 
 static void
 sanity_check(void)
 {
-	unsigned int x;
-	struct chunk *head;
-
-	for (x = 0; x < FREELIST_LEVELS; x++) {
-		LIST_FOREACH(head, &freelist[x], entries) {
-			bmk_assert(!allocated_in_map(head));
-			bmk_assert(head->magic == CHUNKMAGIC);
+	struct pgrange *r;
+	unsigned long n;
+	int i, j;
+
+	for (j = 0; j < (int)FREELIST_LEVELS; j++) {
+		n = 0;
+		for (i = 0; i < npgranges; i++) {
+			r = &pgranges[i];
+			if (j <= r->pr_maxorder)
+				n += r->pr_free[j].pb_nset;
 		}
+		bmk_assert(n == nfree[j]);
+		bmk_assert(((freeorders & (1UL<<j)) != 0) == (n != 0));
 	}
 }
 #endif
@@ -246,37 +377,38 @@ sanity_check(void)
 void
 bmk_pgalloc_dumpstats(void)
 {
-	struct chunk *ch;
 	unsigned long remainingkb;
 	unsigned i;
 
 	remainingkb = pgalloc_totalkb - pgalloc_usedkb;
 	bmk_printf("pgalloc total %ld kB, used %ld kB (remaining %ld kB)\n",
 	    pgalloc_totalkb, pgalloc_usedkb, remainingkb);
+	bmk_printf("watermarks %ld/%ld kB, pressure level %d\n",
+	    pgalloc_lowkb, pgalloc_highkb, pressure_level);
 
 	bmk_printf("available chunks:\n");
 	for (i = 0; i < FREELIST_LEVELS; i++) {
 		unsigned long chunks, levelhas;
 
-		if (LIST_EMPTY(&freelist[i]))
+		if ((chunks = nfree[i]) == 0)
 			continue;
 
-		chunks = 0;
-		LIST_FOREACH(ch, &freelist[i], entries) {
-			chunks++;
-		}
 		levelhas = chunks * (order2size(i)>>10);
 		bmk_printf("%8ld kB: %8ld chunks, %12ld kB\t(%2ld%%)\n",
 		    order2size(i)>>10, chunks, levelhas,
 		    (100*levelhas)/remainingkb);
 	}
+#ifdef HUGE_ORDER
+	bmk_printf("huge page pool: %ld/%ld chunks of %ld kB, "
+	    "%ld hits, %ld misses\n", hugepool_n, hugepool_target,
+	    order2size(HUGE_ORDER)>>10, hugepool_hits, hugepool_misses);
+#endif
 }
 
 static void
-carverange(unsigned long addr, unsigned long range)
+carverange(struct pgrange *r, unsigned long addr, unsigned long range)
 {
-	struct chunk *ch;
-	unsigned i, r;
+	unsigned i, s;
 
 	while (range) {
 		/*
@@ -284,83 +416,348 @@ carverange(unsigned long addr, unsigned long range)
 		 * must not be bigger than remaining range.
 		 */
 		i = __builtin_ctzl(addr);
-		r = 8*sizeof(range) - (__builtin_clzl(range)+1);
-		if (i > r) {
-			i = r;
+		s = 8*sizeof(range) - (__builtin_clzl(range)+1);
+		if (i > s) {
+			i = s;
 		}
 		i -= BMK_PCPU_PAGE_SHIFT;
 
-		ch = addr2chunk(addr, 0);
-		freechunk_link(ch, i);
+		chunk_link(r, addr, i);
 		addr += order2size(i);
 		range -= order2size(i);
 
-		DPRINTF(("bmk_pgalloc: carverange chunk 0x%lx at %p\n",
-		    order2size(i), ch));
+		DPRINTF(("bmk_pgalloc: carverange chunk 0x%lx at 0x%lx\n",
+		    order2size(i), addr - order2size(i)));
 	}
 }
 
 /*
- * Load [min,max] as available addresses.
+ * Lay out the bitmaps for r at mem, or just count the words they
+ * need if mem is NULL.
+ */
+static unsigned long
+range_initmaps(struct pgrange *r, unsigned long *mem)
+{
+	struct pgbits *pb = NULL;
+	unsigned long used, nbits;
+	int i, nmaps;
+
+	nmaps = r->pr_maxorder+1;
+#ifdef HUGE_ORDER
+	if (r->pr_maxorder >= HUGE_ORDER)
+		nmaps++;
+#endif
+	used = (nmaps * sizeof(*pb) + sizeof(*mem)-1) / sizeof(*mem);
+	if (mem) {
+		pb = (void *)mem;
+		r->pr_free = pb;
+		r->pr_pool = NULL;
+	}
+
+	for (i = 0; i < nmaps; i++) {
+		int shift = i + BMK_PCPU_PAGE_SHIFT;
+
+#ifdef HUGE_ORDER
+		if (i > r->pr_maxorder)
+			shift = HUGE_ORDER + BMK_PCPU_PAGE_SHIFT;
+#endif
+		nbits = ((r->pr_max-1) >> shift) - (r->pr_min >> shift) + 1;
+		used += pgbits_init(pb ? &pb[i] : NULL, nbits,
+		    mem ? mem + used : NULL);
+	}
+#ifdef HUGE_ORDER
+	if (mem && nmaps > r->pr_maxorder+1)
+		r->pr_pool = &pb[nmaps-1];
+#endif
+
+	return used;
+}
+
+/*
+ * Load [min,max] as available addresses.  May be called once for
+ * every discontiguous range of memory, up to BMK_PGALLOC_MAXRANGES
+ * times.  The ranges must not overlap.
  */
 void
 bmk_pgalloc_loadmem(unsigned long min, unsigned long max)
 {
-	static int called;
-	unsigned long range, bitmap_size;
-	unsigned int i;
-
-	if (called)
-		bmk_platform_halt("bmk_pgalloc_loadmem called more than once");
-	called = 1;
+	struct pgrange *r;
+	unsigned long range, mapsize;
 
-	bmk_assert(max > min);
+	if (npgranges == BMK_PGALLOC_MAXRANGES)
+		bmk_platform_halt("bmk_pgalloc_loadmem: too many ranges");
 
 	min = bmk_round_page(min);
 	max = bmk_trunc_page(max);
+	bmk_assert(max > min);
 
 	DPRINTF(("bmk_pgalloc_loadmem: available memory [0x%lx,0x%lx]\n",
 	    min, max));
 
-	for (i = 0; i < FREELIST_LEVELS; i++) {
-		LIST_INIT(&freelist[i]);
+	/*
+	 * Size the bitmaps for the whole range, and then take the
+	 * space for them from the start of the range.  The bitmaps
+	 * end up a little larger than necessary.
+	 */
+	r = &pgranges[npgranges];
+	r->pr_min = min;
+	r->pr_max = max;
+	r->pr_maxorder = 8*sizeof(range) - (__builtin_clzl(max-min)+1)
+	    - BMK_PCPU_PAGE_SHIFT;
+	mapsize = bmk_round_page(range_initmaps(r, NULL)
+	    * sizeof(unsigned long));
+	if (max - min <= mapsize)
+		return;
+
+	bmk_memset((void *)min, 0, mapsize);
+	range_initmaps(r, (void *)min);
+	r->pr_min = min + mapsize;
+	range = max - r->pr_min;
+
+	bmk_spin_lock(&pgalloc_lock);
+	npgranges++;
+	pgalloc_totalkb += range >> 10;
+	if (!pgalloc_setwm) {
+		pgalloc_lowkb = pgalloc_totalkb - pgalloc_totalkb/4;
+		pgalloc_highkb = pgalloc_totalkb - pgalloc_totalkb/8;
 	}
+	carverange(r, r->pr_min, range);
+	bmk_spin_unlock(&pgalloc_lock);
 
-	/* Allocate space for the allocation bitmap. */
-	bitmap_size  = ((max-min) >> (BMK_PCPU_PAGE_SHIFT+3)) + 1;
-	bitmap_size  = bmk_round_page(bitmap_size);
-	alloc_bitmap = (unsigned long *)min;
-	min         += bitmap_size;
-	range        = max - min;
+#ifdef HUGE_ORDER
+	hugepool_fill((pgalloc_totalkb << 10) >> (BMK_PCPU_HUGEPAGE_SHIFT+1));
+#endif
+}
 
-	minpage_addr = (void *)min;
-	maxpage_addr = (void *)max;
+/*
+ * Take a chunk off the free bitmaps.  The lowest free chunk of the
+ * smallest order which will do is split as necessary.  If the
+ * alignment is larger than the chunk, we only look at chunks which
+ * are at least as large as the alignment, and therefore aligned,
+ * instead of searching for a smaller chunk which happens to be.
+ * Called with pgalloc_lock held.  Returns 0 if no chunk fits.
+ */
+static unsigned long
+chunk_alloc(int order, unsigned long align)
+{
+	struct pgrange *r;
+	unsigned long addr, orders;
+	int bucket, i;
+
+	bucket = __builtin_ctzl(align) - BMK_PCPU_PAGE_SHIFT;
+	if (bucket < order)
+		bucket = order;
+	if ((unsigned)bucket >= FREELIST_LEVELS)
+		return 0;
+	if ((orders = freeorders & -(1UL << bucket)) == 0)
+		return 0;
+	bucket = __builtin_ctzl(orders);
 
-	pgalloc_totalkb = range >> 10;
-	pgalloc_usedkb = 0;
+	for (i = 0; i < npgranges; i++) {
+		r = &pgranges[i];
+		if (bucket <= r->pr_maxorder && r->pr_free[bucket].pb_nset)
+			break;
+	}
+	bmk_assert(i < npgranges);
 
-	/* All allocated by default. */
-	bmk_memset(alloc_bitmap, ~0, bitmap_size);
-	/* Free up the memory we've been given to play with. */
-	map_free((void *)min, range>>BMK_PCPU_PAGE_SHIFT);
+	addr = idx2addr(r, pgbits_first(&r->pr_free[bucket]), bucket);
+	chunk_unlink(r, addr, bucket);
 
-	carverange(min, range);
+	/* give back the upper halves we do not need */
+	while (bucket > order) {
+		bucket--;
+		chunk_link(r, addr + order2size(bucket), bucket);
+	}
+
+	return addr;
 }
 
-/* can we allocate for given align from freelist index i? */
-static struct chunk *
-satisfies_p(int i, unsigned long align)
+/*
+ * Put a chunk on the free bitmaps, creating as large a free chunk as
+ * we can.  Chunks are never merged across ranges.  Called with
+ * pgalloc_lock held.
+ */
+static void
+chunk_free(unsigned long addr, int order)
 {
-	struct chunk *ch;
-	unsigned long p;
+	struct pgrange *r;
+	unsigned long buddy;
 
-	LIST_FOREACH(ch, &freelist[i], entries) {
-		p = (unsigned long)ch;
-		if ((p & (align-1)) == 0)
-			return ch;
+	r = addr2range(addr);
+	bmk_assert(r != NULL);
+
+	for (; order < r->pr_maxorder; order++) {
+		buddy = addr ^ order2size(order);
+		if (!addr_in_range(r, buddy)
+		    || !pgbits_isset(&r->pr_free[order],
+		      addr2idx(r, buddy, order)))
+			break;
+		chunk_unlink(r, buddy, order);
+		addr &= ~order2size(order);
 	}
 
-	return NULL;
+	chunk_link(r, addr, order);
+}
+
+#ifdef HUGE_ORDER
+/*
+ * Put an allocated huge page sized chunk into the pool.
+ * Called with pgalloc_lock held.
+ */
+static void
+hugepool_put(unsigned long addr)
+{
+	struct pgrange *r;
+
+	bmk_assert((addr & (order2size(HUGE_ORDER)-1)) == 0);
+	r = addr2range(addr);
+	bmk_assert(r != NULL && r->pr_pool != NULL);
+	pgbits_set(r->pr_pool, addr2idx(r, addr, HUGE_ORDER));
+	hugepool_n++;
+}
+
+static unsigned long
+hugepool_get(void)
+{
+	struct pgrange *r;
+	unsigned long addr;
+	int i;
+
+	if (hugepool_n == 0)
+		return 0;
+	for (i = 0; i < npgranges; i++) {
+		r = &pgranges[i];
+		if (r->pr_pool && r->pr_pool->pb_nset)
+			break;
+	}
+	bmk_assert(i < npgranges);
+
+	addr = idx2addr(r, pgbits_first(r->pr_pool), HUGE_ORDER);
+	pgbits_clr(r->pr_pool, addr2idx(r, addr, HUGE_ORDER));
+	hugepool_n--;
+
+	return addr;
+}
+
+/*
+ * Give up to n chunks from the pool back to the buddy allocator.
+ * Returns the number of chunks released.
+ */
+static unsigned long
+hugepool_release(unsigned long n)
+{
+	unsigned long addr, i;
+
+	for (i = 0; i < n && (addr = hugepool_get()) != 0; i++)
+		chunk_free(addr, HUGE_ORDER);
+	return i;
+}
+
+/* Set aside up to target chunks while there is memory for them. */
+static void
+hugepool_fill(unsigned long target)
+{
+	unsigned long addr;
+
+	bmk_spin_lock(&pgalloc_lock);
+	hugepool_target = target;
+	while (hugepool_n < hugepool_target) {
+		if ((addr = chunk_alloc(HUGE_ORDER,
+		    order2size(HUGE_ORDER))) == 0)
+			break;
+		hugepool_put(addr);
+	}
+	bmk_spin_unlock(&pgalloc_lock);
+}
+#endif
+
+/*
+ * Recompute the pressure level after an allocation, a failed
+ * allocation or a free.  Returns the new level if it changed and
+ * -1 if it did not.  Called with pgalloc_lock held.
+ */
+static int
+pressure_update(int failed)
+{
+	int level = pressure_level;
+
+	if (failed) {
+		level = BMK_PGALLOC_PRESSURE_CRIT;
+	} else if (pgalloc_usedkb > pgalloc_highkb) {
+		if (level == BMK_PGALLOC_PRESSURE_NONE)
+			level = BMK_PGALLOC_PRESSURE_WARN;
+	} else if (pgalloc_usedkb < pgalloc_lowkb) {
+		level = BMK_PGALLOC_PRESSURE_NONE;
+	}
+
+	if (level == pressure_level)
+		return -1;
+	pressure_level = level;
+	return level;
+}
+
+/* Call the hooks.  Not with pgalloc_lock held. */
+static void
+pressure_notify(int level)
+{
+	int i;
+
+	for (i = 0; i < npressure_hooks; i++)
+		pressure_hooks[i].ph_func(pressure_hooks[i].ph_arg, level);
+}
+
+int
+bmk_pgalloc_pressure(void)
+{
+
+	return pressure_level;
+}
+
+/*
+ * Set the watermarks, in kB of memory used.  Pressure starts
+ * above highkb and ends below lowkb.
+ */
+void
+bmk_pgalloc_setwatermarks(unsigned long lowkb, unsigned long highkb)
+{
+	int level;
+
+	bmk_assert(lowkb <= highkb);
+
+	bmk_spin_lock(&pgalloc_lock);
+	pgalloc_lowkb = lowkb;
+	pgalloc_highkb = highkb;
+	pgalloc_setwm = 1;
+	level = pressure_update(0);
+	bmk_spin_unlock(&pgalloc_lock);
+
+	if (level != -1)
+		pressure_notify(level);
+}
+
+/*
+ * Register a function to be called with the new level whenever the
+ * pressure level changes.  The hook is called from whichever thread
+ * allocated or freed memory, possibly with allocator locks held, so
+ * it may not block, allocate or free memory.  Hooks cannot be
+ * removed.
+ */
+int
+bmk_pgalloc_addhook(void (*func)(void *, int), void *arg)
+{
+	int rv = 0;
+
+	bmk_spin_lock(&pgalloc_lock);
+	if (npressure_hooks == BMK_PGALLOC_MAXHOOKS) {
+		rv = BMK_EBUSY;
+	} else {
+		pressure_hooks[npressure_hooks].ph_func = func;
+		pressure_hooks[npressure_hooks].ph_arg = arg;
+		npressure_hooks++;
+	}
+	bmk_spin_unlock(&pgalloc_lock);
+
+	return rv;
 }
 
 void *
@@ -373,115 +770,237 @@ bmk_pgalloc(int order)
 void *
 bmk_pgalloc_align(int order, unsigned long align)
 {
-	struct chunk *alloc_ch;
-	unsigned long p, len;
-	unsigned int bucket;
+	unsigned long addr;
+	int level;
 
 	bmk_assert(align >= BMK_PCPU_PAGE_SIZE && (align & (align-1)) == 0);
 	bmk_assert((unsigned)order < FREELIST_LEVELS);
 
-	for (bucket = order; bucket < FREELIST_LEVELS; bucket++) {
-		if ((alloc_ch = satisfies_p(bucket, align)) != NULL)
-			break;
-	}
-	if (!alloc_ch) {
-		bmk_printf("cannot handle page request order %d/0x%lx!\n",
-		    order, align);
-		return 0;
+	bmk_spin_lock(&pgalloc_lock);
+#ifdef HUGE_ORDER
+	if (order == HUGE_ORDER && align <= order2size(HUGE_ORDER)) {
+		if ((addr = hugepool_get()) != 0) {
+			hugepool_hits++;
+			goto out;
+		}
+		hugepool_misses++;
 	}
-	/* Unlink the chunk. */
-	LIST_REMOVE(alloc_ch, entries);
+#endif
 
-	bmk_assert(alloc_ch->magic == CHUNKMAGIC);
-	alloc_ch->magic = 0;
+	addr = chunk_alloc(order, align);
 
+#ifdef HUGE_ORDER
 	/*
-	 * TODO: figure out if we can cheaply carve the block without
-	 * using the best alignment.
+	 * Out of luck in the buddy allocator.  Break up pool chunks,
+	 * all of them if the request is larger than one, and retry.
 	 */
-	len = order2size(order);
-	p = (unsigned long)alloc_ch;
-
-	/* carve up leftovers (if any) */
-	carverange(p+len, order2size(bucket) - len);
+	if (!addr
+	    && hugepool_release(order > HUGE_ORDER ? hugepool_n : 1) > 0)
+		addr = chunk_alloc(order, align);
+ out:
+#endif
+	if (!addr) {
+		level = pressure_update(1);
+		bmk_spin_unlock(&pgalloc_lock);
+		if (level != -1) {
+			bmk_printf("cannot handle page request order %d/0x%lx!\n",
+			    order, align);
+			pressure_notify(level);
+		}
+		return 0;
+	}
 
-	map_alloc(alloc_ch, 1UL<<order);
-	DPRINTF(("bmk_pgalloc: allocated 0x%lx bytes at %p\n",
-	    order2size(order), alloc_ch));
-	pgalloc_usedkb += len>>10;
+	DPRINTF(("bmk_pgalloc: allocated 0x%lx bytes at 0x%lx\n",
+	    order2size(order), addr));
+	pgalloc_usedkb += order2size(order)>>10;
+	level = pressure_update(0);
 
 #ifdef BMK_PGALLOC_DEBUG
 	{
-		unsigned npgs = 1<<order;
-		char *p = (char *)alloc_ch;
+		unsigned long p;
 
-		for (npgs = 1<<order; npgs; npgs--, p += BMK_PCPU_PAGE_SIZE) {
-			bmk_assert(allocated_in_map(p));
+		for (p = addr; p < addr + order2size(order);
+		    p += BMK_PCPU_PAGE_SIZE) {
+			bmk_assert(!page_is_free(p));
 		}
 	}
 #endif
 
 	SANITY_CHECK();
+	bmk_spin_unlock(&pgalloc_lock);
 
-	bmk_assert(((unsigned long)alloc_ch & (align-1)) == 0);
-	return alloc_ch;
+	if (level != -1)
+		pressure_notify(level);
+
+	bmk_assert((addr & (align-1)) == 0);
+	bmk_trace(BMK_TRACE_PGALLOC, order, (void *)addr);
+	return (void *)addr;
 }
 
 void
 bmk_pgfree(void *pointer, int order)
 {
-	struct chunk *freed_ch, *to_merge_ch;
-	unsigned long mask;
+	unsigned long addr = (unsigned long)pointer;
+	int level;
 
 	DPRINTF(("bmk_pgfree: freeing 0x%lx bytes at %p\n",
 	    order2size(order), pointer));
 
+	bmk_trace(BMK_TRACE_PGFREE, order, pointer);
+
+	bmk_spin_lock(&pgalloc_lock);
 #ifdef BMK_PGALLOC_DEBUG
 	{
-		unsigned npgs = 1<<order;
-		char *p = (char *)pointer;
+		unsigned long p;
 
-		for (npgs = 1<<order; npgs; npgs--, p += BMK_PCPU_PAGE_SIZE) {
-			bmk_assert(allocated_in_map(p));
+		for (p = addr; p < addr + order2size(order);
+		    p += BMK_PCPU_PAGE_SIZE) {
+			bmk_assert(!page_is_free(p));
 		}
 	}
 #endif
-
-	/* free the allocation in the bitmap */
-	map_free(pointer, 1UL << order);
 	pgalloc_usedkb -= order2size(order)>>10;
 
-	/* create as large a free chunk as we can */
-	for (freed_ch = pointer; (unsigned)order < FREELIST_LEVELS; ) {
-		mask = order2size(order);
-		if ((unsigned long)freed_ch & mask) {
-			to_merge_ch = addr2chunk(freed_ch, -mask);
-			if (!addr_is_managed(to_merge_ch)
-			    || allocated_in_map(to_merge_ch)
-			    || chunklevel(to_merge_ch) != order)
-				break;
-			freed_ch->magic = 0;
-
-			/* merge with predecessor, point freed chuck there */
-			freed_ch = to_merge_ch;
-		} else {
-			to_merge_ch = addr2chunk(freed_ch, mask);
-			if (!addr_is_managed(to_merge_ch)
-			    || allocated_in_map(to_merge_ch)
-			    || chunklevel(to_merge_ch) != order)
-				break;
-			freed_ch->magic = 0;
-
-			/* merge with successor, freed chuck already correct */
-		}
+#ifdef HUGE_ORDER
+	if (order == HUGE_ORDER && hugepool_n < hugepool_target) {
+		hugepool_put(addr);
+		goto out;
+	}
+#endif
+	chunk_free(addr, order);
 
-		to_merge_ch->magic = 0;
-		LIST_REMOVE(to_merge_ch, entries);
+#ifdef HUGE_ORDER
+ out:
+#endif
+	level = pressure_update(0);
+	SANITY_CHECK();
+	bmk_spin_unlock(&pgalloc_lock);
 
-		order++;
-	}
+	if (level != -1)
+		pressure_notify(level);
+}
 
-	freechunk_link(freed_ch, order);
+/*
+ * The rest of this file contains a benchmark.
+ */
 
-	SANITY_CHECK();
+#ifdef PGALLOC_TESTING
+
+/*
+ * Run a randomized trace of page allocations and frees, like a long
+ * running guest would, and report the latency of both and how
+ * fragmented the free memory is at the end.  Half of the requests
+ * are single pages, a quarter two pages and so on, and one in eight
+ * asks for an alignment larger than the chunk.  Afterwards
+ * everything is freed, which must leave the free chunks exactly as
+ * they were before.
+ */
+
+#define TEST_NALLOC 4096
+#define TEST_ROUNDS 256
+#define TEST_MAXORDER 8
+#define TEST_MAXALIGN 4		/* in orders above the chunk */
+#define TEST_LARGEORDER 9
+
+static unsigned randstate;
+
+static unsigned
+myrand(void)
+{
+
+	return (randstate = randstate * 1103515245 + 12345) % (0x80000000L);
+}
+
+static void *testpg[TEST_NALLOC];
+static int testorder[TEST_NALLOC];
+static unsigned long testnfree[FREELIST_LEVELS];
+
+/* XXX: no prototype */
+void bmk_pgalloc_test(void);
+void
+bmk_pgalloc_test(void)
+{
+	bmk_time_t t, atime = 0, amax = 0, ftime = 0, fmax = 0;
+	unsigned long align, nalloc = 0, nfail = 0, nfrees = 0;
+	unsigned long freekb, largekb;
+	int i, n, order, maxorder;
+
+	randstate = (unsigned)bmk_platform_cpu_clock_epochoffset();
+#ifdef HUGE_ORDER
+	/* keep the pool out of the picture */
+	bmk_spin_lock(&pgalloc_lock);
+	hugepool_target = 0;
+	hugepool_release(hugepool_n);
+	bmk_spin_unlock(&pgalloc_lock);
+#endif
+	bmk_memcpy(testnfree, nfree, sizeof(testnfree));
+
+	for (n = 0; n < TEST_ROUNDS * TEST_NALLOC; n++) {
+		i = myrand() % TEST_NALLOC;
+		if (testpg[i]) {
+			bmk_assert(*(unsigned long *)testpg[i]
+			    == (unsigned long)testpg[i]);
+			t = bmk_platform_cpu_clock_monotonic();
+			bmk_pgfree(testpg[i], testorder[i]);
+			t = bmk_platform_cpu_clock_monotonic() - t;
+			ftime += t;
+			if (t > fmax)
+				fmax = t;
+			nfrees++;
+			testpg[i] = NULL;
+			continue;
+		}
+
+		order = __builtin_ctz(myrand() | (1<<TEST_MAXORDER));
+		align = BMK_PCPU_PAGE_SIZE;
+		if (myrand() % 8 == 0)
+			align = order2size(order + myrand() % TEST_MAXALIGN);
+
+		t = bmk_platform_cpu_clock_monotonic();
+		testpg[i] = bmk_pgalloc_align(order, align);
+		t = bmk_platform_cpu_clock_monotonic() - t;
+		atime += t;
+		if (t > amax)
+			amax = t;
+		nalloc++;
+		if (testpg[i] == NULL) {
+			nfail++;
+			continue;
+		}
+		bmk_assert(((unsigned long)testpg[i] & (align-1)) == 0);
+		*(unsigned long *)testpg[i] = (unsigned long)testpg[i];
+		testorder[i] = order;
+	}
+
+	bmk_spin_lock(&pgalloc_lock);
+	freekb = largekb = 0;
+	maxorder = 0;
+	for (i = 0; i < (int)FREELIST_LEVELS; i++) {
+		freekb += nfree[i] * (order2size(i)>>10);
+		if (i >= TEST_LARGEORDER)
+			largekb += nfree[i] * (order2size(i)>>10);
+		if (nfree[i])
+			maxorder = i;
+	}
+	bmk_spin_unlock(&pgalloc_lock);
+
+	bmk_printf("pgalloc: %lu allocs (%lu failed), "
+	    "avg %llu ns, max %llu ns\n", nalloc, nfail,
+	    (unsigned long long)(atime / nalloc), (unsigned long long)amax);
+	bmk_printf("pgalloc: %lu frees, avg %llu ns, max %llu ns\n",
+	    nfrees, (unsigned long long)(ftime / nfrees),
+	    (unsigned long long)fmax);
+	bmk_printf("pgalloc: %lu kB free, %lu%% in chunks of %lu kB or more, "
+	    "largest %lu kB\n", freekb, freekb ? 100*largekb / freekb : 0,
+	    order2size(TEST_LARGEORDER)>>10, order2size(maxorder)>>10);
+	bmk_pgalloc_dumpstats();
+
+	for (i = 0; i < TEST_NALLOC; i++) {
+		if (testpg[i]) {
+			bmk_pgfree(testpg[i], testorder[i]);
+			testpg[i] = NULL;
+		}
+	}
+	bmk_assert(bmk_memcmp(testnfree, nfree, sizeof(testnfree)) == 0);
 }
+#endif /* PGALLOC_TESTING */
@@ -38,6 +38,10 @@
 #include <bmk-core/queue.h>
 #include <bmk-core/string.h>
 #include <bmk-core/sched.h>
+#include <bmk-core/spinlock.h>
+#include <bmk-core/trace.h>
+
+#include <bmk-pcpu/pcpu.h>
 
 void *bmk_mainstackbase;
 unsigned long bmk_mainstacksize;
@@ -58,13 +62,19 @@ unsigned long bmk_mainstacksize;
 #define THR_RUNNING	0x0008		/* no queue, thread == current	*/
 
 #define THR_TIMEDOUT	0x0010
-#define THR_MUSTJOIN	0x0020
-#define THR_JOINED	0x0040
 
 #define THR_EXTSTACK	0x0100
 #define THR_DEAD	0x0200
 #define THR_BLOCKPREP	0x0400
 
+/* bt_join, protected by threadq_lock */
+#define THR_MUSTJOIN	0x0001
+#define THR_JOINED	0x0002
+
+#ifndef BMK_PCPU_MAXCPUS
+#define BMK_PCPU_MAXCPUS 1
+#endif
+
 #if !(defined(__i386__) || defined(__x86_64__))
 #define _TLS_I
 #else
@@ -88,10 +98,22 @@ struct bmk_thread {
 	char bt_name[NAME_MAXLEN];
 
 	bmk_time_t bt_wakeup_time;
+	unsigned long bt_timeq_idx;	/* index in timeq heap */
 
 	int bt_flags;
+	int bt_join;
 	int bt_errno;
 
+	int bt_cpu;			/* CPU the thread is bound to */
+	int bt_pri;			/* BMK_SCHED_PRI_* class */
+	int bt_runq;			/* runq the thread is on */
+	bmk_time_t bt_slicestart;	/* when the thread was last switched to */
+
+	/* accounting, updated by the owning CPU in schedule() */
+	bmk_time_t bt_runtime;
+	unsigned long bt_nvcsw;
+	unsigned long bt_nivcsw;
+
 	void *bt_stackbase;
 
 	void *bt_cookie;
@@ -105,12 +127,32 @@ struct bmk_thread {
 __thread struct bmk_thread *bmk_current;
 
 TAILQ_HEAD(threadqueue, bmk_thread);
+
+/*
+ * All threads, for joining and for debugging.  Since threads can be
+ * created and exit on any CPU, the list and the join state of threads
+ * are protected by threadq_lock.
+ */
 static struct threadqueue threadq = TAILQ_HEAD_INITIALIZER(threadq);
-static struct threadqueue zombieq = TAILQ_HEAD_INITIALIZER(zombieq);
+static struct bmk_spinlock threadq_lock = BMK_SPINLOCK_INITIALIZER;
 
 /*
- * We have 3 different queues for theoretically runnable threads:
- * 1) runnable threads waiting to be scheduled
+ * Each CPU has its own scheduler state.  A thread is bound to the CPU
+ * it was created on for its whole life, so a CPU never runs a thread
+ * from another CPU's queues.  Application threads are spread over
+ * the CPUs when they are created, see sched_pickcpu().  A thread is
+ * switched to only by the CPU which owns it, which means that the
+ * switch itself can be done after dropping sc_lock.  Other CPUs touch
+ * the queues only to make threads runnable (wakeup, creation), and
+ * kick the owning CPU if it is idle.
+ *
+ * Lock order: threadq_lock, then sc_lock.  Both are always taken at
+ * splhigh, since wakeups happen also from interrupt context.
+ *
+ * Each CPU has 3 different queues for theoretically runnable threads:
+ * 1) runnable threads waiting to be scheduled, one queue per priority
+ *    class.  A bit in sc_runbits is set for every non-empty queue,
+ *    so the most urgent runnable thread is found in O(1).
  * 2) threads waiting for a timeout to expire (or to be woken up)
  * 3) threads waiting indefinitely for a wakeup
  *
@@ -121,13 +163,86 @@ static struct threadqueue zombieq = TAILQ_HEAD_INITIALIZER(zombieq);
  *        expires), the thread will move to the runnable queue.  Wakeups
  *        while a thread is already in the runnable queue or while
  *        running (via interrupt handler) have no effect.
+ *
+ * The timeq is a binary min-heap keyed on bt_wakeup_time.  Each thread
+ * remembers its own slot index, so both insertion and removal of an
+ * arbitrary thread (i.e. wakeup before timeout) are O(log n), and the
+ * next thread to time out is always at the top of the heap.
+ *
+ * A thread can be on the timeq at most once, so the heap never needs
+ * more slots than the CPU has threads.  We grow the heap when threads
+ * are created, which means that insertion, which happens with
+ * interrupts disabled, never has to allocate memory.
  */
-static struct threadqueue runq = TAILQ_HEAD_INITIALIZER(runq);
-static struct threadqueue blockq = TAILQ_HEAD_INITIALIZER(blockq);
-static struct threadqueue timeq = TAILQ_HEAD_INITIALIZER(timeq);
+struct sched_cpu {
+	struct bmk_spinlock sc_lock;
+	int sc_idle;			/* blocked in bmk_platform_cpu_block */
+
+	struct threadqueue sc_runq[BMK_SCHED_NPRI];
+	unsigned int sc_runbits;
+	bmk_time_t sc_nextwake;		/* earliest timeout at last schedule */
+	bmk_time_t sc_sliceend;		/* end of the user time slice, or 0 */
+	int sc_resched;			/* slice over, see bmk_sched_slice() */
+	struct threadqueue sc_blockq;
+	struct threadqueue sc_zombieq;
+
+	struct bmk_thread **sc_timeq;
+	unsigned long sc_timeq_nent, sc_timeq_size;
+
+	unsigned long sc_nthreads;
+
+	/*
+	 * Accounting, under sc_lock.  A thread's run time is charged
+	 * to it and to its class when schedule() is entered, and the
+	 * time spent in bmk_platform_cpu_block() is idle time.
+	 * sc_curthread is the thread whose slice is in progress, if any.
+	 */
+	struct bmk_thread *sc_curthread;
+	bmk_time_t sc_idlestart;
+	bmk_time_t sc_idletime;
+	bmk_time_t sc_runtime[BMK_SCHED_NPRI];
+	unsigned long sc_nswitch;
+	unsigned long sc_nvcsw;
+	unsigned long sc_nivcsw;
+} __attribute__((__aligned__(64)));
+#define TIMEQ_MINSIZE 64
+
+#define SCHED_CPU_INITIALIZER(sc) {					\
+	.sc_lock = BMK_SPINLOCK_INITIALIZER,				\
+	.sc_runq = {							\
+		TAILQ_HEAD_INITIALIZER((sc).sc_runq[0]),		\
+		TAILQ_HEAD_INITIALIZER((sc).sc_runq[1]),		\
+		TAILQ_HEAD_INITIALIZER((sc).sc_runq[2]),		\
+		TAILQ_HEAD_INITIALIZER((sc).sc_runq[3]),		\
+	},								\
+	.sc_blockq = TAILQ_HEAD_INITIALIZER((sc).sc_blockq),		\
+	.sc_zombieq = TAILQ_HEAD_INITIALIZER((sc).sc_zombieq),		\
+}
+
+/* the boot CPU is usable right away, the rest via bmk_sched_initcpus() */
+static struct sched_cpu sched_cpus[BMK_PCPU_MAXCPUS] = {
+	[0] = SCHED_CPU_INITIALIZER(sched_cpus[0]),
+};
+static int sched_ncpu = 1;
+static void (*sched_kick)(int);
+
+/* set once the boot CPU is running threads and bmk_current is valid */
+static int sched_started;
 
 static void (*scheduler_hook)(void *, void *);
 
+/*
+ * Time slice for user threads, 0 for none.  See bmk_sched_preempt().
+ * The platform slice timer flags the end of a slice from its interrupt.
+ * If the platform has none, bmk_sched_preempt() checks the clock.
+ */
+static bmk_time_t sched_quantum;
+static int sched_noslicetimer;
+
+#ifdef SCHED_TESTING
+static void lat_interrupt(bmk_time_t);
+#endif
+
 static void
 print_threadinfo(struct bmk_thread *thread)
 {
@@ -144,27 +259,236 @@ setflags(struct bmk_thread *thread, int add, int remove)
 	thread->bt_flags |= add;
 }
 
+static inline int
+sched_curcpu(void)
+{
+
+	/* before the scheduler is started, only the boot CPU runs */
+	if (__builtin_expect(!sched_started, 0))
+		return 0;
+	return bmk_current->bt_cpu;
+}
+
+static inline unsigned long
+sched_lock(struct sched_cpu *sc)
+{
+	unsigned long flags;
+
+	flags = bmk_platform_splhigh();
+	bmk_spin_lock(&sc->sc_lock);
+	return flags;
+}
+
+static inline void
+sched_unlock(struct sched_cpu *sc, unsigned long flags)
+{
+
+	bmk_spin_unlock(&sc->sc_lock);
+	bmk_platform_splx(flags);
+}
+
+static inline unsigned long
+threadq_enter(void)
+{
+	unsigned long flags;
+
+	flags = bmk_platform_splhigh();
+	bmk_spin_lock(&threadq_lock);
+	return flags;
+}
+
+static inline void
+threadq_exit(unsigned long flags)
+{
+
+	bmk_spin_unlock(&threadq_lock);
+	bmk_platform_splx(flags);
+}
+
+static inline void
+timeq_set(struct sched_cpu *sc, unsigned long idx, struct bmk_thread *thread)
+{
+
+	sc->sc_timeq[idx] = thread;
+	thread->bt_timeq_idx = idx;
+}
+
 static void
-set_runnable(struct bmk_thread *thread)
+timeq_siftup(struct sched_cpu *sc, unsigned long idx)
+{
+	struct bmk_thread **timeq = sc->sc_timeq;
+	struct bmk_thread *thread = timeq[idx];
+	struct bmk_thread *parent;
+
+	while (idx > 0) {
+		parent = timeq[(idx-1)/2];
+		if (parent->bt_wakeup_time <= thread->bt_wakeup_time)
+			break;
+		timeq_set(sc, idx, parent);
+		idx = (idx-1)/2;
+	}
+	timeq_set(sc, idx, thread);
+}
+
+static void
+timeq_siftdown(struct sched_cpu *sc, unsigned long idx)
+{
+	struct bmk_thread **timeq = sc->sc_timeq;
+	struct bmk_thread *thread = timeq[idx];
+	unsigned long nent = sc->sc_timeq_nent;
+	unsigned long child;
+
+	while ((child = 2*idx+1) < nent) {
+		if (child+1 < nent && timeq[child+1]->bt_wakeup_time
+		    < timeq[child]->bt_wakeup_time)
+			child++;
+		if (thread->bt_wakeup_time <= timeq[child]->bt_wakeup_time)
+			break;
+		timeq_set(sc, idx, timeq[child]);
+		idx = child;
+	}
+	timeq_set(sc, idx, thread);
+}
+
+/*
+ * Insert thread into timeq.  Called with sc_lock held.
+ */
+static void
+timeq_insert(struct sched_cpu *sc, struct bmk_thread *thread)
+{
+
+	bmk_assert(thread->bt_wakeup_time != BMK_SCHED_BLOCK_INFTIME);
+	bmk_assert(sc->sc_timeq_nent < sc->sc_timeq_size);
+
+	timeq_set(sc, sc->sc_timeq_nent++, thread);
+	timeq_siftup(sc, thread->bt_timeq_idx);
+}
+
+/*
+ * Remove thread from timeq.  Called with sc_lock held.
+ */
+static void
+timeq_remove(struct sched_cpu *sc, struct bmk_thread *thread)
+{
+	struct bmk_thread *last;
+	unsigned long idx = thread->bt_timeq_idx;
+
+	bmk_assert(idx < sc->sc_timeq_nent && sc->sc_timeq[idx] == thread);
+
+	last = sc->sc_timeq[--sc->sc_timeq_nent];
+	if (last != thread) {
+		timeq_set(sc, idx, last);
+		if (idx > 0 && sc->sc_timeq[(idx-1)/2]->bt_wakeup_time
+		    > last->bt_wakeup_time)
+			timeq_siftup(sc, idx);
+		else
+			timeq_siftdown(sc, idx);
+	}
+}
+
+static inline struct bmk_thread *
+timeq_first(struct sched_cpu *sc)
+{
+
+	return sc->sc_timeq_nent ? sc->sc_timeq[0] : NULL;
+}
+
+/*
+ * Make sure the timeq can hold every thread of the CPU.  Not called
+ * with interrupts disabled, since we might have to allocate.
+ */
+static void
+timeq_reserve(struct sched_cpu *sc, unsigned long n)
+{
+	struct bmk_thread **newq, **oldq;
+	unsigned long newsize;
+	unsigned long flags;
+
+	if (n <= __atomic_load_n(&sc->sc_timeq_size, __ATOMIC_RELAXED))
+		return;
+
+	for (newsize = TIMEQ_MINSIZE; newsize < n; newsize *= 2)
+		continue;
+	newq = bmk_xmalloc_bmk(newsize * sizeof(*newq));
+
+	flags = sched_lock(sc);
+	/* someone else may have grown it in the meantime */
+	if (newsize <= sc->sc_timeq_size) {
+		sched_unlock(sc, flags);
+		bmk_memfree(newq, BMK_MEMWHO_WIREDBMK);
+		return;
+	}
+	if (sc->sc_timeq_nent)
+		bmk_memcpy(newq, sc->sc_timeq,
+		    sc->sc_timeq_nent * sizeof(*newq));
+	oldq = sc->sc_timeq;
+	sc->sc_timeq = newq;
+	sc->sc_timeq_size = newsize;
+	sched_unlock(sc, flags);
+
+	bmk_memfree(oldq, BMK_MEMWHO_WIREDBMK);
+}
+
+/*
+ * Runqueue manipulation, called with sc_lock held.  A thread normally
+ * goes on the queue of its own class, but see bmk_sched_yield().
+ */
+static void
+runq_insert(struct sched_cpu *sc, struct bmk_thread *thread, int pri)
+{
+
+	thread->bt_runq = pri;
+	TAILQ_INSERT_TAIL(&sc->sc_runq[pri], thread, bt_schedq);
+	__atomic_store_n(&sc->sc_runbits, sc->sc_runbits | (1U<<pri),
+	    __ATOMIC_RELAXED);
+}
+
+static void
+runq_remove(struct sched_cpu *sc, struct bmk_thread *thread)
+{
+	int pri = thread->bt_runq;
+
+	TAILQ_REMOVE(&sc->sc_runq[pri], thread, bt_schedq);
+	if (TAILQ_EMPTY(&sc->sc_runq[pri]))
+		__atomic_store_n(&sc->sc_runbits, sc->sc_runbits & ~(1U<<pri),
+		    __ATOMIC_RELAXED);
+}
+
+static struct bmk_thread *
+runq_first(struct sched_cpu *sc)
+{
+
+	if (sc->sc_runbits == 0)
+		return NULL;
+	return TAILQ_FIRST(&sc->sc_runq[__builtin_ctz(sc->sc_runbits)]);
+}
+
+/*
+ * Make a thread runnable.  Called with the thread's sc_lock held.
+ * Returns non-zero if the owning CPU should be kicked out of idle.
+ */
+static int
+set_runnable_locked(struct sched_cpu *sc, struct bmk_thread *thread)
 {
 	struct threadqueue *tq;
 	int tflags;
-	int flags;
+
+	thread->bt_wakeup_time = BMK_SCHED_BLOCK_INFTIME;
 
 	tflags = thread->bt_flags;
 	/*
 	 * Already runnable?  Nothing to do, then.
 	 */
 	if ((tflags & THR_RUNQ) == THR_RUNQ)
-		return;
+		return 0;
 
 	/* get current queue */
 	switch (tflags & THR_QMASK) {
 	case THR_TIMEQ:
-		tq = &timeq;
+		tq = NULL;
 		break;
 	case THR_BLOCKQ:
-		tq = &blockq;
+		tq = &sc->sc_blockq;
 		break;
 	default:
 		/*
@@ -173,7 +497,7 @@ set_runnable(struct bmk_thread *thread)
 		 * this whole thing.
 		 */
 		if ((tflags & (THR_RUNNING|THR_QMASK)) == THR_RUNNING)
-			return;
+			return 0;
 
 		print_threadinfo(thread);
 		bmk_platform_halt("invalid thread queue");
@@ -182,48 +506,36 @@ set_runnable(struct bmk_thread *thread)
 	/*
 	 * Else, target was blocked and need to make it runnable
 	 */
-	flags = bmk_platform_splhigh();
-	TAILQ_REMOVE(tq, thread, bt_schedq);
+	if (tq)
+		TAILQ_REMOVE(tq, thread, bt_schedq);
+	else
+		timeq_remove(sc, thread);
 	setflags(thread, THR_RUNQ, THR_QMASK);
-	TAILQ_INSERT_TAIL(&runq, thread, bt_schedq);
-	bmk_platform_splx(flags);
+	runq_insert(sc, thread, thread->bt_pri);
+
+	return sc->sc_idle && thread->bt_cpu != sched_curcpu();
 }
 
-/*
- * Insert thread into timeq at the correct place.
- */
 static void
-timeq_sorted_insert(struct bmk_thread *thread)
+set_runnable(struct bmk_thread *thread)
 {
-	struct bmk_thread *iter;
-
-	bmk_assert(thread->bt_wakeup_time != BMK_SCHED_BLOCK_INFTIME);
-
-	/* case1: no others */
-	if (TAILQ_EMPTY(&timeq)) {
-		TAILQ_INSERT_HEAD(&timeq, thread, bt_schedq);
-		return;
-	}
+	struct sched_cpu *sc = &sched_cpus[thread->bt_cpu];
+	unsigned long flags;
+	int kick;
 
-	/* case2: not last in queue */
-	TAILQ_FOREACH(iter, &timeq, bt_schedq) {
-		if (iter->bt_wakeup_time > thread->bt_wakeup_time) {
-			TAILQ_INSERT_BEFORE(iter, thread, bt_schedq);
-			return;
-		}
-	}
+	flags = sched_lock(sc);
+	kick = set_runnable_locked(sc, thread);
+	sched_unlock(sc, flags);
 
-	/* case3: last in queue with greatest current timeout */
-	bmk_assert(TAILQ_LAST(&timeq, threadqueue)->bt_wakeup_time
-	    <= thread->bt_wakeup_time);
-	TAILQ_INSERT_TAIL(&timeq, thread, bt_schedq);
+	if (kick)
+		sched_kick(thread->bt_cpu);
 }
 
 /*
- * Called with interrupts disabled
+ * Called with the current CPU's sc_lock held
  */
 static void
-clear_runnable(void)
+clear_runnable(struct sched_cpu *sc)
 {
 	struct bmk_thread *thread = bmk_current;
 	int newfl;
@@ -239,10 +551,10 @@ clear_runnable(void)
 	newfl = thread->bt_flags;
 	if (thread->bt_wakeup_time != BMK_SCHED_BLOCK_INFTIME) {
 		newfl |= THR_TIMEQ;
-		timeq_sorted_insert(thread);
+		timeq_insert(sc, thread);
 	} else {
 		newfl |= THR_BLOCKQ;
-		TAILQ_INSERT_TAIL(&blockq, thread, bt_schedq);
+		TAILQ_INSERT_TAIL(&sc->sc_blockq, thread, bt_schedq);
 	}
 	thread->bt_flags = newfl;
 }
@@ -262,28 +574,42 @@ stackfree(struct bmk_thread *thread)
 	bmk_pgfree(thread->bt_stackbase, bmk_stackpageorder);
 }
 
+/*
+ * Debugging aid, does not lock the queues.
+ */
 void
 bmk_sched_dumpqueue(void)
 {
+	struct sched_cpu *sc;
 	struct bmk_thread *thr;
+	unsigned long i;
+	int cpu;
+
+	for (cpu = 0; cpu < sched_ncpu; cpu++) {
+		sc = &sched_cpus[cpu];
+		if (sched_ncpu > 1)
+			bmk_printf("CPU %d:\n", cpu);
+
+		bmk_printf("BEGIN runq dump\n");
+		for (i = 0; i < BMK_SCHED_NPRI; i++) {
+			TAILQ_FOREACH(thr, &sc->sc_runq[i], bt_schedq) {
+				print_threadinfo(thr);
+			}
+		}
+		bmk_printf("END runq dump\n");
 
-	bmk_printf("BEGIN runq dump\n");
-	TAILQ_FOREACH(thr, &runq, bt_schedq) {
-		print_threadinfo(thr);
-	}
-	bmk_printf("END runq dump\n");
-
-	bmk_printf("BEGIN timeq dump\n");
-	TAILQ_FOREACH(thr, &timeq, bt_schedq) {
-		print_threadinfo(thr);
-	}
-	bmk_printf("END timeq dump\n");
+		bmk_printf("BEGIN timeq dump\n");
+		for (i = 0; i < sc->sc_timeq_nent; i++) {
+			print_threadinfo(sc->sc_timeq[i]);
+		}
+		bmk_printf("END timeq dump\n");
 
-	bmk_printf("BEGIN blockq dump\n");
-	TAILQ_FOREACH(thr, &blockq, bt_schedq) {
-		print_threadinfo(thr);
+		bmk_printf("BEGIN blockq dump\n");
+		TAILQ_FOREACH(thr, &sc->sc_blockq, bt_schedq) {
+			print_threadinfo(thr);
+		}
+		bmk_printf("END blockq dump\n");
 	}
-	bmk_printf("END blockq dump\n");
 }
 
 static void
@@ -293,45 +619,94 @@ sched_switch(struct bmk_thread *prev, struct bmk_thread *next)
 	bmk_assert(next->bt_flags & THR_RUNNING);
 	bmk_assert((next->bt_flags & THR_QMASK) == 0);
 
+	bmk_trace(BMK_TRACE_SWITCH, prev, next);
 	if (scheduler_hook)
 		scheduler_hook(prev->bt_cookie, next->bt_cookie);
 	bmk_platform_cpu_sched_settls(&next->bt_tcb);
 	bmk_cpu_sched_switch(&prev->bt_tcb, &next->bt_tcb);
 }
 
+/*
+ * End the slice of the current thread.  Called with sc_lock held.
+ */
+static void
+sched_charge(struct sched_cpu *sc, struct bmk_thread *thread,
+	bmk_time_t curtime)
+{
+	bmk_time_t ran = curtime - thread->bt_slicestart;
+
+	thread->bt_runtime += ran;
+	sc->sc_runtime[thread->bt_pri] += ran;
+	sc->sc_curthread = NULL;
+}
+
+/*
+ * Start a time slice for the thread about to run, or end the slice
+ * if it is not a user thread.  Called with interrupts disabled.
+ */
+static void
+sched_slicestart(struct sched_cpu *sc, struct bmk_thread *thread,
+	bmk_time_t curtime)
+{
+	bmk_time_t quantum;
+
+	quantum = __atomic_load_n(&sched_quantum, __ATOMIC_RELAXED);
+	sc->sc_resched = 0;
+	if (quantum && thread->bt_pri == BMK_SCHED_PRI_USER) {
+		sc->sc_sliceend = curtime + quantum;
+		if (!sched_noslicetimer
+		    && bmk_platform_cpu_slicetimer(sc->sc_sliceend) != 0)
+			sched_noslicetimer = 1;
+	} else if (sc->sc_sliceend) {
+		sc->sc_sliceend = 0;
+		if (!sched_noslicetimer)
+			bmk_platform_cpu_slicetimer(0);
+	}
+}
+
 static void
 schedule(void)
 {
 	struct bmk_thread *prev, *next, *thread;
+	struct threadqueue zombies;
+	struct sched_cpu *sc;
+	bmk_time_t curtime, waketime;
 	unsigned long flags;
+	int preempted;
 
 	prev = bmk_current;
+	sc = &sched_cpus[prev->bt_cpu];
 
 	flags = bmk_platform_splhigh();
 	if (flags) {
 		bmk_platform_halt("schedule() called at !spl0");
 	}
-	for (;;) {
-		bmk_time_t curtime, waketime;
+	bmk_spin_lock(&sc->sc_lock);
 
-		curtime = bmk_platform_cpu_clock_monotonic();
+	/* still runnable means yield or preemption, not a block */
+	preempted = (prev->bt_flags & THR_RUNQ) != 0;
+	curtime = bmk_platform_cpu_clock_monotonic();
+	sched_charge(sc, prev, curtime);
+
+	for (;;) {
 		waketime = curtime + BLOCKTIME_MAX;
 
 		/*
 		 * Process timeout queue first by moving threads onto
 		 * the runqueue if their timeouts have expired.  Since
-		 * the timeouts are sorted, we process until we hit the
-		 * first one which will not be woked up.
+		 * the earliest timeout is always at the top of the heap,
+		 * we process until we hit the first one which will not be
+		 * woken up.
 		 */
-		while ((thread = TAILQ_FIRST(&timeq)) != NULL) {
+		while ((thread = timeq_first(sc)) != NULL) {
 			if (thread->bt_wakeup_time <= curtime) {
 				/*
 				 * move thread to runqueue.
-				 * threads will run in inverse order of timeout
-				 * expiry.  not sure if that matters or not.
+				 * threads will run in order of timeout expiry.
 				 */
 				thread->bt_flags |= THR_TIMEDOUT;
-				bmk_sched_wake(thread);
+				bmk_trace(BMK_TRACE_WAKE, thread, 0);
+				set_runnable_locked(sc, thread);
 			} else {
 				if (thread->bt_wakeup_time < waketime)
 					waketime = thread->bt_wakeup_time;
@@ -339,7 +714,7 @@ schedule(void)
 			}
 		}
 
-		if ((next = TAILQ_FIRST(&runq)) != NULL) {
+		if ((next = runq_first(sc)) != NULL) {
 			bmk_assert(next->bt_flags & THR_RUNQ);
 			bmk_assert((next->bt_flags & THR_DEAD) == 0);
 			break;
@@ -348,15 +723,40 @@ schedule(void)
 		/*
 		 * Nothing to run, block until waketime or until an interrupt
 		 * occurs, whichever happens first.  The call will enable
-		 * interrupts "atomically" before actually blocking.
+		 * interrupts "atomically" before actually blocking.  Other
+		 * CPUs may make our threads runnable while we are blocked,
+		 * so release the queues and let them know they have to
+		 * kick us.
 		 */
+		sc->sc_idle = 1;
+		sc->sc_idlestart = curtime;
+		bmk_spin_unlock(&sc->sc_lock);
 		bmk_platform_cpu_block(waketime);
+		bmk_spin_lock(&sc->sc_lock);
+		sc->sc_idle = 0;
+		curtime = bmk_platform_cpu_clock_monotonic();
+		sc->sc_idletime += curtime - sc->sc_idlestart;
 	}
 	/* now we're committed to letting "next" run next */
+	__atomic_store_n(&sc->sc_nextwake, waketime, __ATOMIC_RELAXED);
 	setflags(prev, 0, THR_RUNNING);
 
-	TAILQ_REMOVE(&runq, next, bt_schedq);
+	runq_remove(sc, next);
 	setflags(next, THR_RUNNING, THR_RUNQ);
+	next->bt_slicestart = curtime;
+	sc->sc_curthread = next;
+	if (prev != next) {
+		sc->sc_nswitch++;
+		if (preempted) {
+			prev->bt_nivcsw++;
+			sc->sc_nivcsw++;
+		} else {
+			prev->bt_nvcsw++;
+			sc->sc_nvcsw++;
+		}
+	}
+	bmk_spin_unlock(&sc->sc_lock);
+	sched_slicestart(sc, next, curtime);
 	bmk_platform_splx(flags);
 
 	/*
@@ -370,13 +770,23 @@ schedule(void)
 
 	/*
 	 * Reaper.  This always runs in the context of the first "non-virgin"
-	 * thread that was scheduled after the current thread decided to exit.
+	 * thread that was scheduled on this CPU after the current thread
+	 * decided to exit.
 	 */
-	while ((thread = TAILQ_FIRST(&zombieq)) != NULL) {
-		TAILQ_REMOVE(&zombieq, thread, bt_threadq);
+	if (TAILQ_EMPTY(&sc->sc_zombieq))
+		return;
+
+	TAILQ_INIT(&zombies);
+	flags = sched_lock(sc);
+	TAILQ_CONCAT(&zombies, &sc->sc_zombieq, bt_threadq);
+	sched_unlock(sc, flags);
+
+	while ((thread = TAILQ_FIRST(&zombies)) != NULL) {
+		TAILQ_REMOVE(&zombies, thread, bt_threadq);
 		if ((thread->bt_flags & THR_EXTSTACK) == 0)
 			stackfree(thread);
 		bmk_memfree(thread, BMK_MEMWHO_WIREDBMK);
+		__atomic_sub_fetch(&sc->sc_nthreads, 1, __ATOMIC_RELAXED);
 	}
 }
 
@@ -435,13 +845,58 @@ initcurrent(void *tcb, struct bmk_thread *value)
 	bmk_platform_cpu_sched_initcurrent(tcb, value);
 }
 
-struct bmk_thread *
-bmk_sched_create_withtls(const char *name, void *cookie, int joinable,
+/*
+ * Pick a CPU for a new application thread: the one with the fewest
+ * threads.  The search starts one CPU further on every call, so that
+ * ties go round-robin.  Threads never migrate, so this is where
+ * application threads get to use more than the boot CPU.
+ */
+static int
+sched_pickcpu(void)
+{
+	static unsigned int rotor;
+	unsigned long n, best;
+	unsigned int start;
+	int ncpu, cpu, bestcpu, i;
+
+	ncpu = __atomic_load_n(&sched_ncpu, __ATOMIC_ACQUIRE);
+	if (ncpu == 1)
+		return 0;
+
+	start = __atomic_fetch_add(&rotor, 1, __ATOMIC_RELAXED);
+	best = ~0UL;
+	bestcpu = 0;
+	for (i = 0; i < ncpu; i++) {
+		cpu = (start + i) % ncpu;
+		n = __atomic_load_n(&sched_cpus[cpu].sc_nthreads,
+		    __ATOMIC_RELAXED);
+		if (n < best) {
+			best = n;
+			bestcpu = cpu;
+		}
+	}
+	return bestcpu;
+}
+
+static struct bmk_thread *
+sched_create(const char *name, void *cookie, int joinable,
 	void (*f)(void *), void *data,
-	void *stack_base, unsigned long stack_size, void *tlsarea)
+	void *stack_base, unsigned long stack_size, void *tlsarea, int cpu,
+	int pri)
 {
 	struct bmk_thread *thread;
+	struct sched_cpu *sc;
 	unsigned long flags;
+	int kick;
+
+	if (cpu < 0)
+		cpu = pri == BMK_SCHED_PRI_USER
+		    ? sched_pickcpu() : sched_curcpu();
+	bmk_assert(cpu < sched_ncpu);
+	sc = &sched_cpus[cpu];
+
+	timeq_reserve(sc,
+	    __atomic_add_fetch(&sc->sc_nthreads, 1, __ATOMIC_RELAXED));
 
 	thread = bmk_xmalloc_bmk(sizeof(*thread));
 	bmk_memset(thread, 0, sizeof(*thread));
@@ -455,7 +910,9 @@ bmk_sched_create_withtls(const char *name, void *cookie, int joinable,
 	}
 	thread->bt_stackbase = stack_base;
 	if (joinable)
-		thread->bt_flags |= THR_MUSTJOIN;
+		thread->bt_join = THR_MUSTJOIN;
+	thread->bt_cpu = cpu;
+	thread->bt_pri = pri;
 
 	bmk_cpu_sched_create(thread, &thread->bt_tcb, f, data,
 	    stack_base, stack_size);
@@ -466,17 +923,40 @@ bmk_sched_create_withtls(const char *name, void *cookie, int joinable,
 	inittcb(&thread->bt_tcb, tlsarea, TCBOFFSET);
 	initcurrent(tlsarea, thread);
 
+	flags = threadq_enter();
 	TAILQ_INSERT_TAIL(&threadq, thread, bt_threadq);
+	threadq_exit(flags);
+	bmk_trace_name(thread, thread->bt_name);
 
 	/* set runnable manually, we don't satisfy invariants yet */
-	flags = bmk_platform_splhigh();
-	TAILQ_INSERT_TAIL(&runq, thread, bt_schedq);
+	flags = sched_lock(sc);
+	runq_insert(sc, thread, pri);
 	thread->bt_flags |= THR_RUNQ;
-	bmk_platform_splx(flags);
+	kick = sc->sc_idle && cpu != sched_curcpu();
+	sched_unlock(sc, flags);
+
+	if (kick)
+		sched_kick(cpu);
 
 	return thread;
 }
 
+/*
+ * Threads created with their own TLS are application threads,
+ * so they go into the user class and onto the least loaded CPU.
+ * The rest are kernel threads and stay on the creating CPU unless
+ * created with bmk_sched_create_oncpu().
+ */
+struct bmk_thread *
+bmk_sched_create_withtls(const char *name, void *cookie, int joinable,
+	void (*f)(void *), void *data,
+	void *stack_base, unsigned long stack_size, void *tlsarea)
+{
+
+	return sched_create(name, cookie, joinable, f, data,
+	    stack_base, stack_size, tlsarea, -1, BMK_SCHED_PRI_USER);
+}
+
 struct bmk_thread *
 bmk_sched_create(const char *name, void *cookie, int joinable,
 	void (*f)(void *), void *data,
@@ -485,8 +965,25 @@ bmk_sched_create(const char *name, void *cookie, int joinable,
 	void *tlsarea;
 
 	tlsarea = bmk_sched_tls_alloc();
-	return bmk_sched_create_withtls(name, cookie, joinable, f, data,
-	    stack_base, stack_size, tlsarea);
+	return sched_create(name, cookie, joinable, f, data,
+	    stack_base, stack_size, tlsarea, -1, BMK_SCHED_PRI_KERN);
+}
+
+/*
+ * Create a thread bound to the given CPU.  A negative cpu means
+ * the CPU of the creating thread, which is what bmk_sched_create()
+ * does.
+ */
+struct bmk_thread *
+bmk_sched_create_oncpu(const char *name, void *cookie, int joinable,
+	void (*f)(void *), void *data,
+	void *stack_base, unsigned long stack_size, int cpu)
+{
+	void *tlsarea;
+
+	tlsarea = bmk_sched_tls_alloc();
+	return sched_create(name, cookie, joinable, f, data,
+	    stack_base, stack_size, tlsarea, cpu, BMK_SCHED_PRI_KERN);
 }
 
 struct join_waiter {
@@ -496,18 +993,24 @@ struct join_waiter {
 };
 static TAILQ_HEAD(, join_waiter) joinwq = TAILQ_HEAD_INITIALIZER(joinwq);
 
+/*
+ * The exiting thread and the joiner may run on different CPUs.
+ * Both of them prepare to block while still holding threadq_lock,
+ * so a wakeup sent after the other party sees the state change
+ * cannot get lost.
+ */
 void
 bmk_sched_exit_withtls(void)
 {
 	struct bmk_thread *thread = bmk_current;
+	struct sched_cpu *sc = &sched_cpus[thread->bt_cpu];
 	struct join_waiter *jw_iter;
 	unsigned long flags;
 
 	/* if joinable, gate until we are allowed to exit */
-	flags = bmk_platform_splhigh();
-	while (thread->bt_flags & THR_MUSTJOIN) {
-		thread->bt_flags |= THR_JOINED;
-		bmk_platform_splx(flags);
+	flags = threadq_enter();
+	while (thread->bt_join & THR_MUSTJOIN) {
+		thread->bt_join |= THR_JOINED;
 
 		/* see if the joiner is already there */
 		TAILQ_FOREACH(jw_iter, &joinwq, jw_entries) {
@@ -517,18 +1020,22 @@ bmk_sched_exit_withtls(void)
 			}
 		}
 		bmk_sched_blockprepare();
+		threadq_exit(flags);
 		bmk_sched_block();
-		flags = bmk_platform_splhigh();
+		flags = threadq_enter();
 	}
 
 	/* Remove from the thread list */
-	bmk_assert((thread->bt_flags & THR_QMASK) == 0);
 	TAILQ_REMOVE(&threadq, thread, bt_threadq);
-	setflags(thread, THR_DEAD, THR_RUNNING);
+	threadq_exit(flags);
 
 	/* Put onto exited list */
-	TAILQ_INSERT_HEAD(&zombieq, thread, bt_threadq);
-	bmk_platform_splx(flags);
+	flags = sched_lock(sc);
+	bmk_assert((thread->bt_flags & THR_QMASK) == 0);
+	setflags(thread, THR_DEAD, THR_RUNNING);
+	TAILQ_INSERT_HEAD(&sc->sc_zombieq, thread, bt_threadq);
+	sched_unlock(sc, flags);
+	bmk_trace(BMK_TRACE_EXIT, 0, 0);
 
 	/* bye */
 	schedule();
@@ -550,27 +1057,26 @@ bmk_sched_join(struct bmk_thread *joinable)
 	struct bmk_thread *thread = bmk_current;
 	unsigned long flags;
 
-	bmk_assert(joinable->bt_flags & THR_MUSTJOIN);
+	flags = threadq_enter();
+	bmk_assert(joinable->bt_join & THR_MUSTJOIN);
 
-	flags = bmk_platform_splhigh();
 	/* wait for exiting thread to hit thread_exit() */
-	while ((joinable->bt_flags & THR_JOINED) == 0) {
-		bmk_platform_splx(flags);
-
+	while ((joinable->bt_join & THR_JOINED) == 0) {
 		jw.jw_thread = thread;
 		jw.jw_wanted = joinable;
 		TAILQ_INSERT_TAIL(&joinwq, &jw, jw_entries);
 		bmk_sched_blockprepare();
+		threadq_exit(flags);
+
 		bmk_sched_block();
-		TAILQ_REMOVE(&joinwq, &jw, jw_entries);
 
-		flags = bmk_platform_splhigh();
+		flags = threadq_enter();
+		TAILQ_REMOVE(&joinwq, &jw, jw_entries);
 	}
 
 	/* signal exiting thread that we have seen it and it may now exit */
-	bmk_assert(joinable->bt_flags & THR_JOINED);
-	joinable->bt_flags &= ~THR_MUSTJOIN;
-	bmk_platform_splx(flags);
+	joinable->bt_join &= ~THR_MUSTJOIN;
+	threadq_exit(flags);
 
 	bmk_sched_wake(joinable);
 }
@@ -599,15 +1105,16 @@ void
 bmk_sched_blockprepare_timeout(bmk_time_t deadline)
 {
 	struct bmk_thread *thread = bmk_current;
-	int flags;
+	struct sched_cpu *sc = &sched_cpus[thread->bt_cpu];
+	unsigned long flags;
 
 	bmk_assert((thread->bt_flags & THR_BLOCKPREP) == 0);
 
-	flags = bmk_platform_splhigh();
+	flags = sched_lock(sc);
 	thread->bt_wakeup_time = deadline;
 	thread->bt_flags |= THR_BLOCKPREP;
-	clear_runnable();
-	bmk_platform_splx(flags);
+	clear_runnable(sc);
+	sched_unlock(sc, flags);
 }
 
 void
@@ -626,8 +1133,10 @@ bmk_sched_block(void)
 	bmk_assert((thread->bt_flags & THR_TIMEDOUT) == 0);
 	bmk_assert(thread->bt_flags & THR_BLOCKPREP);
 
+	bmk_trace(BMK_TRACE_BLOCK, thread->bt_wakeup_time, 0);
 	schedule();
 
+	/* we are running, so nobody else touches our flags now */
 	tflags = thread->bt_flags;
 	thread->bt_flags &= ~(THR_TIMEDOUT | THR_BLOCKPREP);
 
@@ -638,10 +1147,48 @@ void
 bmk_sched_wake(struct bmk_thread *thread)
 {
 
-	thread->bt_wakeup_time = BMK_SCHED_BLOCK_INFTIME;
+	bmk_trace(BMK_TRACE_WAKE, thread, 0);
 	set_runnable(thread);
 }
 
+/*
+ * Wake up a batch of threads with interrupts blocked only once.
+ * Each CPU's sc_lock is taken once per run of consecutive threads
+ * it owns, and idle CPUs are kicked only after everything is queued.
+ */
+bmk_ctassert(BMK_PCPU_MAXCPUS <= 32);
+void
+bmk_sched_wake_many(struct bmk_thread **threads, int nthreads)
+{
+	struct sched_cpu *sc = NULL;
+	struct bmk_thread *thread;
+	unsigned long flags;
+	unsigned int kick = 0;
+	int cpu, i;
+
+	flags = bmk_platform_splhigh();
+	for (i = 0; i < nthreads; i++) {
+		thread = threads[i];
+		bmk_trace(BMK_TRACE_WAKE, thread, 0);
+		if (sc != &sched_cpus[thread->bt_cpu]) {
+			if (sc)
+				bmk_spin_unlock(&sc->sc_lock);
+			sc = &sched_cpus[thread->bt_cpu];
+			bmk_spin_lock(&sc->sc_lock);
+		}
+		if (set_runnable_locked(sc, thread))
+			kick |= 1U << thread->bt_cpu;
+	}
+	if (sc)
+		bmk_spin_unlock(&sc->sc_lock);
+	bmk_platform_splx(flags);
+
+	for (cpu = 0; kick; cpu++, kick >>= 1) {
+		if (kick & 1)
+			sched_kick(cpu);
+	}
+}
+
 void __attribute__((noreturn))
 bmk_sched_startmain(void (*mainfun)(void *), void *arg)
 {
@@ -650,6 +1197,7 @@ bmk_sched_startmain(void (*mainfun)(void *), void *arg)
 
 	bmk_memset(&initthread, 0, sizeof(initthread));
 	bmk_strcpy(initthread.bt_name, "init");
+	bmk_trace_init();
 	stackalloc(&bmk_mainstackbase, &bmk_mainstacksize);
 
 	mainthread = bmk_sched_create("main", NULL, 0,
@@ -661,13 +1209,119 @@ bmk_sched_startmain(void (*mainfun)(void *), void *arg)
 	 * Manually switch to mainthread without going through
 	 * bmk_sched (avoids confusion with bmk_current).
 	 */
-	TAILQ_REMOVE(&runq, mainthread, bt_schedq);
+	runq_remove(&sched_cpus[0], mainthread);
 	setflags(mainthread, THR_RUNNING, THR_RUNQ);
+	mainthread->bt_slicestart = bmk_platform_cpu_clock_monotonic();
+	sched_cpus[0].sc_curthread = mainthread;
+	sched_started = 1;
 	sched_switch(&initthread, mainthread);
 
 	bmk_platform_halt("bmk_sched_init unreachable");
 }
 
+/*
+ * Set up scheduler state for CPUs 1..ncpu-1.  Called by the platform
+ * on the boot CPU before it starts the other CPUs.  "kick" is used to
+ * get an idle CPU out of bmk_platform_cpu_block() when one of its
+ * threads is made runnable by another CPU.
+ */
+void
+bmk_sched_initcpus(int ncpu, void (*kick)(int))
+{
+	struct sched_cpu *sc;
+	int cpu, i;
+
+	if (ncpu > BMK_PCPU_MAXCPUS)
+		ncpu = BMK_PCPU_MAXCPUS;
+	bmk_assert(ncpu >= 1 && sched_ncpu == 1);
+
+	for (cpu = 1; cpu < ncpu; cpu++) {
+		sc = &sched_cpus[cpu];
+		bmk_spin_init(&sc->sc_lock);
+		for (i = 0; i < BMK_SCHED_NPRI; i++)
+			TAILQ_INIT(&sc->sc_runq[i]);
+		TAILQ_INIT(&sc->sc_blockq);
+		TAILQ_INIT(&sc->sc_zombieq);
+	}
+	sched_kick = kick;
+	__atomic_store_n(&sched_ncpu, ncpu, __ATOMIC_RELEASE);
+}
+
+#if BMK_PCPU_MAXCPUS > 1
+static void
+idlethread(void *arg)
+{
+
+	for (;;) {
+		bmk_sched_blockprepare();
+		bmk_sched_block();
+	}
+}
+#endif
+
+/*
+ * Start scheduling on a secondary CPU.  Called by the platform on the
+ * CPU itself, with interrupts disabled.  The CPU first runs an idle
+ * thread, which keeps it blocked until threads are created on it.
+ */
+void __attribute__((noreturn))
+bmk_sched_startcpu(int cpu)
+{
+#if BMK_PCPU_MAXCPUS > 1
+	struct bmk_thread *idle;
+	struct bmk_thread initthread;
+	struct sched_cpu *sc;
+	unsigned long flags;
+	void *tlsarea;
+
+	bmk_assert(cpu > 0 && cpu < sched_ncpu);
+	sc = &sched_cpus[cpu];
+
+	/*
+	 * Unlike the boot CPU, we may take a wakeup before the first
+	 * switch, so make bmk_current valid right away.
+	 */
+	bmk_memset(&initthread, 0, sizeof(initthread));
+	bmk_strcpy(initthread.bt_name, "init");
+	initthread.bt_cpu = cpu;
+	tlsarea = bmk_sched_tls_alloc();
+	inittcb(&initthread.bt_tcb, tlsarea, TCBOFFSET);
+	initcurrent(tlsarea, &initthread);
+	bmk_platform_cpu_sched_settls(&initthread.bt_tcb);
+
+	idle = bmk_sched_create_oncpu("idle", NULL, 0, idlethread, NULL,
+	    NULL, 0, cpu);
+	if (idle == NULL)
+		bmk_platform_halt("failed to create idle thread");
+
+	flags = sched_lock(sc);
+	runq_remove(sc, idle);
+	setflags(idle, THR_RUNNING, THR_RUNQ);
+	idle->bt_slicestart = bmk_platform_cpu_clock_monotonic();
+	sc->sc_curthread = idle;
+	sched_unlock(sc, flags);
+	sched_switch(&initthread, idle);
+
+	bmk_platform_halt("bmk_sched_startcpu unreachable");
+#else
+	bmk_platform_halt("bmk_sched_startcpu: uniprocessor build");
+#endif
+}
+
+int
+bmk_sched_ncpu(void)
+{
+
+	return __atomic_load_n(&sched_ncpu, __ATOMIC_ACQUIRE);
+}
+
+int
+bmk_sched_curcpu(void)
+{
+
+	return sched_curcpu();
+}
+
 void
 bmk_sched_set_hook(void (*f)(void *, void *))
 {
@@ -690,6 +1344,23 @@ bmk_sched_threadname(struct bmk_thread *thread)
 	return thread->bt_name;
 }
 
+#ifdef BMK_TRACE
+/*
+ * Record the names of all live threads into the trace buffer.
+ */
+void
+bmk_sched_trace_names(void)
+{
+	struct bmk_thread *thread;
+	unsigned long flags;
+
+	flags = threadq_enter();
+	TAILQ_FOREACH(thread, &threadq, bt_threadq)
+		bmk_trace_name(thread, thread->bt_name);
+	threadq_exit(flags);
+}
+#endif
+
 /*
  * XXX: this does not really belong here, but libbmk_rumpuser needs
  * to be able to set an errno, so we can't push it into libc without
@@ -702,19 +1373,497 @@ bmk_sched_geterrno(void)
 	return &bmk_current->bt_errno;
 }
 
-void
-bmk_sched_yield(void)
+static void
+requeue(struct bmk_thread *thread, int pri)
 {
-	struct bmk_thread *thread = bmk_current;
-	int flags;
+	struct sched_cpu *sc = &sched_cpus[thread->bt_cpu];
+	unsigned long flags;
 
 	bmk_assert(thread->bt_flags & THR_RUNNING);
 
 	/* make schedulable and re-insert into runqueue */
-	flags = bmk_platform_splhigh();
+	flags = sched_lock(sc);
 	setflags(thread, THR_RUNQ, THR_RUNNING);
-	TAILQ_INSERT_TAIL(&runq, thread, bt_schedq);
-	bmk_platform_splx(flags);
+	runq_insert(sc, thread, pri);
+	sched_unlock(sc, flags);
 
 	schedule();
 }
+
+/*
+ * Let every other runnable thread run before we continue.  Callers
+ * such as the interrupt thread in polling mode rely on that, so the
+ * thread goes to the back of the least urgent queue for this round,
+ * whatever its own class is.
+ */
+void
+bmk_sched_yield(void)
+{
+
+	requeue(bmk_current, BMK_SCHED_NPRI-1);
+}
+
+/*
+ * Preemption point.  Threads are never switched from interrupt
+ * context, so code which runs long without blocking calls this at
+ * places where it holds nothing that others could be waiting for.
+ * Switch if a thread of a more urgent class is runnable or a timeout
+ * has expired.  Since expired timeouts are processed only in schedule(),
+ * a woken thread of a less urgent class just goes on the runq and
+ * we get the CPU right back.  A user thread also switches if its time
+ * slice is over and another user thread is runnable, and otherwise
+ * starts a new slice.  The slice timer cannot switch by itself, so a
+ * thread which never gets here keeps the CPU.
+ */
+void
+bmk_sched_preempt(void)
+{
+	struct bmk_thread *thread;
+	struct sched_cpu *sc;
+	unsigned int runbits;
+	unsigned long flags;
+	bmk_time_t now, sliceend;
+
+	if (!sched_started)
+		return;
+
+	thread = bmk_current;
+	sc = &sched_cpus[thread->bt_cpu];
+	runbits = __atomic_load_n(&sc->sc_runbits, __ATOMIC_RELAXED);
+	if (runbits & ((1U<<thread->bt_pri)-1)) {
+		requeue(thread, thread->bt_pri);
+		return;
+	}
+
+	now = bmk_platform_cpu_clock_monotonic();
+	if (now >= __atomic_load_n(&sc->sc_nextwake, __ATOMIC_RELAXED)) {
+		requeue(thread, thread->bt_pri);
+		return;
+	}
+
+	sliceend = __atomic_load_n(&sc->sc_sliceend, __ATOMIC_RELAXED);
+	if (sliceend == 0)
+		return;
+	if (!__atomic_load_n(&sc->sc_resched, __ATOMIC_RELAXED)
+	    && (!sched_noslicetimer || now < sliceend))
+		return;
+	if (runbits & (1U<<BMK_SCHED_PRI_USER)) {
+		requeue(thread, thread->bt_pri);
+		return;
+	}
+
+	/* nobody to hand the CPU to */
+	flags = bmk_platform_splhigh();
+	sched_slicestart(sc, thread, now);
+	bmk_platform_splx(flags);
+}
+
+/*
+ * Called by the platform from the slice timer interrupt.  Threads are
+ * not switched from interrupt context, so just flag the end of the
+ * slice for bmk_sched_preempt().
+ */
+void
+bmk_sched_slice(void)
+{
+	struct sched_cpu *sc;
+	bmk_time_t now;
+
+	if (!sched_started)
+		return;
+
+	/* no slice while in schedule(), the timer just ended an idle wait */
+	sc = &sched_cpus[bmk_current->bt_cpu];
+	if (sc->sc_curthread == NULL || sc->sc_sliceend == 0)
+		return;
+
+	now = bmk_platform_cpu_clock_monotonic();
+	if (now < sc->sc_sliceend) {
+		/* the one-shot timer rounds down, so it may be early */
+		bmk_platform_cpu_slicetimer(sc->sc_sliceend);
+		return;
+	}
+	__atomic_store_n(&sc->sc_resched, 1, __ATOMIC_RELAXED);
+#ifdef SCHED_TESTING
+	lat_interrupt(now);
+#endif
+}
+
+/*
+ * Set the time slice for user threads, 0 to turn slicing off.  Takes
+ * effect at the next context switch.
+ */
+void
+bmk_sched_setquantum(bmk_time_t quantum)
+{
+
+	__atomic_store_n(&sched_quantum, quantum, __ATOMIC_RELAXED);
+}
+
+/*
+ * Change the class of a thread.  Takes effect the next time the
+ * thread is made runnable.
+ */
+void
+bmk_sched_setpri(struct bmk_thread *thread, int pri)
+{
+
+	bmk_assert(pri >= 0 && pri < BMK_SCHED_NPRI);
+	thread->bt_pri = pri;
+}
+
+int
+bmk_sched_getpri(struct bmk_thread *thread)
+{
+
+	return thread->bt_pri;
+}
+
+/*
+ * CPU time accounting.  The counters of a thread which runs on
+ * another CPU may be a switch or two behind.
+ */
+void
+bmk_sched_threadstat(struct bmk_thread *thread,
+	struct bmk_sched_threadstat *bts)
+{
+
+	bts->bts_runtime = thread->bt_runtime;
+	bts->bts_nvcsw = thread->bt_nvcsw;
+	bts->bts_nivcsw = thread->bt_nivcsw;
+
+	/* add the slice in progress */
+	if (thread == bmk_current)
+		bts->bts_runtime += bmk_platform_cpu_clock_monotonic()
+		    - thread->bt_slicestart;
+}
+
+void
+bmk_sched_cpustat(int cpu, struct bmk_sched_cpustat *bcs)
+{
+	struct sched_cpu *sc;
+	struct bmk_thread *cur;
+	unsigned long flags;
+	bmk_time_t now;
+	int i;
+
+	bmk_assert(cpu >= 0 && cpu < sched_ncpu);
+	sc = &sched_cpus[cpu];
+
+	flags = sched_lock(sc);
+	now = bmk_platform_cpu_clock_monotonic();
+	bcs->bcs_idletime = sc->sc_idletime;
+	for (i = 0; i < BMK_SCHED_NPRI; i++)
+		bcs->bcs_runtime[i] = sc->sc_runtime[i];
+	bcs->bcs_nswitch = sc->sc_nswitch;
+	bcs->bcs_nvcsw = sc->sc_nvcsw;
+	bcs->bcs_nivcsw = sc->sc_nivcsw;
+
+	/* add the slice or idle period in progress */
+	if (sc->sc_idle && now > sc->sc_idlestart)
+		bcs->bcs_idletime += now - sc->sc_idlestart;
+	if ((cur = sc->sc_curthread) != NULL && now > cur->bt_slicestart)
+		bcs->bcs_runtime[cur->bt_pri] += now - cur->bt_slicestart;
+	sched_unlock(sc, flags);
+}
+
+static void
+acct_consoleout(void *arg, const char *buf, unsigned long len)
+{
+
+	bmk_printf("%s", buf);
+}
+
+struct acct_thread {
+	const struct bmk_thread *at_thread;
+	char at_name[NAME_MAXLEN];
+	int at_cpu;
+	struct bmk_sched_threadstat at_stat;
+};
+
+/*
+ * Write out the accounting counters of all CPUs and live threads as
+ * "name = value" lines, sysctl style, for monitoring to scrape.
+ * If "out" is NULL, the output goes to the console.  Times are in
+ * nanoseconds.  Returns BMK_ENOMEM if the thread snapshot cannot be
+ * allocated.
+ */
+int
+bmk_sched_acct_dump(void (*out)(void *, const char *, unsigned long),
+	void *arg)
+{
+	static const char *classnames[BMK_SCHED_NPRI] = {
+		"intr", "softint", "kern", "user",
+	};
+	struct bmk_sched_cpustat bcs;
+	struct bmk_thread *thread;
+	struct acct_thread *at;
+	unsigned long flags, i, n, nmax;
+	char line[128];
+	int cpu, pri;
+
+	if (out == NULL)
+		out = acct_consoleout;
+
+#define ACCTLINE(...)							\
+	out(arg, line, bmk_snprintf(line, sizeof(line), __VA_ARGS__))
+
+	ACCTLINE("sched.ncpu = %d\n", sched_ncpu);
+	for (cpu = 0; cpu < sched_ncpu; cpu++) {
+		bmk_sched_cpustat(cpu, &bcs);
+		ACCTLINE("sched.cpu%d.idle_ns = %llu\n", cpu,
+		    (unsigned long long)bcs.bcs_idletime);
+		for (pri = 0; pri < BMK_SCHED_NPRI; pri++) {
+			ACCTLINE("sched.cpu%d.%s_ns = %llu\n", cpu,
+			    classnames[pri],
+			    (unsigned long long)bcs.bcs_runtime[pri]);
+		}
+		ACCTLINE("sched.cpu%d.nswitch = %lu\n", cpu, bcs.bcs_nswitch);
+		ACCTLINE("sched.cpu%d.nvcsw = %lu\n", cpu, bcs.bcs_nvcsw);
+		ACCTLINE("sched.cpu%d.nivcsw = %lu\n", cpu, bcs.bcs_nivcsw);
+	}
+
+	/*
+	 * Threads may come and go while we print, so take a snapshot
+	 * under threadq_lock first.  The slack is for threads created
+	 * between counting and allocating; any beyond that are skipped.
+	 */
+	flags = threadq_enter();
+	nmax = 0;
+	TAILQ_FOREACH(thread, &threadq, bt_threadq)
+		nmax++;
+	threadq_exit(flags);
+	nmax += 16;
+	at = bmk_memalloc(nmax * sizeof(*at), 0, BMK_MEMWHO_WIREDBMK);
+	if (at == NULL)
+		return BMK_ENOMEM;
+
+	n = 0;
+	flags = threadq_enter();
+	TAILQ_FOREACH(thread, &threadq, bt_threadq) {
+		if (n == nmax)
+			break;
+		at[n].at_thread = thread;
+		bmk_memcpy(at[n].at_name, thread->bt_name, NAME_MAXLEN);
+		at[n].at_cpu = thread->bt_cpu;
+		bmk_sched_threadstat(thread, &at[n].at_stat);
+		n++;
+	}
+	threadq_exit(flags);
+
+	for (i = 0; i < n; i++) {
+		ACCTLINE("sched.thread.%p.name = %s\n",
+		    at[i].at_thread, at[i].at_name);
+		ACCTLINE("sched.thread.%p.cpu = %d\n",
+		    at[i].at_thread, at[i].at_cpu);
+		ACCTLINE("sched.thread.%p.run_ns = %llu\n", at[i].at_thread,
+		    (unsigned long long)at[i].at_stat.bts_runtime);
+		ACCTLINE("sched.thread.%p.nvcsw = %lu\n",
+		    at[i].at_thread, at[i].at_stat.bts_nvcsw);
+		ACCTLINE("sched.thread.%p.nivcsw = %lu\n",
+		    at[i].at_thread, at[i].at_stat.bts_nivcsw);
+	}
+#undef ACCTLINE
+
+	bmk_memfree(at, BMK_MEMWHO_WIREDBMK);
+	return 0;
+}
+
+/*
+ * The rest of this file contains microbenchmarks for the timeq and
+ * for wakeup latency.
+ */
+
+#ifdef SCHED_TESTING
+
+#define TEST_NROUNDS 100000
+
+static unsigned randstate;
+
+static unsigned
+myrand(void)
+{
+
+	return (randstate = randstate * 1103515245 + 12345) % (0x80000000L);
+}
+
+/*
+ * Measure the cost of one "timed block + wakeup" cycle on the timeq
+ * with a given number of sleepers already on it.  The sleepers are
+ * fake threads with timeouts far in the future, so the scheduler
+ * will not try to run them while the test is in progress.
+ */
+static void
+timeq_bench(unsigned long nsleepers)
+{
+	struct sched_cpu *sc = &sched_cpus[0];
+	struct bmk_thread *thrs, *thr;
+	bmk_time_t base, start, end;
+	unsigned long flags, i;
+
+	thrs = bmk_memcalloc(nsleepers, sizeof(*thrs), BMK_MEMWHO_WIREDBMK);
+	if (thrs == NULL) {
+		bmk_printf("timeq_bench: cannot allocate %lu threads\n",
+		    nsleepers);
+		return;
+	}
+	timeq_reserve(sc, sc->sc_timeq_nent + nsleepers);
+
+	base = bmk_platform_cpu_clock_monotonic() + 1000*1000*1000*1000LL;
+	flags = sched_lock(sc);
+	for (i = 0; i < nsleepers; i++) {
+		thrs[i].bt_wakeup_time = base + myrand();
+		timeq_insert(sc, &thrs[i]);
+	}
+
+	start = bmk_platform_cpu_clock_monotonic();
+	for (i = 0; i < TEST_NROUNDS; i++) {
+		thr = &thrs[myrand() % nsleepers];
+		timeq_remove(sc, thr);
+		thr->bt_wakeup_time = base + myrand();
+		timeq_insert(sc, thr);
+	}
+	end = bmk_platform_cpu_clock_monotonic();
+
+	for (i = 0; i < nsleepers; i++)
+		timeq_remove(sc, &thrs[i]);
+	sched_unlock(sc, flags);
+
+	bmk_printf("timeq: %6lu sleepers, %5llu ns per block/wake\n",
+	    nsleepers, (unsigned long long)(end - start) / TEST_NROUNDS);
+	bmk_memfree(thrs, BMK_MEMWHO_WIREDBMK);
+}
+
+/*
+ * Measure how long an interrupt-class thread waits to run after a
+ * timer interrupt while CPU-bound user threads hog the CPU.  The
+ * interrupt is the slice timer: with the quantum at LAT_PERIOD/4,
+ * bmk_sched_slice() stamps the time and wakes the handler like an
+ * interrupt routine wakes its interrupt thread.  The hogs either yield
+ * every LAT_PERIOD or call bmk_sched_preempt() at short intervals,
+ * like application threads calling into the rump kernel.
+ */
+#define LAT_NHOGS 4
+#define LAT_NROUNDS 1000
+#define LAT_PERIOD (1000*1000)
+
+static struct bmk_thread *lat_handler;
+static bmk_time_t lat_woken, lat_sum, lat_max;
+static volatile int lat_pending, lat_done;
+
+/* from bmk_sched_slice(), in interrupt context */
+static void
+lat_interrupt(bmk_time_t now)
+{
+
+	/* the handler is still on its way from the previous interrupt */
+	if (lat_handler == NULL || lat_pending || lat_done)
+		return;
+	lat_pending = 1;
+	lat_woken = now;
+	bmk_sched_wake(lat_handler);
+}
+
+static void
+lat_spin(bmk_time_t nsec)
+{
+	bmk_time_t until = bmk_platform_cpu_clock_monotonic() + nsec;
+
+	while (bmk_platform_cpu_clock_monotonic() < until)
+		continue;
+}
+
+static void
+lat_hog(void *arg)
+{
+	int preempt = (int)(unsigned long)arg;
+
+	while (!lat_done) {
+		if (preempt) {
+			lat_spin(10*1000);
+			bmk_sched_preempt();
+		} else {
+			lat_spin(LAT_PERIOD);
+			bmk_sched_yield();
+		}
+	}
+	bmk_sched_exit();
+}
+
+static void
+lat_handlerthread(void *arg)
+{
+	bmk_time_t lat;
+	int i;
+
+	for (i = 0; i < LAT_NROUNDS; i++) {
+		/* a wakeup before we are on the blockq would be lost */
+		bmk_sched_blockprepare();
+		lat_pending = 0;
+		bmk_sched_block();
+		lat = bmk_platform_cpu_clock_monotonic() - lat_woken;
+		lat_sum += lat;
+		if (lat > lat_max)
+			lat_max = lat;
+	}
+	lat_done = 1;
+	bmk_sched_exit();
+}
+
+static void
+latency_bench(int preempt)
+{
+	struct bmk_thread *hogs[LAT_NHOGS];
+	bmk_time_t quantum;
+	int cpu, i;
+
+	if (bmk_platform_cpu_slicetimer(0) != 0) {
+		bmk_printf("latency: no slice timer, skipped\n");
+		return;
+	}
+
+	lat_pending = 1;
+	lat_done = 0;
+	lat_sum = lat_max = 0;
+	quantum = sched_quantum;
+	bmk_sched_setquantum(LAT_PERIOD/4);
+
+	/* everything on one CPU, or we would measure the kick too */
+	cpu = bmk_sched_curcpu();
+	lat_handler = bmk_sched_create_oncpu("lathandler", NULL, 1,
+	    lat_handlerthread, NULL, NULL, 0, cpu);
+	bmk_sched_setpri(lat_handler, BMK_SCHED_PRI_INTR);
+	for (i = 0; i < LAT_NHOGS; i++) {
+		hogs[i] = bmk_sched_create_oncpu("lathog", NULL, 1,
+		    lat_hog, (void *)(unsigned long)preempt, NULL, 0, cpu);
+		bmk_sched_setpri(hogs[i], BMK_SCHED_PRI_USER);
+	}
+
+	for (i = 0; i < LAT_NHOGS; i++)
+		bmk_sched_join(hogs[i]);
+	bmk_sched_join(lat_handler);
+	lat_handler = NULL;
+	bmk_sched_setquantum(quantum);
+
+	bmk_printf("latency: %d hogs, %-8s avg %8llu ns, max %8llu ns\n",
+	    LAT_NHOGS, preempt ? "preempt" : "yield",
+	    (unsigned long long)lat_sum / LAT_NROUNDS,
+	    (unsigned long long)lat_max);
+}
+
+/* XXX: no prototype */
+void bmk_sched_test(void);
+void
+bmk_sched_test(void)
+{
+
+	randstate = (unsigned)bmk_platform_cpu_clock_epochoffset();
+
+	timeq_bench(10);
+	timeq_bench(1000);
+	timeq_bench(10000);
+
+	latency_bench(0);
+	latency_bench(1);
+}
+#endif /* SCHED_TESTING */
@@ -47,7 +47,10 @@
 
 #define _BMK_PRINTF_VA
 #include <bmk-core/null.h>
+#include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
+#include <bmk-core/sched.h>
+#include <bmk-core/spinlock.h>
 #include <bmk-core/string.h>
 
 #define TOBUFONLY	0x01
@@ -120,18 +123,34 @@ cons_putchar(int c, int flags)
 	(*v_putc)(c);
 }
 
-static void
-kprintf_lock(void)
+/*
+ * Keep output from different CPUs (and their interrupt handlers) from
+ * mixing in the console and dmesg.  Not needed, and not done, as long
+ * as there is only one CPU, so printing works also before the
+ * platform's spl machinery is up.
+ */
+static struct bmk_spinlock kprintf_spin = BMK_SPINLOCK_INITIALIZER;
+
+static int
+kprintf_lock(unsigned long *flagsp)
 {
 
-	/* XXX */
+	if (bmk_sched_ncpu() == 1)
+		return 0;
+
+	*flagsp = bmk_platform_splhigh();
+	bmk_spin_lock(&kprintf_spin);
+	return 1;
 }
 
 static void
-kprintf_unlock(void)
+kprintf_unlock(int locked, unsigned long flags)
 {
 
-	/* XXX */
+	if (locked) {
+		bmk_spin_unlock(&kprintf_spin);
+		bmk_platform_splx(flags);
+	}
 }
 
 /*
@@ -141,14 +160,16 @@ void
 bmk_printf(const char *fmt, ...)
 {
         va_list ap;
+        unsigned long flags = 0;
+        int locked;
 
-        kprintf_lock();
+        locked = kprintf_lock(&flags);
 
         va_start(ap, fmt);
         kprintf(fmt, TOCONS, NULL, NULL, ap);
         va_end(ap);
 
-        kprintf_unlock();
+        kprintf_unlock(locked, flags);
 }
 
 /*
@@ -158,11 +179,14 @@ bmk_printf(const char *fmt, ...)
 void
 bmk_vprintf(const char *fmt, va_list ap)
 {
-	kprintf_lock();
+	unsigned long flags = 0;
+	int locked;
+
+	locked = kprintf_lock(&flags);
 
 	kprintf(fmt, TOCONS, NULL, NULL, ap);
 
-	kprintf_unlock();
+	kprintf_unlock(locked, flags);
 }
 
 /*
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Event trace ring buffer.
+ *
+ * Writers claim a slot by atomically incrementing the head index,
+ * so recording works from both thread and interrupt context without
+ * locks.  The slot's sequence number is cleared while the record is
+ * being filled and set to (index+1) last, which lets the dumper skip
+ * records that were torn by a wraparound.  When the ring is full, the
+ * oldest records are overwritten.
+ *
+ * The dump is a line-oriented text format which is converted into
+ * Chrome trace / Perfetto JSON on the host by app-tools/rumptrace2json.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/errno.h>
+#include <bmk-core/null.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/platform.h>
+#define _BMK_PRINTF_VA
+#include <bmk-core/printf.h>
+#include <bmk-core/sched.h>
+#include <bmk-core/string.h>
+#include <bmk-core/trace.h>
+
+#include <bmk-pcpu/pcpu.h>
+
+/* number of records, must be a power of two */
+#ifndef BMK_TRACE_NENT
+#define BMK_TRACE_NENT (1<<14)
+#endif
+
+#define TRACE_FORMAT_VERSION 1
+
+static const char *const evnames[BMK_TRACE_NEVENTS] = {
+	[BMK_TRACE_NONE]	= "none",
+	[BMK_TRACE_SWITCH]	= "switch",
+	[BMK_TRACE_BLOCK]	= "block",
+	[BMK_TRACE_WAKE]	= "wake",
+	[BMK_TRACE_THREAD]	= "thread",
+	[BMK_TRACE_EXIT]	= "exit",
+	[BMK_TRACE_RUMPSCHED]	= "rumpsched",
+	[BMK_TRACE_RUMPUNSCHED]	= "rumpunsched",
+	[BMK_TRACE_INTR]	= "intr",
+	[BMK_TRACE_INTREND]	= "intrend",
+	[BMK_TRACE_PGALLOC]	= "pgalloc",
+	[BMK_TRACE_PGFREE]	= "pgfree",
+	[BMK_TRACE_MEMALLOC]	= "memalloc",
+	[BMK_TRACE_MEMFREE]	= "memfree",
+	[BMK_TRACE_USER]	= "user",
+};
+
+static struct bmk_trace_rec *trace_ring;
+static unsigned long trace_head;
+static int trace_enabled;
+
+/* clock calibration taken at init, see dump */
+static uint64_t trace_ts0;
+static bmk_time_t trace_ns0;
+
+static inline uint64_t
+trace_clock(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return (uint64_t)bmk_platform_cpu_clock_monotonic();
+#endif
+}
+
+static struct bmk_trace_rec *
+trace_claim(unsigned long *idxp)
+{
+	struct bmk_trace_rec *tr;
+	unsigned long idx;
+
+	idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	tr = &trace_ring[idx & (BMK_TRACE_NENT-1)];
+	__atomic_store_n(&tr->tr_seq, 0, __ATOMIC_RELAXED);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	*idxp = idx;
+	return tr;
+}
+
+static void
+trace_commit(struct bmk_trace_rec *tr, unsigned long idx)
+{
+
+	__atomic_store_n(&tr->tr_seq, idx+1, __ATOMIC_RELEASE);
+}
+
+void
+bmk_trace_record(enum bmk_trace_event ev, uint64_t arg0, uint64_t arg1)
+{
+	struct bmk_trace_rec *tr;
+	unsigned long idx;
+
+	if (__builtin_expect(!trace_enabled, 0))
+		return;
+
+	tr = trace_claim(&idx);
+	tr->tr_ts = trace_clock();
+	tr->tr_thread = (unsigned long)bmk_current;
+	tr->tr_event = ev;
+	tr->tr_arg[0] = arg0;
+	tr->tr_arg[1] = arg1;
+	trace_commit(tr, idx);
+}
+
+/*
+ * Record the name of a thread.  The name is packed into the
+ * argument words, so it is truncated to sizeof(tr_arg) bytes.
+ */
+void
+bmk_trace_name(const void *thread, const char *name)
+{
+	struct bmk_trace_rec *tr;
+	unsigned long idx;
+
+	if (!trace_enabled)
+		return;
+
+	tr = trace_claim(&idx);
+	tr->tr_ts = trace_clock();
+	tr->tr_thread = (unsigned long)thread;
+	tr->tr_event = BMK_TRACE_THREAD;
+	bmk_memset(tr->tr_arg, 0, sizeof(tr->tr_arg));
+	bmk_strncpy((char *)tr->tr_arg, name, sizeof(tr->tr_arg));
+	trace_commit(tr, idx);
+}
+
+void
+bmk_trace_init(void)
+{
+	unsigned long size;
+	int order;
+
+	size = BMK_TRACE_NENT * sizeof(struct bmk_trace_rec);
+	for (order = 0; (BMK_PCPU_PAGE_SIZE << order) < size; order++)
+		continue;
+	if ((trace_ring = bmk_pgalloc(order)) == NULL) {
+		bmk_printf("trace: could not allocate %lu bytes\n", size);
+		return;
+	}
+	bmk_memset(trace_ring, 0, size);
+
+	trace_ts0 = trace_clock();
+	trace_ns0 = bmk_platform_cpu_clock_monotonic();
+	trace_enabled = 1;
+}
+
+void
+bmk_trace_enable(int enable)
+{
+
+	if (trace_ring)
+		trace_enabled = enable;
+}
+
+/*
+ * Output is accumulated into a buffer and handed out a chunk at a
+ * time.  The chunk is always NUL-terminated for the benefit of
+ * console output.
+ */
+struct dumpbuf {
+	char db_buf[1024];
+	unsigned long db_len;
+	bmk_trace_output_fn db_out;
+	void *db_arg;
+};
+
+static void
+dumpflush(struct dumpbuf *db)
+{
+
+	if (db->db_len) {
+		db->db_buf[db->db_len] = '\0';
+		db->db_out(db->db_arg, db->db_buf, db->db_len);
+		db->db_len = 0;
+	}
+}
+
+static void __attribute__((__format__(__printf__,2,3)))
+dumpline(struct dumpbuf *db, const char *fmt, ...)
+{
+	char line[128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = bmk_vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(line))
+		len = sizeof(line)-1;
+
+	if (db->db_len + len >= sizeof(db->db_buf))
+		dumpflush(db);
+	bmk_memcpy(db->db_buf + db->db_len, line, len);
+	db->db_len += len;
+}
+
+static void
+consoleout(void *arg, const char *buf, unsigned long len)
+{
+
+	bmk_printf("%s", buf);
+}
+
+/*
+ * Write out the contents of the trace buffer.  If "out" is NULL,
+ * the dump goes to the console.  Tracing is paused for the duration.
+ */
+int
+bmk_trace_dump(bmk_trace_output_fn out, void *arg)
+{
+	struct dumpbuf db;
+	struct bmk_trace_rec *tr;
+	unsigned long head, idx, lost;
+	uint64_t ts1;
+	bmk_time_t ns1;
+	char name[sizeof(tr->tr_arg)+1];
+	int wasenabled;
+
+	if (trace_ring == NULL)
+		return BMK_ENXIO;
+
+	/* make sure live threads are named even if their creation wrapped */
+	bmk_sched_trace_names();
+
+	wasenabled = trace_enabled;
+	trace_enabled = 0;
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	ts1 = trace_clock();
+	ns1 = bmk_platform_cpu_clock_monotonic();
+
+	db.db_len = 0;
+	db.db_out = out ? out : consoleout;
+	db.db_arg = arg;
+
+	lost = head > BMK_TRACE_NENT ? head - BMK_TRACE_NENT : 0;
+	dumpline(&db, "# bmk-trace %d\n", TRACE_FORMAT_VERSION);
+#if defined(__i386__) || defined(__x86_64__)
+	dumpline(&db, "clock tsc\n");
+#else
+	dumpline(&db, "clock ns\n");
+#endif
+	dumpline(&db, "calib %llu %llu %llu %llu\n",
+	    (unsigned long long)trace_ts0, (unsigned long long)trace_ns0,
+	    (unsigned long long)ts1, (unsigned long long)ns1);
+	dumpline(&db, "lost %lu\n", lost);
+
+	for (idx = lost; idx < head; idx++) {
+		tr = &trace_ring[idx & (BMK_TRACE_NENT-1)];
+		if (tr->tr_seq != idx+1 || tr->tr_event >= BMK_TRACE_NEVENTS)
+			continue;
+
+		if (tr->tr_event == BMK_TRACE_THREAD) {
+			bmk_memcpy(name, tr->tr_arg, sizeof(tr->tr_arg));
+			name[sizeof(tr->tr_arg)] = '\0';
+			dumpline(&db, "N %llu %lx %s\n",
+			    (unsigned long long)tr->tr_ts, tr->tr_thread, name);
+		} else {
+			dumpline(&db, "E %llu %lx %s %llx %llx\n",
+			    (unsigned long long)tr->tr_ts, tr->tr_thread,
+			    evnames[tr->tr_event],
+			    (unsigned long long)tr->tr_arg[0],
+			    (unsigned long long)tr->tr_arg[1]);
+		}
+	}
+	dumpline(&db, "# end\n");
+	dumpflush(&db);
+
+	trace_enabled = wasenabled;
+	return 0;
+}
@@ -73,7 +73,9 @@ rumpuser_getparam(const char *name, void *buf, size_t buflen)
 		bmk_strcpy(buf, "1");
 
 	} else if (bmk_strcmp(name, RUMPUSER_PARAM_NCPU) == 0) {
-		bmk_strcpy(buf, "1");
+		if (bmk_snprintf(buf, buflen, "%d", bmk_sched_ncpu())
+		    >= (int)buflen)
+			rv = BMK_EINVAL;
 
 	} else if (bmk_strcmp(name, RUMPUSER_PARAM_HOSTNAME) == 0) {
 		bmk_strncpy(buf, "rumprun", buflen-1);
@@ -46,22 +46,37 @@ len2order(unsigned long len)
 	return v - BMK_PCPU_PAGE_SHIFT;
 }
 
-int
-rumpuser_malloc(size_t len, int alignment, void **retval)
+static void *
+doalloc(size_t len, int alignment)
 {
 
 	/*
 	 * Allocate large chunks with the page allocator to avoid
 	 * malloc overhead.
 	 */
-	if (len < BMK_PCPU_PAGE_SIZE) {
-		*retval = bmk_memalloc(len, alignment, BMK_MEMWHO_RUMPKERN);
-	} else {
-		bmk_assert((alignment & (alignment-1)) == 0);
-		if (alignment < BMK_PCPU_PAGE_SIZE)
-			alignment = BMK_PCPU_PAGE_SIZE;
-		*retval = bmk_pgalloc_align(len2order(len), alignment);
-	}
+	if (len < BMK_PCPU_PAGE_SIZE)
+		return bmk_memalloc(len, alignment, BMK_MEMWHO_RUMPKERN);
+
+	bmk_assert((alignment & (alignment-1)) == 0);
+	if (alignment < BMK_PCPU_PAGE_SIZE)
+		alignment = BMK_PCPU_PAGE_SIZE;
+	return bmk_pgalloc_align(len2order(len), alignment);
+}
+
+int
+rumpuser_malloc(size_t len, int alignment, void **retval)
+{
+
+	/*
+	 * If we are out of pages, retry once after the slab and arena
+	 * caches have been given back.  We cannot know if the caller
+	 * may sleep, so do not wait for memory here.  Callers which
+	 * may sleep already wait for the pagedaemon in the rump kernel.
+	 */
+	if ((*retval = doalloc(len, alignment)) == NULL
+	    && bmk_memalloc_drain() != 0)
+		*retval = doalloc(len, alignment);
+
 	if (*retval)
 		return 0;
 	else
@@ -24,10 +24,11 @@
  */
 
 /*
- * El-simplo threading/locking hypercalls for rump kernels,
- * assumes one (1) CPU with non-preemptable scheduling.
- * These are never used from interrupt context, so we don't need
- * anything fancy.
+ * El-simplo threading/locking hypercalls for rump kernels.
+ * Scheduling is non-preemptable, but threads bound to different CPUs
+ * run concurrently, so each object is protected by a spinlock.  The
+ * spinlocks are never held across a block.  These are never used from
+ * interrupt context, so we don't need to go to splhigh.
  */
 
 #include <bmk-core/core.h>
@@ -35,11 +36,19 @@
 #include <bmk-core/memalloc.h>
 #include <bmk-core/queue.h>
 #include <bmk-core/sched.h>
+#include <bmk-core/spinlock.h>
 #include <bmk-core/string.h>
 
 #include <bmk-rumpuser/core_types.h>
 #include <bmk-rumpuser/rumpuser.h>
 
+/*
+ * How many times to retry a contended mutex before going to sleep.
+ * Only used if there is more than one CPU, since otherwise the owner
+ * cannot be running.
+ */
+#define MTX_SPINS 1000
+
 TAILQ_HEAD(waithead, waiter);
 struct waiter {
 	struct bmk_thread *who;
@@ -47,26 +56,53 @@ struct waiter {
 	int onlist;
 };
 
-static int
-wait(struct waithead *wh, bmk_time_t wakeup)
+/*
+ * Waiting is split into two steps.  The first one queues the thread
+ * and prepares it to block, and is called with the object lock held.
+ * The caller may then drop locks (even rump kernel ones) before
+ * calling the second one: a wakeup in between makes the block return
+ * immediately instead of getting lost.  wait_block() returns with the
+ * object lock held.
+ */
+static void
+wait_prepare(struct waithead *wh, struct waiter *w, bmk_time_t wakeup)
 {
-	struct waiter w;
 
 	if (wakeup != BMK_SCHED_BLOCK_INFTIME)
 		wakeup += bmk_platform_cpu_clock_monotonic();
 
-	w.who = bmk_current;
-	w.onlist = 1;
-	TAILQ_INSERT_TAIL(wh, &w, entries);
+	w->who = bmk_current;
+	w->onlist = 1;
+	TAILQ_INSERT_TAIL(wh, w, entries);
 
 	bmk_sched_blockprepare_timeout(wakeup);
+}
+
+static int
+wait_block(struct bmk_spinlock *lock, struct waithead *wh, struct waiter *w)
+{
+
 	bmk_sched_block();
+	bmk_spin_lock(lock);
 
 	/* woken up by timeout? */
-	if (w.onlist)
-		TAILQ_REMOVE(wh, &w, entries);
+	if (w->onlist)
+		TAILQ_REMOVE(wh, w, entries);
 
-	return w.onlist ? BMK_ETIMEDOUT : 0;
+	return w->onlist ? BMK_ETIMEDOUT : 0;
+}
+
+/*
+ * Called with lock held, returns with lock held.
+ */
+static int
+wait(struct bmk_spinlock *lock, struct waithead *wh, bmk_time_t wakeup)
+{
+	struct waiter w;
+
+	wait_prepare(wh, &w, wakeup);
+	bmk_spin_unlock(lock);
+	return wait_block(lock, wh, &w);
 }
 
 static void
@@ -93,16 +129,35 @@ wakeup_all(struct waithead *wh)
 	}
 }
 
+/*
+ * NetBSD kernel thread priorities from PRI_KERNEL_RT up are the
+ * realtime kernel threads and the softint levels (PRI_SOFTCLOCK and
+ * friends).  Everything else, including PRI_NONE, is an ordinary
+ * kernel thread.
+ */
+#define NETBSD_PRI_KERNEL_RT 192
+
+/*
+ * A thread with a CPU index is bound to that (bmk) CPU, which gives
+ * the rump kernel's per-CPU threads real parallelism.  Others stay
+ * on the CPU of their creator.
+ */
 int
 rumpuser_thread_create(void *(*f)(void *), void *arg, const char *thrname,
 	int joinable, int pri, int cpuidx, void **tptr)
 {
 	struct bmk_thread *thr;
+	int cpu = -1;
+
+	if (cpuidx >= 0)
+		cpu = cpuidx % bmk_sched_ncpu();
 
-	thr = bmk_sched_create(thrname, NULL, joinable,
-	    (void (*)(void *))f, arg, NULL, 0);
+	thr = bmk_sched_create_oncpu(thrname, NULL, joinable,
+	    (void (*)(void *))f, arg, NULL, 0, cpu);
 	if (!thr)
 		return BMK_EINVAL;
+	if (pri >= NETBSD_PRI_KERNEL_RT)
+		bmk_sched_setpri(thr, BMK_SCHED_PRI_SOFTINT);
 
 	*tptr = thr;
 	return 0;
@@ -124,6 +179,7 @@ rumpuser_thread_join(void *p)
 }
 
 struct rumpuser_mtx {
+	struct bmk_spinlock lock;
 	struct waithead waiters;
 	int v;
 	int flags;
@@ -137,63 +193,105 @@ rumpuser_mutex_init(struct rumpuser_mtx **mtxp, int flags)
 	struct rumpuser_mtx *mtx;
 
 	mtx = bmk_memcalloc(1, sizeof(*mtx), BMK_MEMWHO_WIREDBMK);
+	bmk_spin_init(&mtx->lock);
 	mtx->flags = flags;
 	TAILQ_INIT(&mtx->waiters);
 	*mtxp = mtx;
 }
 
+static int
+mutex_tryenter_locked(struct rumpuser_mtx *mtx)
+{
+
+	if (mtx->bmk_o == bmk_current) {
+		bmk_platform_halt("rumpuser mutex: locking against myself");
+	}
+	if (mtx->v)
+		return BMK_EBUSY;
+
+	mtx->v = 1;
+	mtx->o = rumpuser_curlwp();
+	mtx->bmk_o = bmk_current;
+
+	return 0;
+}
+
+/*
+ * Spin for a while if the owner may be running on another CPU.
+ */
+static int
+mutex_spin(struct rumpuser_mtx *mtx)
+{
+	int i;
+
+	if (bmk_sched_ncpu() == 1)
+		return BMK_EBUSY;
+
+	for (i = 0; i < MTX_SPINS; i++) {
+		if (__atomic_load_n(&mtx->v, __ATOMIC_RELAXED) == 0
+		    && rumpuser_mutex_tryenter(mtx) == 0)
+			return 0;
+		bmk_cpu_relax();
+	}
+	return BMK_EBUSY;
+}
+
+static void
+mutex_sleep(struct rumpuser_mtx *mtx)
+{
+
+	bmk_spin_lock(&mtx->lock);
+	while (mutex_tryenter_locked(mtx) != 0)
+		wait(&mtx->lock, &mtx->waiters, BMK_SCHED_BLOCK_INFTIME);
+	bmk_spin_unlock(&mtx->lock);
+}
+
 void
 rumpuser_mutex_enter(struct rumpuser_mtx *mtx)
 {
 	int nlocks;
 
-	if (rumpuser_mutex_tryenter(mtx) != 0) {
-		rumpkern_unsched(&nlocks, NULL);
-		while (rumpuser_mutex_tryenter(mtx) != 0)
-			wait(&mtx->waiters, BMK_SCHED_BLOCK_INFTIME);
-		rumpkern_sched(nlocks, NULL);
-	}
+	if (rumpuser_mutex_tryenter(mtx) == 0 || mutex_spin(mtx) == 0)
+		return;
+
+	rumpkern_unsched(&nlocks, NULL);
+	mutex_sleep(mtx);
+	rumpkern_sched(nlocks, NULL);
 }
 
 void
 rumpuser_mutex_enter_nowrap(struct rumpuser_mtx *mtx)
 {
-	int rv;
 
-	rv = rumpuser_mutex_tryenter(mtx);
-	/* one VCPU supported, no preemption => must succeed */
-	if (rv != 0) {
-		bmk_platform_halt("rumpuser mutex error");
-	}
+	if (rumpuser_mutex_tryenter(mtx) == 0 || mutex_spin(mtx) == 0)
+		return;
+
+	mutex_sleep(mtx);
 }
 
 int
 rumpuser_mutex_tryenter(struct rumpuser_mtx *mtx)
 {
-	struct lwp *l = rumpuser_curlwp();
-
-	if (mtx->bmk_o == bmk_current) {
-		bmk_platform_halt("rumpuser mutex: locking against myself");
-	}
-	if (mtx->v)
-		return BMK_EBUSY;
+	int rv;
 
-	mtx->v = 1;
-	mtx->o = l;
-	mtx->bmk_o = bmk_current;
+	bmk_spin_lock(&mtx->lock);
+	rv = mutex_tryenter_locked(mtx);
+	bmk_spin_unlock(&mtx->lock);
 
-	return 0;
+	return rv;
 }
 
 void
 rumpuser_mutex_exit(struct rumpuser_mtx *mtx)
 {
 
+	bmk_spin_lock(&mtx->lock);
 	bmk_assert(mtx->v == 1);
 	mtx->v = 0;
 	mtx->o = NULL;
 	mtx->bmk_o = NULL;
 	wakeup_one(&mtx->waiters);
+	bmk_spin_unlock(&mtx->lock);
 }
 
 void
@@ -212,6 +310,7 @@ rumpuser_mutex_owner(struct rumpuser_mtx *mtx, struct lwp **lp)
 }
 
 struct rumpuser_rw {
+	struct bmk_spinlock lock;
 	struct waithead rwait;
 	struct waithead wwait;
 	int v;
@@ -224,12 +323,40 @@ rumpuser_rw_init(struct rumpuser_rw **rwp)
 	struct rumpuser_rw *rw;
 
 	rw = bmk_memcalloc(1, sizeof(*rw), BMK_MEMWHO_WIREDBMK);
+	bmk_spin_init(&rw->lock);
 	TAILQ_INIT(&rw->rwait);
 	TAILQ_INIT(&rw->wwait);
 
 	*rwp = rw;
 }
 
+static int
+rw_tryenter_locked(enum rumprwlock lk, struct rumpuser_rw *rw)
+{
+	int rv = -1;
+
+	switch (lk) {
+	case RUMPUSER_RW_WRITER:
+		if (rw->o == NULL) {
+			rw->o = rumpuser_curlwp();
+			rv = 0;
+		} else {
+			rv = BMK_EBUSY;
+		}
+		break;
+	case RUMPUSER_RW_READER:
+		if (rw->o == NULL && TAILQ_EMPTY(&rw->wwait)) {
+			rw->v++;
+			rv = 0;
+		} else {
+			rv = BMK_EBUSY;
+		}
+		break;
+	}
+
+	return rv;
+}
+
 void
 rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 {
@@ -248,8 +375,10 @@ rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 
 	if (rumpuser_rw_tryenter(enum_rumprwlock, rw) != 0) {
 		rumpkern_unsched(&nlocks, NULL);
-		while (rumpuser_rw_tryenter(enum_rumprwlock, rw) != 0)
-			wait(w, BMK_SCHED_BLOCK_INFTIME);
+		bmk_spin_lock(&rw->lock);
+		while (rw_tryenter_locked(lk, rw) != 0)
+			wait(&rw->lock, w, BMK_SCHED_BLOCK_INFTIME);
+		bmk_spin_unlock(&rw->lock);
 		rumpkern_sched(nlocks, NULL);
 	}
 }
@@ -257,27 +386,11 @@ rumpuser_rw_enter(int enum_rumprwlock, struct rumpuser_rw *rw)
 int
 rumpuser_rw_tryenter(int enum_rumprwlock, struct rumpuser_rw *rw)
 {
-	enum rumprwlock lk = enum_rumprwlock;
-	int rv = -1;
+	int rv;
 
-	switch (lk) {
-	case RUMPUSER_RW_WRITER:
-		if (rw->o == NULL) {
-			rw->o = rumpuser_curlwp();
-			rv = 0;
-		} else {
-			rv = BMK_EBUSY;
-		}
-		break;
-	case RUMPUSER_RW_READER:
-		if (rw->o == NULL && TAILQ_EMPTY(&rw->wwait)) {
-			rw->v++;
-			rv = 0;
-		} else {
-			rv = BMK_EBUSY;
-		}
-		break;
-	}
+	bmk_spin_lock(&rw->lock);
+	rv = rw_tryenter_locked(enum_rumprwlock, rw);
+	bmk_spin_unlock(&rw->lock);
 
 	return rv;
 }
@@ -286,6 +399,7 @@ void
 rumpuser_rw_exit(struct rumpuser_rw *rw)
 {
 
+	bmk_spin_lock(&rw->lock);
 	if (rw->o) {
 		rw->o = NULL;
 	} else {
@@ -299,6 +413,7 @@ rumpuser_rw_exit(struct rumpuser_rw *rw)
 	} else if (!TAILQ_EMPTY(&rw->rwait) && rw->o == NULL) {
 		wakeup_all(&rw->rwait);
 	}
+	bmk_spin_unlock(&rw->lock);
 }
 
 void
@@ -327,24 +442,30 @@ void
 rumpuser_rw_downgrade(struct rumpuser_rw *rw)
 {
 
+	bmk_spin_lock(&rw->lock);
 	bmk_assert(rw->o == rumpuser_curlwp());
 	rw->v = -1;
+	bmk_spin_unlock(&rw->lock);
 }
 
 int
 rumpuser_rw_tryupgrade(struct rumpuser_rw *rw)
 {
+	int rv = BMK_EBUSY;
 
+	bmk_spin_lock(&rw->lock);
 	if (rw->v == -1) {
 		rw->v = 1;
 		rw->o = rumpuser_curlwp();
-		return 0;
+		rv = 0;
 	}
+	bmk_spin_unlock(&rw->lock);
 
-	return BMK_EBUSY;
+	return rv;
 }
 
 struct rumpuser_cv {
+	struct bmk_spinlock lock;
 	struct waithead waiters;
 	int nwaiters;
 };
@@ -355,6 +476,7 @@ rumpuser_cv_init(struct rumpuser_cv **cvp)
 	struct rumpuser_cv *cv;
 
 	cv = bmk_memcalloc(1, sizeof(*cv), BMK_MEMWHO_WIREDBMK);
+	bmk_spin_init(&cv->lock);
 	TAILQ_INIT(&cv->waiters);
 	*cvp = cv;
 }
@@ -367,14 +489,6 @@ rumpuser_cv_destroy(struct rumpuser_cv *cv)
 	bmk_memfree(cv, BMK_MEMWHO_WIREDBMK);
 }
 
-static void
-cv_unsched(struct rumpuser_mtx *mtx, int *nlocks)
-{
-
-	rumpkern_unsched(nlocks, mtx);
-	rumpuser_mutex_exit(mtx);
-}
-
 static void
 cv_resched(struct rumpuser_mtx *mtx, int nlocks)
 {
@@ -390,64 +504,87 @@ cv_resched(struct rumpuser_mtx *mtx, int nlocks)
 	}
 }
 
-void
-rumpuser_cv_wait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx)
+/*
+ * Queue ourselves on the cv before releasing the mutex, so that a
+ * signal sent by another CPU right after the mutex is released is
+ * not lost.  The rump kernel CPU must be released first, since that
+ * may block.
+ */
+static int
+cv_wait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx,
+	bmk_time_t timeout, int unsched)
 {
-	int nlocks;
+	struct waiter w;
+	int nlocks = 0;
+	int rv;
+
+	if (unsched)
+		rumpkern_unsched(&nlocks, mtx);
 
+	bmk_spin_lock(&cv->lock);
 	cv->nwaiters++;
-	cv_unsched(mtx, &nlocks);
-	wait(&cv->waiters, BMK_SCHED_BLOCK_INFTIME);
-	cv_resched(mtx, nlocks);
+	wait_prepare(&cv->waiters, &w, timeout);
+	bmk_spin_unlock(&cv->lock);
+
+	rumpuser_mutex_exit(mtx);
+
+	rv = wait_block(&cv->lock, &cv->waiters, &w);
 	cv->nwaiters--;
+	bmk_spin_unlock(&cv->lock);
+
+	if (unsched)
+		cv_resched(mtx, nlocks);
+	else
+		rumpuser_mutex_enter_nowrap(mtx);
+
+	return rv;
+}
+
+void
+rumpuser_cv_wait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx)
+{
+
+	cv_wait(cv, mtx, BMK_SCHED_BLOCK_INFTIME, 1);
 }
 
 void
 rumpuser_cv_wait_nowrap(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx)
 {
 
-	cv->nwaiters++;
-	rumpuser_mutex_exit(mtx);
-	wait(&cv->waiters, BMK_SCHED_BLOCK_INFTIME);
-	rumpuser_mutex_enter_nowrap(mtx);
-	cv->nwaiters--;
+	cv_wait(cv, mtx, BMK_SCHED_BLOCK_INFTIME, 0);
 }
 
 int
 rumpuser_cv_timedwait(struct rumpuser_cv *cv, struct rumpuser_mtx *mtx,
 	int64_t sec, int64_t nsec)
 {
-	int nlocks;
-	int rv;
 
-	cv->nwaiters++;
-	cv_unsched(mtx, &nlocks);
-	rv = wait(&cv->waiters, sec * 1000*1000*1000ULL + nsec);
-	cv_resched(mtx, nlocks);
-	cv->nwaiters--;
-
-	return rv;
+	return cv_wait(cv, mtx, sec * 1000*1000*1000ULL + nsec, 1);
 }
 
 void
 rumpuser_cv_signal(struct rumpuser_cv *cv)
 {
 
+	bmk_spin_lock(&cv->lock);
 	wakeup_one(&cv->waiters);
+	bmk_spin_unlock(&cv->lock);
 }
 
 void
 rumpuser_cv_broadcast(struct rumpuser_cv *cv)
 {
 
+	bmk_spin_lock(&cv->lock);
 	wakeup_all(&cv->waiters);
+	bmk_spin_unlock(&cv->lock);
 }
 
 void
 rumpuser_cv_has_waiters(struct rumpuser_cv *cv, int *rvp)
 {
 
-	*rvp = cv->nwaiters != 0;
+	*rvp = __atomic_load_n(&cv->nwaiters, __ATOMIC_RELAXED) != 0;
 }
 
 /*
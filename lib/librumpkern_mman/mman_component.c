@@ -39,12 +39,15 @@ extern sy_call_t sys_mlockall;
 extern sy_call_t sys_munlock;
 extern sy_call_t sys_munlockall;
 
+void rumprun_mman_init(void);
+
 #define ENTRY(name) { SYS_##name, sys_##name },
 static const struct rump_onesyscall mysys[] = {
 	ENTRY(mmap)
 	ENTRY(munmap)
 	ENTRY(__msync13)
 	ENTRY(mincore)
+	ENTRY(madvise)
 	ENTRY(mprotect)
 	ENTRY(mlock)
 	ENTRY(mlockall)
@@ -56,5 +59,6 @@ static const struct rump_onesyscall mysys[] = {
 RUMP_COMPONENT(RUMP_COMPONENT_SYSCALL)
 {
 
+	rumprun_mman_init();
 	rump_syscall_boot_establish(mysys, __arraycount(mysys));
 }
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Page allocation for mmap.  Mappings get exactly the pages they ask
+ * for straight from the page allocator, and any page-aligned part of
+ * a mapping can be given back on its own.  The buddy allocator is
+ * happy to take back a block piecemeal as long as each piece is a
+ * naturally aligned power of two, so that is what we feed it.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/null.h>
+#include <bmk-core/pgalloc.h>
+
+#include <bmk-pcpu/pcpu.h>
+
+#include "mman_user.h"
+
+void
+rumpcomp_mman_pgfree(void *addr, unsigned long len)
+{
+	unsigned long va = (unsigned long)addr;
+	unsigned long npgs = len >> BMK_PCPU_PAGE_SHIFT;
+	int order, maxorder;
+
+	bmk_assert((va & (BMK_PCPU_PAGE_SIZE-1)) == 0);
+
+	while (npgs) {
+		/* largest aligned block at va which fits */
+		order = __builtin_ctzl(va >> BMK_PCPU_PAGE_SHIFT);
+		maxorder = 8*sizeof(npgs) - 1 - __builtin_clzl(npgs);
+		if (order > maxorder)
+			order = maxorder;
+
+		bmk_pgfree((void *)va, order);
+		va += 1UL << (order + BMK_PCPU_PAGE_SHIFT);
+		npgs -= 1UL << order;
+	}
+}
+
+void *
+rumpcomp_mman_pgalloc(unsigned long len)
+{
+	unsigned long npgs = len >> BMK_PCPU_PAGE_SHIFT;
+	unsigned long mapped;
+	void *v;
+	int order;
+
+	bmk_assert(npgs > 0);
+	for (order = 0; (1UL << order) < npgs; order++)
+		continue;
+	if ((v = bmk_pgalloc(order)) == NULL)
+		return NULL;
+
+	/* give back the tail the power-of-two rounding added */
+	mapped = npgs << BMK_PCPU_PAGE_SHIFT;
+	if (npgs < (1UL << order))
+		rumpcomp_mman_pgfree((char *)v + mapped,
+		    ((1UL << order) - npgs) << BMK_PCPU_PAGE_SHIFT);
+
+	return v;
+}
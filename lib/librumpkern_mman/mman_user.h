@@ -0,0 +1,23 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+void	*rumpcomp_mman_pgalloc(unsigned long);
+void	rumpcomp_mman_pgfree(void *, unsigned long);
+
+/* memory pressure levels, same as BMK_PGALLOC_PRESSURE_* */
+#define RUMPCOMP_PGPRESS_NONE	0
+#define RUMPCOMP_PGPRESS_WARN	1
+#define RUMPCOMP_PGPRESS_CRIT	2
+
+int	rumpcomp_pgpress_init(void);
+int	rumpcomp_pgpress_level(void);
+int	rumpcomp_pgpress_wait(int);
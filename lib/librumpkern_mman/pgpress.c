@@ -0,0 +1,212 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Memory pressure feedback.  The pgpress kthread follows the pressure
+ * level of the bmk page allocator.  While there is pressure, it kicks
+ * the pagedaemon once a second so that the rump kernel gives back
+ * what it has cached (pools, buffers, vnode pages) before allocations
+ * start failing.
+ *
+ * Applications see the level through /dev/pgpress:
+ *   - read() returns the current level as an int.  It blocks while
+ *     there is no pressure, or fails with EAGAIN if non-blocking.
+ *   - poll() reports POLLIN while there is pressure.
+ *   - EVFILT_READ is active while there is pressure, with the level
+ *     in data.  Use EV_CLEAR to get one event per level change.
+ */
+
+#include <sys/param.h>
+#include <sys/conf.h>
+#include <sys/condvar.h>
+#include <sys/event.h>
+#include <sys/kernel.h>
+#include <sys/kthread.h>
+#include <sys/mutex.h>
+#include <sys/poll.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/systm.h>
+#include <sys/uio.h>
+#include <sys/vnode.h>
+
+#include <uvm/uvm_extern.h>
+
+#include "rump_private.h"
+#include "rump_vfs_private.h"
+
+#include "mman_user.h"
+
+static kmutex_t pgpress_mtx;
+static kcondvar_t pgpress_cv;
+static struct selinfo pgpress_sel;
+static int pgpress_level = RUMPCOMP_PGPRESS_NONE;
+
+static void
+pgpress_setlevel(int level)
+{
+
+	mutex_enter(&pgpress_mtx);
+	if (level != pgpress_level) {
+		pgpress_level = level;
+		cv_broadcast(&pgpress_cv);
+		selnotify(&pgpress_sel, POLLIN | POLLRDNORM, NOTE_SUBMIT);
+	}
+	mutex_exit(&pgpress_mtx);
+}
+
+static void
+pgpress_thread(void *arg)
+{
+	int level = RUMPCOMP_PGPRESS_NONE;
+
+	for (;;) {
+		if (level == RUMPCOMP_PGPRESS_NONE) {
+			level = rumpcomp_pgpress_wait(level);
+		} else {
+			uvm_wait("pgpress");
+			kpause("pgpress", false, hz, NULL);
+			level = rumpcomp_pgpress_level();
+		}
+		pgpress_setlevel(level);
+	}
+}
+
+static int
+pgpress_read(dev_t dev, struct uio *uio, int flags)
+{
+	int level, error;
+
+	if (uio->uio_resid < sizeof(level))
+		return EINVAL;
+
+	mutex_enter(&pgpress_mtx);
+	while (pgpress_level == RUMPCOMP_PGPRESS_NONE) {
+		if (flags & IO_NDELAY) {
+			mutex_exit(&pgpress_mtx);
+			return EWOULDBLOCK;
+		}
+		if ((error = cv_wait_sig(&pgpress_cv, &pgpress_mtx)) != 0) {
+			mutex_exit(&pgpress_mtx);
+			return error;
+		}
+	}
+	level = pgpress_level;
+	mutex_exit(&pgpress_mtx);
+
+	return uiomove(&level, sizeof(level), uio);
+}
+
+static int
+pgpress_poll(dev_t dev, int events, struct lwp *l)
+{
+	int revents = 0;
+
+	mutex_enter(&pgpress_mtx);
+	if (pgpress_level != RUMPCOMP_PGPRESS_NONE)
+		revents = events & (POLLIN | POLLRDNORM);
+	else if (events & (POLLIN | POLLRDNORM))
+		selrecord(l, &pgpress_sel);
+	mutex_exit(&pgpress_mtx);
+
+	return revents;
+}
+
+static void
+filt_pgpressdetach(struct knote *kn)
+{
+
+	mutex_enter(&pgpress_mtx);
+	SLIST_REMOVE(&pgpress_sel.sel_klist, kn, knote, kn_selnext);
+	mutex_exit(&pgpress_mtx);
+}
+
+static int
+filt_pgpressread(struct knote *kn, long hint)
+{
+	int rv;
+
+	if (hint != NOTE_SUBMIT)
+		mutex_enter(&pgpress_mtx);
+	kn->kn_data = pgpress_level;
+	rv = pgpress_level != RUMPCOMP_PGPRESS_NONE;
+	if (hint != NOTE_SUBMIT)
+		mutex_exit(&pgpress_mtx);
+
+	return rv;
+}
+
+static const struct filterops pgpress_filtops = {
+	.f_isfd = 1,
+	.f_attach = NULL,
+	.f_detach = filt_pgpressdetach,
+	.f_event = filt_pgpressread,
+};
+
+static int
+pgpress_kqfilter(dev_t dev, struct knote *kn)
+{
+
+	if (kn->kn_filter != EVFILT_READ)
+		return EINVAL;
+
+	kn->kn_fop = &pgpress_filtops;
+	mutex_enter(&pgpress_mtx);
+	SLIST_INSERT_HEAD(&pgpress_sel.sel_klist, kn, kn_selnext);
+	mutex_exit(&pgpress_mtx);
+
+	return 0;
+}
+
+static const struct cdevsw pgpress_cdevsw = {
+	.d_open = nullopen,
+	.d_close = nullclose,
+	.d_read = pgpress_read,
+	.d_write = nowrite,
+	.d_ioctl = noioctl,
+	.d_stop = nostop,
+	.d_tty = notty,
+	.d_poll = pgpress_poll,
+	.d_mmap = nommap,
+	.d_kqfilter = pgpress_kqfilter,
+	.d_discard = nodiscard,
+	.d_flag = D_OTHER | D_MPSAFE
+};
+
+RUMP_COMPONENT(RUMP_COMPONENT_DEV)
+{
+	devmajor_t bmaj, cmaj;
+	int error;
+
+	mutex_init(&pgpress_mtx, MUTEX_DEFAULT, IPL_NONE);
+	cv_init(&pgpress_cv, "pgpress");
+	selinit(&pgpress_sel);
+
+	bmaj = cmaj = NODEVMAJOR;
+	if ((error = devsw_attach("pgpress", NULL, &bmaj,
+	    &pgpress_cdevsw, &cmaj)) != 0)
+		panic("pgpress: devsw attach failed: %d", error);
+	if ((error = rump_vfs_makeonedevnode(S_IFCHR, "/dev/pgpress",
+	    cmaj, 0)) != 0)
+		panic("pgpress: cannot create device node: %d", error);
+
+	/* without the hook or threads the level simply stays at none */
+	if ((error = rumpcomp_pgpress_init()) != 0) {
+		aprint_error("pgpress: cannot register hook: %d\n", error);
+		return;
+	}
+	if (!rump_threads)
+		return;
+	if ((error = kthread_create(PRI_NONE, KTHREAD_MPSAFE, NULL,
+	    pgpress_thread, NULL, NULL, "pgpress")) != 0)
+		panic("pgpress: cannot create kthread: %d", error);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Memory pressure from the page allocator.  There is one waiter, the
+ * pgpress kthread, which sleeps here until the level changes.  The
+ * page allocator calls our hook on every change; all the hook does is
+ * wake the waiter.
+ */
+
+#include <bmk-core/core.h>
+#include <bmk-core/null.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/sched.h>
+
+#include <bmk-rumpuser/core_types.h>
+#include <bmk-rumpuser/rumpuser.h>
+
+#include "mman_user.h"
+
+bmk_ctassert(RUMPCOMP_PGPRESS_NONE == BMK_PGALLOC_PRESSURE_NONE);
+bmk_ctassert(RUMPCOMP_PGPRESS_WARN == BMK_PGALLOC_PRESSURE_WARN);
+bmk_ctassert(RUMPCOMP_PGPRESS_CRIT == BMK_PGALLOC_PRESSURE_CRIT);
+
+static struct bmk_thread * volatile pgpress_waiter;
+
+static void
+pgpress_hook(void *arg, int level)
+{
+	struct bmk_thread *thread = pgpress_waiter;
+
+	if (thread)
+		bmk_sched_wake(thread);
+}
+
+int
+rumpcomp_pgpress_init(void)
+{
+
+	return bmk_pgalloc_addhook(pgpress_hook, NULL);
+}
+
+int
+rumpcomp_pgpress_level(void)
+{
+
+	return bmk_pgalloc_pressure();
+}
+
+/*
+ * Wait until the pressure level is something else than level,
+ * return the new level.
+ */
+int
+rumpcomp_pgpress_wait(int level)
+{
+	int nlocks, newlevel;
+
+	rumpkern_unsched(&nlocks, NULL);
+	pgpress_waiter = bmk_current;
+	do {
+		/* a wakeup after blockprepare makes block return at once */
+		bmk_sched_blockprepare();
+		if ((newlevel = bmk_pgalloc_pressure()) != level)
+			bmk_sched_wake(bmk_current);
+		bmk_sched_block();
+	} while (newlevel == level);
+	pgpress_waiter = NULL;
+	rumpkern_sched(nlocks, NULL);
+
+	return newlevel;
+}
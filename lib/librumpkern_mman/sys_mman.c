@@ -32,114 +32,607 @@
 #include <sys/cdefs.h>
 
 #include <sys/param.h>
+#include <sys/condvar.h>
 #include <sys/errno.h>
 #include <sys/file.h>
 #include <sys/filedesc.h>
+#include <sys/kauth.h>
 #include <sys/kmem.h>
+#include <sys/kthread.h>
 #include <sys/mman.h>
-#include <sys/queue.h>
+#include <sys/mutex.h>
+#include <sys/rbtree.h>
+#include <sys/rwlock.h>
 #include <sys/syscall.h>
 #include <sys/syscallargs.h>
+#include <sys/vnode.h>
+
+#include <uvm/uvm.h>
 
 #include "rump_private.h"
 
+#include "mman_user.h"
+
 #ifdef RUMPRUN_MMAP_DEBUG
 #define MMAP_PRINTF(x) printf x
 #else
 #define MMAP_PRINTF(x)
 #endif
 
-struct mmapchunk {
-	void *mm_start;
-	size_t mm_size;
-	size_t mm_pgsleft;
+/*
+ * Mapped regions.  Regions never overlap, so a tree sorted by start
+ * address is enough to find the region containing an address in
+ * O(log n).  Each region owns its pages, and since the pages can be
+ * given back to the page allocator a page at a time, munmap can
+ * punch holes anywhere.
+ *
+ * The lock is a rwlock because page faults on demand-paged regions
+ * hold it, as readers, across file I/O.
+ */
+struct mmapregion {
+	vaddr_t mr_start;
+	vaddr_t mr_end;		/* exclusive */
+	int mr_flags;
+
+	/* MR_LAZY only */
+	struct vnode *mr_vp;
+	kauth_cred_t mr_cred;
+	off_t mr_off;		/* file offset of mr_start */
+	int mr_prot;
+
+	rb_node_t mr_node;
+};
+#define MR_UNZEROED	0x01	/* anonymous, not zeroed yet */
+#define MR_LAZY		0x02	/* file, populated on fault */
+
+static rb_tree_t mmr_tree;
+static krwlock_t mmr_lock;
 
-	LIST_ENTRY(mmapchunk) mm_chunks;
+static int
+mmr_compare_nodes(void *ctx, const void *n1, const void *n2)
+{
+	const struct mmapregion *mr1 = n1, *mr2 = n2;
+
+	if (mr1->mr_start < mr2->mr_start)
+		return -1;
+	if (mr1->mr_start > mr2->mr_start)
+		return 1;
+	return 0;
+}
+
+static int
+mmr_compare_key(void *ctx, const void *n, const void *key)
+{
+	const struct mmapregion *mr = n;
+	vaddr_t va = *(const vaddr_t *)key;
+
+	if (mr->mr_start < va)
+		return -1;
+	if (mr->mr_start > va)
+		return 1;
+	return 0;
+}
+
+static const rb_tree_ops_t mmr_tree_ops = {
+	.rbto_compare_nodes = mmr_compare_nodes,
+	.rbto_compare_key = mmr_compare_key,
+	.rbto_node_offset = offsetof(struct mmapregion, mr_node),
+	.rbto_context = NULL,
 };
+
+static struct mmapregion *
+mmr_insert(vaddr_t start, vaddr_t end, int flags)
+{
+	struct mmapregion *mr;
+
+	mr = kmem_zalloc(sizeof(*mr), KM_SLEEP);
+	mr->mr_start = start;
+	mr->mr_end = end;
+	mr->mr_flags = flags;
+	rb_tree_insert_node(&mmr_tree, mr);
+
+	return mr;
+}
+
+/* first region which ends after va */
+static struct mmapregion *
+mmr_first(vaddr_t va)
+{
+	struct mmapregion *mr;
+
+	mr = rb_tree_find_node_leq(&mmr_tree, &va);
+	if (mr == NULL || mr->mr_end <= va)
+		mr = rb_tree_find_node_geq(&mmr_tree, &va);
+	return mr;
+}
+
+static struct mmapregion *
+mmr_next(struct mmapregion *mr)
+{
+
+	return rb_tree_iterate(&mmr_tree, mr, RB_DIR_RIGHT);
+}
+
 /*
- * XXX: use a tree?  we don't know how many entries we get,
- * someone might mmap pages individually ...
+ * Split regions so that [start,end) is made up of whole regions.
  */
-static LIST_HEAD(, mmapchunk) mmc_list = LIST_HEAD_INITIALIZER(&mmc_list);
+static void
+mmr_clip(vaddr_t start, vaddr_t end)
+{
+	struct mmapregion *mr, *nmr;
+	vaddr_t cuts[2] = { start, end };
+	unsigned i;
+
+	for (i = 0; i < __arraycount(cuts); i++) {
+		mr = rb_tree_find_node_leq(&mmr_tree, &cuts[i]);
+		if (mr == NULL || mr->mr_start == cuts[i]
+		    || mr->mr_end <= cuts[i])
+			continue;
+		nmr = mmr_insert(cuts[i], mr->mr_end, mr->mr_flags);
+		if (mr->mr_flags & MR_LAZY) {
+			nmr->mr_vp = mr->mr_vp;
+			nmr->mr_cred = mr->mr_cred;
+			nmr->mr_off = mr->mr_off + (cuts[i] - mr->mr_start);
+			nmr->mr_prot = mr->mr_prot;
+			vref(nmr->mr_vp);
+			kauth_cred_hold(nmr->mr_cred);
+		}
+		mr->mr_end = cuts[i];
+	}
+}
 
-static void *
-mmapmem_alloc(size_t roundedlen)
+/* is all of [start,end) mapped to memory we own? */
+static bool
+mmr_covered(vaddr_t start, vaddr_t end)
 {
-	struct mmapchunk *mc;
-	void *v;
+	struct mmapregion *mr;
+	vaddr_t va = start;
 
-	mc = kmem_alloc(sizeof(*mc), KM_SLEEP);
-	if (mc == NULL)
-		return NULL;
+	for (mr = mmr_first(start); mr && va < end; mr = mmr_next(mr)) {
+		if (mr->mr_start > va || (mr->mr_flags & MR_LAZY))
+			return false;
+		va = mr->mr_end;
+	}
+	return va >= end;
+}
 
-	v = rump_hypermalloc(roundedlen, PAGE_SIZE, true, "mmapmem");
+static void
+mmr_remove(struct mmapregion *mr)
+{
 
-	mc->mm_start = v;
-	mc->mm_size = roundedlen;
-	mc->mm_pgsleft = roundedlen / PAGE_SIZE;
+	rb_tree_remove_node(&mmr_tree, mr);
+	if (mr->mr_flags & MR_LAZY) {
+		vrele(mr->mr_vp);
+		kauth_cred_free(mr->mr_cred);
+	}
+	kmem_free(mr, sizeof(*mr));
+}
 
-	LIST_INSERT_HEAD(&mmc_list, mc, mm_chunks);
+/*
+ * Demand paging, provided by the platform if it can (see
+ * platform/hw/arch/amd64/vm.c).  Pages of lazy regions are private
+ * copies read from the file on first touch.  Sharing the vnode's
+ * pages would save the copy, but rump kernel UVM has no way to keep
+ * a page in place while it is mapped behind its back.
+ */
+void *plat_vm_reserve(size_t);
+int plat_vm_enter(void *, void *, int);
+void *plat_vm_lookup(void *);
+void *plat_vm_extract(void *);
+void plat_vm_flush(void);
+void plat_vm_setfault(int (*)(void *));
+
+#pragma weak plat_vm_reserve
+#pragma weak plat_vm_enter
+#pragma weak plat_vm_lookup
+#pragma weak plat_vm_extract
+#pragma weak plat_vm_flush
+#pragma weak plat_vm_setfault
+
+/* pages to read in per fault */
+#define FAULT_CLUSTER	8
+
+/* is the vnode's cached page at off busy? */
+static bool
+lazy_pagebusy(struct vnode *vp, off_t off)
+{
+	struct vm_page *pg;
+	bool busy;
+
+	mutex_enter(vp->v_uobj.vmobjlock);
+	pg = uvm_pagelookup(&vp->v_uobj, trunc_page(off));
+	busy = pg != NULL && (pg->flags & PG_BUSY) != 0;
+	mutex_exit(vp->v_uobj.vmobjlock);
+
+	return busy;
+}
+
+/*
+ * Populate [va,end) of a lazy region.  Called with mmr_lock held,
+ * as reader is enough.
+ *
+ * If we hold the vnode locked (VOP_ISLOCKED() says LK_EXCLUSIVE only
+ * to the holder), the fault comes from a syscall on the same file,
+ * e.g. write(fd, p, n) where p is a mapping of fd, and locking it
+ * again would deadlock.  Read under the caller's lock instead.  That
+ * still deadlocks if the page we need is the one the syscall is busy
+ * writing, and since there is no way to make copyin fail, we return
+ * EFAULT and the fault is fatal.
+ */
+static int
+lazy_fill(struct mmapregion *mr, vaddr_t va, vaddr_t end)
+{
+	vaddr_t start = va;
+	size_t resid;
+	off_t off;
+	void *pg;
+	int error, ioflg;
+
+	KASSERT(mr->mr_flags & MR_LAZY);
+
+	ioflg = 0;
+	if (VOP_ISLOCKED(mr->mr_vp) == LK_EXCLUSIVE)
+		ioflg = IO_NODELOCKED;
+
+	for (; va < end; va += PAGE_SIZE) {
+		if (plat_vm_lookup((void *)va) != NULL)
+			continue;
+
+		off = mr->mr_off + (va - mr->mr_start);
+		if (ioflg && lazy_pagebusy(mr->mr_vp, off)) {
+			/* read-ahead can just stop here */
+			if (va != start)
+				return 0;
+			printf("mman: fault at %p on a page being written "
+			    "from it\n", (void *)va);
+			return EFAULT;
+		}
+
+		if ((pg = rumpcomp_mman_pgalloc(PAGE_SIZE)) == NULL)
+			return ENOMEM;
+		error = vn_rdwr(UIO_READ, mr->mr_vp, pg, PAGE_SIZE,
+		    off, UIO_SYSSPACE, ioflg, mr->mr_cred, &resid, NULL);
+		if (error) {
+			rumpcomp_mman_pgfree(pg, PAGE_SIZE);
+			return error;
+		}
+		if (resid)
+			memset((uint8_t *)pg + PAGE_SIZE - resid, 0, resid);
+
+		/* someone else may have faulted it in while we read */
+		if ((error = plat_vm_enter((void *)va, pg, mr->mr_prot)) != 0)
+			rumpcomp_mman_pgfree(pg, PAGE_SIZE);
+		if (error && error != EEXIST)
+			return error;
+	}
+	return 0;
+}
 
+/*
+ * Unmap and free the populated pages in [va,end).  Called with
+ * mmr_lock held as writer, so nobody can fault them back in
+ * before we are done.
+ */
+static void
+lazy_evict(vaddr_t va, vaddr_t end)
+{
+	void *pgs[64];
+	unsigned i, n;
+
+	while (va < end) {
+		for (n = 0; n < __arraycount(pgs) && va < end; va += PAGE_SIZE) {
+			if ((pgs[n] = plat_vm_extract((void *)va)) != NULL)
+				n++;
+		}
+		if (n == 0)
+			continue;
+		plat_vm_flush();
+		for (i = 0; i < n; i++)
+			rumpcomp_mman_pgfree(pgs[i], PAGE_SIZE);
+	}
+}
+
+/*
+ * Page fault handler.  The fault may come from the application, which
+ * runs without a rump kernel CPU, or from inside the rump kernel,
+ * e.g. when copying out of a mapped file in write().
+ */
+static int
+mmap_fault(void *addr)
+{
+	vaddr_t va = (vaddr_t)addr & ~(PAGE_SIZE-1);
+	struct mmapregion *mr;
+	struct lwp *l;
+	bool sched;
+	int error = EFAULT;
+
+	l = rumpuser_curlwp();
+	sched = l == NULL || l->l_cpu == NULL || l->l_cpu->ci_curlwp != l;
+	if (sched)
+		rump_schedule();
+
+	rw_enter(&mmr_lock, RW_READER);
+	mr = rb_tree_find_node_leq(&mmr_tree, &va);
+	if (mr && va < mr->mr_end && (mr->mr_flags & MR_LAZY)) {
+		error = lazy_fill(mr, va,
+		    MIN(mr->mr_end, va + FAULT_CLUSTER*PAGE_SIZE));
+	}
+	rw_exit(&mmr_lock);
+
+	if (sched)
+		rump_unschedule();
+	return error;
+}
+
+/* give back the memory backing a region */
+static void
+mmr_freepages(struct mmapregion *mr)
+{
+
+	if (mr->mr_flags & MR_LAZY)
+		lazy_evict(mr->mr_start, mr->mr_end);
+	else
+		rumpcomp_mman_pgfree((void *)mr->mr_start,
+		    mr->mr_end - mr->mr_start);
+}
+
+/*
+ * Pool of zeroed blocks for small anonymous mappings, so that the
+ * common malloc-via-mmap case does not memset on the syscall path.
+ * A kernel thread keeps the pool topped up.  Pool blocks are linked
+ * through their first word, which is cleared when they are taken.
+ */
+#define ZPOOL_MAXORDER	4	/* up to 16 pages */
+#define ZPOOL_TARGET	16	/* blocks of each size to keep */
+
+struct zpool {
+	void *zp_head;
+	unsigned zp_count;
+};
+static struct zpool zpool[ZPOOL_MAXORDER+1];
+static kmutex_t zpool_lock;
+static kcondvar_t zpool_cv;
+static bool zpool_running;
+
+static void
+zpool_thread(void *arg)
+{
+	void *v;
+	unsigned i;
+	bool filled;
+
+	mutex_enter(&zpool_lock);
+	for (;;) {
+		filled = false;
+		for (i = 0; i <= ZPOOL_MAXORDER; i++) {
+			if (zpool[i].zp_count >= ZPOOL_TARGET)
+				continue;
+
+			mutex_exit(&zpool_lock);
+			v = rumpcomp_mman_pgalloc(PAGE_SIZE << i);
+			if (v)
+				memset(v, 0, PAGE_SIZE << i);
+			mutex_enter(&zpool_lock);
+			if (v == NULL)
+				break;
+
+			*(void **)v = zpool[i].zp_head;
+			zpool[i].zp_head = v;
+			zpool[i].zp_count++;
+			filled = true;
+		}
+		if (!filled)
+			cv_wait(&zpool_cv, &zpool_lock);
+	}
+}
+
+/*
+ * Get zeroed pages for an anonymous mapping, from the pool if
+ * possible.
+ */
+static void *
+zpool_get(size_t roundedlen)
+{
+	size_t npgs = roundedlen / PAGE_SIZE;
+	unsigned order;
+	void *v = NULL;
+
+	for (order = 0; (1UL << order) < npgs; order++)
+		continue;
+
+	if (order <= ZPOOL_MAXORDER && zpool_running) {
+		mutex_enter(&zpool_lock);
+		if ((v = zpool[order].zp_head) != NULL) {
+			zpool[order].zp_head = *(void **)v;
+			zpool[order].zp_count--;
+			*(void **)v = NULL;
+		}
+		if (zpool[order].zp_count < ZPOOL_TARGET/2)
+			cv_signal(&zpool_cv);
+		mutex_exit(&zpool_lock);
+
+		if (v && npgs < (1UL << order)) {
+			rumpcomp_mman_pgfree((uint8_t *)v + roundedlen,
+			    (PAGE_SIZE << order) - roundedlen);
+		}
+	}
+
+	if (v == NULL) {
+		if ((v = rumpcomp_mman_pgalloc(roundedlen)) != NULL)
+			memset(v, 0, roundedlen);
+	}
 	return v;
 }
 
+void rumprun_mman_init(void);
+void
+rumprun_mman_init(void)
+{
+	int error;
+
+	rb_tree_init(&mmr_tree, &mmr_tree_ops);
+	rw_init(&mmr_lock);
+
+	mutex_init(&zpool_lock, MUTEX_DEFAULT, IPL_NONE);
+	cv_init(&zpool_cv, "mmapzero");
+	error = kthread_create(PRI_NONE, KTHREAD_MPSAFE, NULL,
+	    zpool_thread, NULL, NULL, "mmapzero");
+	if (error == 0)
+		zpool_running = true;
+	else
+		printf("mman: cannot create zeroing thread (%d)\n", error);
+
+	if (plat_vm_setfault)
+		plat_vm_setfault(mmap_fault);
+}
+
+/*
+ * Fill in a mapping from a file.  Memory after the end of the object
+ * until the end of the page should be 0-filled.  We don't really know
+ * when the object stops (we could do a fstat(), but that's racy), so
+ * just assume that the caller knows what her or she is doing.
+ */
 static int
-mmapmem_free(void *addr, size_t roundedlen)
+mmapmem_readfile(int fd, void *v, size_t roundedlen, off_t pos)
 {
-	struct mmapchunk *mc;
-	size_t npgs;
-
-	LIST_FOREACH(mc, &mmc_list, mm_chunks) {
-		if (mc->mm_start <= addr &&
-		    ((uint8_t *)mc->mm_start + mc->mm_size
-		      >= (uint8_t *)addr + roundedlen))
-			break;
+	struct file *fp;
+	register_t cnt;
+	int error;
+
+	if ((fp = fd_getfile(fd)) == NULL)
+		return EBADF;
+
+	if ((fp->f_flag & FREAD) == 0) {
+		fd_putfile(fd);
+		return EBADF;
 	}
-	if (!mc) {
-		return EINVAL;
+	if (fp->f_type != DTYPE_VNODE) {
+		fd_putfile(fd);
+		return ENODEV;
 	}
 
-	npgs = roundedlen / PAGE_SIZE;
-	KASSERT(npgs <= mc->mm_pgsleft);
-	mc->mm_pgsleft -= npgs;
-	if (mc->mm_pgsleft)
-		return 0;
+	/* dofileread() releases the file */
+	error = dofileread(fd, fp, v, roundedlen, &pos, 0, &cnt);
+	if (error)
+		return error;
 
-	/* no pages left => free bookkeeping chunk */
-	LIST_REMOVE(mc, mm_chunks);
-	kmem_free(mc->mm_start, mc->mm_size);
-	kmem_free(mc, sizeof(*mc));
+	if ((size_t)cnt != roundedlen) {
+		KASSERT(cnt < roundedlen);
+		memset((uint8_t *)v+cnt, 0, roundedlen-cnt);
+	}
+	return 0;
+}
 
+/*
+ * Set up a demand-paged file mapping.  Nothing is read until the
+ * pages are touched.
+ */
+static int
+mmap_lazy(int fd, size_t roundedlen, int prot, off_t pos, void **vp)
+{
+	struct mmapregion *mr;
+	struct file *fp;
+	void *v;
+
+	if ((fp = fd_getfile(fd)) == NULL)
+		return EBADF;
+
+	if ((fp->f_flag & FREAD) == 0) {
+		fd_putfile(fd);
+		return EBADF;
+	}
+	if (fp->f_type != DTYPE_VNODE) {
+		fd_putfile(fd);
+		return ENODEV;
+	}
+	if ((v = plat_vm_reserve(roundedlen)) == NULL) {
+		fd_putfile(fd);
+		return ENOMEM;
+	}
+
+	rw_enter(&mmr_lock, RW_WRITER);
+	mr = mmr_insert((vaddr_t)v, (vaddr_t)v + roundedlen, MR_LAZY);
+	mr->mr_vp = fp->f_data;
+	mr->mr_cred = fp->f_cred;
+	mr->mr_off = pos;
+	mr->mr_prot = prot;
+	vref(mr->mr_vp);
+	kauth_cred_hold(mr->mr_cred);
+	rw_exit(&mmr_lock);
+	fd_putfile(fd);
+
+	*vp = v;
 	return 0;
 }
 
+/*
+ * MAP_FIXED.  Since we do not have a VM, the only addresses we can
+ * hand out are ones we already own, i.e. ones inside existing
+ * mappings.  That covers the common pattern of reserving address
+ * space with PROT_NONE and later committing parts of it.
+ */
+static int
+mmap_fixed(vaddr_t start, size_t roundedlen, int prot, int flags,
+	int fd, off_t pos)
+{
+	struct mmapregion *mr, *next;
+	vaddr_t end = start + roundedlen;
+	int error = 0;
+
+	if ((start & (PAGE_SIZE-1)) != 0 || end < start)
+		return EINVAL;
+
+	rw_enter(&mmr_lock, RW_WRITER);
+	if (!mmr_covered(start, end)) {
+		rw_exit(&mmr_lock);
+		return ENOMEM;
+	}
+
+	/* replace whatever was there with one fresh region */
+	mmr_clip(start, end);
+	for (mr = mmr_first(start); mr && mr->mr_start < end; mr = next) {
+		next = mmr_next(mr);
+		mmr_remove(mr);
+	}
+	if ((flags & MAP_ANON) && prot == PROT_NONE) {
+		mmr_insert(start, end, MR_UNZEROED);
+	} else {
+		mmr_insert(start, end, 0);
+		if (flags & MAP_ANON)
+			memset((void *)start, 0, roundedlen);
+	}
+	rw_exit(&mmr_lock);
+
+	if ((flags & MAP_ANON) == 0)
+		error = mmapmem_readfile(fd, (void *)start, roundedlen, pos);
+	return error;
+}
+
 int
 sys_mmap(struct lwp *l, const struct sys_mmap_args *uap, register_t *retval)
 {
+	void *addr = SCARG(uap, addr);
 	size_t len = SCARG(uap, len);
 	int prot = SCARG(uap, prot);
 	int flags = SCARG(uap, flags);
 	int fd = SCARG(uap, fd);
 	off_t pos = SCARG(uap, pos);
-	struct file *fp;
-	register_t cnt;
+	struct mmapregion *mr;
 	void *v;
 	size_t roundedlen;
+	int mrflags = 0;
 	int error = 0;
 
 	MMAP_PRINTF(("-> mmap: %p %zu, 0x%x, 0x%x, %d, %" PRId64 "\n",
 	    SCARG(uap, addr), len, prot, flags, fd, pos));
 
-	if (fd != -1 && prot != PROT_READ) {
-		MMAP_PRINTF(("mmap: trying to r/w map a file. failing!\n"));
+	/* private mappings are copies anyway, shared ones we can't do */
+	if (fd != -1 && (prot & PROT_WRITE) && (flags & MAP_PRIVATE) == 0) {
+		MMAP_PRINTF(("mmap: trying to shared r/w map a file. "
+		    "failing!\n"));
 		return EOPNOTSUPP;
 	}
 
-	/* we're not going to even try */
-	if (flags & MAP_FIXED) {
-		return ENOMEM;
-	}
-
 	/* offset should be aligned to page size */
 	if ((pos & (PAGE_SIZE-1)) != 0) {
 		return EINVAL;
@@ -147,48 +640,55 @@ sys_mmap(struct lwp *l, const struct sys_mmap_args *uap, register_t *retval)
 
 	/* allocate full whatever-we-lie-to-be-pages */
 	roundedlen = roundup2(len, PAGE_SIZE);
-	if ((v = mmapmem_alloc(roundedlen)) == NULL) {
-		return ENOMEM;
-	}
+	if (roundedlen == 0)
+		return EINVAL;
 
-	*retval = (register_t)v;
+	if (flags & MAP_FIXED) {
+		error = mmap_fixed((vaddr_t)addr, roundedlen,
+		    prot, flags, fd, pos);
+		if (error == 0)
+			*retval = (register_t)addr;
+		MMAP_PRINTF(("<- mmap: %p %d\n", addr, error));
+		return error;
+	}
 
-	if (flags & MAP_ANON) {
-		memset(v, 0, roundedlen);
-		return 0;
+	if (fd != -1 && (flags & MAP_ANON) == 0 && plat_vm_reserve) {
+		error = mmap_lazy(fd, roundedlen, prot, pos, &v);
+		if (error == 0)
+			*retval = (register_t)v;
+		MMAP_PRINTF(("<- mmap: %p %d (lazy)\n", v, error));
+		return error;
 	}
 
 	/*
-	 * Ok, so we have a file-backed mapping case.
+	 * Anonymous PROT_NONE mappings are reservations, which usually
+	 * get committed piece by piece later, so zero them only once
+	 * they become accessible.
 	 */
-
-	if ((fp = fd_getfile(fd)) == NULL)
-		return EBADF;
-
-	if ((fp->f_flag & FREAD) == 0) {
-		fd_putfile(fd);
-		return EBADF;
-	}
-	if (fp->f_type != DTYPE_VNODE) {
-		fd_putfile(fd);
-		return ENODEV;
+	if ((flags & MAP_ANON) && prot != PROT_NONE) {
+		v = zpool_get(roundedlen);
+	} else {
+		v = rumpcomp_mman_pgalloc(roundedlen);
+		if (flags & MAP_ANON)
+			mrflags = MR_UNZEROED;
 	}
+	if (v == NULL)
+		return ENOMEM;
 
-	error = dofileread(fd, fp, v, roundedlen, &pos, 0, &cnt);
-	if (error) {
-		mmapmem_free(v, roundedlen);
-		return error;
-	}
+	rw_enter(&mmr_lock, RW_WRITER);
+	mr = mmr_insert((vaddr_t)v, (vaddr_t)v + roundedlen, mrflags);
+	rw_exit(&mmr_lock);
 
-	/*
-	 * Memory after the end of the object until the end of the page
-	 * should be 0-filled.  We don't really know when the object
-	 * stops (we could do a fstat(), but that's racy), so just assume
-	 * that the caller knows what her or she is doing.
-	 */
-	if ((size_t)cnt != roundedlen) {
-		KASSERT(cnt < roundedlen);
-		memset((uint8_t *)v+cnt, 0, roundedlen-cnt);
+	*retval = (register_t)v;
+
+	if ((flags & MAP_ANON) == 0) {
+		error = mmapmem_readfile(fd, v, roundedlen, pos);
+		if (error) {
+			rw_enter(&mmr_lock, RW_WRITER);
+			mmr_remove(mr);
+			rw_exit(&mmr_lock);
+			rumpcomp_mman_pgfree(v, roundedlen);
+		}
 	}
 
 	MMAP_PRINTF(("<- mmap: %p %d\n", v, error));
@@ -217,17 +717,35 @@ sys_munmap(struct lwp *l, const struct sys_munmap_args *uap, register_t *retval)
 {
 	void *addr = SCARG(uap, addr);
 	size_t len = SCARG(uap, len);
-	int rv;
+	struct mmapregion *mr, *next;
+	vaddr_t start, end;
+	int rv = 0;
 
 	MMAP_PRINTF(("-> munmap: %p, %zu\n", addr, len));
 
 	/* addr must be page-aligned */
-	if (((uintptr_t)addr & (PAGE_SIZE-1)) != 0) {
+	start = (vaddr_t)addr;
+	end = start + roundup2(len, PAGE_SIZE);
+	if ((start & (PAGE_SIZE-1)) != 0 || len == 0 || end < start) {
 		rv = EINVAL;
 		goto out;
 	}
 
-	rv =  mmapmem_free(addr, roundup2(len, PAGE_SIZE));
+	/* like before, fail if there is nothing at all to unmap */
+	rw_enter(&mmr_lock, RW_WRITER);
+	mr = mmr_first(start);
+	if (mr == NULL || mr->mr_start >= end) {
+		rw_exit(&mmr_lock);
+		rv = EINVAL;
+		goto out;
+	}
+	mmr_clip(start, end);
+	for (mr = mmr_first(start); mr && mr->mr_start < end; mr = next) {
+		next = mmr_next(mr);
+		mmr_freepages(mr);
+		mmr_remove(mr);
+	}
+	rw_exit(&mmr_lock);
 
  out:
 	MMAP_PRINTF(("<- munmap: %d\n", rv));
@@ -238,8 +756,12 @@ int
 sys_mincore(struct lwp *l, const struct sys_mincore_args *uap,
 	register_t *retval)
 {
+	vaddr_t start = (vaddr_t)SCARG(uap, addr);
 	size_t len = SCARG(uap, len);
 	char *vec = SCARG(uap, vec);
+	struct mmapregion *mr;
+	vaddr_t va, end;
+	size_t i;
 
 	/*
 	 * Questionable if we should allocate vec + copyout().
@@ -247,21 +769,115 @@ sys_mincore(struct lwp *l, const struct sys_mincore_args *uap,
 	 * this code into the wrong place.
 	 */
 	memset(vec, 0x01, (len + PAGE_SIZE - 1) / PAGE_SIZE);
+
+	/* only pages of demand-paged files may be missing */
+	start &= ~(PAGE_SIZE-1);
+	end = start + roundup2(len, PAGE_SIZE);
+	rw_enter(&mmr_lock, RW_READER);
+	for (mr = mmr_first(start); mr && mr->mr_start < end;
+	    mr = mmr_next(mr)) {
+		if ((mr->mr_flags & MR_LAZY) == 0)
+			continue;
+		for (va = MAX(mr->mr_start, start);
+		    va < MIN(mr->mr_end, end); va += PAGE_SIZE) {
+			i = (va - start) / PAGE_SIZE;
+			vec[i] = plat_vm_lookup((void *)va) != NULL;
+		}
+	}
+	rw_exit(&mmr_lock);
+
 	return 0;
 }
 
+/*
+ * Read in (MADV_WILLNEED) or throw away (MADV_DONTNEED) pages of
+ * demand-paged file mappings.  Thrown away pages are read again from
+ * the file on the next touch, which is what DONTNEED means for
+ * private mappings.  Everything else is a hint we cannot use.
+ */
+int
+sys_madvise(struct lwp *l, const struct sys_madvise_args *uap,
+	register_t *retval)
+{
+	vaddr_t start = (vaddr_t)SCARG(uap, addr);
+	size_t len = SCARG(uap, len);
+	int behav = SCARG(uap, behav);
+	struct mmapregion *mr;
+	vaddr_t end;
+	int error = 0;
+
+	if ((start & (PAGE_SIZE-1)) != 0)
+		return EINVAL;
+	end = start + roundup2(len, PAGE_SIZE);
+	if (end < start)
+		return EINVAL;
+
+	switch (behav) {
+	case MADV_WILLNEED:
+		rw_enter(&mmr_lock, RW_READER);
+		for (mr = mmr_first(start); mr && mr->mr_start < end;
+		    mr = mmr_next(mr)) {
+			if ((mr->mr_flags & MR_LAZY) == 0)
+				continue;
+			error = lazy_fill(mr, MAX(mr->mr_start, start),
+			    MIN(mr->mr_end, end));
+			if (error)
+				break;
+		}
+		rw_exit(&mmr_lock);
+		break;
+	case MADV_DONTNEED:
+		rw_enter(&mmr_lock, RW_WRITER);
+		for (mr = mmr_first(start); mr && mr->mr_start < end;
+		    mr = mmr_next(mr)) {
+			if (mr->mr_flags & MR_LAZY)
+				lazy_evict(MAX(mr->mr_start, start),
+				    MIN(mr->mr_end, end));
+		}
+		rw_exit(&mmr_lock);
+		break;
+	default:
+		break;
+	}
+
+	return error;
+}
+
 /*
  * Rest are stubs.
  */
 
 int
-sys_madvise(struct lwp *l, const struct sys_madvise_args *uap,
+sys_minherit(struct lwp *l, const struct sys_minherit_args *uap,
 	register_t *retval)
 {
 
 	return 0;
 }
 
+/*
+ * Zero the parts of [start,start+len) which were mapped PROT_NONE
+ * and have not been zeroed yet.
+ */
+static void
+mmapmem_commit(vaddr_t start, size_t len)
+{
+	struct mmapregion *mr;
+	vaddr_t end = start + len;
+
+	rw_enter(&mmr_lock, RW_WRITER);
+	mmr_clip(start, end);
+	for (mr = mmr_first(start); mr && mr->mr_start < end;
+	    mr = mmr_next(mr)) {
+		if (mr->mr_flags & MR_UNZEROED) {
+			memset((void *)mr->mr_start, 0,
+			    mr->mr_end - mr->mr_start);
+			mr->mr_flags &= ~MR_UNZEROED;
+		}
+	}
+	rw_exit(&mmr_lock);
+}
+
 int plat_mprotect(void *addr, size_t len, int prot);
 
 #pragma weak plat_mprotect
@@ -276,6 +892,8 @@ sys_mprotect(struct lwp *l, const struct sys_mprotect_args *uap, register_t *ret
         /* nothing to do */
         return 0;
     }
+	if (prot != PROT_NONE)
+		mmapmem_commit((vaddr_t)addr, roundup2(len, PAGE_SIZE));
 	if (plat_mprotect == NULL) {
 		/* There isn't an implementation */
 		return 0;
@@ -290,8 +908,7 @@ sys_mprotect(struct lwp *l, const struct sys_mprotect_args *uap, register_t *ret
 /* Note - these functions are called by matching strong aliases in
  * librumprun_base/syscall_mman.c and need to be kept in sync
  */
-__strong_alias(sys_minherit,sys_madvise);
-__strong_alias(sys_mlock,sys_madvise);
-__strong_alias(sys_mlockall,sys_madvise);
-__strong_alias(sys_munlock,sys_madvise);
-__strong_alias(sys_munlockall,sys_madvise);
+__strong_alias(sys_mlock,sys_minherit);
+__strong_alias(sys_mlockall,sys_minherit);
+__strong_alias(sys_munlock,sys_minherit);
+__strong_alias(sys_munlockall,sys_minherit);
@@ -29,7 +29,6 @@
 #include <sys/param.h>
 #include <sys/lwpctl.h>
 #include <sys/lwp.h>
-#include <sys/queue.h>
 #include <sys/time.h>
 #include <sys/tls.h>
 
@@ -46,6 +45,7 @@
 
 #include <bmk-core/core.h>
 #include <bmk-core/sched.h>
+#include <bmk-core/spinlock.h>
 
 #include <rumprun-base/makelwp.h>
 
@@ -60,12 +60,35 @@ struct rumprun_lwp {
 
 	struct lwpctl rl_lwpctl;
 	int rl_no_parking_hare;	/* a looney tunes reference ... finally! */
-
-	TAILQ_ENTRY(rumprun_lwp) rl_entries;
+				/* (an unpark not yet consumed by a park) */
 };
-static TAILQ_HEAD(, rumprun_lwp) all_lwp = TAILQ_HEAD_INITIALIZER(all_lwp);
 static __thread struct rumprun_lwp *me;
 
+/*
+ * lwpid -> lwp lookup, done by libpthread on every contended mutex
+ * and condvar handoff, so it must not depend on the number of lwps.
+ * lwpids are handed out sequentially, so the low bits hash them
+ * perfectly.  Open addressing with linear probing; the slot of an
+ * exited lwp is marked dead and reused by a later insert.  The table
+ * is rehashed, growing if needed, when live and dead slots fill half
+ * of it.  Growing happens in rumprun_makelwp() before the new lwp
+ * exists, so inserting never fails.
+ *
+ * lwps run on all CPUs, so the table and curlwpid are protected by
+ * lwptab_lock.  It is never held across a block or a rump kernel call.
+ */
+#define LWPTAB_MINSIZE 64
+static struct rumprun_lwp *lwptab_initial[LWPTAB_MINSIZE];
+static struct rumprun_lwp **lwptab = lwptab_initial;
+static unsigned int lwptab_size = LWPTAB_MINSIZE;
+static unsigned int lwptab_nlive, lwptab_nused;
+static struct rumprun_lwp lwptab_dead;
+#define LWPTAB_DEAD (&lwptab_dead)
+static struct bmk_spinlock lwptab_lock = BMK_SPINLOCK_INITIALIZER;
+
+/* how many lwps _lwp_unpark_all() wakes with one bmk_sched_wake_many() */
+#define UNPARK_BATCH 64
+
 #define FIRST_LWPID 1
 static int curlwpid = FIRST_LWPID;
 
@@ -75,6 +98,68 @@ static struct rumprun_lwp mainthread = {
 
 static void rumprun_makelwp_tramp(void *);
 
+static void
+lwptab_insert(struct rumprun_lwp *rl)
+{
+	unsigned int mask = lwptab_size-1;
+	unsigned int i;
+
+	for (i = rl->rl_lwpid & mask; ; i = (i+1) & mask) {
+		if (lwptab[i] == NULL) {
+			lwptab_nused++;
+			break;
+		}
+		if (lwptab[i] == LWPTAB_DEAD)
+			break;
+	}
+	lwptab[i] = rl;
+	lwptab_nlive++;
+}
+
+static void
+lwptab_remove(struct rumprun_lwp *rl)
+{
+	unsigned int mask = lwptab_size-1;
+	unsigned int i;
+
+	for (i = rl->rl_lwpid & mask; lwptab[i] != rl; i = (i+1) & mask)
+		assert(lwptab[i] != NULL);
+	lwptab[i] = LWPTAB_DEAD;
+	lwptab_nlive--;
+}
+
+/*
+ * Make sure there is room for one more lwp.
+ */
+static int
+lwptab_reserve(void)
+{
+	struct rumprun_lwp **oldtab;
+	unsigned int oldsize, newsize, i;
+
+	if ((lwptab_nused+1)*2 <= lwptab_size)
+		return 0;
+
+	for (newsize = LWPTAB_MINSIZE; newsize < (lwptab_nlive+1)*4;)
+		newsize *= 2;
+	oldtab = lwptab;
+	oldsize = lwptab_size;
+	if ((lwptab = calloc(newsize, sizeof(*lwptab))) == NULL) {
+		lwptab = oldtab;
+		return ENOMEM;
+	}
+	lwptab_size = newsize;
+	lwptab_nlive = lwptab_nused = 0;
+	for (i = 0; i < oldsize; i++) {
+		if (oldtab[i] != NULL && oldtab[i] != LWPTAB_DEAD)
+			lwptab_insert(oldtab[i]);
+	}
+	if (oldtab != lwptab_initial)
+		free(oldtab);
+
+	return 0;
+}
+
 static ptrdiff_t meoff;
 static void
 assignme(void *tcb, struct rumprun_lwp *value)
@@ -98,6 +183,7 @@ rumprun_makelwp(void (*start)(void *), void *arg, void *private,
 {
 	struct rumprun_lwp *rl;
 	struct lwp *curlwp, *newlwp;
+	int error;
 
 	rl = calloc(1, sizeof(*rl));
 	if (rl == NULL)
@@ -112,19 +198,33 @@ rumprun_makelwp(void (*start)(void *), void *arg, void *private,
 	newlwp = rump_pub_lwproc_curlwp();
 	rl->rl_start = start;
 	rl->rl_arg = arg;
-	rl->rl_lwpid = ++curlwpid;
-	rl->rl_thread = bmk_sched_create_withtls("lwp", rl, 0,
-	    rumprun_makelwp_tramp, newlwp, stack_base, stack_size, private);
-	if (rl->rl_thread == NULL) {
+
+	/*
+	 * The new thread may start right away on another CPU, so it
+	 * goes into lwptab before lwptab_lock is released.
+	 */
+	bmk_spin_lock(&lwptab_lock);
+	if ((error = lwptab_reserve()) == 0) {
+		rl->rl_lwpid = ++curlwpid;
+		rl->rl_thread = bmk_sched_create_withtls("lwp", rl, 0,
+		    rumprun_makelwp_tramp, newlwp, stack_base, stack_size,
+		    private);
+		if (rl->rl_thread != NULL)
+			lwptab_insert(rl);
+		else
+			error = EBUSY; /* ??? */
+	}
+	bmk_spin_unlock(&lwptab_lock);
+
+	if (error) {
 		free(rl);
 		rump_pub_lwproc_releaselwp();
 		rump_pub_lwproc_switch(curlwp);
-		return EBUSY; /* ??? */
+		return error;
 	}
 	rump_pub_lwproc_switch(curlwp);
 
 	*lid = rl->rl_lwpid;
-	TAILQ_INSERT_TAIL(&all_lwp, rl, rl_entries);
 
 	return 0;
 }
@@ -133,6 +233,10 @@ static void
 rumprun_makelwp_tramp(void *arg)
 {
 
+	/* wait until our creator has finished entering us into lwptab */
+	bmk_spin_lock(&lwptab_lock);
+	bmk_spin_unlock(&lwptab_lock);
+
 	rump_pub_lwproc_switch(arg);
 	(me->rl_start)(me->rl_arg);
 }
@@ -141,14 +245,18 @@ static struct rumprun_lwp *
 lwpid2rl(lwpid_t lid)
 {
 	struct rumprun_lwp *rl;
+	unsigned int mask, i;
 
 	if (lid == 0)
 		return &mainthread;
-	TAILQ_FOREACH(rl, &all_lwp, rl_entries) {
-		if (rl->rl_lwpid == lid)
-			return rl;
+	bmk_spin_lock(&lwptab_lock);
+	mask = lwptab_size-1;
+	for (i = lid & mask; (rl = lwptab[i]) != NULL; i = (i+1) & mask) {
+		if (rl != LWPTAB_DEAD && rl->rl_lwpid == lid)
+			break;
 	}
-	return NULL;
+	bmk_spin_unlock(&lwptab_lock);
+	return rl;
 }
 
 int
@@ -160,6 +268,8 @@ _lwp_unpark(lwpid_t lid, const void *hint)
 		return -1;
 	}
 
+	/* the target may be on its way to park on another CPU */
+	__atomic_store_n(&rl->rl_no_parking_hare, 1, __ATOMIC_RELEASE);
 	bmk_sched_wake(rl->rl_thread);
 	return 0;
 }
@@ -167,18 +277,27 @@ _lwp_unpark(lwpid_t lid, const void *hint)
 ssize_t
 _lwp_unpark_all(const lwpid_t *targets, size_t ntargets, const void *hint)
 {
+	struct bmk_thread *batch[UNPARK_BATCH];
+	struct rumprun_lwp *rl;
 	ssize_t rv;
+	int n;
 
 	if (targets == NULL)
 		return 1024;
 
 	rv = ntargets;
-	while (ntargets--) {
-		if (_lwp_unpark(*targets, NULL) != 0)
-			rv--;
-		targets++;
+	while (ntargets) {
+		for (n = 0; n < UNPARK_BATCH && ntargets; ntargets--) {
+			if ((rl = lwpid2rl(*targets++)) != NULL) {
+				__atomic_store_n(&rl->rl_no_parking_hare, 1,
+				    __ATOMIC_RELEASE);
+				batch[n++] = rl->rl_thread;
+			} else {
+				rv--;
+			}
+		}
+		bmk_sched_wake_many(batch, n);
 	}
-	//assert(rv >= 0);
 	return rv;
 }
 
@@ -214,7 +333,7 @@ rumprun_lwp_init(void)
 	assignme(tcb, &mainthread);
 	mainthread.rl_thread = bmk_sched_init_mainlwp(&mainthread);
 
-	TAILQ_INSERT_TAIL(&all_lwp, me, rl_entries);
+	lwptab_insert(me);
 }
 
 int
@@ -226,10 +345,8 @@ _lwp_park(clockid_t clock_id, int flags, const struct timespec *ts,
 	if (unpark)
 		_lwp_unpark(unpark, unparkhint);
 
-	if (me->rl_no_parking_hare) {
-		me->rl_no_parking_hare = 0;
+	if (__atomic_exchange_n(&me->rl_no_parking_hare, 0, __ATOMIC_ACQUIRE))
 		return 0;
-	}
 
 	if (ts) {
 		bmk_time_t nsecs = ts->tv_sec*1000*1000*1000 + ts->tv_nsec;
@@ -243,6 +360,14 @@ _lwp_park(clockid_t clock_id, int flags, const struct timespec *ts,
 	} else {
 		bmk_sched_blockprepare();
 	}
+
+	/*
+	 * An unpark which came in after the check above may have missed
+	 * us, since we were not blocked yet.  Check again now that a wakeup
+	 * will be noticed.
+	 */
+	if (__atomic_exchange_n(&me->rl_no_parking_hare, 0, __ATOMIC_ACQUIRE))
+		bmk_sched_wake(me->rl_thread);
 	rv = bmk_sched_block();
 	bmk_assert(rv == 0 || rv == ETIMEDOUT);
 
@@ -259,7 +384,9 @@ _lwp_exit(void)
 
 	me->rl_lwpctl.lc_curcpu = LWPCTL_CPU_EXITED;
 	rump_pub_lwproc_releaselwp();
-	TAILQ_REMOVE(&all_lwp, me, rl_entries);
+	bmk_spin_lock(&lwptab_lock);
+	lwptab_remove(me);
+	bmk_spin_unlock(&lwptab_lock);
 
 	/* could just assign it here, but for symmetry! */
 	assignme(bmk_sched_gettcb(), NULL);
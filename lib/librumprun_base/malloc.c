@@ -71,3 +71,12 @@ free(void *cp)
 
 	bmk_memfree(cp, BMK_MEMWHO_USER);
 }
+
+/* XXX: not declared in the NetBSD headers we build against */
+size_t malloc_usable_size(const void *);
+size_t
+malloc_usable_size(const void *cp)
+{
+
+	return bmk_memalloc_usable(__UNCONST(cp), BMK_MEMWHO_USER);
+}
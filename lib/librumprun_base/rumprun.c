@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sched.h>
@@ -46,6 +47,8 @@
 #include <fs/tmpfs/tmpfs_args.h>
 
 #include <bmk-core/platform.h>
+#include <bmk-core/sched.h>
+#include <bmk-core/trace.h>
 
 #include <rumprun-base/rumprun.h>
 #include <rumprun-base/config.h>
@@ -102,7 +105,7 @@ rumprun_boot(struct rumprun_boot_config *config)
 		.ta_root_mode = 01777,
 	};
 	int tmpfserrno;
-	char *sysproxy;
+	char *sysproxy, *quantum;
 	int rv, x;
 
 	rump_boot_setsigmodel(RUMP_SIGMODEL_IGNORE);
@@ -155,6 +158,10 @@ rumprun_boot(struct rumprun_boot_config *config)
 		printf("sysproxy listening at: %s\n", sysproxy);
 	}
 
+	/* time slice for application threads in milliseconds, 0 for none */
+	if ((quantum = getenv("RUMPRUN_SCHED_QUANTUM")) != NULL)
+		bmk_sched_setquantum(strtoull(quantum, NULL, 10)*1000*1000);
+
 	/*
 	 * give all threads a chance to run, and ensure that the main
 	 * thread has gone through a context switch
@@ -383,9 +390,112 @@ rumprun_daemon(void)
 	pthread_mutex_unlock(&w_mtx);
 }
 
+static void
+tracewrite(void *arg, const char *buf, unsigned long len)
+{
+	int fd = *(int *)arg;
+
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Dump the event trace buffer to the file "path", or to the
+ * console if path is NULL or "-".  The output is converted to
+ * Chrome trace JSON on the host with rumptrace2json.
+ */
+int
+rumprun_trace_dump(const char *path)
+{
+#ifdef BMK_TRACE
+	int fd, rv;
+
+	if (path == NULL || strcmp(path, "-") == 0) {
+		rv = bmk_trace_dump(NULL, NULL);
+	} else {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+			return -1;
+		rv = bmk_trace_dump(tracewrite, &fd);
+		close(fd);
+	}
+	if (rv) {
+		errno = rv;
+		return -1;
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Dump the CPU accounting counters to the file "path", or to the
+ * console if path is NULL or "-".  One "name = value" per line.
+ */
+int
+rumprun_acct_dump(const char *path)
+{
+	int fd, rv;
+
+	if (path == NULL || strcmp(path, "-") == 0) {
+		rv = bmk_sched_acct_dump(NULL, NULL);
+	} else {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+			return -1;
+		rv = bmk_sched_acct_dump(tracewrite, &fd);
+		close(fd);
+	}
+	if (rv) {
+		errno = rv;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Dump the per-interrupt counters of the platform to the file "path",
+ * or to the console if path is NULL or "-".  Same format as
+ * rumprun_acct_dump().
+ */
+int
+rumprun_intr_dump(const char *path)
+{
+	int fd, rv;
+
+	if (path == NULL || strcmp(path, "-") == 0) {
+		rv = bmk_platform_intr_dump(NULL, NULL);
+	} else {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+			return -1;
+		rv = bmk_platform_intr_dump(tracewrite, &fd);
+		close(fd);
+	}
+	if (rv) {
+		errno = rv;
+		return -1;
+	}
+	return 0;
+}
+
 void __attribute__((noreturn))
 rumprun_reboot(void)
 {
+	const char *tracedump, *acctdump, *intrdump;
+
+	/* dump the trace buffer and the counters on exit if requested */
+	if ((tracedump = getenv("RUMPRUN_TRACEDUMP")) != NULL)
+		rumprun_trace_dump(tracedump);
+	if ((acctdump = getenv("RUMPRUN_ACCTDUMP")) != NULL)
+		rumprun_acct_dump(acctdump);
+	if ((intrdump = getenv("RUMPRUN_INTRDUMP")) != NULL)
+		rumprun_intr_dump(intrdump);
 
 	_netbsd_userlevel_fini();
 	rump_sys_reboot(0, 0);
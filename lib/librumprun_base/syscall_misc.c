@@ -25,6 +25,8 @@
 
 #include <sys/cdefs.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/syscallargs.h>
 #include <sys/time.h>
 
 #include <errno.h>
@@ -38,8 +40,21 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <bmk-core/sched.h>
+
 #include <rumprun-base/rumprun.h>
 
+/* XXX */
+int	rump_syscall(int, void *, size_t, register_t *);
+
+#if     BYTE_ORDER == BIG_ENDIAN
+#define SPARG(p,k)      ((p)->k.be.datum)
+#else /* LITTLE_ENDIAN, I hope dearly */
+#define SPARG(p,k)      ((p)->k.le.datum)
+#endif
+
+#define NSEC_PER_SEC 1000000000LL
+
 void __dead
 _exit(int eval)
 {
@@ -79,29 +94,98 @@ ____sigtimedwait50(const sigset_t *set, siginfo_t *info,
 	return -1;
 }
 
+/*
+ * CPU time of the whole guest, which is all one process.  Time spent
+ * in application threads is user time, the rest of the non-idle time
+ * (rump kernel threads, interrupts) is system time.
+ */
+static void
+cputime(bmk_time_t *utime, bmk_time_t *stime, struct rusage *usage)
+{
+	struct bmk_sched_cpustat bcs;
+	int cpu, pri;
+
+	*utime = *stime = 0;
+	for (cpu = 0; cpu < bmk_sched_ncpu(); cpu++) {
+		bmk_sched_cpustat(cpu, &bcs);
+		for (pri = 0; pri < BMK_SCHED_NPRI; pri++) {
+			if (pri == BMK_SCHED_PRI_USER)
+				*utime += bcs.bcs_runtime[pri];
+			else
+				*stime += bcs.bcs_runtime[pri];
+		}
+		if (usage) {
+			usage->ru_nvcsw += bcs.bcs_nvcsw;
+			usage->ru_nivcsw += bcs.bcs_nivcsw;
+		}
+	}
+}
+
 /* XXX: manual proto.  plug into libc internals some other day */
 int __getrusage50(int, struct rusage *);
 int
 __getrusage50(int who, struct rusage *usage)
 {
+	bmk_time_t utime, stime;
 
-	/* We fake something.  We should query the scheduler some day */
 	memset(usage, 0, sizeof(*usage));
-	if (who == RUSAGE_SELF) {
-		usage->ru_utime.tv_sec = 1;
-		usage->ru_utime.tv_usec = 1;
-		usage->ru_stime.tv_sec = 1;
-		usage->ru_stime.tv_usec = 1;
+	switch (who) {
+	case RUSAGE_SELF:
+		break;
+	case RUSAGE_CHILDREN:
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
 	}
 
-	usage->ru_maxrss = 1024;
-	usage->ru_ixrss = 1024;
-	usage->ru_idrss = 1024;
-	usage->ru_isrss = 1024;
+	cputime(&utime, &stime, usage);
+	usage->ru_utime.tv_sec = utime / NSEC_PER_SEC;
+	usage->ru_utime.tv_usec = (utime % NSEC_PER_SEC) / 1000;
+	usage->ru_stime.tv_sec = stime / NSEC_PER_SEC;
+	usage->ru_stime.tv_usec = (stime % NSEC_PER_SEC) / 1000;
+
+	return 0;
+}
+
+/*
+ * The rump kernel does not know how much CPU time anything took,
+ * so answer the CPU time clocks here and pass the rest on.
+ */
+/* XXX: manual proto, as above */
+int __clock_gettime50(clockid_t, struct timespec *);
+int
+__clock_gettime50(clockid_t clock_id, struct timespec *ts)
+{
+	struct sys___clock_gettime50_args callarg;
+	struct bmk_sched_threadstat bts;
+	register_t retval[2];
+	bmk_time_t t, utime, stime;
+	int error;
 
-	usage->ru_nvcsw = 1;
-	usage->ru_nivcsw = 1;
+	switch (clock_id) {
+	case CLOCK_THREAD_CPUTIME_ID:
+		bmk_sched_threadstat(bmk_current, &bts);
+		t = bts.bts_runtime;
+		break;
+	case CLOCK_PROCESS_CPUTIME_ID:
+		cputime(&utime, &stime, NULL);
+		t = utime + stime;
+		break;
+	default:
+		memset(&callarg, 0, sizeof(callarg));
+		SPARG(&callarg, clock_id) = clock_id;
+		SPARG(&callarg, tp) = ts;
+		error = rump_syscall(SYS___clock_gettime50,
+		    &callarg, sizeof(callarg), retval);
+		if (error) {
+			errno = error;
+			return -1;
+		}
+		return 0;
+	}
 
-	/* XXX: wrong in many ways */
-	return ENOTSUP;
+	ts->tv_sec = t / NSEC_PER_SEC;
+	ts->tv_nsec = t % NSEC_PER_SEC;
+	return 0;
 }
@@ -156,19 +156,38 @@ mprotect(void *addr, size_t len, int prot)
 	return -1;
 }
 
+int
+madvise(void *addr, size_t len, int adv)
+{
+	struct sys_madvise_args callarg;
+	register_t retval[2];
+	int error;
+
+	memset(&callarg, 0, sizeof(callarg));
+	SPARG(&callarg, addr) = addr;
+	SPARG(&callarg, len) = len;
+	SPARG(&callarg, behav) = adv;
+
+	error = rump_syscall(SYS_madvise, &callarg, sizeof(callarg), retval);
+	errno = error;
+	if (error == 0) {
+		return 0;
+	}
+	return -1;
+}
+
 /*
  * We "know" that the following are stubs also in the kernel.  Risk of
  * them going out-of-sync is quite minimal ...
  */
 
 int
-madvise(void *addr, size_t len, int adv)
+minherit(void *addr, size_t len, int inherit)
 {
 
 	return 0;
 }
-__strong_alias(minherit,madvise);
-__strong_alias(mlock,madvise);
-__strong_alias(mlockall,madvise);
-__strong_alias(munlock,madvise);
-__strong_alias(munlockall,madvise);
+__strong_alias(mlock,minherit);
+__strong_alias(mlockall,minherit);
+__strong_alias(munlock,minherit);
+__strong_alias(munlockall,minherit);
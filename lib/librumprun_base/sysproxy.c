@@ -41,6 +41,7 @@ __RCSID("$NetBSD: rumpuser_sp.c,v 1.68 2014/12/08 00:12:03 justin Exp $");
 #endif /* !lint */
 
 #include <sys/types.h>
+#include <sys/event.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 
@@ -63,6 +64,8 @@ __RCSID("$NetBSD: rumpuser_sp.c,v 1.68 2014/12/08 00:12:03 justin Exp $");
 #define LIBRUMPUSER /* XXX */
 #include <rump/rumpuser.h>
 
+#include <rumprun-base/sysproxy_shm.h>
+
 extern struct rumpuser_hyperup rumpuser__hyp;
 
 static inline void
@@ -130,6 +133,7 @@ rumpkern_sched(int nlocks, void *interlock)
 #include <limits.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -182,7 +186,8 @@ enum {	RUMPSP_HANDSHAKE,
 	RUMPSP_COPYOUT, RUMPSP_COPYOUTSTR,
 	RUMPSP_ANONMMAP,
 	RUMPSP_PREFORK,
-	RUMPSP_RAISE };
+	RUMPSP_RAISE,
+	RUMPSP_BATCH };
 
 enum { HANDSHAKE_GUEST, HANDSHAKE_AUTH, HANDSHAKE_FORK, HANDSHAKE_EXEC };
 
@@ -280,11 +285,15 @@ struct respwait {
 };
 
 struct prefork;
+struct spshm;
 struct spclient {
 	int spc_fd;
 	int spc_refcnt;
 	int spc_state;
 
+	/* set if the client talks to us over shared memory */
+	struct spshm *spc_shm;
+
 	pthread_mutex_t spc_mtx;
 	pthread_cond_t spc_cv;
 
@@ -379,6 +388,160 @@ sendunlock(struct spclient *spc)
 	pthread_mutex_unlock(&spc->spc_mtx);
 }
 
+/*
+ * Shared memory transport.  The two rings in the shared region
+ * behave like the two directions of a nonblocking stream socket,
+ * so the framing code does not care which transport it runs over.
+ * The fields we depend on for bounds checking are copied out of
+ * the shared header when it is set up, since the client could
+ * change them under us.
+ */
+struct spshm {
+	struct rumprun_spshm *ss_hdr;
+	uint8_t *ss_base;
+	size_t ss_len;
+
+	uint8_t *ss_req, *ss_resp;
+	uint64_t ss_ringsize;
+	uint64_t ss_arenaoff, ss_arenasize;
+	uint64_t ss_clientbase;
+
+	/* poller tells the server loop about activity via this pipe */
+	int ss_kickfd[2];
+	int ss_kicked;
+	int ss_discoseen;
+};
+
+/* header page, the two rings and at least a page of arena */
+#define SHM_HDRSIZE	4096
+#define SHM_MINSIZE	(SHM_HDRSIZE + 2*RUMPRUN_SPSHM_RINGSIZE + 4096)
+
+static int
+shm_dead(struct spshm *ss)
+{
+
+	return ss->ss_hdr->sh_state != RUMPRUN_SPSHM_CONNECTED;
+}
+
+static ssize_t
+shm_read(struct spshm *ss, void *buf, size_t len)
+{
+	struct rumprun_spshm_ring *r = &ss->ss_hdr->sh_req;
+	uint64_t head, tail, off;
+	size_t n, chunk;
+
+	head = __atomic_load_n(&r->sr_head, __ATOMIC_ACQUIRE);
+	tail = r->sr_tail;
+	if (head - tail > ss->ss_ringsize) {
+		/* client scribbled over the ring */
+		return 0;
+	}
+	if (head == tail) {
+		if (shm_dead(ss))
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	n = len < head - tail ? len : head - tail;
+	off = tail & (ss->ss_ringsize-1);
+	chunk = n < ss->ss_ringsize - off ? n : ss->ss_ringsize - off;
+	memcpy(buf, ss->ss_req + off, chunk);
+	memcpy((uint8_t *)buf + chunk, ss->ss_req, n - chunk);
+	__atomic_store_n(&r->sr_tail, tail + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static ssize_t
+shm_sendmsg(struct spshm *ss, const struct msghdr *msg)
+{
+	struct rumprun_spshm_ring *r = &ss->ss_hdr->sh_resp;
+	uint64_t head, tail, off;
+	size_t space, n, chunk, total = 0;
+	int i;
+
+	if (shm_dead(ss)) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	head = r->sr_head;
+	tail = __atomic_load_n(&r->sr_tail, __ATOMIC_ACQUIRE);
+	if (head - tail > ss->ss_ringsize) {
+		errno = EPIPE;
+		return -1;
+	}
+	space = ss->ss_ringsize - (head - tail);
+	for (i = 0; i < msg->msg_iovlen && space > 0; i++) {
+		const uint8_t *p = msg->msg_iov[i].iov_base;
+
+		n = msg->msg_iov[i].iov_len;
+		if (n > space)
+			n = space;
+		off = (head + total) & (ss->ss_ringsize-1);
+		chunk = n < ss->ss_ringsize - off ? n : ss->ss_ringsize - off;
+		memcpy(ss->ss_resp + off, p, chunk);
+		memcpy(ss->ss_resp, p + chunk, n - chunk);
+		total += n;
+		space -= n;
+	}
+	if (total == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	__atomic_store_n(&r->sr_head, head + total, __ATOMIC_RELEASE);
+
+	return total;
+}
+
+/* wait for the client to make room in the response ring */
+static void
+shm_wait(struct spshm *ss)
+{
+
+	sched_yield();
+}
+
+static ssize_t
+spread(struct spclient *spc, void *buf, size_t len)
+{
+
+	if (spc->spc_shm)
+		return shm_read(spc->spc_shm, buf, len);
+	return host_read(spc->spc_fd, buf, len);
+}
+
+static void
+spcshutdown(struct spclient *spc)
+{
+
+	if (spc->spc_shm)
+		spc->spc_shm->ss_hdr->sh_state = RUMPRUN_SPSHM_DISCONNECT;
+	else
+		shutdown(spc->spc_fd, SHUT_RDWR);
+}
+
+/*
+ * If the client range [raddr, raddr+len) is within the shared data
+ * arena, return our address for it.  Else NULL.
+ */
+static void *
+shm_arenaaddr(struct spclient *spc, const void *raddr, size_t len)
+{
+	struct spshm *ss = spc->spc_shm;
+	uint64_t start, ra = (uintptr_t)raddr;
+
+	if (ss == NULL)
+		return NULL;
+
+	start = ss->ss_clientbase + ss->ss_arenaoff;
+	if (ra < start || ra - start > ss->ss_arenasize
+	    || len > ss->ss_arenasize - (ra - start))
+		return NULL;
+	return ss->ss_base + ss->ss_arenaoff + (ra - start);
+}
+
 static int
 dosend(struct spclient *spc, struct iovec *iov, size_t iovlen)
 {
@@ -399,7 +562,9 @@ dosend(struct spclient *spc, struct iovec *iov, size_t iovlen)
 
 	for (;;) {
 		/* not first round?  poll */
-		if (n) {
+		if (n && spc->spc_shm) {
+			shm_wait(spc->spc_shm);
+		} else if (n) {
 			if (host_poll(&pfd, 1, INFTIM) == -1) {
 				if (errno == EINTR)
 					continue;
@@ -410,7 +575,10 @@ dosend(struct spclient *spc, struct iovec *iov, size_t iovlen)
 
 		msg.msg_iov = iov;
 		msg.msg_iovlen = iovlen;
-		n = host_sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (spc->spc_shm)
+			n = shm_sendmsg(spc->spc_shm, &msg);
+		else
+			n = host_sendmsg(fd, &msg, MSG_NOSIGNAL);
 		if (n == -1)  {
 			if (errno == EPIPE)
 				error = ENOTCONN;
@@ -555,7 +723,6 @@ kickall(struct spclient *spc)
 static int
 readframe(struct spclient *spc)
 {
-	int fd = spc->spc_fd;
 	size_t left;
 	size_t framelen;
 	ssize_t n;
@@ -567,7 +734,7 @@ readframe(struct spclient *spc)
 
 		left = HDRSZ - spc->spc_off;
 		/*LINTED: cast ok */
-		n = host_read(fd, (uint8_t*)&spc->spc_hdr + spc->spc_off, left);
+		n = spread(spc, (uint8_t*)&spc->spc_hdr + spc->spc_off, left);
 		if (n == 0) {
 			return -1;
 		}
@@ -610,7 +777,7 @@ readframe(struct spclient *spc)
 
 	if (left == 0)
 		return 1;
-	n = host_read(fd, spc->spc_buf + (spc->spc_off - HDRSZ), left);
+	n = spread(spc, spc->spc_buf + (spc->spc_off - HDRSZ), left);
 	if (n == 0) {
 		return -1;
 	}
@@ -791,6 +958,41 @@ unix_cleanup(struct sockaddr *sa)
 	}
 }
 
+static struct spshm spshm;
+
+/*
+ * shm://<addr>,<size>, where the region is already mapped at addr
+ * in our address space.
+ */
+/*ARGSUSED*/
+static int
+shm_parse(const char *addr, struct sockaddr **sa, int allow_wildcard)
+{
+	unsigned long long base, len;
+	char *ep;
+
+	errno = 0;
+	base = strtoull(addr, &ep, 0);
+	if (errno || *ep != ',') {
+		fprintf(stderr, "rump_sp_shm: cannot parse address: %s\n", addr);
+		return EINVAL;
+	}
+	len = strtoull(ep+1, &ep, 0);
+	if (errno || *ep != '\0' || len == 0) {
+		fprintf(stderr, "rump_sp_shm: cannot parse size: %s\n", addr);
+		return EINVAL;
+	}
+	if (len < SHM_MINSIZE || len > SIZE_MAX || base > UINTPTR_MAX - len) {
+		fprintf(stderr, "rump_sp_shm: invalid region: %s\n", addr);
+		return EINVAL;
+	}
+
+	spshm.ss_base = (void *)(uintptr_t)base;
+	spshm.ss_len = len;
+	*sa = NULL;
+	return 0;
+}
+
 /*ARGSUSED*/
 static int
 notsupp(void)
@@ -822,6 +1024,8 @@ static struct {
 	{ "tcp6", PF_INET6, sizeof(struct sockaddr_in6),
 	    (addrparse_fn)notsupp, (connecthook_fn)success,
 	    (cleanup_fn)success },
+	{ "shm", PF_UNSPEC, 0,
+	    shm_parse, (connecthook_fn)success, (cleanup_fn)success },
 };
 #define NPARSE (sizeof(parsetab)/sizeof(parsetab[0]))
 
@@ -884,15 +1088,20 @@ parseurl(const char *url, struct sockaddr **sap, unsigned *idxp,
 int rumpsp_maxworker = MAXWORKER;
 int rumpsp_idleworker = IDLEWORKER;
 
-static struct pollfd pfdlist[MAXCLI];
+/* how many kevents to fetch per round in the server loop */
+#define NEVENTS 32
+
+static int spkq = -1;
+static unsigned spshmidx;
 static struct spclient spclist[MAXCLI];
 static unsigned int disco;
 static volatile int spfini;
 
 static char banner[MAXBANNER];
 
+/* minor 5: RUMPSP_BATCH */
 #define PROTOMAJOR 0
-#define PROTOMINOR 4
+#define PROTOMINOR 5
 
 
 /* how to use atomic ops on Linux? */
@@ -1357,6 +1566,13 @@ spcrelease(struct spclient *spc)
 	spc->spc_fd = -1;
 	spc->spc_state = SPCSTATE_NEW;
 
+	/* ready for the next shared memory client */
+	if (spc->spc_shm) {
+		__atomic_store_n(&spc->spc_shm->ss_hdr->sh_state,
+		    RUMPRUN_SPSHM_IDLE, __ATOMIC_RELEASE);
+		spc->spc_shm = NULL;
+	}
+
 	signaldisco();
 }
 
@@ -1364,12 +1580,19 @@ static void
 serv_handledisco(unsigned int idx)
 {
 	struct spclient *spc = &spclist[idx];
+	struct kevent kev;
 	int dolwpexit;
 
 	DPRINTF(("rump_sp: disconnecting [%u]\n", idx));
 
-	pfdlist[idx].fd = -1;
-	pfdlist[idx].revents = 0;
+	if (spc->spc_shm) {
+		spcshutdown(spc);
+		spshmidx = 0;
+	}
+
+	/* the descriptor stays open until the last reference is gone */
+	EV_SET(&kev, spc->spc_fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+	(void)kevent(spkq, &kev, 1, NULL, 0, NULL);
 	pthread_mutex_lock(&spc->spc_mtx);
 	spc->spc_state = SPCSTATE_DYING;
 	kickall(spc);
@@ -1405,7 +1628,7 @@ serv_shutdown(void)
 		if (spc->spc_fd == -1)
 			continue;
 
-		shutdown(spc->spc_fd, SHUT_RDWR);
+		spcshutdown(spc);
 		serv_handledisco(i);
 
 		spcrelease(spc);
@@ -1416,6 +1639,7 @@ static unsigned
 serv_handleconn(int fd, connecthook_fn connhook, int busy)
 {
 	struct sockaddr_storage ss;
+	struct kevent kev;
 	socklen_t sl = sizeof(ss);
 	int newfd, flags;
 	unsigned i;
@@ -1450,7 +1674,8 @@ serv_handleconn(int fd, connecthook_fn connhook, int busy)
 
 	/* find empty slot the simple way */
 	for (i = 0; i < MAXCLI; i++) {
-		if (pfdlist[i].fd == -1 && spclist[i].spc_state == SPCSTATE_NEW)
+		if (spclist[i].spc_fd == -1
+		    && spclist[i].spc_state == SPCSTATE_NEW)
 			break;
 	}
 
@@ -1465,7 +1690,12 @@ serv_handleconn(int fd, connecthook_fn connhook, int busy)
 	if (i == MAXCLI)
 		abort();
 
-	pfdlist[i].fd = newfd;
+	EV_SET(&kev, newfd, EVFILT_READ, EV_ADD, 0, 0, (intptr_t)i);
+	if (kevent(spkq, &kev, 1, NULL, 0, NULL) == -1) {
+		close(newfd);
+		return 0;
+	}
+
 	spclist[i].spc_fd = newfd;
 	spclist[i].spc_istatus = SPCSTATUS_BUSY; /* dedicated receiver */
 	spclist[i].spc_refcnt = 1;
@@ -1541,13 +1771,114 @@ struct servbouncearg {
 	struct rsp_hdr sba_hdr;
 	enum sbatype sba_type;
 	uint8_t *sba_data;
+};
 
-	TAILQ_ENTRY(servbouncearg) sba_entries;
+/*
+ * Bounded lock-free queue of work items.  Every slot carries a
+ * sequence number which tells producers and consumers whether the
+ * slot is theirs to use on the current lap around the ring, so
+ * neither side ever takes a lock.  The design is Dmitry Vyukov's
+ * bounded MPMC queue.
+ */
+#define SPQ_SIZE 512 /* power of two */
+
+struct spqslot {
+	unsigned long sq_seq;
+	struct servbouncearg *sq_sba;
+};
+
+struct spqueue {
+	struct spqslot spq_slot[SPQ_SIZE];
+	unsigned long spq_head __aligned(64);
+	unsigned long spq_tail __aligned(64);
 };
+
+static void
+spq_init(struct spqueue *q)
+{
+	unsigned long i;
+
+	for (i = 0; i < SPQ_SIZE; i++)
+		q->spq_slot[i].sq_seq = i;
+	q->spq_head = q->spq_tail = 0;
+}
+
+static int
+spq_put(struct spqueue *q, struct servbouncearg *sba)
+{
+	struct spqslot *slot;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->spq_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &q->spq_slot[pos & (SPQ_SIZE-1)];
+		seq = __atomic_load_n(&slot->sq_seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->spq_tail, &pos,
+			    pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&q->spq_tail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->sq_sba = sba;
+	__atomic_store_n(&slot->sq_seq, pos+1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static struct servbouncearg *
+spq_get(struct spqueue *q)
+{
+	struct servbouncearg *sba;
+	struct spqslot *slot;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->spq_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &q->spq_slot[pos & (SPQ_SIZE-1)];
+		seq = __atomic_load_n(&slot->sq_seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - (pos+1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->spq_head, &pos,
+			    pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->spq_head, __ATOMIC_RELAXED);
+		}
+	}
+	sba = slot->sq_sba;
+	__atomic_store_n(&slot->sq_seq, pos+SPQ_SIZE, __ATOMIC_RELEASE);
+
+	return sba;
+}
+
+/*
+ * All work items are preallocated and circulate between the free
+ * queue and the work queue, so the work queue can never overflow.
+ * The server thread is the only one which starts workers.  Workers
+ * are never torn down; they sleep on sbacv when there is nothing
+ * to do.
+ *
+ * idleworker counts the sleeping workers which nobody has yet
+ * signalled for a request.  schedulework() takes one off the count
+ * when it signals, so a burst of requests larger than the number of
+ * sleepers starts new workers instead of waiting for sleepers that
+ * are already spoken for.  nwakeup counts signals not yet consumed.
+ * Both are protected by sbamtx; idleworker is also read without it.
+ */
+static struct servbouncearg sbapool[SPQ_SIZE];
+static struct spqueue sbafree, sbawork;
 static pthread_mutex_t sbamtx;
 static pthread_cond_t sbacv;
-static int nworker, idleworker, nwork;
-static TAILQ_HEAD(, servbouncearg) wrklist = TAILQ_HEAD_INITIALIZER(wrklist);
+static int nworker, idleworker, nwakeup;
 
 /*ARGSUSED*/
 static void *
@@ -1556,23 +1887,22 @@ serv_workbouncer(void *arg)
 	struct servbouncearg *sba;
 
 	for (;;) {
-		pthread_mutex_lock(&sbamtx);
-		if (__predict_false(idleworker - nwork >= rumpsp_idleworker)) {
-			nworker--;
+		if (__predict_false((sba = spq_get(&sbawork)) == NULL)) {
+			/*
+			 * Advertise ourselves as idle before the final
+			 * check so that schedulework() cannot miss us.
+			 */
+			pthread_mutex_lock(&sbamtx);
+			__atomic_add_fetch(&idleworker, 1, __ATOMIC_SEQ_CST);
+			while ((sba = spq_get(&sbawork)) == NULL)
+				pthread_cond_wait(&sbacv, &sbamtx);
+			if (nwakeup > 0)
+				nwakeup--;
+			else
+				__atomic_sub_fetch(&idleworker, 1,
+				    __ATOMIC_SEQ_CST);
 			pthread_mutex_unlock(&sbamtx);
-			break;
 		}
-		idleworker++;
-		while (TAILQ_EMPTY(&wrklist)) {
-			_DIAGASSERT(nwork == 0);
-			pthread_cond_wait(&sbacv, &sbamtx);
-		}
-		idleworker--;
-
-		sba = TAILQ_FIRST(&wrklist);
-		TAILQ_REMOVE(&wrklist, sba, sba_entries);
-		nwork--;
-		pthread_mutex_unlock(&sbamtx);
 
 		if (__predict_true(sba->sba_type == SBA_SYSCALL)) {
 			serv_handlesyscall(sba->sba_spc,
@@ -1584,19 +1914,52 @@ serv_workbouncer(void *arg)
 		}
 		spcrelease(sba->sba_spc);
 		free(sba->sba_data);
-		free(sba);
+		if (!spq_put(&sbafree, sba))
+			abort();
 	}
 
 	return NULL;
 }
 
+/*
+ * Length of a string in the arena, looking at most max bytes and not
+ * past the end of the arena.  Returns ENAMETOOLONG or EFAULT,
+ * respectively, if there is no terminating NUL within those bounds.
+ */
+static int
+ss_strnlen(struct spshm *ss, const uint8_t *p, size_t max, size_t *lenp)
+{
+	const uint8_t *end = ss->ss_base + ss->ss_arenaoff + ss->ss_arenasize;
+	size_t avail = end - p, l;
+
+	l = strnlen((const char *)p, max < avail ? max : avail);
+	if (l == max)
+		return ENAMETOOLONG;
+	if (l == avail)
+		return EFAULT;
+	*lenp = l;
+	return 0;
+}
+
 static int
 sp_copyin(void *arg, const void *raddr, void *laddr, size_t *len, int wantstr)
 {
 	struct spclient *spc = arg;
 	void *rdata = NULL; /* XXXuninit */
+	uint8_t *p;
+	size_t l;
 	int rv, nlocks;
 
+	if ((p = shm_arenaaddr(spc, raddr, wantstr ? 1 : *len)) != NULL) {
+		if (wantstr) {
+			if ((rv = ss_strnlen(spc->spc_shm, p, *len, &l)) != 0)
+				return rv;
+			*len = l+1;
+		}
+		memcpy(laddr, p, *len);
+		return 0;
+	}
+
 	rumpkern_unsched(&nlocks, NULL);
 
 	rv = copyin_req(spc, raddr, len, wantstr, &rdata);
@@ -1635,8 +1998,14 @@ static int
 sp_copyout(void *arg, const void *laddr, void *raddr, size_t dlen)
 {
 	struct spclient *spc = arg;
+	void *p;
 	int nlocks, rv;
 
+	if ((p = shm_arenaaddr(spc, raddr, dlen)) != NULL) {
+		memcpy(p, laddr, dlen);
+		return 0;
+	}
+
 	rumpkern_unsched(&nlocks, NULL);
 	rv = send_copyout_req(spc, raddr, laddr, dlen);
 	rumpkern_sched(nlocks, NULL);
@@ -1707,23 +2076,29 @@ rumpuser_sp_raise(void *arg, int signo)
 }
 
 static pthread_attr_t pattr_detached;
+
+static int
+startworker(void)
+{
+	pthread_t pt;
+
+	if (pthread_create(&pt, &pattr_detached, serv_workbouncer, NULL) != 0)
+		return 0;
+	nworker++;
+	return 1;
+}
+
 static void
 schedulework(struct spclient *spc, enum sbatype sba_type)
 {
 	struct servbouncearg *sba;
-	pthread_t pt;
-	uint64_t reqno;
-	int retries = 0;
+	int signalled = 0;
 
-	reqno = spc->spc_hdr.rsp_reqno;
-	while ((sba = malloc(sizeof(*sba))) == NULL) {
-		if (nworker == 0 || retries > 10) {
-			send_error_resp(spc, reqno, RUMPSP_ERR_TRYAGAIN);
-			spcfreebuf(spc);
-			return;
-		}
-		/* slim chance of more memory? */
-		usleep(10000);
+	if ((sba = spq_get(&sbafree)) == NULL) {
+		send_error_resp(spc, spc->spc_hdr.rsp_reqno,
+		    RUMPSP_ERR_TRYAGAIN);
+		spcfreebuf(spc);
+		return;
 	}
 
 	sba->sba_spc = spc;
@@ -1734,24 +2109,75 @@ schedulework(struct spclient *spc, enum sbatype sba_type)
 
 	spcref(spc);
 
-	pthread_mutex_lock(&sbamtx);
-	TAILQ_INSERT_TAIL(&wrklist, sba, sba_entries);
-	nwork++;
-	if (nwork <= idleworker) {
-		/* do we have a daemon's tool (i.e. idle threads)? */
-		pthread_cond_signal(&sbacv);
-	} else if (nworker < rumpsp_maxworker) {
+	if (!spq_put(&sbawork, sba))
+		abort();
+
+	/* pairs with the idle announcement in serv_workbouncer() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&idleworker, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&sbamtx);
+		if (idleworker > 0) {
+			__atomic_sub_fetch(&idleworker, 1, __ATOMIC_SEQ_CST);
+			nwakeup++;
+			pthread_cond_signal(&sbacv);
+			signalled = 1;
+		}
+		pthread_mutex_unlock(&sbamtx);
+	}
+	if (!signalled && nworker < rumpsp_maxworker) {
 		/*
-		 * Else, need to create one
-		 * (if we can, otherwise just expect another
-		 * worker to pick up the syscall)
+		 * Everyone is busy or already woken for an earlier
+		 * request, possibly blocked in a syscall waiting for
+		 * a request that is behind this one.
+		 * Grow the pool if we can, otherwise just expect
+		 * an existing worker to pick up the request.
 		 */
-		if (pthread_create(&pt, &pattr_detached,
-		    serv_workbouncer, NULL) == 0) {
-			nworker++;
+		(void)startworker();
+	}
+}
+
+/*
+ * A batch frame carries several complete syscall request frames
+ * back to back.  Take them apart and schedule each one as if it had
+ * arrived on its own.  The responses are sent individually.
+ */
+static void
+serv_handlebatch(struct spclient *spc)
+{
+	struct rsp_hdr rhdr;
+	uint8_t *batch = spc->spc_buf;
+	size_t len = spc->spc_off - HDRSZ;
+	size_t off, datalen;
+
+	spcresetbuf(spc);
+	for (off = 0; off + HDRSZ <= len; off += rhdr.rsp_len) {
+		memcpy(&rhdr, batch + off, HDRSZ);
+		if (rhdr.rsp_len < HDRSZ || rhdr.rsp_len > len - off) {
+			send_error_resp(spc, rhdr.rsp_reqno,
+			    RUMPSP_ERR_MALFORMED_REQUEST);
+			break;
+		}
+		if (rhdr.rsp_class != RUMPSP_REQ
+		    || rhdr.rsp_type != RUMPSP_SYSCALL) {
+			send_error_resp(spc, rhdr.rsp_reqno,
+			    RUMPSP_ERR_MALFORMED_REQUEST);
+			continue;
 		}
+
+		spc->spc_hdr = rhdr;
+		datalen = rhdr.rsp_len - HDRSZ;
+		if (datalen) {
+			if ((spc->spc_buf = malloc(datalen)) == NULL) {
+				send_error_resp(spc, rhdr.rsp_reqno,
+				    RUMPSP_ERR_NOMEM);
+				continue;
+			}
+			memcpy(spc->spc_buf, batch + off + HDRSZ, datalen);
+		}
+		schedulework(spc, SBA_SYSCALL);
 	}
-	pthread_mutex_unlock(&sbamtx);
+	spcresetbuf(spc);
+	free(batch);
 }
 
 /*
@@ -1762,6 +2188,7 @@ schedulework(struct spclient *spc, enum sbatype sba_type)
 
 struct spservarg {
 	int sps_sock;
+	int sps_shm;
 	connecthook_fn sps_connhook;
 };
 
@@ -1775,7 +2202,7 @@ handlereq(struct spclient *spc)
 	if (__predict_false(spc->spc_state == SPCSTATE_NEW)) {
 		if (spc->spc_hdr.rsp_type != RUMPSP_HANDSHAKE) {
 			send_error_resp(spc, reqno, RUMPSP_ERR_AUTH);
-			shutdown(spc->spc_fd, SHUT_RDWR);
+			spcshutdown(spc);
 			spcfreebuf(spc);
 			return;
 		}
@@ -1793,7 +2220,7 @@ handlereq(struct spclient *spc)
 
 			if ((error = lwproc_rfork(spc,
 			    RUMP_RFFD_CLEAR, comm)) != 0) {
-				shutdown(spc->spc_fd, SHUT_RDWR);
+				spcshutdown(spc);
 			}
 
 			spcfreebuf(spc);
@@ -1812,7 +2239,7 @@ handlereq(struct spclient *spc)
 			if (spc->spc_off-HDRSZ != sizeof(*rfp)) {
 				send_error_resp(spc, reqno,
 				    RUMPSP_ERR_MALFORMED_REQUEST);
-				shutdown(spc->spc_fd, SHUT_RDWR);
+				spcshutdown(spc);
 				spcfreebuf(spc);
 				return;
 			}
@@ -1836,7 +2263,7 @@ handlereq(struct spclient *spc)
 			if (!pf) {
 				send_error_resp(spc, reqno,
 				    RUMPSP_ERR_INVALID_PREFORK);
-				shutdown(spc->spc_fd, SHUT_RDWR);
+				spcshutdown(spc);
 				return;
 			}
 
@@ -1845,7 +2272,7 @@ handlereq(struct spclient *spc)
 			lwproc_switch(tmpmain);
 			if (cancel) {
 				lwproc_release();
-				shutdown(spc->spc_fd, SHUT_RDWR);
+				spcshutdown(spc);
 				return;
 			}
 
@@ -1861,7 +2288,7 @@ handlereq(struct spclient *spc)
 			    RUMP_RFFD_SHARE, NULL)) != 0) {
 				send_error_resp(spc, reqno,
 				    RUMPSP_ERR_RFORK_FAILED);
-				shutdown(spc->spc_fd, SHUT_RDWR);
+				spcshutdown(spc);
 				lwproc_release();
 				return;
 			}
@@ -1873,7 +2300,7 @@ handlereq(struct spclient *spc)
 			send_handshake_resp(spc, reqno, 0);
 		} else {
 			send_error_resp(spc, reqno, RUMPSP_ERR_AUTH);
-			shutdown(spc->spc_fd, SHUT_RDWR);
+			spcshutdown(spc);
 			spcfreebuf(spc);
 			return;
 		}
@@ -1902,7 +2329,7 @@ handlereq(struct spclient *spc)
 		pthread_mutex_unlock(&spc->spc_mtx);
 		if (inexec) {
 			send_error_resp(spc, reqno, RUMPSP_ERR_INEXEC);
-			shutdown(spc->spc_fd, SHUT_RDWR);
+			spcshutdown(spc);
 			return;
 		}
 
@@ -1949,7 +2376,7 @@ handlereq(struct spclient *spc)
 		if (spc->spc_hdr.rsp_handshake != HANDSHAKE_EXEC) {
 			send_error_resp(spc, reqno,
 			    RUMPSP_ERR_MALFORMED_REQUEST);
-			shutdown(spc->spc_fd, SHUT_RDWR);
+			spcshutdown(spc);
 			spcfreebuf(spc);
 			return;
 		}
@@ -1959,7 +2386,7 @@ handlereq(struct spclient *spc)
 		pthread_mutex_unlock(&spc->spc_mtx);
 		if (inexec) {
 			send_error_resp(spc, reqno, RUMPSP_ERR_INEXEC);
-			shutdown(spc->spc_fd, SHUT_RDWR);
+			spcshutdown(spc);
 			spcfreebuf(spc);
 			return;
 		}
@@ -1984,6 +2411,11 @@ handlereq(struct spclient *spc)
 		return;
 	}
 
+	if (spc->spc_hdr.rsp_type == RUMPSP_BATCH) {
+		serv_handlebatch(spc);
+		return;
+	}
+
 	if (__predict_false(spc->spc_hdr.rsp_type != RUMPSP_SYSCALL)) {
 		send_error_resp(spc, reqno, RUMPSP_ERR_MALFORMED_REQUEST);
 		spcfreebuf(spc);
@@ -1993,29 +2425,254 @@ handlereq(struct spclient *spc)
 	schedulework(spc, SBA_SYSCALL);
 }
 
+/*
+ * Shared memory server side.  There is no descriptor to wait on for
+ * the rings, so a poller thread watches the shared header and pokes
+ * the server loop through a pipe, which stands in for the listening
+ * socket.  The poller backs off to sleeping when the client is quiet.
+ */
+#define SHM_SPINS	1000
+#define SHM_MAXSLEEP	1000	/* us */
+
+__CTASSERT(sizeof(struct rumprun_spshm) <= SHM_HDRSIZE);
+
+static int
+shm_setup(struct spshm *ss)
+{
+	struct rumprun_spshm *sh = (void *)ss->ss_base;
+	int i;
+
+	if (ss->ss_len < SHM_MINSIZE) {
+		fprintf(stderr, "rump_sp_shm: region too small\n");
+		return EINVAL;
+	}
+	if (pipe(ss->ss_kickfd) == -1)
+		return errno;
+	for (i = 0; i < 2; i++) {
+		fcntl(ss->ss_kickfd[i], F_SETFL,
+		    fcntl(ss->ss_kickfd[i], F_GETFL, 0) | O_NONBLOCK);
+	}
+
+	memset(sh, 0, sizeof(*sh));
+	ss->ss_hdr = sh;
+	ss->ss_ringsize = RUMPRUN_SPSHM_RINGSIZE;
+	ss->ss_req = ss->ss_base + SHM_HDRSIZE;
+	ss->ss_resp = ss->ss_req + ss->ss_ringsize;
+	ss->ss_arenaoff = SHM_HDRSIZE + 2*ss->ss_ringsize;
+	ss->ss_arenasize = ss->ss_len - ss->ss_arenaoff;
+
+	sh->sh_req.sr_off = ss->ss_req - ss->ss_base;
+	sh->sh_req.sr_size = ss->ss_ringsize;
+	sh->sh_resp.sr_off = ss->ss_resp - ss->ss_base;
+	sh->sh_resp.sr_size = ss->ss_ringsize;
+	sh->sh_arenaoff = ss->ss_arenaoff;
+	sh->sh_arenasize = ss->ss_arenasize;
+	sh->sh_version = RUMPRUN_SPSHM_VERSION;
+	sh->sh_state = RUMPRUN_SPSHM_IDLE;
+	__atomic_store_n(&sh->sh_magic, RUMPRUN_SPSHM_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void
+shm_kick(struct spshm *ss)
+{
+
+	if (__atomic_exchange_n(&ss->ss_kicked, 1, __ATOMIC_SEQ_CST) == 0)
+		(void)write(ss->ss_kickfd[1], "", 1);
+}
+
+/* a client wants in: start a fresh session */
+static void
+shm_accept(struct spshm *ss)
+{
+	struct rumprun_spshm *sh = ss->ss_hdr;
+	size_t len = strlen(banner);
+
+	sh->sh_req.sr_head = sh->sh_req.sr_tail = 0;
+	sh->sh_resp.sr_head = sh->sh_resp.sr_tail = 0;
+	ss->ss_clientbase = sh->sh_clientbase;
+	ss->ss_discoseen = 0;
+
+	memcpy(ss->ss_resp, banner, len);
+	sh->sh_resp.sr_head = len;
+	__atomic_store_n(&sh->sh_state, RUMPRUN_SPSHM_CONNECTED,
+	    __ATOMIC_RELEASE);
+}
+
+/*ARGSUSED*/
+static void *
+shm_poller(void *arg)
+{
+	struct spshm *ss = arg;
+	struct rumprun_spshm *sh = ss->ss_hdr;
+	unsigned idle = 0, us;
+	int busy;
+
+	for (;;) {
+		busy = 0;
+		switch (__atomic_load_n(&sh->sh_state, __ATOMIC_ACQUIRE)) {
+		case RUMPRUN_SPSHM_CONNECT:
+			shm_accept(ss);
+			busy = 1;
+			break;
+		case RUMPRUN_SPSHM_CONNECTED:
+			busy = sh->sh_req.sr_head != sh->sh_req.sr_tail;
+			break;
+		case RUMPRUN_SPSHM_DISCONNECT:
+			busy = !ss->ss_discoseen;
+			ss->ss_discoseen = 1;
+			break;
+		}
+
+		if (busy) {
+			shm_kick(ss);
+			idle = 0;
+		} else {
+			idle++;
+		}
+
+		/* threads are not preempted, so always give way */
+		if (idle < SHM_SPINS) {
+			sched_yield();
+		} else {
+			if (idle > SHM_SPINS + 10)
+				idle = SHM_SPINS + 10;
+			us = 1U << (idle - SHM_SPINS);
+			usleep(us < SHM_MAXSLEEP ? us : SHM_MAXSLEEP);
+		}
+	}
+
+	return NULL;
+}
+
+/* set up a client slot for a freshly connected shared memory client */
+static unsigned
+serv_shmconn(struct spshm *ss)
+{
+	unsigned i;
+	int fd;
+
+	/* a descriptor to keep the slot bookkeeping the same */
+	if ((fd = dup(ss->ss_kickfd[0])) == -1)
+		goto fail;
+
+	for (i = 1; i < MAXCLI; i++) {
+		if (spclist[i].spc_fd == -1
+		    && spclist[i].spc_state == SPCSTATE_NEW)
+			break;
+	}
+	if (i == MAXCLI) {
+		close(fd);
+		goto fail;
+	}
+
+	spclist[i].spc_fd = fd;
+	spclist[i].spc_shm = ss;
+	spclist[i].spc_istatus = SPCSTATUS_BUSY; /* dedicated receiver */
+	spclist[i].spc_refcnt = 1;
+	TAILQ_INIT(&spclist[i].spc_respwait);
+
+	DPRINTF(("rump_sp: added shm connection at idx %u\n", i));
+	return i;
+
+ fail:
+	__atomic_store_n(&ss->ss_hdr->sh_state, RUMPRUN_SPSHM_IDLE,
+	    __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void serv_handleread(unsigned);
+
+/*
+ * The poller poked us.  Returns 1 if a new client connected.
+ */
+static int
+serv_handleshm(struct spshm *ss)
+{
+	char buf[64];
+	int isnew = 0;
+
+	while (read(ss->ss_kickfd[0], buf, sizeof(buf)) > 0)
+		continue;
+	__atomic_store_n(&ss->ss_kicked, 0, __ATOMIC_SEQ_CST);
+
+	if (spshmidx == 0) {
+		if (ss->ss_hdr->sh_state != RUMPRUN_SPSHM_CONNECTED)
+			return 0;
+		if ((spshmidx = serv_shmconn(ss)) == 0)
+			return 0;
+		isnew = 1;
+	}
+	serv_handleread(spshmidx);
+
+	return isnew;
+}
+
+/*
+ * Read and dispatch everything the client has sent.  A client which
+ * pipelines requests may have several frames waiting in the socket.
+ */
+static void
+serv_handleread(unsigned idx)
+{
+	struct spclient *spc = &spclist[idx];
+
+	DPRINTF(("rump_sp: mainloop read [%u]\n", idx));
+	for (;;) {
+		switch (readframe(spc)) {
+		case 0:
+			return;
+		case -1:
+			serv_handledisco(idx);
+			return;
+		default:
+			break;
+		}
+
+		switch (spc->spc_hdr.rsp_class) {
+		case RUMPSP_RESP:
+			kickwaiter(spc);
+			break;
+		case RUMPSP_REQ:
+			handlereq(spc);
+			break;
+		default:
+			send_error_resp(spc, spc->spc_hdr.rsp_reqno,
+			    RUMPSP_ERR_MALFORMED_REQUEST);
+			spcfreebuf(spc);
+			break;
+		}
+	}
+}
+
 static void *
 spserver(void *arg)
 {
 	struct spservarg *sarg = arg;
 	struct spclient *spc;
-	unsigned idx;
-	int seen;
-	int rv;
-	unsigned int nfds, maxidx;
+	struct kevent evs[NEVENTS], kev;
+	unsigned idx, nfds;
+	int i, n;
 
 	for (idx = 0; idx < MAXCLI; idx++) {
-		pfdlist[idx].fd = -1;
-		pfdlist[idx].events = POLLIN;
-
 		spc = &spclist[idx];
 		pthread_mutex_init(&spc->spc_mtx, NULL);
 		pthread_cond_init(&spc->spc_cv, NULL);
 		spc->spc_fd = -1;
 	}
-	pfdlist[0].fd = spclist[0].spc_fd = sarg->sps_sock;
-	pfdlist[0].events = POLLIN;
+	spclist[0].spc_fd = sarg->sps_sock;
 	nfds = 1;
-	maxidx = 0;
+
+	if ((spkq = kqueue()) == -1) {
+		fprintf(stderr, "rump_spserver: kqueue failed: %d\n", errno);
+		return NULL;
+	}
+	EV_SET(&kev, sarg->sps_sock, EVFILT_READ, EV_ADD, 0, 0, 0);
+	if (kevent(spkq, &kev, 1, NULL, 0, NULL) == -1) {
+		fprintf(stderr, "rump_spserver: kevent failed: %d\n", errno);
+		return NULL;
+	}
 
 	pthread_attr_init(&pattr_detached);
 	pthread_attr_setdetachstate(&pattr_detached, PTHREAD_CREATE_DETACHED);
@@ -2025,92 +2682,57 @@ spserver(void *arg)
 
 	pthread_mutex_init(&sbamtx, NULL);
 	pthread_cond_init(&sbacv, NULL);
+	spq_init(&sbafree);
+	spq_init(&sbawork);
+	for (i = 0; i < SPQ_SIZE; i++)
+		(void)spq_put(&sbafree, &sbapool[i]);
+	while (nworker < rumpsp_idleworker && nworker < rumpsp_maxworker) {
+		if (!startworker())
+			break;
+	}
 
 	DPRINTF(("rump_sp: server mainloop\n"));
 
 	for (;;) {
-		int discoed;
-
 		/* g/c hangarounds (eventually) */
-		discoed = getdisco();
-		while (discoed--) {
-			nfds--;
-			idx = maxidx;
-			while (idx) {
-				if (pfdlist[idx].fd != -1) {
-					maxidx = idx;
-					break;
-				}
-				idx--;
-			}
-			DPRINTF(("rump_sp: set maxidx to [%u]\n",
-			    maxidx));
-		}
+		nfds -= getdisco();
 
-		DPRINTF(("rump_sp: loop nfd %d\n", maxidx+1));
-		seen = 0;
-		rv = poll(pfdlist, maxidx+1, INFTIM);
-		assert(maxidx+1 <= MAXCLI);
-		assert(rv != 0);
-		if (rv == -1) {
+		n = kevent(spkq, NULL, 0, evs, NEVENTS, NULL);
+		if (n == -1) {
 			if (errno == EINTR)
 				continue;
-			fprintf(stderr, "rump_spserver: poll returned %d\n",
+			fprintf(stderr, "rump_spserver: kevent returned %d\n",
 			    errno);
 			break;
 		}
 
-		for (idx = 0; seen < rv && idx < MAXCLI; idx++) {
-			if ((pfdlist[idx].revents & POLLIN) == 0)
-				continue;
-
-			seen++;
+		for (i = 0; i < n; i++) {
+			idx = (unsigned)evs[i].udata;
 			DPRINTF(("rump_sp: activity at [%u] %d/%d\n",
-			    idx, seen, rv));
+			    idx, i, n));
 			if (idx > 0) {
-				spc = &spclist[idx];
-				DPRINTF(("rump_sp: mainloop read [%u]\n", idx));
-				switch (readframe(spc)) {
-				case 0:
-					break;
-				case -1:
-					serv_handledisco(idx);
-					break;
-				default:
-					switch (spc->spc_hdr.rsp_class) {
-					case RUMPSP_RESP:
-						kickwaiter(spc);
-						break;
-					case RUMPSP_REQ:
-						handlereq(spc);
-						break;
-					default:
-						send_error_resp(spc,
-						  spc->spc_hdr.rsp_reqno,
-						  RUMPSP_ERR_MALFORMED_REQUEST);
-						spcfreebuf(spc);
-						break;
-					}
-					break;
-				}
+				serv_handleread(idx);
+				continue;
+			}
 
-			} else {
-				DPRINTF(("rump_sp: mainloop new connection\n"));
+			DPRINTF(("rump_sp: mainloop new connection\n"));
 
-				if (__predict_false(spfini)) {
-					close(spclist[0].spc_fd);
-					serv_shutdown();
-					goto out;
-				}
+			if (__predict_false(spfini)) {
+				close(spclist[0].spc_fd);
+				serv_shutdown();
+				goto out;
+			}
 
-				idx = serv_handleconn(pfdlist[0].fd,
-				    sarg->sps_connhook, nfds == MAXCLI);
-				if (idx)
+			if (sarg->sps_shm) {
+				if (serv_handleshm(&spshm))
 					nfds++;
-				if (idx > maxidx)
-					maxidx = idx;
-				DPRINTF(("rump_sp: maxid now %d\n", maxidx));
+				continue;
 			}
+
+			idx = serv_handleconn(spclist[0].spc_fd,
+			    sarg->sps_connhook, nfds == MAXCLI);
+			if (idx)
+				nfds++;
 		}
 	}
 
@@ -2129,7 +2751,7 @@ rumpuser_sp_init(const char *url,
 	struct sockaddr *sap;
 	char *p;
 	unsigned idx = 0; /* XXXgcc */
-	int error, s;
+	int error, s, shm;
 
 	p = strdup(url);
 	if (p == NULL) {
@@ -2144,10 +2766,17 @@ rumpuser_sp_init(const char *url,
 	snprintf(banner, sizeof(banner), "RUMPSP-%d.%d-%s-%s/%s\n",
 	    PROTOMAJOR, PROTOMINOR, ostype, osrelease, machine);
 
-	s = socket(parsetab[idx].domain, SOCK_STREAM, 0);
-	if (s == -1) {
-		error = errno;
-		goto out;
+	shm = parsetab[idx].domain == PF_UNSPEC;
+	if (shm) {
+		if ((error = shm_setup(&spshm)) != 0)
+			goto out;
+		s = spshm.ss_kickfd[0];
+	} else {
+		s = socket(parsetab[idx].domain, SOCK_STREAM, 0);
+		if (s == -1) {
+			error = errno;
+			goto out;
+		}
 	}
 
 	sarg = malloc(sizeof(*sarg));
@@ -2158,6 +2787,7 @@ rumpuser_sp_init(const char *url,
 	}
 
 	sarg->sps_sock = s;
+	sarg->sps_shm = shm;
 	sarg->sps_connhook = parsetab[idx].connhook;
 
 	cleanupidx = idx;
@@ -2165,16 +2795,25 @@ rumpuser_sp_init(const char *url,
 
 	/* sloppy error recovery */
 
-	/*LINTED*/
-	if (bind(s, sap, parsetab[idx].slen) == -1) {
-		error = errno;
-		fprintf(stderr, "rump_sp: server bind failed\n");
-		goto out;
-	}
-	if (listen(s, MAXCLI) == -1) {
-		error = errno;
-		fprintf(stderr, "rump_sp: server listen failed\n");
-		goto out;
+	if (shm) {
+		if ((error = pthread_create(&pt, NULL,
+		    shm_poller, &spshm)) != 0) {
+			fprintf(stderr, "rump_sp: cannot create shm poller\n");
+			goto out;
+		}
+		pthread_detach(pt);
+	} else {
+		/*LINTED*/
+		if (bind(s, sap, parsetab[idx].slen) == -1) {
+			error = errno;
+			fprintf(stderr, "rump_sp: server bind failed\n");
+			goto out;
+		}
+		if (listen(s, MAXCLI) == -1) {
+			error = errno;
+			fprintf(stderr, "rump_sp: server listen failed\n");
+			goto out;
+		}
 	}
 
 	if ((error = pthread_create(&pt, NULL, spserver, sarg)) != 0) {
@@ -2223,6 +2862,9 @@ rumpuser_sp_fini(void *arg)
 	if (spclist[0].spc_fd) {
 		shutdown(spclist[0].spc_fd, SHUT_RDWR);
 		spfini = 1;
+		/* no socket to shut down, wake up the server loop by hand */
+		if (spshm.ss_hdr)
+			(void)write(spshm.ss_kickfd[1], "", 1);
 	}
 
 }
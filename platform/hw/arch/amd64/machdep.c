@@ -25,6 +25,9 @@
 
 #include <hw/kernel.h>
 
+#include <bmk-pcpu/pcpu.h>
+
+#include <bmk-core/pgalloc.h>
 #include <bmk-core/printf.h>
 #include <bmk-core/sched.h>
 
@@ -106,6 +109,40 @@ static char intrstack[4096];
 static char nmistack[4096];
 static char dfstack[4096];
 
+/*
+ * Boot CPU per-CPU data.  The secondaries are filled in by smp.c.
+ * Interrupts start out disabled (spldepth = 1) on every CPU.
+ */
+struct x86_cpu x86_cpus[BMK_PCPU_MAXCPUS] = {
+	[0] = { .xc_self = &x86_cpus[0], .xc_spldepth = 1, },
+};
+
+/*
+ * Fill a TSS with the given interrupt stacks and install it
+ * into slot 4 of gdt.
+ */
+static void
+inittss(unsigned long *gdt, struct tss *tss, char *stacks[3],
+	unsigned long size)
+{
+	struct taskgate_descriptor *td = (void *)&gdt[4];
+	unsigned long base = (unsigned long)tss;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		tss->tss_ist[i] = (unsigned long)stacks[i] + size-16;
+
+	td->td_lolimit = sizeof(*tss)-1;
+	td->td_lobase = base & 0xffffff;
+	td->td_type = 0x9;
+	td->td_dpl = 0;
+	td->td_p = 1;
+	td->td_hilimit = 0;
+	td->td_gran = 0;
+	td->td_hibase = base >> 24;
+	td->td_zero = 0;
+}
+
 /*
  * This routine fills out the interrupt descriptors so that
  * we can handle interrupts without involving a jump to hyperspace.
@@ -114,6 +151,7 @@ void
 cpu_init(void)
 {
 	struct region_descriptor region;
+	char *stacks[3] = { intrstack, nmistack, dfstack };
 
 	x86_initidt();
 	region.rd_limit = sizeof(idt)-1;
@@ -122,28 +160,44 @@ cpu_init(void)
 
 	x86_initpic();
 
-	/*
-	 * fill TSS
-	 */
-	mytss.tss_ist[0] = (unsigned long)intrstack + sizeof(intrstack)-16;
-	mytss.tss_ist[1] = (unsigned long)nmistack + sizeof(nmistack)-16;
-	mytss.tss_ist[2] = (unsigned long)dfstack + sizeof(dfstack)-16;
-
-	struct taskgate_descriptor *td = (void *)&cpu_gdt64[4];
-	td->td_lolimit = 0;
-	td->td_lobase = 0;
-	td->td_type = 0x9;
-	td->td_dpl = 0;
-	td->td_p = 1;
-	td->td_hilimit = 0xf;
-	td->td_gran = 0;
-	td->td_hibase = 0xffffffffffUL;
-	td->td_zero = 0;
+	inittss(cpu_gdt64, &mytss, stacks, sizeof(intrstack));
 	amd64_ltr(4*8);
 
 	x86_initclocks();
 }
 
+/*
+ * Descriptor tables for a secondary CPU.  The IDT is shared, but
+ * every CPU needs its own TSS and therefore its own GDT.
+ */
+static struct tss aptss[BMK_PCPU_MAXCPUS];
+
+void
+x86_cpu_initap(struct x86_cpu *ci)
+{
+	struct region_descriptor region;
+	char *stacks[3];
+	int i;
+
+	region.rd_limit = sizeof(idt)-1;
+	region.rd_base = (uintptr_t)(void *)idt;
+	amd64_lidt(&region);
+
+	for (i = 0; i < 3; i++) {
+		stacks[i] = bmk_pgalloc_one();
+		if (stacks[i] == NULL)
+			bmk_platform_halt("cannot allocate interrupt stacks");
+	}
+	for (i = 0; i < 4; i++)
+		ci->xc_gdt[i] = cpu_gdt64[i];
+	inittss(ci->xc_gdt, &aptss[ci->xc_index], stacks, BMK_PCPU_PAGE_SIZE);
+
+	region.rd_limit = sizeof(ci->xc_gdt)-1;
+	region.rd_base = (uintptr_t)(void *)ci->xc_gdt;
+	amd64_lgdt(&region);
+	amd64_ltr(4*8);
+}
+
 void cpu_fattrap(const char *, void *, unsigned long);
 void
 cpu_fattrap(const char *name, void *rip, unsigned long cr2)
@@ -158,8 +212,19 @@ bmk_platform_cpu_sched_settls(struct bmk_tcb *next)
 {
 
 	__asm__ __volatile("wrmsr" ::
-		"c" (0xc0000100),
+		"c" (MSR_FSBASE),
 		"a" ((uint32_t)(next->btcb_tp)),
 		"d" ((uint32_t)(next->btcb_tp >> 32))
 	);
 }
+
+void
+bmk_platform_cpu_sched_initcurrent(void *tlsarea, struct bmk_thread *value)
+{
+	struct bmk_thread **current;
+	long off;
+
+	__asm__("movq $bmk_current@tpoff, %0" : "=r"(off));
+	current = (void *)((char *)tlsarea + off);
+	*current = value;
+}
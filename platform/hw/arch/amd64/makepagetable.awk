@@ -68,7 +68,7 @@ BEGIN {
 	}
 
 	# and finally, lessons in hate from page map level 42
-	printf("\n.align 0x1000\ncpu_pml4:\n");
+	printf("\n.align 0x1000\n.globl cpu_pml4\ncpu_pml4:\n");
 	printf("\t.quad cpu_pdpt + 0x%x\n", PG_FORALL);
 	printf("\t.fill 0x1ff, 0x8, 0x0\n");
 }
@@ -0,0 +1,298 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Secondary CPU discovery and startup.
+ *
+ * The CPUs are found from the ACPI MADT.  Each one is started with
+ * the usual INIT-SIPI-SIPI sequence into mptramp.S, one at a time,
+ * and then waits in x86_ap_start() until the boot CPU has told the
+ * scheduler how many CPUs there are.  After that, every secondary
+ * CPU runs its own idle thread and whatever threads are created
+ * on it.  Interrupts from devices are still handled by the boot CPU
+ * only.
+ */
+
+#include <hw/kernel.h>
+
+#include <bmk-pcpu/pcpu.h>
+
+#include <arch/x86/var.h>
+
+#include <bmk-core/core.h>
+#include <bmk-core/errno.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/printf.h>
+#include <bmk-core/sched.h>
+#include <bmk-core/spinlock.h>
+#include <bmk-core/string.h>
+
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_MSEC	1000000ULL
+
+struct acpi_rsdp {
+	char		rsdp_sig[8];
+	uint8_t		rsdp_cksum;
+	char		rsdp_oemid[6];
+	uint8_t		rsdp_rev;
+	uint32_t	rsdp_rsdt;
+	uint32_t	rsdp_len;
+	uint64_t	rsdp_xsdt;
+	uint8_t		rsdp_xcksum;
+	uint8_t		rsdp_reserved[3];
+} __attribute__((__packed__));
+
+struct acpi_hdr {
+	char		ah_sig[4];
+	uint32_t	ah_len;
+	uint8_t		ah_rev;
+	uint8_t		ah_cksum;
+	char		ah_oemid[6];
+	char		ah_oemtblid[8];
+	uint32_t	ah_oemrev;
+	uint32_t	ah_creatorid;
+	uint32_t	ah_creatorrev;
+} __attribute__((__packed__));
+
+struct acpi_madt {
+	struct acpi_hdr	madt_hdr;
+	uint32_t	madt_lapic;
+	uint32_t	madt_flags;
+	uint8_t		madt_entries[];
+} __attribute__((__packed__));
+
+#define MADT_TYPE_LAPIC		0
+#define MADT_LAPIC_ENABLED	0x1
+struct madt_lapic {
+	uint8_t		ml_type;
+	uint8_t		ml_len;
+	uint8_t		ml_acpiid;
+	uint8_t		ml_apicid;
+	uint32_t	ml_flags;
+} __attribute__((__packed__));
+
+/* parameters for the next CPU, consumed by mptramp.S */
+unsigned long x86_ap_stack;
+struct x86_cpu *x86_ap_cpu;
+
+extern char mptramp_start[], mptramp_end[];
+
+/* set once the scheduler knows about all CPUs */
+static int smp_go;
+
+static int
+acpi_cksum(const void *p, unsigned long len)
+{
+	const uint8_t *b = p;
+	uint8_t sum = 0;
+
+	while (len--)
+		sum += *b++;
+	return sum;
+}
+
+/*
+ * Look for the RSDP in the BIOS read-only area.  The EBDA would be
+ * the other candidate, but on the machines we run on (i.e. qemu and
+ * friends) it is always found here.
+ */
+static struct acpi_rsdp *
+acpi_findrsdp(void)
+{
+	unsigned long pa;
+
+	for (pa = 0xe0000; pa < 0x100000; pa += 16) {
+		struct acpi_rsdp *rsdp = (void *)pa;
+
+		if (bmk_memcmp(rsdp->rsdp_sig, "RSD PTR ", 8) == 0
+		    && acpi_cksum(rsdp, 20) == 0)
+			return rsdp;
+	}
+	return NULL;
+}
+
+static struct acpi_madt *
+acpi_findmadt(void)
+{
+	struct acpi_rsdp *rsdp;
+	struct acpi_hdr *sdt, *hdr;
+	unsigned long entsize, i, n;
+
+	if ((rsdp = acpi_findrsdp()) == NULL)
+		return NULL;
+
+	/* we map only the first 4GB, so the 64bit pointer is of no use */
+	if (rsdp->rsdp_rev >= 2 && rsdp->rsdp_xsdt
+	    && rsdp->rsdp_xsdt < 0x100000000ULL) {
+		sdt = (void *)(unsigned long)rsdp->rsdp_xsdt;
+		entsize = 8;
+	} else {
+		sdt = (void *)(unsigned long)rsdp->rsdp_rsdt;
+		entsize = 4;
+	}
+	if (acpi_cksum(sdt, sdt->ah_len) != 0)
+		return NULL;
+
+	n = (sdt->ah_len - sizeof(*sdt)) / entsize;
+	for (i = 0; i < n; i++) {
+		char *ent = (char *)(sdt+1) + i*entsize;
+		uint64_t pa;
+
+		if (entsize == 8)
+			bmk_memcpy(&pa, ent, 8);
+		else
+			pa = *(uint32_t *)ent;
+		if (pa >= 0x100000000ULL)
+			continue;
+		hdr = (void *)(unsigned long)pa;
+		if (bmk_memcmp(hdr->ah_sig, "APIC", 4) == 0
+		    && acpi_cksum(hdr, hdr->ah_len) == 0)
+			return (void *)hdr;
+	}
+	return NULL;
+}
+
+/*
+ * Find the APIC ids of the enabled secondary CPUs.
+ */
+static int
+smp_enumerate(unsigned int *apicids, int max)
+{
+	struct acpi_madt *madt;
+	struct madt_lapic *ml;
+	unsigned int self = x86_lapic_id();
+	uint8_t *p, *end;
+	int n = 0;
+
+	if ((madt = acpi_findmadt()) == NULL)
+		return 0;
+
+	end = (uint8_t *)madt + madt->madt_hdr.ah_len;
+	for (p = madt->madt_entries; p + 2 <= end && n < max; p += p[1]) {
+		if (p[1] == 0)
+			break;
+		if (p[0] != MADT_TYPE_LAPIC)
+			continue;
+		ml = (void *)p;
+		if ((ml->ml_flags & MADT_LAPIC_ENABLED) == 0
+		    || ml->ml_apicid == self)
+			continue;
+		apicids[n++] = ml->ml_apicid;
+	}
+	return n;
+}
+
+static void
+smp_delay(bmk_time_t nsec)
+{
+	bmk_time_t until = bmk_platform_cpu_clock_monotonic() + nsec;
+
+	while (bmk_platform_cpu_clock_monotonic() < until)
+		bmk_cpu_relax();
+}
+
+static int
+smp_startap(struct x86_cpu *ci)
+{
+	void *stack;
+	int i;
+
+	if ((stack = bmk_pgalloc(BMK_THREAD_STACK_PAGE_ORDER)) == NULL)
+		return BMK_ENOMEM;
+	x86_ap_stack = (unsigned long)stack + BMK_THREAD_STACKSIZE;
+	x86_ap_cpu = ci;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	x86_lapic_ipi(ci->xc_apicid,
+	    LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+	smp_delay(10*NSEC_PER_MSEC);
+	for (i = 0; i < 2; i++) {
+		x86_lapic_ipi(ci->xc_apicid,
+		    LAPIC_ICR_STARTUP | (MPTRAMP_BASE >> 12));
+		smp_delay(200*NSEC_PER_USEC);
+	}
+
+	for (i = 0; i < 100 && !ci->xc_running; i++)
+		smp_delay(NSEC_PER_MSEC);
+	return ci->xc_running ? 0 : BMK_ETIMEDOUT;
+}
+
+/* called from mptramp.S */
+void x86_ap_start(struct x86_cpu *);
+void
+x86_ap_start(struct x86_cpu *ci)
+{
+
+	x86_cpu_initap(ci);
+	x86_lapic_init(0);
+	x86_initclocks_ap();
+
+	ci->xc_running = 1;
+	while (!__atomic_load_n(&smp_go, __ATOMIC_ACQUIRE))
+		bmk_cpu_relax();
+
+	bmk_sched_startcpu(ci->xc_index);
+}
+
+static void
+smp_kick(int cpu)
+{
+
+	x86_lapic_ipi(x86_cpus[cpu].xc_apicid, LAPIC_VEC_IPI);
+}
+
+void
+x86_smp_init(void)
+{
+	unsigned int apicids[BMK_PCPU_MAXCPUS-1];
+	struct x86_cpu *ci;
+	int i, n, ncpu, rv;
+
+	if (x86_lapic_init(1) != 0) {
+		bmk_printf("x86_smp_init(): no local APIC\n");
+		return;
+	}
+	x86_cpus[0].xc_apicid = x86_lapic_id();
+
+	/* even a single CPU sleeps on the local APIC timer from now on */
+	x86_lapic_calibrate();
+
+	n = smp_enumerate(apicids, BMK_PCPU_MAXCPUS-1);
+	if (n == 0)
+		return;
+
+	bmk_memcpy((void *)MPTRAMP_BASE, mptramp_start,
+	    mptramp_end - mptramp_start);
+
+	for (ncpu = 1, i = 0; i < n; i++) {
+		ci = &x86_cpus[ncpu];
+		ci->xc_self = ci;
+		ci->xc_spldepth = 1;
+		ci->xc_index = ncpu;
+		ci->xc_apicid = apicids[i];
+		if ((rv = smp_startap(ci)) != 0) {
+			/*
+			 * A late starter would pick up the parameters
+			 * of the next CPU, so stop here.
+			 */
+			bmk_printf("x86_smp_init(): cpu with APIC id %u "
+			    "failed to start (%d)\n", apicids[i], rv);
+			break;
+		}
+		ncpu++;
+	}
+
+	bmk_sched_initcpus(ncpu, smp_kick);
+	__atomic_store_n(&smp_go, 1, __ATOMIC_RELEASE);
+	bmk_printf("x86_smp_init(): %d CPUs\n", ncpu);
+}
@@ -0,0 +1,408 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Demand paging for mmap.  Everything else runs on the identity map
+ * of physical memory: the first 4GB are mapped statically by
+ * pagetable.S, and cpu_mapmem() extends the map over RAM above that,
+ * up to the end of the first PML4 slot (512GB).  Above that,
+ * starting at the second PML4 slot, is a window where librumpkern_mman
+ * can reserve address space, map individual pages and get a callback
+ * when something touches a page which is not mapped.
+ *
+ * The interface is exported to the rump kernel as the weak plat_vm_*
+ * hooks, in the same way as plat_mprotect.  Page table pages are
+ * never freed; the window is allocated bump-style and not reused.
+ */
+
+#include <hw/kernel.h>
+
+#include <bmk-core/core.h>
+#include <bmk-core/errno.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/printf.h>
+#include <bmk-core/sched.h>
+#include <bmk-core/spinlock.h>
+#include <bmk-core/string.h>
+
+#include <bmk-pcpu/pcpu.h>
+
+#define PG_V		0x001
+#define PG_RW		0x002
+#define PG_PS		0x080
+#define PG_FRAME	0x000ffffffffff000UL
+
+/* page fault error code: the page was present */
+#define PGEX_P		0x01
+
+/* PROT_WRITE from <sys/mman.h> */
+#define VM_PROT_WRITE	0x02
+
+/* CPUID 0x80000001 EDX: 1GB pages */
+#define CPUID_80000001H_EDX_PAGE1GB	0x04000000
+
+#define NBPD_L2		(1UL<<21)
+#define NBPD_L3		(1UL<<30)
+#define IDMAP_STATIC	(4UL<<30)	/* mapped by pagetable.S */
+
+#define VM_WINDOW_START	(1UL<<39)
+#define VM_WINDOW_END	(256UL<<39)
+
+bmk_ctassert(__builtin_offsetof(struct x86_cpu, xc_tlbgen) == XC_TLBGEN);
+
+unsigned long x86_tlbgen;
+
+static unsigned long vm_next = VM_WINDOW_START;
+static struct bmk_spinlock vm_lock = BMK_SPINLOCK_INITIALIZER;
+
+static int (*vm_faulthandler)(void *);
+
+static unsigned long *
+vm_pml4(void)
+{
+	unsigned long cr3;
+
+	__asm__ __volatile__("movq %%cr3, %0" : "=r"(cr3));
+	return (void *)(cr3 & PG_FRAME);
+}
+
+/*
+ * Return the page table entry for va, allocating the intermediate
+ * levels if alloc is set.  Called with vm_lock held.
+ */
+static unsigned long *
+vm_pte(unsigned long va, int alloc)
+{
+	unsigned long *table = vm_pml4();
+	unsigned long *next;
+	int shift;
+
+	for (shift = 39; shift > 12; shift -= 9) {
+		unsigned long *ent = &table[(va >> shift) & 0x1ff];
+
+		if ((*ent & PG_V) == 0) {
+			if (!alloc)
+				return NULL;
+			if ((next = bmk_pgalloc_one()) == NULL)
+				return NULL;
+			bmk_memset(next, 0, BMK_PCPU_PAGE_SIZE);
+			*ent = (unsigned long)next | PG_V | PG_RW;
+		}
+		table = (void *)(*ent & PG_FRAME);
+	}
+	return &table[(va >> 12) & 0x1ff];
+}
+
+/*
+ * Identity map the RAM at [start,*endp).  We map whole gigabytes, with
+ * 1GB pages if the CPU has them and with 2MB pages otherwise.  The
+ * page directories for the latter come from pgalloc, so there must
+ * be memory loaded already.  This is done before the other CPUs are
+ * started, and they use the same page tables.  RAM above the end of
+ * the identity map is not mapped; *endp is lowered to where it stops.
+ */
+int
+cpu_mapmem(unsigned long start, unsigned long *endp)
+{
+	uint32_t eax, ebx, ecx, edx;
+	unsigned long *pdpt, *pd, pa, end;
+	int gbpages, i;
+
+	if (start >= VM_WINDOW_START)
+		return BMK_EINVAL;
+	if (*endp > VM_WINDOW_START)
+		*endp = VM_WINDOW_START;
+	end = *endp;
+	if (end <= IDMAP_STATIC)
+		return 0;
+
+	x86_cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+	gbpages = 0;
+	if (eax >= 0x80000001) {
+		x86_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+		gbpages = (edx & CPUID_80000001H_EDX_PAGE1GB) != 0;
+	}
+
+	pdpt = (void *)(vm_pml4()[0] & PG_FRAME);
+	for (pa = start & ~(NBPD_L3-1); pa < end; pa += NBPD_L3) {
+		unsigned long *ent = &pdpt[pa / NBPD_L3];
+
+		if (*ent & PG_V)
+			continue;
+		if (gbpages) {
+			*ent = pa | PG_V | PG_RW | PG_PS;
+			continue;
+		}
+		if ((pd = bmk_pgalloc_one()) == NULL)
+			return BMK_ENOMEM;
+		for (i = 0; i < 512; i++)
+			pd[i] = (pa + i*NBPD_L2) | PG_V | PG_RW | PG_PS;
+		*ent = (unsigned long)pd | PG_V | PG_RW;
+	}
+	__asm__ __volatile__("movq %%cr3, %%rax; movq %%rax, %%cr3"
+	    ::: "rax", "memory");
+
+	return 0;
+}
+
+static int
+vm_inwindow(unsigned long va)
+{
+
+	return va >= VM_WINDOW_START && va < VM_WINDOW_END;
+}
+
+void cpu_fattrap(const char *, void *, unsigned long);
+
+/*
+ * Called from x86_trap_14 with interrupts disabled.  Only faults on
+ * unmapped pages in the window can be resolved.  Faults in code
+ * running with interrupts blocked are fatal too, since resolving the
+ * fault may have to wait for I/O.
+ */
+void x86_pagefault(unsigned long, unsigned long, void *);
+void
+x86_pagefault(unsigned long va, unsigned long error, void *rip)
+{
+	int rv;
+
+	if (!vm_inwindow(va) || (error & PGEX_P)
+	    || vm_faulthandler == NULL || spldepth != 0)
+		goto fatal;
+
+	__asm__ __volatile__("sti");
+	rv = vm_faulthandler((void *)va);
+	__asm__ __volatile__("cli");
+	if (rv == 0)
+		return;
+
+ fatal:
+	cpu_fattrap("page fault", rip, va);
+}
+
+/*
+ * Flush the TLB on all CPUs, and wait until they have done so.
+ */
+static void
+vm_shootdown(void)
+{
+	unsigned long gen;
+	int i, me, ncpu;
+
+	gen = __atomic_add_fetch(&x86_tlbgen, 1, __ATOMIC_SEQ_CST);
+	__asm__ __volatile__("movq %%cr3, %%rax; movq %%rax, %%cr3"
+	    ::: "rax", "memory");
+
+	me = x86_curcpu_index();
+	ncpu = bmk_sched_ncpu();
+	for (i = 0; i < ncpu; i++) {
+		if (i != me)
+			x86_lapic_ipi(x86_cpus[i].xc_apicid, LAPIC_VEC_IPI);
+	}
+	for (i = 0; i < ncpu; i++) {
+		if (i == me)
+			continue;
+		while ((long)(x86_cpus[i].xc_tlbgen - gen) < 0)
+			bmk_cpu_relax();
+	}
+}
+
+/*
+ * The hooks for librumpkern_mman.  They are called from the rump
+ * kernel, hence the namespace.
+ */
+
+void *rumpns_plat_vm_reserve(unsigned long);
+void *
+rumpns_plat_vm_reserve(unsigned long len)
+{
+	unsigned long va;
+
+	len = (len + BMK_PCPU_PAGE_SIZE-1) & ~(BMK_PCPU_PAGE_SIZE-1);
+
+	bmk_spin_lock(&vm_lock);
+	if (VM_WINDOW_END - vm_next < len) {
+		bmk_spin_unlock(&vm_lock);
+		return NULL;
+	}
+	va = vm_next;
+	vm_next += len;
+	bmk_spin_unlock(&vm_lock);
+
+	return (void *)va;
+}
+
+int rumpns_plat_vm_enter(void *, void *, int);
+int
+rumpns_plat_vm_enter(void *va, void *page, int prot)
+{
+	unsigned long *pte;
+
+	bmk_assert(vm_inwindow((unsigned long)va));
+
+	bmk_spin_lock(&vm_lock);
+	if ((pte = vm_pte((unsigned long)va, 1)) == NULL) {
+		bmk_spin_unlock(&vm_lock);
+		return BMK_ENOMEM;
+	}
+	if (*pte & PG_V) {
+		bmk_spin_unlock(&vm_lock);
+		return BMK_EEXIST;
+	}
+	*pte = (unsigned long)page | PG_V
+	    | ((prot & VM_PROT_WRITE) ? PG_RW : 0);
+	bmk_spin_unlock(&vm_lock);
+
+	return 0;
+}
+
+void *rumpns_plat_vm_lookup(void *);
+void *
+rumpns_plat_vm_lookup(void *va)
+{
+	unsigned long *pte;
+	void *page = NULL;
+
+	bmk_spin_lock(&vm_lock);
+	if ((pte = vm_pte((unsigned long)va, 0)) != NULL && (*pte & PG_V))
+		page = (void *)(*pte & PG_FRAME);
+	bmk_spin_unlock(&vm_lock);
+
+	return page;
+}
+
+/*
+ * Unmap a page and return it.  The caller must call plat_vm_flush()
+ * before reusing the page.
+ */
+void *rumpns_plat_vm_extract(void *);
+void *
+rumpns_plat_vm_extract(void *va)
+{
+	unsigned long *pte;
+	void *page = NULL;
+
+	bmk_spin_lock(&vm_lock);
+	if ((pte = vm_pte((unsigned long)va, 0)) != NULL && (*pte & PG_V)) {
+		page = (void *)(*pte & PG_FRAME);
+		*pte = 0;
+	}
+	bmk_spin_unlock(&vm_lock);
+
+	return page;
+}
+
+void rumpns_plat_vm_flush(void);
+void
+rumpns_plat_vm_flush(void)
+{
+
+	vm_shootdown();
+}
+
+void rumpns_plat_vm_setfault(int (*)(void *));
+void
+rumpns_plat_vm_setfault(int (*handler)(void *))
+{
+
+	vm_faulthandler = handler;
+}
+
+#ifdef VM_TESTING
+
+/*
+ * Measure what the 2MB pages of the identity map buy us: walk the
+ * same memory once through the identity map and once through 4k
+ * mappings in the window.  The pages are visited in a scattered
+ * order so that neither the prefetcher nor the TLB can keep up with
+ * the 4k case.  The window space is not reused afterwards.
+ */
+
+#define HUGE_ORDER (BMK_PCPU_HUGEPAGE_SHIFT - BMK_PCPU_PAGE_SHIFT)
+#define HUGE_SIZE (1UL<<BMK_PCPU_HUGEPAGE_SHIFT)
+
+#define TLBTEST_HUGEPAGES 16
+#define TLBTEST_PAGES (TLBTEST_HUGEPAGES << HUGE_ORDER)
+#define TLBTEST_STRIDE 613
+#define TLBTEST_PASSES 16
+
+static bmk_time_t
+tlbtest_walk(char **bases)
+{
+	bmk_time_t start;
+	volatile unsigned long *p;
+	unsigned long i, pg, off, sum = 0;
+	int pass;
+
+	start = bmk_platform_cpu_clock_monotonic();
+	for (pass = 0; pass < TLBTEST_PASSES; pass++) {
+		for (i = 0, pg = 0; i < TLBTEST_PAGES; i++) {
+			pg = (pg + TLBTEST_STRIDE) % TLBTEST_PAGES;
+			off = (pg & ((1UL<<HUGE_ORDER)-1)) << BMK_PCPU_PAGE_SHIFT;
+			p = (void *)(bases[pg >> HUGE_ORDER] + off
+			    + (pg & 63) * 64);
+			sum += *p;
+		}
+	}
+	bmk_assert(sum == 0);
+
+	return bmk_platform_cpu_clock_monotonic() - start;
+}
+
+/* XXX: no prototype */
+void bmk_vm_tlbtest(void);
+void
+bmk_vm_tlbtest(void)
+{
+	char *phys[TLBTEST_HUGEPAGES], *virt[TLBTEST_HUGEPAGES];
+	bmk_time_t thuge, tsmall;
+	char *va;
+	unsigned long off;
+	int i;
+
+	va = rumpns_plat_vm_reserve(TLBTEST_HUGEPAGES * HUGE_SIZE);
+	if (va == NULL)
+		bmk_platform_halt("bmk_vm_tlbtest: no address space");
+	for (i = 0; i < TLBTEST_HUGEPAGES; i++) {
+		if ((phys[i] = bmk_pgalloc(HUGE_ORDER)) == NULL)
+			bmk_platform_halt("bmk_vm_tlbtest: out of memory");
+		bmk_memset(phys[i], 0, HUGE_SIZE);
+		virt[i] = va + i*HUGE_SIZE;
+		for (off = 0; off < HUGE_SIZE; off += BMK_PCPU_PAGE_SIZE) {
+			if (rumpns_plat_vm_enter(virt[i] + off, phys[i] + off,
+			    VM_PROT_WRITE) != 0)
+				bmk_platform_halt("bmk_vm_tlbtest: vm_enter");
+		}
+	}
+
+	/* once around each to warm up the caches */
+	tlbtest_walk(phys);
+	tlbtest_walk(virt);
+
+	thuge = tlbtest_walk(phys);
+	tsmall = tlbtest_walk(virt);
+	bmk_printf("tlbtest: %d passes over %lu kB: 2MB pages %llu us, "
+	    "4kB pages %llu us\n", TLBTEST_PASSES,
+	    TLBTEST_HUGEPAGES * (HUGE_SIZE >> 10),
+	    (unsigned long long)thuge / 1000,
+	    (unsigned long long)tsmall / 1000);
+
+	for (i = 0; i < TLBTEST_HUGEPAGES; i++) {
+		for (off = 0; off < HUGE_SIZE; off += BMK_PCPU_PAGE_SIZE)
+			rumpns_plat_vm_extract(virt[i] + off);
+	}
+	vm_shootdown();
+	for (i = 0; i < TLBTEST_HUGEPAGES; i++)
+		bmk_pgfree(phys[i], HUGE_ORDER);
+}
+#endif /* VM_TESTING */
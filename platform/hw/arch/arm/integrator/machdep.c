@@ -34,6 +34,7 @@
 #include <hw/kernel.h>
 
 #include <bmk-core/core.h>
+#include <bmk-core/errno.h>
 #include <bmk-core/mainthread.h>
 #include <bmk-core/pgalloc.h>
 #include <bmk-core/platform.h>
@@ -188,6 +189,13 @@ bmk_platform_cpu_block(bmk_time_t until)
 	outl(INTR_CLEAR, 0x80);
 }
 
+int
+bmk_platform_cpu_slicetimer(bmk_time_t until)
+{
+
+	return BMK_ENOSYS;
+}
+
 int
 cpu_intr_init(int intr)
 {
@@ -203,3 +211,18 @@ cpu_intr_ack(unsigned mask)
 
 	outl(INTR_ENABLE, mask);
 }
+
+/* interrupts are disabled in arm_interrupt() until acked */
+void
+cpu_intr_mask(unsigned mask)
+{
+
+	outl(INTR_CLEAR, mask);
+}
+
+void
+cpu_intr_unmask(unsigned mask)
+{
+
+	outl(INTR_ENABLE, mask);
+}
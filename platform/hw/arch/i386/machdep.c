@@ -154,6 +154,16 @@ cpu_init(void)
 	x86_initclocks();
 }
 
+/*
+ * We run without paging, so all memory we can address is there.
+ */
+int
+cpu_mapmem(unsigned long start, unsigned long *endp)
+{
+
+	return 0;
+}
+
 void
 bmk_platform_cpu_sched_settls(struct bmk_tcb *next)
 {
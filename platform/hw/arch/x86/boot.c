@@ -27,6 +27,8 @@
 #include <hw/kernel.h>
 #include <hw/multiboot.h>
 
+#include <arch/x86/var.h>
+
 #include <bmk-core/core.h>
 #include <bmk-core/mainthread.h>
 #include <bmk-core/sched.h>
@@ -44,6 +46,9 @@ x86_boot(struct multiboot_info *mbi)
 	bmk_sched_init();
 	multiboot(mbi);
 	cpu_intr_init(4);
+#ifdef __x86_64__
+	x86_smp_init();
+#endif
 	spl0();
 	struct rumprun_boot_config rumprun_config = {(char *)multiboot_cmdline, 1};
 
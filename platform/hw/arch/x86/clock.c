@@ -29,12 +29,14 @@
 
 #include <arch/x86/hypervisor.h>
 #include <arch/x86/var.h>
-#include <arch/x86/tsc.h>
 
 #include <bmk-core/core.h>
+#include <bmk-core/errno.h>
 #include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
 
+#include <bmk-pcpu/pcpu.h>
+
 #define NSEC_PER_SEC	1000000000ULL
 /*
  * Minimum delta to sleep using PIT. Programming seems to have an overhead of
@@ -66,7 +68,10 @@ static int have_pvclock;
  * TSC clock specific.
  */
 
-/* Base time values at the last call to tscclock_monotonic(). */
+/*
+ * Base time values, set once at calibration.  They are never updated
+ * afterwards so that any CPU may read the clock without locking.
+ */
 static bmk_time_t time_base;
 static uint64_t tsc_base;
 
@@ -96,13 +101,19 @@ struct pvclock_wall_clock {
 	uint32_t nsec;
 } __attribute__((__packed__));
 
+#ifndef BMK_PCPU_MAXCPUS
+#define BMK_PCPU_MAXCPUS 1
+#endif
+
 /*
- * pvclock structures shared with hypervisor.
+ * pvclock structures shared with hypervisor.  The time info is per
+ * vcpu; each CPU registers and reads its own.
  * TODO: These should be pointers (for Xen HVM support), but we can't use
  * bmk_pgalloc() here.
  */
-volatile static struct pvclock_vcpu_time_info pvclock_ti;
+volatile static struct pvclock_vcpu_time_info pvclock_ti[BMK_PCPU_MAXCPUS];
 volatile static struct pvclock_wall_clock pvclock_wc;
+static uint32_t msr_kvm_system_time;
 
 /*
  * Calculate prod = (a * b) where a is (64.0) fixed point and b is (0.32) fixed
@@ -234,17 +245,8 @@ rtc_gettimeofday(void)
 static bmk_time_t
 tscclock_monotonic(void)
 {
-	uint64_t tsc_now, tsc_delta;
-
-	/*
-	 * Update time_base (monotonic time) and tsc_base (TSC time).
-	 */
-	tsc_now = rdtsc();
-	tsc_delta = tsc_now - tsc_base;
-	time_base += mul64_32(tsc_delta, tsc_mult);
-	tsc_base = tsc_now;
 
-	return time_base;
+	return time_base + mul64_32(rdtsc() - tsc_base, tsc_mult);
 }
 
 /*
@@ -301,21 +303,23 @@ tscclock_init(void)
 static bmk_time_t
 pvclock_monotonic(void)
 {
+	volatile struct pvclock_vcpu_time_info *ti;
 	uint32_t version;
 	uint64_t delta, time_now;
 
+	ti = &pvclock_ti[x86_curcpu_index()];
 	do {
-		version = pvclock_ti.version;
+		version = ti->version;
 		__asm__ ("mfence" ::: "memory");
-		delta = rdtsc() - pvclock_ti.tsc_timestamp;
-		if (pvclock_ti.tsc_shift < 0)
-			delta >>= -pvclock_ti.tsc_shift;
+		delta = rdtsc() - ti->tsc_timestamp;
+		if (ti->tsc_shift < 0)
+			delta >>= -ti->tsc_shift;
 		else
-			delta <<= pvclock_ti.tsc_shift;
-		time_now = mul64_32(delta, pvclock_ti.tsc_to_system_mul) +
-			pvclock_ti.system_time;
+			delta <<= ti->tsc_shift;
+		time_now = mul64_32(delta, ti->tsc_to_system_mul) +
+			ti->system_time;
 		__asm__ ("mfence" ::: "memory");
-	} while ((pvclock_ti.version & 1) || (pvclock_ti.version != version));
+	} while ((ti->version & 1) || (ti->version != version));
 
 	return (bmk_time_t)time_now;
 }
@@ -340,6 +344,26 @@ pvclock_read_wall_clock(void)
 	return wc_boot;
 }
 
+/*
+ * Register the current CPU's pvclock time info with the hypervisor.
+ */
+static void
+pvclock_register(void)
+{
+	volatile struct pvclock_vcpu_time_info *ti;
+
+	ti = &pvclock_ti[x86_curcpu_index()];
+	__asm__ __volatile("wrmsr" ::
+		"c" (msr_kvm_system_time),
+		"a" ((uint32_t)((uintptr_t)ti | 0x1)),
+#if defined(__x86_64__)
+		"d" ((uint32_t)((uintptr_t)ti >> 32))
+#else
+		"d" (0)
+#endif
+	);
+}
+
 /*
  * Initialise PV clock. Returns zero if successful (PV clock is available).
  *
@@ -349,7 +373,7 @@ static int
 pvclock_init(void)
 {
 	uint32_t eax, ebx, ecx, edx;
-	uint32_t msr_kvm_system_time, msr_kvm_wall_clock;
+	uint32_t msr_kvm_wall_clock;
 
 	if (hypervisor_detect() != HYPERVISOR_KVM)
 		return 1;
@@ -369,15 +393,7 @@ pvclock_init(void)
 	else
 		return 1;
 
-	__asm__ __volatile("wrmsr" ::
-		"c" (msr_kvm_system_time),
-		"a" ((uint32_t)((uintptr_t)&pvclock_ti | 0x1)),
-#if defined(__x86_64__)
-		"d" ((uint32_t)((uintptr_t)&pvclock_ti >> 32))
-#else
-		"d" (0)
-#endif
-	);
+	pvclock_register();
 	__asm__ __volatile("wrmsr" ::
 		"c" (msr_kvm_wall_clock),
 		"a" ((uint32_t)((uintptr_t)&pvclock_wc)),
@@ -440,6 +456,18 @@ x86_initclocks(void)
 	outb(PIC1_DATA, pic1mask);
 }
 
+/*
+ * Clock setup for a secondary CPU.  The TSC clock needs nothing,
+ * but pvclock needs to be told where to put this vcpu's time info.
+ */
+void
+x86_initclocks_ap(void)
+{
+
+	if (have_pvclock)
+		pvclock_register();
+}
+
 /*
  * Return monotonic time since system boot in nanoseconds.
  */
@@ -462,22 +490,34 @@ bmk_platform_cpu_clock_epochoffset(void)
 	return rtc_epochoffset;
 }
 
+/*
+ * Halt until the next interrupt.  Called and returns with interrupts
+ * disabled.  sti takes effect only after the following instruction,
+ * so an interrupt cannot sneak in between sti and hlt.  Idle time is
+ * accounted for by the scheduler.
+ */
+void
+x86_cpu_idle(void)
+{
+	int s;
+
+	s = spldepth;
+	spldepth = 0;
+	__asm__ __volatile__("sti; hlt; cli" ::: "memory");
+	spldepth = s;
+}
+
 /*
  * Block the CPU until monotonic time is *no later than* the specified time.
  * Returns early if any interrupts are serviced, or if the requested delay is
  * too short.
  */
- uint64_t ccount = 0;
- uint64_t prev;
- uint64_t ts;
-
 void
 bmk_platform_cpu_block(bmk_time_t until)
 {
 	bmk_time_t now, delta_ns;
 	uint64_t delta_ticks;
 	unsigned int ticks;
-	int s;
 
 	bmk_assert(spldepth > 0);
 
@@ -489,6 +529,14 @@ bmk_platform_cpu_block(bmk_time_t until)
 	if (until <= now)
 		return;
 
+#ifdef __x86_64__
+	/* once it is calibrated, every CPU uses the local APIC timer */
+	if (x86_lapic_timer) {
+		x86_lapic_block(until);
+		return;
+	}
+#endif
+
 	/*
 	 * Compute delta in PIT ticks. Return if it is less than minimum safe
 	 * amount of ticks.  Essentially this will cause us to spin until
@@ -534,22 +582,23 @@ bmk_platform_cpu_block(bmk_time_t until)
 	 * able to distinguish if the interrupt was the PIT interrupt
 	 * and no other, but this will do for now.
 	 */
-	s = spldepth;
-	spldepth = 0;
-    prev = rdtsc_pure();
-
-    while(1) {
-        ts = rdtsc_pure();;
-        //
-        if ((ts - prev) < 150) {
-            asm volatile("cli" ::: "memory");
-            ccount += (unsigned long long)(ts - prev);
-            asm volatile("sti" ::: "memory");
-            prev = ts;
-        } else {
-            spldepth = s;
-            prev = ts;
-            return;
-        }
-    }
+	x86_cpu_idle();
+}
+
+/*
+ * The time slice runs on the local APIC timer.  The PIT is not per-CPU
+ * and bmk_platform_cpu_block() reprograms it, so there is no slice
+ * timer before the local APIC timer is calibrated, or on i386.
+ */
+int
+bmk_platform_cpu_slicetimer(bmk_time_t until)
+{
+
+#ifdef __x86_64__
+	if (x86_lapic_timer) {
+		x86_lapic_settimer(until);
+		return 0;
+	}
+#endif
+	return BMK_ENOSYS;
 }
@@ -83,3 +83,27 @@ cpu_intr_ack(unsigned int intrs)
 	    "outb %%al, $0x20\n"
 	    ::: "al");
 }
+
+/*
+ * Mask/unmask interrupts on the PIC, used to keep a line quiet
+ * while it is being polled.
+ */
+void
+cpu_intr_mask(unsigned int intrs)
+{
+
+	pic1mask |= intrs & 0xff;
+	pic2mask |= (intrs >> 8) & 0xff;
+	outb(PIC1_DATA, pic1mask);
+	outb(PIC2_DATA, pic2mask);
+}
+
+void
+cpu_intr_unmask(unsigned int intrs)
+{
+
+	pic1mask &= ~(intrs & 0xff);
+	pic2mask &= ~((intrs >> 8) & 0xff);
+	outb(PIC1_DATA, pic1mask);
+	outb(PIC2_DATA, pic2mask);
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2018, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/*
+ * Local APIC in xAPIC (MMIO) mode.  We use it for interprocessor
+ * interrupts and for the per-CPU timer which bmk_platform_cpu_block()
+ * sleeps on once it is calibrated.  While a thread runs, the same
+ * timer ends its time slice.  The timer runs in TSC-deadline mode if
+ * the CPU has it, and in one-shot mode otherwise.  Device interrupts
+ * stay on the boot CPU via the 8259 (LINT0 in ExtINT mode).
+ */
+
+#include <hw/kernel.h>
+
+#include <arch/x86/tsc.h>
+#include <arch/x86/var.h>
+
+#include <bmk-core/core.h>
+#include <bmk-core/platform.h>
+#include <bmk-core/printf.h>
+
+/* page directory bits for making the local APIC page uncached */
+#define PG_WT		0x08
+#define PG_N		0x10
+
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+/* how long to count timer ticks for when calibrating */
+#define CALIBRATE_NSEC	(10*NSEC_PER_MSEC)
+
+unsigned long x86_lapic_base;
+
+/* timer frequency (after the divider) in ticks per millisecond */
+static uint64_t lapic_khz;
+
+/* TSC frequency in ticks per millisecond, for TSC-deadline mode */
+static uint64_t tsc_khz;
+
+/* the timer runs in TSC-deadline mode instead of one-shot mode */
+static int lapic_tscdeadline;
+
+/* set once the timer is calibrated and x86_lapic_block() may be used */
+int x86_lapic_timer;
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+
+	__asm__ __volatile__("wrmsr" ::
+	    "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline uint32_t
+lapic_read(unsigned int reg)
+{
+
+	return *(volatile uint32_t *)(x86_lapic_base + reg);
+}
+
+static inline void
+lapic_write(unsigned int reg, uint32_t val)
+{
+
+	*(volatile uint32_t *)(x86_lapic_base + reg) = val;
+}
+
+/*
+ * The local APIC registers must not be cached.  The boot page tables
+ * identity map the first 4GB with 2MB pages, so flip the attributes
+ * of the page containing them.
+ */
+static void
+lapic_uncache(unsigned long pa)
+{
+	unsigned long *pml4, *pdpt, *pd;
+	unsigned long cr3;
+
+	__asm__ __volatile__("movq %%cr3, %0" : "=r"(cr3));
+	pml4 = (void *)(cr3 & ~0xfffUL);
+	pdpt = (void *)(pml4[0] & ~0xfffUL);
+	pd = (void *)(pdpt[pa >> 30] & ~0xfffUL);
+	pd[(pa >> 21) & 0x1ff] |= PG_N | PG_WT;
+	__asm__ __volatile__("invlpg (%0)" :: "r"(pa) : "memory");
+}
+
+/*
+ * Set up the timer of the current CPU for x86_lapic_block().
+ */
+static void
+lapic_timer_init(void)
+{
+
+	if (lapic_tscdeadline) {
+		lapic_write(LAPIC_LVT_TIMER,
+		    LAPIC_VEC_TIMER | LAPIC_LVT_TSCDEADLINE);
+		/* wrmsr does not wait for the MMIO write to the LVT */
+		__asm__ __volatile__("mfence; lfence" ::: "memory");
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV16);
+		lapic_write(LAPIC_TIMER_ICR, 0);
+		lapic_write(LAPIC_LVT_TIMER, LAPIC_VEC_TIMER);
+	}
+}
+
+/*
+ * Enable the local APIC of the current CPU.  On the boot CPU, also
+ * check that there is one at all and install the interrupt gates.
+ * Returns 0 on success.
+ */
+int
+x86_lapic_init(int bsp)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t apicbase;
+
+	if (bsp) {
+		x86_cpuid(0x1, &eax, &ebx, &ecx, &edx);
+		if ((edx & (1<<9)) == 0)
+			return 1;
+		lapic_tscdeadline = (ecx & (1<<24)) != 0;
+
+		x86_fillgate(LAPIC_VEC_TIMER, x86_lapic_timer_isr, 0);
+		x86_fillgate(LAPIC_VEC_IPI, x86_lapic_isr, 0);
+		x86_fillgate(LAPIC_VEC_SPURIOUS, x86_lapic_spurious, 0);
+	}
+
+	/* global enable, in case the firmware did not do it */
+	apicbase = rdmsr(MSR_APICBASE);
+	if ((apicbase & (1<<11)) == 0)
+		wrmsr(MSR_APICBASE, apicbase | (1<<11));
+	if (bsp) {
+		x86_lapic_base = apicbase & MSR_APICBASE_ADDR;
+		lapic_uncache(x86_lapic_base);
+	}
+
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_VEC_SPURIOUS);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_LVT_LINT0,
+	    bsp ? LAPIC_LVT_EXTINT : LAPIC_LVT_EXTINT | LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+
+	/* on the boot CPU, the timer is set up after calibrating it */
+	if (bsp) {
+		lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DIV16);
+		lapic_write(LAPIC_TIMER_ICR, 0);
+		lapic_write(LAPIC_LVT_TIMER,
+		    LAPIC_VEC_TIMER | LAPIC_LVT_MASKED);
+	} else {
+		lapic_timer_init();
+	}
+
+	return 0;
+}
+
+unsigned int
+x86_lapic_id(void)
+{
+
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+/*
+ * Send an interprocessor interrupt.  Interrupts are blocked
+ * so that nobody else gets to use the ICR between the two writes.
+ */
+void
+x86_lapic_ipi(unsigned int apicid, uint32_t icrlo)
+{
+	unsigned long s;
+
+	s = bmk_platform_splhigh();
+	while (lapic_read(LAPIC_ICRLO) & LAPIC_ICR_PENDING)
+		continue;
+	lapic_write(LAPIC_ICRHI, apicid << 24);
+	lapic_write(LAPIC_ICRLO, icrlo);
+	bmk_platform_splx(s);
+}
+
+/*
+ * Measure the timer frequency, and the TSC frequency for TSC-deadline
+ * mode, against the monotonic clock.  All local APIC timers run at
+ * the same rate, so doing this once on the boot CPU is enough.
+ * After this, every CPU sleeps on its local APIC timer.
+ */
+void
+x86_lapic_calibrate(void)
+{
+	bmk_time_t start, now;
+	uint64_t tscstart, tscticks;
+	uint32_t ticks;
+
+	start = bmk_platform_cpu_clock_monotonic();
+	tscstart = rdtsc_pure();
+	lapic_write(LAPIC_TIMER_ICR, 0xffffffff);
+	do {
+		now = bmk_platform_cpu_clock_monotonic();
+	} while (now - start < CALIBRATE_NSEC);
+	ticks = 0xffffffff - lapic_read(LAPIC_TIMER_CCR);
+	tscticks = rdtsc_pure() - tscstart;
+	lapic_write(LAPIC_TIMER_ICR, 0);
+
+	lapic_khz = ((uint64_t)ticks * NSEC_PER_MSEC) / (now - start);
+	if (lapic_khz == 0)
+		lapic_khz = 1;
+	tsc_khz = (tscticks * NSEC_PER_MSEC) / (now - start);
+	if (tsc_khz == 0)
+		lapic_tscdeadline = 0;
+	bmk_printf("x86_lapic_calibrate(): timer frequency estimate is "
+	    "%llu kHz, using %s mode\n", (unsigned long long)lapic_khz,
+	    lapic_tscdeadline ? "TSC-deadline" : "one-shot");
+
+	lapic_timer_init();
+	x86_lapic_timer = 1;
+}
+
+/*
+ * bmk_platform_cpu_block() once the timer is calibrated.  Sleep
+ * until "until" or until we get an interrupt, whichever comes first.
+ */
+void
+x86_lapic_block(bmk_time_t until)
+{
+	bmk_time_t now, delta;
+	uint64_t ticks, deadline;
+
+	now = bmk_platform_cpu_clock_monotonic();
+	if (until <= now)
+		return;
+
+	/* a few microseconds too early is fine, the scheduler just loops */
+	delta = until - now;
+	if (delta > NSEC_PER_SEC)
+		delta = NSEC_PER_SEC;
+
+	if (lapic_tscdeadline) {
+		deadline = rdtsc_pure() + (delta * tsc_khz) / NSEC_PER_MSEC;
+		wrmsr(MSR_TSC_DEADLINE, deadline);
+		x86_cpu_idle();
+		/* disarm if woken up early, or it would fire for nothing */
+		if (rdtsc_pure() < deadline)
+			wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		ticks = (delta * lapic_khz) / NSEC_PER_MSEC;
+		if (ticks == 0)
+			ticks = 1;
+		lapic_write(LAPIC_TIMER_ICR, ticks);
+		x86_cpu_idle();
+		lapic_write(LAPIC_TIMER_ICR, 0);
+	}
+}
+
+/*
+ * Arm the timer to interrupt at "until" without sleeping, or disarm
+ * it if "until" is 0.  This is the time slice timer of the running
+ * thread, x86_lapic_block() takes the timer over while idle.
+ */
+void
+x86_lapic_settimer(bmk_time_t until)
+{
+	bmk_time_t now, delta;
+	uint64_t ticks;
+
+	if (until == 0) {
+		if (lapic_tscdeadline)
+			wrmsr(MSR_TSC_DEADLINE, 0);
+		else
+			lapic_write(LAPIC_TIMER_ICR, 0);
+		return;
+	}
+
+	now = bmk_platform_cpu_clock_monotonic();
+	delta = until > now ? until - now : 1;
+	if (delta > NSEC_PER_SEC)
+		delta = NSEC_PER_SEC;
+
+	if (lapic_tscdeadline) {
+		wrmsr(MSR_TSC_DEADLINE,
+		    rdtsc_pure() + (delta * tsc_khz) / NSEC_PER_MSEC);
+	} else {
+		ticks = (delta * lapic_khz) / NSEC_PER_MSEC;
+		if (ticks == 0)
+			ticks = 1;
+		lapic_write(LAPIC_TIMER_ICR, ticks);
+	}
+}
@@ -28,7 +28,6 @@
 #include <bmk-core/printf.h>
 
 #include <arch/x86/cons.h>
-#include <arch/x86/tsc.h>
 
 static uint16_t combase = 0;
 
@@ -57,9 +56,6 @@ serialcons_init(uint16_t combase_init, int speed)
 }
 char reset_buffer[] = "reset";
 int pos = 0;
-uint64_t cpucount = 0;
-uint64_t cpucount2 = 0;
-extern uint64_t ccount;
 unsigned char getDebugChar(void);
 unsigned char getDebugChar(void)
 {
@@ -77,16 +73,6 @@ unsigned char getDebugChar(void)
         } else {
             pos = 0;
         }
-		if (c == 'a') {
-			cpucount = rdtsc_pure();
-			ccount = 0;
-		}
-
-		if (c == 'b') {
-			cpucount2 = rdtsc_pure();
-			bmk_printf("tot: %ld\n idle: %ld\n", cpucount2 - cpucount, ccount);
-
-		}
     }
 	if (c == '\r')
 		c = '\n';
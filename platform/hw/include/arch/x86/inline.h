@@ -32,7 +32,11 @@ outl(uint16_t port, uint32_t value)
         __asm__ __volatile__("outl %0, %1" :: "a"(value), "d"(port));
 }
 
+/* amd64 keeps this per-CPU, see md.h */
+#ifndef spldepth
 extern int spldepth;
+#define x86_curcpu_index() 0
+#endif
 
 static inline void
 splhigh(void)
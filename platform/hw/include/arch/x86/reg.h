@@ -15,6 +15,44 @@
 
 #define MSR_EFER_LME	0x00000100 /* Long Mode Enable */
 
+#define MSR_FSBASE	0xc0000100
+#define MSR_GSBASE	0xc0000101
+
+#define MSR_APICBASE	0x0000001b
+#define MSR_APICBASE_ADDR 0xfffff000
+
+#define MSR_TSC_DEADLINE 0x000006e0
+
+/* local APIC registers, offsets from the MSR_APICBASE address */
+#define LAPIC_ID	0x020
+#define LAPIC_TPR	0x080
+#define LAPIC_EOI	0x0b0
+#define LAPIC_SVR	0x0f0
+#define LAPIC_SVR_ENABLE 0x00000100
+#define LAPIC_ICRLO	0x300
+#define LAPIC_ICRHI	0x310
+#define LAPIC_ICR_INIT	0x00000500
+#define LAPIC_ICR_STARTUP 0x00000600
+#define LAPIC_ICR_PENDING 0x00001000
+#define LAPIC_ICR_ASSERT 0x00004000
+#define LAPIC_ICR_LEVEL	0x00008000
+#define LAPIC_LVT_TIMER	0x320
+#define LAPIC_LVT_LINT0	0x350
+#define LAPIC_LVT_LINT1	0x360
+#define LAPIC_LVT_EXTINT 0x00000700
+#define LAPIC_LVT_NMI	0x00000400
+#define LAPIC_LVT_MASKED 0x00010000
+#define LAPIC_LVT_TSCDEADLINE 0x00040000
+#define LAPIC_TIMER_ICR	0x380
+#define LAPIC_TIMER_CCR	0x390
+#define LAPIC_TIMER_DCR	0x3e0
+#define LAPIC_TIMER_DIV16 0x3
+
+/* IDT vectors used with the local APIC */
+#define LAPIC_VEC_TIMER	0xef
+#define LAPIC_VEC_IPI	0xf0
+#define LAPIC_VEC_SPURIOUS 0xff
+
 #define PIC1_CMD	0x20
 #define PIC1_DATA	0x21
 #define PIC2_CMD	0xa0
@@ -5,8 +5,24 @@ void	x86_boot(struct multiboot_info *);
 void	x86_initpic(void);
 void	x86_initidt(void);
 void	x86_initclocks(void);
+void	x86_cpu_idle(void);
 void	x86_fillgate(int, void *, int);
 
+/* local APIC and secondary CPUs, amd64 only */
+extern unsigned long x86_lapic_base;
+extern int x86_lapic_timer;
+int	x86_lapic_init(int);
+unsigned int x86_lapic_id(void);
+void	x86_lapic_ipi(unsigned int, uint32_t);
+void	x86_lapic_calibrate(void);
+void	x86_lapic_block(bmk_time_t);
+void	x86_lapic_settimer(bmk_time_t);
+void	x86_lapic_isr(void);
+void	x86_lapic_timer_isr(void);
+void	x86_lapic_spurious(void);
+void	x86_smp_init(void);
+void	x86_initclocks_ap(void);
+
 /* trap "handlers" */
 void x86_trap_0(void);
 void x86_trap_2(void);
@@ -9,6 +9,12 @@
 #define BMK_THREAD_STACKSIZE ((1<<BMK_THREAD_STACK_PAGE_ORDER) \
     * BMK_PCPU_PAGE_SIZE)
 
+/* real mode entry point for secondary CPUs, see mptramp.S */
+#define MPTRAMP_BASE 0x8000
+
+/* offset of xc_tlbgen in struct x86_cpu, for intr.S */
+#define XC_TLBGEN 72
+
 #include <arch/x86/reg.h>
 #include <arch/x86/var.h>
 
@@ -17,8 +23,38 @@
 
 struct region_descriptor;
 void amd64_lidt(struct region_descriptor *);
+void amd64_lgdt(struct region_descriptor *);
 void amd64_ltr(unsigned long);
 
+/*
+ * Per-CPU data.  %gs points to the current CPU's x86_cpu,
+ * and the self pointer must come first so that we can find it.
+ */
+struct x86_cpu {
+	struct x86_cpu *xc_self;
+	int xc_spldepth;
+	int xc_index;
+	unsigned int xc_apicid;
+	volatile int xc_running;
+	unsigned long xc_gdt[6];
+	volatile unsigned long xc_tlbgen;	/* last TLB flush seen */
+};
+extern struct x86_cpu x86_cpus[];
+
+static inline struct x86_cpu *
+x86_curcpu(void)
+{
+	struct x86_cpu *ci;
+
+	/* threads never migrate, so this need not be volatile */
+	__asm__("movq %%gs:0, %0" : "=r"(ci));
+	return ci;
+}
+#define spldepth (x86_curcpu()->xc_spldepth)
+#define x86_curcpu_index() (x86_curcpu()->xc_index)
+
+void x86_cpu_initap(struct x86_cpu *);
+
 #include <arch/x86/inline.h>
 
 void cpu_boot(void *);
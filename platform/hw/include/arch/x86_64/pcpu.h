@@ -4,4 +4,10 @@
 #define BMK_PCPU_PAGE_SHIFT 12UL
 #define BMK_PCPU_PAGE_SIZE (1<<BMK_PCPU_PAGE_SHIFT)
 
+/* size of the large pages the boot page tables map memory with */
+#define BMK_PCPU_HUGEPAGE_SHIFT 21UL
+
+/* upper limit for secondary CPUs started by arch/amd64/smp.c */
+#define BMK_PCPU_MAXCPUS 16
+
 #endif /* _BMK_PCPU_PCPU_H_ */
@@ -1,5 +1,8 @@
 #include <hw/machine/md.h>
 
+#ifndef _BMK_HW_KERNEL_H_
+#define _BMK_HW_KERNEL_H_
+
 #ifndef _LOCORE
 
 #include <hw/types.h>
@@ -12,9 +15,12 @@ void cons_putc(int);
 void cons_puts(const char *);
 
 void cpu_init(void);
+int cpu_mapmem(unsigned long, unsigned long *);
 void cpu_block(bmk_time_t);
 int cpu_intr_init(int);
 void cpu_intr_ack(unsigned);
+void cpu_intr_mask(unsigned);
+void cpu_intr_unmask(unsigned);
 
 bmk_time_t cpu_clock_now(void);
 bmk_time_t cpu_clock_epochoffset(void);
@@ -25,6 +31,20 @@ void bmk_isr_rumpkernel(int (*)(void *), void *, int, int);
 
 #define BMK_INTR_ROUTED 0x01
 
+struct bmk_isr_stats {
+	unsigned long long is_intrs;	/* interrupts delivered */
+	unsigned long long is_rate;	/* interrupts/s, last sample */
+	unsigned long long is_work;	/* handler calls which did work */
+	unsigned long long is_polls;	/* polling passes */
+	bmk_time_t is_time;		/* nanoseconds spent in handlers */
+	int is_polling;			/* currently in polling mode */
+	unsigned long long is_latn;	/* latency samples */
+	bmk_time_t is_latavg;		/* avg ns from interrupt to doisr */
+	bmk_time_t is_latmax;		/* max ns from interrupt to doisr */
+};
+void bmk_isr_setpolling(unsigned long, int);
+int bmk_isr_getstats(int, struct bmk_isr_stats *);
+
 #define BMK_MULTIBOOT_CMDLINE_SIZE 4096
 extern char multiboot_cmdline[];
 
@@ -35,3 +55,5 @@ extern char multiboot_cmdline[];
 #define BMK_MAXINTR	32
 
 #define HZ 100
+
+#endif /* _BMK_HW_KERNEL_H_ */
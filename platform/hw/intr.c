@@ -27,9 +27,11 @@
 
 #include <bmk-core/core.h>
 #include <bmk-core/memalloc.h>
+#include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
 #include <bmk-core/queue.h>
 #include <bmk-core/sched.h>
+#include <bmk-core/trace.h>
 
 #include <bmk-rumpuser/core_types.h>
 #include <bmk-rumpuser/rumpuser.h>
@@ -56,6 +58,39 @@ static unsigned int isr_lowest = sizeof(isr_todo)*8;
 
 static struct bmk_thread *isr_thread;
 
+/*
+ * Interrupt mitigation.  If an interrupt line fires at more than
+ * isr_pollrate times per second, doisr() switches it to polling:
+ * the line is kept masked and its handlers are run up to
+ * isr_pollbudget times per round, yielding the CPU between rounds,
+ * until a pass finds no work, after which the line is unmasked again.
+ * This avoids a thread wakeup and rump kernel schedule per interrupt
+ * under high load.  A rate of 0 disables polling.
+ */
+#define INTR_POLLRATE 20000
+#define INTR_POLLBUDGET 8
+#define INTR_RATEWINDOW (10*1000*1000ULL)
+
+static unsigned long isr_pollrate = INTR_POLLRATE;
+static int isr_pollbudget = INTR_POLLBUDGET;
+static unsigned int isr_polled;
+
+static struct isr_counters {
+	unsigned long long ic_intrs;
+	unsigned long long ic_work;
+	unsigned long long ic_polls;
+	unsigned long long ic_rate;
+	bmk_time_t ic_time;
+
+	unsigned long long ic_lastintrs;
+	bmk_time_t ic_lastts;
+
+	/* interrupt to handler latency */
+	bmk_time_t ic_stamp;		/* first undelivered interrupt */
+	bmk_time_t ic_latsum, ic_latmax;
+	unsigned long long ic_latn;
+} isr_counters[INTR_LEVELS];
+
 static int
 routeintr(int i)
 {
@@ -67,11 +102,99 @@ routeintr(int i)
 #endif
 }
 
+/*
+ * Run the handlers for an interrupt.  Returns the number of
+ * handlers which reported that they did something.
+ */
+static int
+runhandlers(int i)
+{
+	struct isr_counters *ic = &isr_counters[i];
+	struct intrhand *ih;
+	bmk_time_t ts;
+	int work = 0;
+
+	ts = bmk_platform_cpu_clock_monotonic();
+	if (isr_routed[i] == INTR_ROUTED_YES)
+		i = routeintr(i);
+	SLIST_FOREACH(ih, &isr_ih[i], ih_entries) {
+		if (ih->ih_fun(ih->ih_arg))
+			work++;
+	}
+	ic->ic_time += bmk_platform_cpu_clock_monotonic() - ts;
+	ic->ic_work += work;
+
+	return work;
+}
+
+/*
+ * Update the interrupt rate of the lines which fired and
+ * return the ones which should be switched to polling.
+ */
+static unsigned int
+checkrates(unsigned int fired)
+{
+	struct isr_counters *ic;
+	unsigned int topoll = 0;
+	bmk_time_t now, delta;
+	int i;
+
+	now = bmk_platform_cpu_clock_monotonic();
+	for (i = isr_lowest; fired; i++) {
+		if ((fired & (1<<i)) == 0)
+			continue;
+		fired &= ~(1<<i);
+
+		ic = &isr_counters[i];
+		delta = now - ic->ic_lastts;
+		if (delta < INTR_RATEWINDOW)
+			continue;
+		ic->ic_rate = (ic->ic_intrs - ic->ic_lastintrs)
+		    * 1000*1000*1000ULL / delta;
+		ic->ic_lastintrs = ic->ic_intrs;
+		ic->ic_lastts = now;
+
+		if (isr_pollrate && ic->ic_rate > isr_pollrate)
+			topoll |= 1<<i;
+	}
+
+	return topoll;
+}
+
+/*
+ * Account the time from the interrupt until doisr() picked it up.
+ * Called at splhigh.
+ */
+static void
+latency(unsigned int fired)
+{
+	struct isr_counters *ic;
+	bmk_time_t now, lat;
+	int i;
+
+	now = bmk_platform_cpu_clock_monotonic();
+	while (fired) {
+		i = __builtin_ctz(fired);
+		fired &= ~(1<<i);
+
+		ic = &isr_counters[i];
+		if (ic->ic_stamp == 0)
+			continue;
+		lat = now - ic->ic_stamp;
+		ic->ic_stamp = 0;
+		ic->ic_latsum += lat;
+		if (lat > ic->ic_latmax)
+			ic->ic_latmax = lat;
+		ic->ic_latn++;
+	}
+}
+
 /* thread context we use to deliver interrupts to the rump kernel */
 static void
 doisr(void *arg)
 {
-	int i, totwork = 0;
+	unsigned int topoll, idle;
+	int i, pass, totwork = 0;
 
 	rumpuser__hyp.hyp_schedule();
 	rumpuser__hyp.hyp_lwproc_newlwp(0);
@@ -79,38 +202,67 @@ doisr(void *arg)
 
 	splhigh();
 	for (;;) {
-		unsigned int isrcopy;
+		unsigned int isrcopy, pollcopy;
 		int nlocks = 1;
 
 		isrcopy = isr_todo;
 		isr_todo = 0;
+		latency(isrcopy);
 		spl0();
 
 		totwork |= isrcopy;
+		pollcopy = isr_polled;
+		idle = 0;
 
 		rumpkern_sched(nlocks, NULL);
 		for (i = isr_lowest; isrcopy; i++) {
-			struct intrhand *ih;
-
 			bmk_assert(i < sizeof(isrcopy)*8);
 			if ((isrcopy & (1<<i)) == 0)
 				continue;
 			isrcopy &= ~(1<<i);
 
-			if (isr_routed[i] == INTR_ROUTED_YES)
-				i = routeintr(i);
-
-			SLIST_FOREACH(ih, &isr_ih[i], ih_entries) {
-				ih->ih_fun(ih->ih_arg);
+			runhandlers(i);
+		}
+		for (i = isr_lowest; pollcopy; i++) {
+			if ((pollcopy & (1<<i)) == 0)
+				continue;
+			pollcopy &= ~(1<<i);
+
+			for (pass = 0; pass < isr_pollbudget; pass++) {
+				isr_counters[i].ic_polls++;
+				if (runhandlers(i) == 0) {
+					idle |= 1<<i;
+					break;
+				}
 			}
 		}
 		rumpkern_unsched(&nlocks, NULL);
 
+		topoll = checkrates(totwork) & ~isr_polled;
+
 		splhigh();
+		if (topoll) {
+			cpu_intr_mask(topoll);
+			isr_polled |= topoll;
+		}
 		if (isr_todo)
 			continue;
 
-		cpu_intr_ack(totwork);
+		cpu_intr_ack(totwork & ~isr_polled);
+		totwork = 0;
+
+		if (idle) {
+			isr_polled &= ~idle;
+			cpu_intr_unmask(idle);
+		}
+
+		/* lines in polling mode: give others a chance and go again */
+		if (isr_polled) {
+			spl0();
+			bmk_sched_yield();
+			splhigh();
+			continue;
+		}
 
 		/* no interrupts left. block until the next one. */
 		bmk_sched_blockprepare();
@@ -118,11 +270,88 @@ doisr(void *arg)
 		spl0();
 
 		bmk_sched_block();
-		totwork = 0;
 		splhigh();
 	}
 }
 
+void
+bmk_isr_setpolling(unsigned long rate, int budget)
+{
+
+	isr_pollrate = rate;
+	if (budget > 0)
+		isr_pollbudget = budget;
+}
+
+int
+bmk_isr_getstats(int intr, struct bmk_isr_stats *st)
+{
+	struct isr_counters *ic;
+
+	if (intr < 0 || intr >= INTR_LEVELS || isr_routed[intr] == INTR_ROUTED_NOIDEA)
+		return BMK_EINVAL;
+
+	ic = &isr_counters[intr];
+	st->is_intrs = ic->ic_intrs;
+	st->is_rate = ic->ic_rate;
+	st->is_work = ic->ic_work;
+	st->is_polls = ic->ic_polls;
+	st->is_time = ic->ic_time;
+	st->is_polling = (isr_polled & (1<<intr)) != 0;
+	st->is_latn = ic->ic_latn;
+	st->is_latavg = ic->ic_latn ? ic->ic_latsum / ic->ic_latn : 0;
+	st->is_latmax = ic->ic_latmax;
+
+	return 0;
+}
+
+static void
+intr_consoleout(void *arg, const char *buf, unsigned long len)
+{
+
+	bmk_printf("%s", buf);
+}
+
+/*
+ * Dump the per-IRQ counters through "out", or to the console if out
+ * is NULL, in the format of bmk_sched_acct_dump().  Lines which never
+ * had a handler established are skipped.
+ */
+int
+bmk_platform_intr_dump(void (*out)(void *, const char *, unsigned long),
+	void *arg)
+{
+	struct bmk_isr_stats st;
+	char line[128];
+	int i;
+
+	if (out == NULL)
+		out = intr_consoleout;
+
+#define INTRLINE(...)							\
+	out(arg, line, bmk_snprintf(line, sizeof(line), __VA_ARGS__))
+
+	for (i = 0; i < INTR_LEVELS; i++) {
+		if (bmk_isr_getstats(i, &st) != 0)
+			continue;
+		INTRLINE("intr.irq%d.intrs = %llu\n", i, st.is_intrs);
+		INTRLINE("intr.irq%d.rate = %llu\n", i, st.is_rate);
+		INTRLINE("intr.irq%d.work = %llu\n", i, st.is_work);
+		INTRLINE("intr.irq%d.polls = %llu\n", i, st.is_polls);
+		INTRLINE("intr.irq%d.polling = %d\n", i, st.is_polling);
+		INTRLINE("intr.irq%d.handler_ns = %llu\n", i,
+		    (unsigned long long)st.is_time);
+		INTRLINE("intr.irq%d.latency_avg_ns = %llu\n", i,
+		    (unsigned long long)st.is_latavg);
+		INTRLINE("intr.irq%d.latency_max_ns = %llu\n", i,
+		    (unsigned long long)st.is_latmax);
+	}
+
+#undef INTRLINE
+
+	return 0;
+}
+
 void
 bmk_isr_rumpkernel(int (*func)(void *), void *arg, int intr, int flags)
 {
@@ -174,6 +403,9 @@ unsigned char getDebugChar(void);
 void
 isr(int which)
 {
+	bmk_time_t now;
+
+	bmk_trace(BMK_TRACE_INTR, which, 0);
 	if ((which & 1<<4) != 0) {
 #if (defined(__i386__) || defined(__x86_64__))
 		serialcons_putc(getDebugChar());
@@ -185,10 +417,22 @@ isr(int which)
 	/* schedule the interrupt handler */
 	isr_todo |= which;
 		if (isr_todo == 0) {
+		bmk_trace(BMK_TRACE_INTREND, 0, 0);
 		return;
 	}
 
+	now = bmk_platform_cpu_clock_monotonic();
+	while (which) {
+		int i = __builtin_ctz(which);
+
+		isr_counters[i].ic_intrs++;
+		if (isr_counters[i].ic_stamp == 0)
+			isr_counters[i].ic_stamp = now;
+		which &= ~(1<<i);
+	}
+
 	bmk_sched_wake(isr_thread);
+	bmk_trace(BMK_TRACE_INTREND, 0, 0);
 }
 
 void
@@ -203,4 +447,5 @@ intr_init(void)
 	isr_thread = bmk_sched_create("isrthr", NULL, 0, doisr, NULL, NULL, 0);
 	if (!isr_thread)
 		bmk_platform_halt("intr_init");
+	bmk_sched_setpri(isr_thread, BMK_SCHED_PRI_INTR);
 }
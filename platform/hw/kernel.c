@@ -28,7 +28,9 @@
 #include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
 
+#ifndef spldepth
 int spldepth = 1;
+#endif
 
 /*
  * splhigh()/spl0() internally track depth
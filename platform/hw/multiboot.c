@@ -36,34 +36,92 @@
 
 #define MEMSTART 0x100000
 
+/* highest address an unsigned long can hold, i.e. we can address */
+#define MEMEND ((multiboot_uint64_t)~0UL)
+
+struct memrange {
+	unsigned long mr_start, mr_end;
+};
+
+/*
+ * Feed every available memory region to the page allocator.  The
+ * BIOS area below MEMSTART is left alone, and the region the kernel
+ * is loaded into starts after the end of the kernel image.  Regions
+ * are loaded in address order, so that the ones under the static
+ * identity map go first and cpu_mapmem() can allocate the page
+ * tables for the rest from them.
+ */
 static int
 parsemem(uint32_t addr, uint32_t len)
 {
+	struct memrange mem[BMK_PGALLOC_MAXRANGES], tmp;
 	struct multiboot_mmap_entry *mbm;
+	multiboot_uint64_t start, end;
 	unsigned long osend;
 	extern char _end[];
 	uint32_t off;
+	int i, j, n, haveos;
+
+	osend = bmk_round_page((unsigned long)_end);
 
 	/*
-	 * Look for our memory.  We assume it's just in one chunk
-	 * starting at MEMSTART.
+	 * Copy the map first.  It may live in memory we are about
+	 * to give away.
 	 */
+	n = haveos = 0;
 	for (off = 0; off < len; off += mbm->size + sizeof(mbm->size)) {
 		mbm = (void *)(uintptr_t)(addr + off);
-		if (mbm->addr == MEMSTART
-		    && mbm->type == MULTIBOOT_MEMORY_AVAILABLE) {
-			break;
+		if (mbm->type != MULTIBOOT_MEMORY_AVAILABLE)
+			continue;
+
+		start = mbm->addr;
+		end = mbm->addr + mbm->len;
+		if (start <= MEMSTART && end > MEMSTART) {
+			bmk_assert(osend > start && osend < end);
+			haveos = 1;
 		}
+		if (start < osend)
+			start = osend;
+		if (end > MEMEND)
+			end = MEMEND;
+		if (bmk_round_page(start) >= bmk_trunc_page(end))
+			continue;
+
+		if (n == BMK_PGALLOC_MAXRANGES) {
+			bmk_printf("multiboot: too many memory regions, "
+			    "ignoring 0x%llx-0x%llx\n",
+			    (unsigned long long)start, (unsigned long long)end);
+			continue;
+		}
+		mem[n].mr_start = start;
+		mem[n].mr_end = end;
+		n++;
 	}
-	if (!(off < len))
+	if (!haveos)
 		bmk_platform_halt("multiboot memory chunk not found");
 
-	osend = bmk_round_page((unsigned long)_end);
-	bmk_assert(osend > mbm->addr && osend < mbm->addr + mbm->len);
-
-	bmk_pgalloc_loadmem(osend, mbm->addr + mbm->len);
+	for (i = 1; i < n; i++) {
+		tmp = mem[i];
+		for (j = i; j > 0 && mem[j-1].mr_start > tmp.mr_start; j--)
+			mem[j] = mem[j-1];
+		mem[j] = tmp;
+	}
 
-	bmk_memsize = mbm->addr + mbm->len - osend;
+	bmk_memsize = 0;
+	for (i = 0; i < n; i++) {
+		end = mem[i].mr_end;
+		if (cpu_mapmem(mem[i].mr_start, &mem[i].mr_end) != 0) {
+			bmk_printf("multiboot: cannot map memory at 0x%lx-0x%lx,"
+			    " ignoring\n", mem[i].mr_start, mem[i].mr_end);
+			continue;
+		}
+		if (mem[i].mr_end < end) {
+			bmk_printf("multiboot: cannot map memory at 0x%lx-0x%lx,"
+			    " ignoring\n", mem[i].mr_end, (unsigned long)end);
+		}
+		bmk_pgalloc_loadmem(mem[i].mr_start, mem[i].mr_end);
+		bmk_memsize += mem[i].mr_end - mem[i].mr_start;
+	}
 
 	return 0;
 }
@@ -41,6 +41,7 @@
 #include <utils/util.h>
 #include <platsupport/timer.h>
 #include <bmk-core/core.h>
+#include <bmk-core/errno.h>
 #include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
 #include <sel4/helpers.h>
@@ -110,3 +111,13 @@ bmk_platform_cpu_block(bmk_time_t until)
 
     bmk_platform_splhigh();
 }
+
+/*
+ * The timer server is only used for blocking, so there is no slice timer
+ * and bmk_sched_preempt() checks the slice on the clock.
+ */
+int
+bmk_platform_cpu_slicetimer(bmk_time_t until)
+{
+    return BMK_ENOSYS;
+}
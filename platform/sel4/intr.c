@@ -40,6 +40,7 @@
 #include <sel4/sel4.h>
 #include <bmk-core/core.h>
 #include <bmk-core/memalloc.h>
+#include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
 #include <bmk-core/queue.h>
 #include <bmk-core/sched.h>
@@ -217,4 +218,14 @@ intr_init(void)
     if (!isr_thread) {
         bmk_platform_halt("intr_init");
     }
+    bmk_sched_setpri(isr_thread, BMK_SCHED_PRI_INTR);
+}
+
+/* interrupts are not counted */
+int
+bmk_platform_intr_dump(void (*out)(void *, const char *, unsigned long),
+    void *arg)
+{
+
+    return BMK_ENOSYS;
 }
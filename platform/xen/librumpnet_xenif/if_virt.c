@@ -34,6 +34,8 @@ __KERNEL_RCSID(0, "$NetBSD: if_virt.c,v 1.36 2013/07/04 11:46:51 pooka Exp $");
 #include <sys/kernel.h>
 #include <sys/kmem.h>
 #include <sys/kthread.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
 #include <sys/mutex.h>
 #include <sys/poll.h>
 #include <sys/sockio.h>
@@ -170,44 +172,62 @@ virtif_ioctl(struct ifnet *ifp, u_long cmd, void *data)
 
 /*
  * Output packets in-context until outgoing queue is empty.
- * Assume that VIFHYPER_SEND() is fast enough to not make it
- * necessary to drop kernel_lock.
+ * Packets are handed to the hypervisor in batches, and the
+ * mbufs are freed by rump_virtif_txdone() once the data has
+ * been transmitted.
  */
-#define LB_SH 32
+#define VIF_TXBATCH 32
+#define VIF_TXIOV 128
 static void
 virtif_start(struct ifnet *ifp)
 {
 	struct virtif_sc *sc = ifp->if_softc;
 	struct mbuf *m, *m0;
-	struct iovec io[LB_SH];
-	int i;
+	struct virtif_txpkt pkts[VIF_TXBATCH];
+	struct iovec io[VIF_TXIOV];
+	int i, npkts, niov;
 
 	ifp->if_flags |= IFF_OACTIVE;
 
-	for (;;) {
+	for (npkts = niov = 0;;) {
 		IF_DEQUEUE(&ifp->if_snd, m0);
 		if (!m0) {
 			break;
 		}
 
-		m = m0;
-		for (i = 0; i < LB_SH && m; i++) {
-			io[i].iov_base = mtod(m, void *);
-			io[i].iov_len = m->m_len;
-			m = m->m_next;
-		}
-		if (i == LB_SH)
+		for (i = 0, m = m0; m; m = m->m_next)
+			i++;
+		if (i > VIF_MAXSEGS)
 			panic("lazy bum");
-		bpf_mtap(ifp, m0);
-
-		VIFHYPER_SEND(sc->sc_viu, io, i);
+		if (npkts == VIF_TXBATCH || niov + i > VIF_TXIOV) {
+			VIFHYPER_SEND(sc->sc_viu, pkts, npkts);
+			npkts = niov = 0;
+		}
 
-		m_freem(m0);
+		pkts[npkts].vt_iov = &io[niov];
+		pkts[npkts].vt_iovlen = i;
+		pkts[npkts].vt_cookie = m0;
+		for (m = m0; m; m = m->m_next) {
+			io[niov].iov_base = mtod(m, void *);
+			io[niov].iov_len = m->m_len;
+			niov++;
+		}
+		npkts++;
+		bpf_mtap(ifp, m0);
 	}
+	if (npkts)
+		VIFHYPER_SEND(sc->sc_viu, pkts, npkts);
 
 	ifp->if_flags &= ~IFF_OACTIVE;
 }
 
+void
+rump_virtif_txdone(struct virtif_sc *sc, void *cookie)
+{
+
+	m_freem(cookie);
+}
+
 static void
 virtif_stop(struct ifnet *ifp, int disable)
 {
@@ -215,6 +235,22 @@ virtif_stop(struct ifnet *ifp, int disable)
 	ifp->if_flags &= ~IFF_RUNNING;
 }
 
+static void
+virtif_input(struct ifnet *ifp, struct mbuf *m)
+{
+
+#if __NetBSD_Prereq__(7,99,31)
+	m_set_rcvif(m, ifp);
+#else
+	m->m_pkthdr.rcvif = ifp;
+#endif
+
+	KERNEL_LOCK(1, NULL);
+	bpf_mtap(ifp, m);
+	ether_input(ifp, m);
+	KERNEL_UNLOCK_LAST(NULL);
+}
+
 void
 rump_virtif_pktdeliver(struct virtif_sc *sc, struct iovec *iov, size_t iovlen)
 {
@@ -242,14 +278,39 @@ rump_virtif_pktdeliver(struct virtif_sc *sc, struct iovec *iov, size_t iovlen)
 		}
 	}
 
-#if __NetBSD_Prereq__(7,99,31)
-	m_set_rcvif(m, ifp);
-#else
-	m->m_pkthdr.rcvif = ifp;
-#endif
+	virtif_input(ifp, m);
+}
 
-	KERNEL_LOCK(1, NULL);
-	bpf_mtap(ifp, m);
-	ether_input(ifp, m);
-	KERNEL_UNLOCK_LAST(NULL);
+/*
+ * Loaned receive buffers.  The hypercall layer gives us a buffer
+ * which we attach to an mbuf as external storage, and the buffer
+ * is given back via VIFHYPER_RXFREE() once the mbuf is freed.
+ */
+static void
+virtif_loan_free(struct mbuf *m, void *buf, size_t size, void *arg)
+{
+	struct virtif_sc *sc = arg;
+
+	VIFHYPER_RXFREE(sc->sc_viu, buf);
+	if (__predict_true(m != NULL))
+		pool_cache_put(mb_cache, m);
+}
+
+void
+rump_virtif_pktdeliver_loan(struct virtif_sc *sc, void *data, size_t dlen)
+{
+	struct ifnet *ifp = &sc->sc_ec.ec_if;
+	struct mbuf *m;
+
+	if ((ifp->if_flags & IFF_RUNNING) == 0
+	    || (m = m_gethdr(M_NOWAIT, MT_DATA)) == NULL) {
+		/* drop packet */
+		VIFHYPER_RXFREE(sc->sc_viu, data);
+		return;
+	}
+
+	MEXTADD(m, data, dlen, M_DEVBUF, virtif_loan_free, sc);
+	m->m_len = m->m_pkthdr.len = dlen;
+
+	virtif_input(ifp, m);
 }
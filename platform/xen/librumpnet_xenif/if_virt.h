@@ -22,6 +22,9 @@
 #define VIFHYPER_DYING VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_dying)
 #define VIFHYPER_DESTROY VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_destroy)
 #define VIFHYPER_SEND VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_send)
+#define VIFHYPER_RXFREE VIF_BASENAME3(rumpcomp_,VIRTIF_BASE,_rxfree)
 
 struct virtif_sc;
 void rump_virtif_pktdeliver(struct virtif_sc *, struct iovec *, size_t);
+void rump_virtif_pktdeliver_loan(struct virtif_sc *, void *, size_t);
+void rump_virtif_txdone(struct virtif_sc *, void *);
@@ -27,9 +27,19 @@
 
 struct virtif_user;
 
+/* max segments per packet */
+#define VIF_MAXSEGS 32
+
+struct virtif_txpkt {
+	struct iovec *vt_iov;
+	size_t vt_iovlen;
+	void *vt_cookie;
+};
+
 int 	VIFHYPER_CREATE(int, struct virtif_sc *, uint8_t *,
 			struct virtif_user **);
 void	VIFHYPER_DYING(struct virtif_user *);
 void	VIFHYPER_DESTROY(struct virtif_user *);
 
-void	VIFHYPER_SEND(struct virtif_user *, struct iovec *, size_t);
+void	VIFHYPER_SEND(struct virtif_user *, struct virtif_txpkt *, size_t);
+void	VIFHYPER_RXFREE(struct virtif_user *, void *);
@@ -34,6 +34,8 @@ struct iovec {
 
 #include <bmk-core/errno.h>
 #include <bmk-core/memalloc.h>
+#include <bmk-core/pgalloc.h>
+#include <bmk-core/printf.h>
 #include <bmk-core/string.h>
 #include <bmk-core/sched.h>
 
@@ -44,66 +46,207 @@ struct iovec {
 #include "if_virt_user.h"
 
 /*
- * For now, shovel the packets from the interrupt to a
- * thread context via an intermediate set of buffers.  Need
- * to fix this a bit down the road.
+ * Received packets are not copied.  netfront gives us the page the
+ * backend wrote the packet into, we give netfront a fresh page from
+ * our pool in return, and the packet page is loaned to the rump
+ * kernel as mbuf external storage.  When the mbuf is freed, the page
+ * comes back to the pool via VIFHYPER_RXFREE().
+ *
+ * Since netfront calls us from interrupt context, we cannot go to
+ * the page allocator there.  Instead, the pusher thread keeps the
+ * pool topped up.  Packets are dropped only if the pool runs dry.
+ *
+ * The packet descriptor is stored at the end of the packet page,
+ * so queueing a packet does not require memory either.
+ *
+ * Transmitted packets are not copied either (well, mostly, see
+ * netfront).  The mbuf chain is the cookie which netfront gives back
+ * once the backend is done with the data.  Completions are reaped
+ * by the pusher thread, which is woken up from the netfront handler.
+ *
+ * With a multi-queue backend, every netfront queue has its own
+ * pusher thread and packet queue; the RX page pool is shared.  The
+ * TX queue for a packet is picked by a hash of its flow, so that
+ * the packets of one connection stay in order.
  */
-#define MAXPKT 2000
 struct onepkt {
-	unsigned char pkt_data[MAXPKT];
+	struct onepkt *pkt_next;
+	unsigned char *pkt_data;
 	int pkt_dlen;
 };
+#define PKT_DESC(page) \
+    ((struct onepkt *)((char *)(page) + PAGE_SIZE) - 1)
+
+struct poolpage {
+	struct poolpage *pp_next;
+};
+
+/*
+ * Per queue, the pool is filled up to LOW by the pushers, freed
+ * pages are kept up to HIGH.
+ */
+#define RXPOOL_LOW 64
+#define RXPOOL_HIGH 256
+
+struct virtif_queue {
+	struct virtif_user *viq_viu;
+	int viq_id;
+
+	struct bmk_thread *viq_rcvr;
+	struct bmk_thread *viq_thr;
+
+	struct onepkt *viq_pkthead;
+	struct onepkt **viq_pkttail;
+
+	int viq_txdone;
+};
 
-#define NBUF 64
 struct virtif_user {
 	struct netfront_dev *viu_dev;
-	struct bmk_thread *viu_rcvr;
-	struct bmk_thread *viu_thr;
 	struct virtif_sc *viu_vifsc;
 
-	int viu_read;
-	int viu_write;
+	struct virtif_queue viu_queues[NETFRONT_MAXQUEUES];
+	int viu_nqueues;
+
+	struct poolpage *viu_pool;
+	int viu_npool;
+	int viu_nloaned;
+
 	int viu_dying;
-	struct onepkt viu_pkts[NBUF];
+	int viu_destroyed;
 };
 
+/* call with interrupts disabled */
+static void *
+rxpool_get(struct virtif_user *viu)
+{
+	struct poolpage *pp;
+
+	if ((pp = viu->viu_pool) != NULL) {
+		viu->viu_pool = pp->pp_next;
+		viu->viu_npool--;
+	}
+	return pp;
+}
+
+/* call with interrupts disabled */
+static void
+rxpool_put(struct virtif_user *viu, void *page)
+{
+	struct poolpage *pp = page;
+
+	pp->pp_next = viu->viu_pool;
+	viu->viu_pool = pp;
+	viu->viu_npool++;
+}
+
+static void
+rxpool_fill(struct virtif_user *viu)
+{
+	void *page;
+	int flags;
+
+	local_irq_save(flags);
+	while (viu->viu_npool < viu->viu_nqueues * RXPOOL_LOW) {
+		local_irq_restore(flags);
+		if ((page = bmk_pgalloc_one()) == NULL)
+			return;
+		local_irq_save(flags);
+		rxpool_put(viu, page);
+	}
+	local_irq_restore(flags);
+}
+
+static void
+rxpool_drain(struct virtif_user *viu)
+{
+	void *page;
+
+	while ((page = rxpool_get(viu)) != NULL)
+		bmk_pgfree_one(page);
+}
+
 /*
- * Ok, based on how (the unmodified) netfront works, we need to
- * consume the data here.  So store it locally (and revisit some day).
+ * Called from netfront interrupt context.  Returns the page netfront
+ * should put back into the RX ring.
  */
-static void
-myrecv(struct netfront_dev *dev, unsigned char *data, int dlen)
+static void *
+myrecv(struct netfront_dev *dev, int queue, void *page,
+	unsigned char *data, int dlen)
 {
 	struct virtif_user *viu = netfront_get_private(dev);
-	int nextw;
+	struct virtif_queue *viq = &viu->viu_queues[queue];
+	struct onepkt *pkt;
+	void *newpage, *pktpage;
 
 	/* TODO: we should be at the correct spl already, assert how? */
 
-	nextw = (viu->viu_write+1) % NBUF;
-	/* queue full?  drop packet */
-	if (nextw == viu->viu_read) {
-		return;
-	}
+	/* pool empty?  drop packet */
+	if ((newpage = rxpool_get(viu)) == NULL)
+		return page;
 
-	if (dlen > MAXPKT) {
-		minios_printk("myrecv: pkt len %d too big\n", dlen);
-		return;
+	/*
+	 * If there's no room for the descriptor after the packet, we
+	 * have to copy.  Shouldn't happen with ethernet-sized frames.
+	 */
+	if (data + dlen > (unsigned char *)PKT_DESC(page)) {
+		if (dlen > PAGE_SIZE - (int)sizeof(*pkt)) {
+			minios_printk("myrecv: pkt len %d too big\n", dlen);
+			rxpool_put(viu, newpage);
+			return page;
+		}
+		bmk_memcpy(newpage, data, dlen);
+		data = newpage;
+		pktpage = newpage;
+		newpage = page;
+	} else {
+		pktpage = page;
 	}
 
-	bmk_memcpy(viu->viu_pkts[viu->viu_write].pkt_data, data, dlen);
-	viu->viu_pkts[viu->viu_write].pkt_dlen = dlen;
-	viu->viu_write = nextw;
+	pkt = PKT_DESC(pktpage);
+	pkt->pkt_next = NULL;
+	pkt->pkt_data = data;
+	pkt->pkt_dlen = dlen;
+	*viq->viq_pkttail = pkt;
+	viq->viq_pkttail = &pkt->pkt_next;
+	viu->viu_nloaned++;
 
-	if (viu->viu_rcvr)
-		bmk_sched_wake(viu->viu_rcvr);
+	if (viq->viq_rcvr)
+		bmk_sched_wake(viq->viq_rcvr);
+
+	return newpage;
+}
+
+/*
+ * Called from netfront when transmitted packets can be reaped.
+ */
+static void
+mytxdone(struct netfront_dev *dev, int queue)
+{
+	struct virtif_user *viu = netfront_get_private(dev);
+	struct virtif_queue *viq = &viu->viu_queues[queue];
+
+	viq->viq_txdone = 1;
+	if (viq->viq_rcvr)
+		bmk_sched_wake(viq->viq_rcvr);
+}
+
+static void
+txreap(struct virtif_queue *viq)
+{
+	struct virtif_user *viu = viq->viq_viu;
+	void *cookie;
+
+	while ((cookie = netfront_xmit_reap(viu->viu_dev, viq->viq_id)) != NULL)
+		rump_virtif_txdone(viu->viu_vifsc, cookie);
 }
 
 static void
 pusher(void *arg)
 {
-	struct virtif_user *viu = arg;
-	struct iovec iov;
-	struct onepkt *mypkt;
+	struct virtif_queue *viq = arg;
+	struct virtif_user *viu = viq->viq_viu;
+	struct onepkt *mypkt, *nextpkt;
 	int flags;
 
 	/* give us a rump kernel context */
@@ -112,39 +255,87 @@ pusher(void *arg)
 	rumpuser__hyp.hyp_unschedule();
 
 	local_irq_save(flags);
- again:
 	while (!viu->viu_dying) {
-		while (viu->viu_read == viu->viu_write) {
-			viu->viu_rcvr = bmk_current;
+		if (viq->viq_pkthead == NULL && !viq->viq_txdone) {
+			viq->viq_rcvr = bmk_current;
 			bmk_sched_blockprepare();
 			local_irq_restore(flags);
 			bmk_sched_block();
 			local_irq_save(flags);
-			viu->viu_rcvr = NULL;
-			goto again;
+			viq->viq_rcvr = NULL;
+			continue;
 		}
-		mypkt = &viu->viu_pkts[viu->viu_read];
-		local_irq_restore(flags);
 
-		iov.iov_base = mypkt->pkt_data;
-		iov.iov_len =  mypkt->pkt_dlen;
+		/* grab everything queued so far */
+		mypkt = viq->viq_pkthead;
+		viq->viq_pkthead = NULL;
+		viq->viq_pkttail = &viq->viq_pkthead;
+		viq->viq_txdone = 0;
+		local_irq_restore(flags);
 
 		rumpuser__hyp.hyp_schedule();
-		rump_virtif_pktdeliver(viu->viu_vifsc, &iov, 1);
+		txreap(viq);
+		for (; mypkt; mypkt = nextpkt) {
+			nextpkt = mypkt->pkt_next;
+			rump_virtif_pktdeliver_loan(viu->viu_vifsc,
+			    mypkt->pkt_data, mypkt->pkt_dlen);
+		}
 		rumpuser__hyp.hyp_unschedule();
 
+		rxpool_fill(viu);
+
 		local_irq_save(flags);
-		viu->viu_read = (viu->viu_read+1) % NBUF;
 	}
 	local_irq_restore(flags);
 }
 
+static void
+viu_free(struct virtif_user *viu)
+{
+
+	rxpool_drain(viu);
+	bmk_memfree(viu, BMK_MEMWHO_RUMPKERN);
+}
+
+/*
+ * Called by the rump kernel when a loaned packet is freed.
+ */
+void
+VIFHYPER_RXFREE(struct virtif_user *viu, void *data)
+{
+	void *page = (void *)((unsigned long)data & ~(PAGE_SIZE-1));
+	int flags, lastref;
+
+	local_irq_save(flags);
+	viu->viu_nloaned--;
+	lastref = viu->viu_destroyed && viu->viu_nloaned == 0;
+	if (viu->viu_destroyed) {
+		/* grants went away with the device */
+	} else if (viu->viu_npool < viu->viu_nqueues * RXPOOL_HIGH
+	    || viu->viu_dev == NULL) {
+		/* pool the page, also while the device is shutting down */
+		rxpool_put(viu, page);
+		page = NULL;
+	} else {
+		/* the backend must not keep write access to a freed page */
+		netfront_rxpage_release(viu->viu_dev, page);
+	}
+	local_irq_restore(flags);
+
+	if (page)
+		bmk_pgfree_one(page);
+	if (lastref)
+		viu_free(viu);
+}
+
 int
 VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
 	struct virtif_user **viup)
 {
 	struct virtif_user *viu = NULL;
-	int rv, nlocks;
+	struct virtif_queue *viq;
+	char name[16];
+	int rv, nlocks, i;
 
 	rumpkern_unsched(&nlocks, NULL);
 
@@ -155,19 +346,34 @@ VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
 	}
 	bmk_memset(viu, 0, sizeof(*viu));
 	viu->viu_vifsc = vif_sc;
+	for (i = 0; i < NETFRONT_MAXQUEUES; i++) {
+		viq = &viu->viu_queues[i];
+		viq->viq_viu = viu;
+		viq->viq_id = i;
+		viq->viq_pkttail = &viq->viq_pkthead;
+	}
+	viu->viu_nqueues = 1;
+	rxpool_fill(viu);
 
-	viu->viu_dev = netfront_init(NULL, myrecv, enaddr, NULL, viu);
+	viu->viu_dev = netfront_init(NULL, myrecv, mytxdone,
+	    enaddr, NULL, viu);
 	if (!viu->viu_dev) {
 		rv = BMK_EINVAL; /* ? */
-		bmk_memfree(viu, BMK_MEMWHO_RUMPKERN);
+		viu_free(viu);
 		goto out;
 	}
 
-	viu->viu_thr = bmk_sched_create("xenifp",
-	    NULL, 1, pusher, viu, NULL, 0);
-	if (viu->viu_thr == NULL) {
-		minios_printk("fatal thread creation failure\n"); /* XXX */
-		minios_do_exit();
+	viu->viu_nqueues = netfront_nqueues(viu->viu_dev);
+	for (i = 0; i < viu->viu_nqueues; i++) {
+		viq = &viu->viu_queues[i];
+		bmk_snprintf(name, sizeof(name), "xenifp%d", i);
+		viq->viq_thr = bmk_sched_create(name,
+		    NULL, 1, pusher, viq, NULL, 0);
+		if (viq->viq_thr == NULL) {
+			minios_printk("fatal thread creation failure\n"); /* XXX */
+			minios_do_exit();
+		}
+		bmk_sched_setpri(viq->viq_thr, BMK_SCHED_PRI_INTR);
 	}
 
 	rv = 0;
@@ -179,69 +385,182 @@ VIFHYPER_CREATE(int devnum, struct virtif_sc *vif_sc, uint8_t *enaddr,
 	return rv;
 }
 
+/* Jenkins one-at-a-time */
+static uint32_t
+hashbytes(uint32_t h, const uint8_t *p, size_t n)
+{
+
+	while (n--) {
+		h += *p++;
+		h += h << 10;
+		h ^= h >> 6;
+	}
+	return h;
+}
+
+/*
+ * Hash of the flow a packet belongs to: the IP addresses, protocol
+ * and, for TCP and UDP, the ports.  IPv4 fragments are hashed
+ * without ports, so that all fragments of a datagram go the same
+ * way.  Non-IP packets hash to 0.
+ */
+#define TXHASH_HDRLEN (14+60+4)
+static uint32_t
+txhash(const struct virtif_txpkt *pkt)
+{
+	uint8_t hdr[TXHASH_HDRLEN];
+	size_t len, c, i, off;
+	uint32_t h;
+	uint8_t proto;
+	int ports;
+
+	/* the headers may be spread over several mbufs */
+	for (len = 0, i = 0; i < pkt->vt_iovlen && len < sizeof(hdr); i++) {
+		c = pkt->vt_iov[i].iov_len;
+		if (c > sizeof(hdr) - len)
+			c = sizeof(hdr) - len;
+		bmk_memcpy(hdr + len, pkt->vt_iov[i].iov_base, c);
+		len += c;
+	}
+	if (len < 14)
+		return 0;
+
+	switch (hdr[12] << 8 | hdr[13]) {
+	case 0x0800:
+		if (len < 14+20)
+			return 0;
+		off = 14 + (hdr[14] & 0xf) * 4;
+		proto = hdr[14+9];
+		ports = (hdr[14+6] & 0x3f) == 0 && hdr[14+7] == 0;
+		h = hashbytes(0, &hdr[14+12], 8);
+		break;
+	case 0x86dd:
+		if (len < 14+40)
+			return 0;
+		off = 14+40;
+		proto = hdr[14+6];
+		ports = 1;
+		h = hashbytes(0, &hdr[14+8], 32);
+		break;
+	default:
+		return 0;
+	}
+
+	h = hashbytes(h, &proto, 1);
+	if (ports && (proto == 6 || proto == 17) && off + 4 <= len)
+		h = hashbytes(h, &hdr[off], 4);
+
+	h += h << 3;
+	h ^= h >> 11;
+	h += h << 15;
+	return h;
+}
+
+/*
+ * Queue a batch of packets and kick the backend once per queue
+ * used.  Packets which cannot be sent are completed right away.
+ */
 void
 VIFHYPER_SEND(struct virtif_user *viu,
-	struct iovec *iov, size_t iovlen)
+	struct virtif_txpkt *pkts, size_t npkts)
 {
-	size_t tlen, i;
-	int nlocks;
-	void *d;
-	char *d0;
+	struct netfront_txseg segs[VIF_MAXSEGS];
+	struct virtif_txpkt *pkt;
+	size_t i, j;
+	unsigned int pushmask = 0;
+	int nlocks, ndropped = 0, q;
 
 	rumpkern_unsched(&nlocks, NULL);
-	/*
-	 * netfront doesn't do scatter-gather, so just simply
-	 * copy the data into one lump here.  drop packet if we
-	 * can't allocate temp memory space.
-	 */
-	if (iovlen == 1) {
-		d = iov->iov_base;
-		tlen = iov->iov_len;
-	} else {
-		for (i = 0, tlen = 0; i < iovlen; i++) {
-			tlen += iov[i].iov_len;
+	for (i = 0; i < npkts; i++) {
+		pkt = &pkts[i];
+		if (pkt->vt_iovlen > VIF_MAXSEGS) {
+			pkt->vt_iovlen = 0;
+			ndropped++;
+			continue;
 		}
-
-		/*
-		 * allocate the temp space from RUMPKERN instead of BMK
-		 * since there are no huge repercussions if we fail or
-		 * succeed.
-		 */
-		d = d0 = bmk_memalloc(tlen, 0, BMK_MEMWHO_RUMPKERN);
-		if (d == NULL)
-			goto out;
-
-		for (i = 0; i < iovlen; i++) {
-			bmk_memcpy(d0, iov[i].iov_base, iov[i].iov_len);
-			d0 += iov[i].iov_len;
+		for (j = 0; j < pkt->vt_iovlen; j++) {
+			segs[j].ts_base = pkt->vt_iov[j].iov_base;
+			segs[j].ts_len = pkt->vt_iov[j].iov_len;
 		}
+		q = viu->viu_nqueues > 1 ? txhash(pkt) % viu->viu_nqueues : 0;
+		if (netfront_xmit_queue(viu->viu_dev, q, segs, j,
+		    pkt->vt_cookie) != 0) {
+			pkt->vt_iovlen = 0;
+			ndropped++;
+			continue;
+		}
+		pushmask |= 1U << q;
+	}
+	for (q = 0; pushmask; q++, pushmask >>= 1) {
+		if (pushmask & 1)
+			netfront_xmit_push(viu->viu_dev, q);
 	}
-
-	netfront_xmit(viu->viu_dev, d, tlen);
-
-	if (iovlen != 1)
-		bmk_memfree(d, BMK_MEMWHO_RUMPKERN);
-
- out:
 	rumpkern_sched(nlocks, NULL);
+
+	for (i = 0; ndropped && i < npkts; i++) {
+		if (pkts[i].vt_iovlen == 0) {
+			rump_virtif_txdone(viu->viu_vifsc, pkts[i].vt_cookie);
+			ndropped--;
+		}
+	}
 }
 
 void
 VIFHYPER_DYING(struct virtif_user *viu)
 {
+	struct virtif_queue *viq;
+	int i;
 
 	viu->viu_dying = 1;
-	if (viu->viu_rcvr)
-		bmk_sched_wake(viu->viu_rcvr);
+	for (i = 0; i < viu->viu_nqueues; i++) {
+		viq = &viu->viu_queues[i];
+		if (viq->viq_rcvr)
+			bmk_sched_wake(viq->viq_rcvr);
+	}
 }
 
 void
 VIFHYPER_DESTROY(struct virtif_user *viu)
 {
+	struct netfront_dev *dev;
+	struct virtif_queue *viq;
+	struct onepkt *pkt;
+	int flags, lastref, i;
 
 	ASSERT(viu->viu_dying == 1);
 
-	bmk_sched_join(viu->viu_thr);
-	netfront_shutdown(viu->viu_dev);
-	bmk_memfree(viu, BMK_MEMWHO_RUMPKERN);
+	for (i = 0; i < viu->viu_nqueues; i++)
+		bmk_sched_join(viu->viu_queues[i].viq_thr);
+
+	/* give back the mbufs the backend is still working on */
+	netfront_xmit_wait(viu->viu_dev);
+	for (i = 0; i < viu->viu_nqueues; i++)
+		txreap(&viu->viu_queues[i]);
+
+	/* RXFREE pools pages until the grants are gone with the device */
+	local_irq_save(flags);
+	dev = viu->viu_dev;
+	viu->viu_dev = NULL;
+	local_irq_restore(flags);
+	netfront_shutdown(dev);
+
+	/* packets still queued after the pushers exited are dropped */
+	for (i = 0; i < viu->viu_nqueues; i++) {
+		viq = &viu->viu_queues[i];
+		while ((pkt = viq->viq_pkthead) != NULL) {
+			viq->viq_pkthead = pkt->pkt_next;
+			viu->viu_nloaned--;
+			bmk_pgfree_one((void *)
+			    ((unsigned long)pkt & ~(PAGE_SIZE-1)));
+		}
+	}
+
+	/* if the rump kernel still holds loaned pages, last free frees viu */
+	local_irq_save(flags);
+	viu->viu_destroyed = 1;
+	lastref = viu->viu_nloaned == 0;
+	local_irq_restore(flags);
+
+	if (lastref)
+		viu_free(viu);
 }
@@ -39,30 +39,31 @@
 #include <bmk-rumpuser/core_types.h>
 #include <bmk-rumpuser/rumpuser.h>
 
-static struct rumpuser_mtx *bio_mtx;
-static struct rumpuser_cv *bio_cv;
-static int bio_outstanding_total;
-
 #define NBLKDEV 10
 #define BLKFDOFF 64
 
+struct biocb;
+
 static struct blkdev {
 	struct blkfront_dev *blk_dev;
 	struct blkfront_info blk_info;
 	int blk_open;
-	int blk_outstanding;
 	int blk_vbd;
+
+	struct biocb *blk_biopool;
+	struct biocb *blk_biofree;
 } blkdevs[NBLKDEV];
 
+static void biointr(struct blkfront_dev *, void *);
+static void biopool_init(struct blkdev *);
+static void biopool_fini(struct blkdev *);
+
 /* not really bio-specific, but only touches this file for now */
 int
 rumprun_platform_rumpuser_init(void)
 {
 	int i;
 
-	rumpuser_mutex_init(&bio_mtx, RUMPUSER_MTX_SPIN);
-	rumpuser_cv_init(&bio_cv);
-
 	for (i = 0; i < NBLKDEV; i++) {
 		blkdevs[i].blk_vbd = -1;
 	}
@@ -90,6 +91,8 @@ devopen(int num)
 
 	if (bd->blk_dev != NULL) {
 		bd->blk_open = 1;
+		biopool_init(bd);
+		blkfront_set_notify(bd->blk_dev, biointr, bd);
 		return 0;
 	} else {
 		return BMK_EIO; /* guess something */
@@ -252,6 +255,7 @@ rumpuser_close(int fd)
 		/* not sure if this appropriately prevents races either ... */
 		bd->blk_dev = NULL;
 		blkfront_shutdown(toclose);
+		biopool_fini(bd);
 	}
 
 	return 0;
@@ -277,39 +281,139 @@ rumpuser_getfileinfo(const char *name, uint64_t *size, int *type)
 	return 0;
 }
 
+/*
+ * Requests larger than what blkfront can do in one go are split
+ * into chunks of max_segments pages, each of which gets a biocb.
+ * The first chunk (head) carries the request and is completed when
+ * all chunks are.
+ *
+ * biocbs come from a per-device pool with one entry per ring slot.
+ * If that runs out (requests waiting for a slot), we fall back to
+ * malloc.
+ *
+ * Completions are processed by biothread.  The blkfront interrupt
+ * handler marks the device as pending and wakes up the thread, which
+ * then polls only the devices which fired, and calls the biodone
+ * routines for everything completed under one rump kernel schedule.
+ * Since bmk threads are not preempted, only the pending mask needs
+ * interrupts disabled.
+ */
 struct biocb {
 	struct blkfront_aiocb bio_aiocb;
-	int bio_num;
+	struct biocb *bio_head;
+	struct biocb *bio_next;
+	struct blkdev *bio_bd;
+	int bio_malloced;
+
+	/* head only */
+	int bio_pending;
+	int bio_error;
+	size_t bio_dlen;
 	rump_biodone_fn bio_done;
 	void *bio_arg;
 };
 
+static struct bmk_thread *bio_thread;
+static unsigned long bio_devpending;
+static struct biocb *bio_donehead;
+
+static void
+biopool_init(struct blkdev *bd)
+{
+	int i, n = bd->blk_info.nslots;
+
+	bd->blk_biopool = bmk_memcalloc(n, sizeof(*bd->blk_biopool),
+	    BMK_MEMWHO_WIREDBMK);
+	bd->blk_biofree = NULL;
+	for (i = 0; bd->blk_biopool && i < n; i++) {
+		bd->blk_biopool[i].bio_next = bd->blk_biofree;
+		bd->blk_biofree = &bd->blk_biopool[i];
+	}
+}
+
+static void
+biopool_fini(struct blkdev *bd)
+{
+
+	bmk_memfree(bd->blk_biopool, BMK_MEMWHO_WIREDBMK);
+	bd->blk_biopool = bd->blk_biofree = NULL;
+}
+
+static struct biocb *
+bio_get(struct blkdev *bd)
+{
+	struct biocb *bio;
+
+	if ((bio = bd->blk_biofree) != NULL) {
+		bd->blk_biofree = bio->bio_next;
+		bio->bio_malloced = 0;
+	} else {
+		bio = bmk_xmalloc_bmk(sizeof(*bio));
+		bio->bio_malloced = 1;
+	}
+	bio->bio_bd = bd;
+	return bio;
+}
+
+static void
+bio_put(struct biocb *bio)
+{
+	struct blkdev *bd = bio->bio_bd;
+
+	if (bio->bio_malloced) {
+		bmk_memfree(bio, BMK_MEMWHO_WIREDBMK);
+	} else {
+		bio->bio_next = bd->blk_biofree;
+		bd->blk_biofree = bio;
+	}
+}
+
+static void
+biowakeup(void)
+{
+
+	if (bio_thread)
+		bmk_sched_wake(bio_thread);
+}
+
+/* called from interrupt context */
+static void
+biointr(struct blkfront_dev *dev, void *arg)
+{
+	struct blkdev *bd = arg;
+
+	bio_devpending |= 1UL << (bd - blkdevs);
+	biowakeup();
+}
+
+/*
+ * Called from blkfront_aio_poll(), either by biothread or by a
+ * thread waiting for a ring slot.  Queue the finished request for
+ * biothread to call biodone.
+ */
 static void
 biocomp(struct blkfront_aiocb *aiocb, int ret)
 {
 	struct biocb *bio = aiocb->data;
-	int dummy, num;
+	struct biocb *head = bio->bio_head;
 
-	rumpkern_sched(0, NULL);
 	if (ret)
-		bio->bio_done(bio->bio_arg, 0, BMK_EIO);
-	else
-		bio->bio_done(bio->bio_arg, bio->bio_aiocb.aio_nbytes, 0);
-	rumpkern_unsched(&dummy, NULL);
-	num = bio->bio_num;
-	bmk_memfree(bio, BMK_MEMWHO_WIREDBMK);
-
-	rumpuser_mutex_enter_nowrap(bio_mtx);
-	bio_outstanding_total--;
-	blkdevs[num].blk_outstanding--;
-	rumpuser_mutex_exit(bio_mtx);
+		head->bio_error = BMK_EIO;
+	if (bio != head)
+		bio_put(bio);
+	if (--head->bio_pending == 0) {
+		head->bio_next = bio_donehead;
+		bio_donehead = head;
+		biowakeup();
+	}
 }
 
 static void
 biothread(void *arg)
 {
-	DEFINE_WAIT(w);
-	int flags, did;
+	struct biocb *bio, *nextbio;
+	unsigned long pending;
+	int flags, i, dummy;
 
 	/* for the bio callback */
 	rumpuser__hyp.hyp_schedule();
@@ -317,81 +421,180 @@ biothread(void *arg)
 	rumpuser__hyp.hyp_unschedule();
 
 	for (;;) {
-		rumpuser_mutex_enter_nowrap(bio_mtx);
-		while (bio_outstanding_total == 0) {
-			rumpuser_cv_wait_nowrap(bio_cv, bio_mtx);
-		}
-		rumpuser_mutex_exit(bio_mtx);
-
-		/*
-		 * if we made any progress, recheck.  could be batched,
-		 * but since currently locks are free here ... meh
-		 */
 		local_irq_save(flags);
-		for (did = 0;;) {
-			struct blkdev *bd;
-
-			for (bd = &blkdevs[0]; bd < &blkdevs[NBLKDEV]; bd++) {
-				if (bd->blk_outstanding)
-					did += blkfront_aio_poll(bd->blk_dev);
-			}
-			if (did)
-				break;
-			minios_add_waiter(w, blkfront_queue);
+		while (bio_devpending == 0 && bio_donehead == NULL) {
+			bio_thread = bmk_current;
+			bmk_sched_blockprepare();
 			local_irq_restore(flags);
-			minios_wait(w);
+			bmk_sched_block();
 			local_irq_save(flags);
+			bio_thread = NULL;
 		}
+		pending = bio_devpending;
+		bio_devpending = 0;
 		local_irq_restore(flags);
+
+		for (i = 0; pending; i++, pending >>= 1) {
+			if ((pending & 1) && blkdevs[i].blk_dev)
+				blkfront_aio_poll(blkdevs[i].blk_dev);
+		}
+
+		if ((bio = bio_donehead) == NULL)
+			continue;
+		bio_donehead = NULL;
+
+		rumpkern_sched(0, NULL);
+		for (nextbio = bio; nextbio; nextbio = nextbio->bio_next) {
+			if (nextbio->bio_error)
+				nextbio->bio_done(nextbio->bio_arg, 0,
+				    nextbio->bio_error);
+			else
+				nextbio->bio_done(nextbio->bio_arg,
+				    nextbio->bio_dlen, 0);
+		}
+		rumpkern_unsched(&dummy, NULL);
+
+		for (; bio; bio = nextbio) {
+			nextbio = bio->bio_next;
+			bio_put(bio);
+		}
 	}
 }
 
+/*
+ * Requests are split at page boundaries into chunks of at most
+ * maxsegs pages.  Every chunk but the first starts on a page boundary.
+ */
+static int
+bio_nchunks(unsigned long start, unsigned long end, int maxsegs)
+{
+	unsigned long npages;
+
+	npages = (bmk_round_page(end) - bmk_trunc_page(start)) / PAGE_SIZE;
+	return (npages + maxsegs-1) / maxsegs;
+}
+
+static unsigned long
+bio_chunkend(unsigned long cstart, unsigned long end, int maxsegs)
+{
+	unsigned long cend;
+
+	cend = bmk_trunc_page(cstart) + maxsegs * PAGE_SIZE;
+	if (cend > end)
+		cend = end;
+	return cend;
+}
+
 void
 rumpuser_bio(int fd, int op, void *data, size_t dlen, int64_t off,
 	rump_biodone_fn biodone, void *donearg)
 {
 	static int bio_inited;
-	struct biocb *bio = bmk_xmalloc_bmk(sizeof(*bio));
-	struct blkfront_aiocb *aiocb = &bio->bio_aiocb;
+	struct biocb *bio, *head;
+	struct blkfront_aiocb *aiocb;
 	int nlocks;
 	int num = fd - BLKFDOFF;
 	struct blkdev *bd = &blkdevs[num];
+	unsigned long start, end, cstart, cend;
+	int i, nchunks, maxsegs;
+
+	/* split at page boundaries so that each chunk fills a request */
+	maxsegs = bd->blk_info.max_segments;
+	start = (unsigned long)data;
+	end = start + dlen;
+	nchunks = bio_nchunks(start, end, maxsegs);
 
 	rumpkern_unsched(&nlocks, NULL);
 
+	/* threads are not preempted, so no need to lock */
 	if (!bio_inited) {
-		rumpuser_mutex_enter_nowrap(bio_mtx);
-		if (!bio_inited) {
-			bio_inited = 1;
-			rumpuser_mutex_exit(bio_mtx);
-			bmk_sched_create("biopoll", NULL, 0,
-			    biothread, NULL, NULL, 0);
-		} else {
-			rumpuser_mutex_exit(bio_mtx);
-		}
+		bio_inited = 1;
+		struct bmk_thread *thr;
+
+		thr = bmk_sched_create("biopoll", NULL, 0,
+		    biothread, NULL, NULL, 0);
+		if (thr != NULL)
+			bmk_sched_setpri(thr, BMK_SCHED_PRI_INTR);
 	}
 
-	bio->bio_done = biodone;
-	bio->bio_arg = donearg;
-	bio->bio_num = num;
+	head = bio_get(bd);
+	head->bio_done = biodone;
+	head->bio_arg = donearg;
+	head->bio_dlen = dlen;
+	head->bio_error = 0;
+	head->bio_pending = nchunks;
+
+	for (i = 0, cstart = start; i < nchunks; i++, cstart = cend) {
+		cend = bio_chunkend(cstart, end, maxsegs);
+
+		bio = i == 0 ? head : bio_get(bd);
+		bio->bio_head = head;
+
+		aiocb = &bio->bio_aiocb;
+		bmk_memset(aiocb, 0, sizeof(*aiocb));
+		aiocb->aio_dev = bd->blk_dev;
+		aiocb->aio_buf = (void *)cstart;
+		aiocb->aio_nbytes = cend - cstart;
+		aiocb->aio_offset = off + (cstart - start);
+		aiocb->aio_cb = biocomp;
+		aiocb->data = bio;
+
+		if (op & RUMPUSER_BIO_READ)
+			blkfront_aio_read(aiocb);
+		else
+			blkfront_aio_write(aiocb);
+	}
 
-	aiocb->aio_dev = bd->blk_dev;
-	aiocb->aio_buf = data;
-	aiocb->aio_nbytes = dlen;
-	aiocb->aio_offset = off;
-	aiocb->aio_cb = biocomp;
-	aiocb->data  = bio;
+	rumpkern_sched(nlocks, NULL);
+}
 
-	if (op & RUMPUSER_BIO_READ)
-		blkfront_aio_read(aiocb);
-	else
-		blkfront_aio_write(aiocb);
+#ifdef BIO_TESTING
 
-	rumpuser_mutex_enter(bio_mtx);
-	bio_outstanding_total++;
-	bd->blk_outstanding++;
-	rumpuser_cv_signal(bio_cv);
-	rumpuser_mutex_exit(bio_mtx);
+/*
+ * Check that the chunks cover the request exactly, none of them
+ * empty (the backend fails 0-segment requests) or longer than
+ * maxsegs pages.  Includes requests whose page count is an exact
+ * multiple of maxsegs, aligned and unaligned.
+ */
+static const struct {
+	unsigned long off, len;
+	int maxsegs;
+} biotest_cases[] = {
+	{ 0,		11*PAGE_SIZE,	11 },
+	{ 0,		22*PAGE_SIZE,	11 },
+	{ 0,		256*PAGE_SIZE,	256 },
+	{ 0,		512*PAGE_SIZE,	256 },
+	{ 512,		11*PAGE_SIZE-1024, 11 },
+	{ 512,		11*PAGE_SIZE,	11 },
+	{ 0,		512,		11 },
+	{ PAGE_SIZE-512, 1024,		1 },
+	{ 1024,		33*PAGE_SIZE,	11 },
+	{ 0,		PAGE_SIZE,	1 },
+};
 
-	rumpkern_sched(nlocks, NULL);
+/* XXX: no prototype */
+void rumpuser_bio_chunktest(void);
+void
+rumpuser_bio_chunktest(void)
+{
+	unsigned long start, end, cstart, cend, base = 0x100000;
+	unsigned i;
+	int j, n, maxsegs;
+
+	for (i = 0; i < sizeof(biotest_cases)/sizeof(biotest_cases[0]); i++) {
+		start = base + biotest_cases[i].off;
+		end = start + biotest_cases[i].len;
+		maxsegs = biotest_cases[i].maxsegs;
+
+		n = bio_nchunks(start, end, maxsegs);
+		for (j = 0, cstart = start; j < n; j++, cstart = cend) {
+			cend = bio_chunkend(cstart, end, maxsegs);
+			bmk_assert(cend > cstart);
+			bmk_assert(bmk_round_page(cend) - bmk_trunc_page(cstart)
+			    <= maxsegs * PAGE_SIZE);
+		}
+		bmk_assert(cstart == end);
+	}
+	bmk_printf("bio chunk test: %u cases ok\n", i);
 }
+#endif /* BIO_TESTING */
@@ -1,6 +1,18 @@
 /* Minimal block driver for Mini-OS. 
  * Copyright (c) 2007-2008 Samuel Thibault.
  * Based on netfront.c.
+ *
+ * If the backend supports persistent grants (feature-persistent), I/O
+ * goes through a pool of bounce pages which are granted once and stay
+ * granted, since the backend keeps them mapped.  Otherwise, grants to
+ * the caller's buffers are kept in a grant cache keyed on the MFN, so
+ * that repeated I/O to the same buffers reuses the grants.
+ *
+ * Requests larger than BLKIF_MAX_SEGMENTS_PER_REQUEST pages are sent as
+ * indirect requests if the backend supports them, which makes the max
+ * request size BLKFRONT_MAX_SEGMENTS pages.  If the backend supports
+ * multiple queues, we set up one ring and event channel per queue and
+ * distribute requests over them round-robin.
  */
 
 #include <mini-os/os.h>
@@ -31,17 +43,42 @@ DECLARE_WAIT_QUEUE_HEAD(blkfront_queue);
 #define BLK_RING_SIZE __RING_SIZE((struct blkif_sring *)0, PAGE_SIZE)
 #define GRANT_INVALID_REF 0
 
+#define BLK_MAX_QUEUES 4
+
+/* max number of data pages a device can have in flight */
+#define BLK_MAX_INFLIGHT (4*BLKFRONT_MAX_SEGMENTS)
+
+#define BLK_SEGS_PER_INDIRECT_FRAME \
+    (PAGE_SIZE / sizeof(struct blkif_request_segment))
+#define BLK_INDIRECT_PAGES(segs) \
+    (((segs) + BLK_SEGS_PER_INDIRECT_FRAME - 1) / BLK_SEGS_PER_INDIRECT_FRAME)
+
+/* a persistently granted bounce page */
+struct blk_pgrant {
+    void *page;
+    grant_ref_t gref;
+    struct blk_pgrant *next;
+    struct blk_pgrant *allnext;
+};
+
 struct blk_buffer {
     void* page;
     grant_ref_t gref;
 };
 
-struct blkfront_dev {
-    domid_t dom;
-
+struct blk_queue {
     struct blkif_front_ring ring;
     grant_ref_t ring_ref;
     evtchn_port_t evtchn;
+};
+
+struct blkfront_dev {
+    domid_t dom;
+
+    struct blk_queue queues[BLK_MAX_QUEUES];
+    int nqueues;
+    int nextqueue;
+    int inflight;
     blkif_vdev_t handle;
 
     char nodename[64];
@@ -50,23 +87,109 @@ struct blkfront_dev {
 
     struct xenbus_event_queue events;
 
+    int persistent;
+    struct blk_pgrant *pgrant_free;
+    struct blk_pgrant *pgrant_all;
+    int npgrant_free;
+
+    void (*notify)(struct blkfront_dev *, void *);
+    void *notify_arg;
 };
 
+static struct blk_pgrant *blkfront_get_pgrant(struct blkfront_dev *dev)
+{
+    struct blk_pgrant *pg;
+
+    pg = dev->pgrant_free;
+    BUG_ON(pg == NULL);
+    dev->pgrant_free = pg->next;
+    dev->npgrant_free--;
+    return pg;
+}
+
+static void blkfront_put_pgrant(struct blkfront_dev *dev, struct blk_pgrant *pg)
+{
+    pg->next = dev->pgrant_free;
+    dev->pgrant_free = pg;
+    dev->npgrant_free++;
+}
+
+/*
+ * Make sure at least count pages are on the free list, so that
+ * blkfront_get_pgrant() cannot fail after a ring slot is taken.
+ * The total is bounded by BLK_MAX_INFLIGHT plus the indirect pages
+ * of full rings.
+ */
+static int blkfront_reserve_pgrants(struct blkfront_dev *dev, int count)
+{
+    struct blk_pgrant *pg;
+
+    while (dev->npgrant_free < count) {
+        pg = bmk_memalloc(sizeof(*pg), 0, BMK_MEMWHO_WIREDBMK);
+        if (pg == NULL)
+            return -1;
+        if ((pg->page = bmk_pgalloc_one()) == NULL) {
+            bmk_memfree(pg, BMK_MEMWHO_WIREDBMK);
+            return -1;
+        }
+        pg->gref = gnttab_grant_access(dev->dom, virt_to_mfn(pg->page), 0);
+        pg->allnext = dev->pgrant_all;
+        dev->pgrant_all = pg;
+        blkfront_put_pgrant(dev, pg);
+    }
+    return 0;
+}
+
 void blkfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
+    struct blkfront_dev *dev = data;
+
+    if (dev->notify)
+        dev->notify(dev, dev->notify_arg);
     minios_wake_up(&blkfront_queue);
 }
 
+/*
+ * Register a routine to be called from interrupt context when the
+ * backend signals the device.  It should arrange for the device to
+ * be polled with blkfront_aio_poll().
+ */
+void blkfront_set_notify(struct blkfront_dev *dev,
+    void (*notify)(struct blkfront_dev *, void *), void *arg)
+{
+    unsigned long flags;
+
+    local_irq_save(flags);
+    dev->notify = notify;
+    dev->notify_arg = arg;
+    local_irq_restore(flags);
+}
+
 static void free_blkfront(struct blkfront_dev *dev)
 {
-    minios_mask_evtchn(dev->evtchn);
+    int q;
+
+    for (q = 0; q < dev->nqueues; q++)
+        minios_mask_evtchn(dev->queues[q].evtchn);
 
     bmk_memfree(dev->backend, BMK_MEMWHO_WIREDBMK);
 
-    gnttab_end_access(dev->ring_ref);
-    bmk_pgfree_one(dev->ring.sring);
+    for (q = 0; q < dev->nqueues; q++) {
+        struct blk_queue *bq = &dev->queues[q];
+
+        gnttab_end_access(bq->ring_ref);
+        bmk_pgfree_one(bq->ring.sring);
+        minios_unbind_evtchn(bq->evtchn);
+    }
 
-    minios_unbind_evtchn(dev->evtchn);
+    while (dev->pgrant_all) {
+        struct blk_pgrant *pg = dev->pgrant_all;
+
+        dev->pgrant_all = pg->allnext;
+        gnttab_end_access(pg->gref);
+        bmk_pgfree_one(pg->page);
+        bmk_memfree(pg, BMK_MEMWHO_WIREDBMK);
+    }
 
     bmk_memfree(dev, BMK_MEMWHO_WIREDBMK);
 }
@@ -74,7 +197,7 @@ static void free_blkfront(struct blkfront_dev *dev)
 struct blkfront_dev *blkfront_init(char *_nodename, struct blkfront_info *info)
 {
     xenbus_transaction_t xbt;
-    char* err;
+    char* err = NULL;
     char* message=NULL;
     struct blkif_sring *s;
     int retry=0;
@@ -82,26 +205,61 @@ struct blkfront_dev *blkfront_init(char *_nodename, struct blkfront_info *info)
     char* c;
     char* nodename = _nodename ? _nodename : "device/vbd/768";
     unsigned long len;
+    int q, maxsegs;
 
     struct blkfront_dev *dev;
 
     char path[bmk_strlen(nodename) + 1 + 10 + 1];
+    char qnode[bmk_strlen(nodename) + 1 + 16 + 1];
 
-    dev = bmk_memcalloc(1, sizeof(*dev), BMK_MEMWHO_WIREDBMK);
+    if ((dev = bmk_memcalloc(1, sizeof(*dev), BMK_MEMWHO_WIREDBMK)) == NULL) {
+        minios_printk("blkfront: out of memory\n");
+        return NULL;
+    }
     bmk_strncpy(dev->nodename, nodename, sizeof(dev->nodename)-1);
 
     bmk_snprintf(path, sizeof(path), "%s/backend-id", nodename);
     dev->dom = xenbus_read_integer(path); 
-    minios_evtchn_alloc_unbound(dev->dom, blkfront_handler, dev, &dev->evtchn);
 
-    s = bmk_pgalloc_one();
-    bmk_memset(s,0,PAGE_SIZE);
+    bmk_snprintf(path, sizeof(path), "%s/backend", nodename);
+    msg = xenbus_read(XBT_NIL, path, &dev->backend);
+    if (msg) {
+        minios_printk("Error %s when reading the backend path %s\n", msg, path);
+        goto error;
+    }
 
+    /* the backend advertises the number of queues before we connect */
+    {
+        char path[bmk_strlen(dev->backend) + 1 + 22 + 1];
+
+        bmk_snprintf(path, sizeof(path), "%s/multi-queue-max-queues",
+            dev->backend);
+        dev->nqueues = xenbus_read_integer(path);
+        if (dev->nqueues < 1)
+            dev->nqueues = 1;
+        if (dev->nqueues > BLK_MAX_QUEUES)
+            dev->nqueues = BLK_MAX_QUEUES;
+    }
 
-    SHARED_RING_INIT(s);
-    FRONT_RING_INIT(&dev->ring, s, PAGE_SIZE);
+    for (q = 0; q < dev->nqueues; q++) {
+        struct blk_queue *bq = &dev->queues[q];
 
-    dev->ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(s),0);
+        minios_evtchn_alloc_unbound(dev->dom, blkfront_handler, dev,
+            &bq->evtchn);
+
+        if ((s = bmk_pgalloc_one()) == NULL) {
+            minios_printk("blkfront: out of memory\n");
+            minios_unbind_evtchn(bq->evtchn);
+            dev->nqueues = q;
+            goto error;
+        }
+        bmk_memset(s,0,PAGE_SIZE);
+
+        SHARED_RING_INIT(s);
+        FRONT_RING_INIT(&bq->ring, s, PAGE_SIZE);
+
+        bq->ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(s),0);
+    }
 
     xenbus_event_queue_init(&dev->events);
 
@@ -112,22 +270,51 @@ again:
         bmk_memfree(err, BMK_MEMWHO_WIREDBMK);
     }
 
-    err = xenbus_printf(xbt, nodename, "ring-ref","%u",
-                dev->ring_ref);
-    if (err) {
-        message = "writing ring-ref";
-        goto abort_transaction;
+    if (dev->nqueues == 1) {
+        err = xenbus_printf(xbt, nodename, "ring-ref","%u",
+                    dev->queues[0].ring_ref);
+        if (err) {
+            message = "writing ring-ref";
+            goto abort_transaction;
+        }
+        err = xenbus_printf(xbt, nodename,
+                    "event-channel", "%u", dev->queues[0].evtchn);
+        if (err) {
+            message = "writing event-channel";
+            goto abort_transaction;
+        }
+    } else {
+        err = xenbus_printf(xbt, nodename,
+                    "multi-queue-num-queues", "%u", dev->nqueues);
+        if (err) {
+            message = "writing multi-queue-num-queues";
+            goto abort_transaction;
+        }
+        for (q = 0; q < dev->nqueues; q++) {
+            bmk_snprintf(qnode, sizeof(qnode), "%s/queue-%d", nodename, q);
+            err = xenbus_printf(xbt, qnode, "ring-ref","%u",
+                        dev->queues[q].ring_ref);
+            if (err) {
+                message = "writing queue ring-ref";
+                goto abort_transaction;
+            }
+            err = xenbus_printf(xbt, qnode,
+                        "event-channel", "%u", dev->queues[q].evtchn);
+            if (err) {
+                message = "writing queue event-channel";
+                goto abort_transaction;
+            }
+        }
     }
     err = xenbus_printf(xbt, nodename,
-                "event-channel", "%u", dev->evtchn);
+                "protocol", "%s", XEN_IO_PROTO_ABI_NATIVE);
     if (err) {
-        message = "writing event-channel";
+        message = "writing protocol";
         goto abort_transaction;
     }
-    err = xenbus_printf(xbt, nodename,
-                "protocol", "%s", XEN_IO_PROTO_ABI_NATIVE);
+    err = xenbus_printf(xbt, nodename, "feature-persistent", "%u", 1);
     if (err) {
-        message = "writing protocol";
+        message = "writing feature-persistent";
         goto abort_transaction;
     }
 
@@ -156,13 +343,6 @@ abort_transaction:
 
 done:
 
-    bmk_snprintf(path, sizeof(path), "%s/backend", nodename);
-    msg = xenbus_read(XBT_NIL, path, &dev->backend);
-    if (msg) {
-        minios_printk("Error %s when reading the backend path %s\n", msg, path);
-        goto error;
-    }
-
     minios_printk("blkfront: node=%s backend=%s\n", nodename, dev->backend);
 
     len = bmk_strlen(nodename);
@@ -170,7 +350,7 @@ done:
 
     {
         XenbusState state;
-        char path[bmk_strlen(dev->backend) + 1 + 19 + 1];
+        char path[bmk_strlen(dev->backend) + 1 + 29 + 1];
         bmk_snprintf(path, sizeof(path), "%s/mode", dev->backend);
         msg = xenbus_read(XBT_NIL, path, &c);
         if (msg) {
@@ -213,11 +393,27 @@ done:
         bmk_snprintf(path, sizeof(path), "%s/feature-flush-cache", dev->backend);
         dev->info.flush = xenbus_read_integer(path);
 
+        bmk_snprintf(path, sizeof(path), "%s/feature-persistent", dev->backend);
+        dev->persistent = xenbus_read_integer(path) == 1;
+
+        bmk_snprintf(path, sizeof(path), "%s/feature-max-indirect-segments",
+            dev->backend);
+        maxsegs = xenbus_read_integer(path);
+        if (maxsegs > BLKFRONT_MAX_SEGMENTS)
+            maxsegs = BLKFRONT_MAX_SEGMENTS;
+        if (maxsegs <= BLKIF_MAX_SEGMENTS_PER_REQUEST)
+            maxsegs = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        dev->info.max_segments = maxsegs;
+        dev->info.nslots = dev->nqueues * RING_SIZE(&dev->queues[0].ring);
+
         *info = dev->info;
     }
-    minios_unmask_evtchn(dev->evtchn);
+    for (q = 0; q < dev->nqueues; q++)
+        minios_unmask_evtchn(dev->queues[q].evtchn);
 
-    minios_printk("blkfront: %u sectors\n", dev->info.sectors);
+    minios_printk("blkfront: %u sectors, %d queue(s), %d segments%s\n",
+        dev->info.sectors, dev->nqueues, dev->info.max_segments,
+        dev->persistent ? ", persistent grants" : "");
 
     return dev;
 
@@ -278,25 +474,71 @@ close:
     if (err) bmk_memfree(err, BMK_MEMWHO_WIREDBMK);
     xenbus_unwatch_path_token(XBT_NIL, path, path);
 
-    bmk_snprintf(path, sizeof(path), "%s/ring-ref", nodename);
-    xenbus_rm(XBT_NIL, path);
-    bmk_snprintf(path, sizeof(path), "%s/event-channel", nodename);
-    xenbus_rm(XBT_NIL, path);
+    if (dev->nqueues == 1) {
+        bmk_snprintf(path, sizeof(path), "%s/ring-ref", nodename);
+        xenbus_rm(XBT_NIL, path);
+        bmk_snprintf(path, sizeof(path), "%s/event-channel", nodename);
+        xenbus_rm(XBT_NIL, path);
+    } else {
+        char qpath[bmk_strlen(dev->nodename) + 1 + 30 + 1];
+        int q;
+
+        for (q = 0; q < dev->nqueues; q++) {
+            bmk_snprintf(qpath, sizeof(qpath), "%s/queue-%d/ring-ref",
+                dev->nodename, q);
+            xenbus_rm(XBT_NIL, qpath);
+            bmk_snprintf(qpath, sizeof(qpath), "%s/queue-%d/event-channel",
+                dev->nodename, q);
+            xenbus_rm(XBT_NIL, qpath);
+            bmk_snprintf(qpath, sizeof(qpath), "%s/queue-%d",
+                dev->nodename, q);
+            xenbus_rm(XBT_NIL, qpath);
+        }
+        bmk_snprintf(qpath, sizeof(qpath), "%s/multi-queue-num-queues",
+            dev->nodename);
+        xenbus_rm(XBT_NIL, qpath);
+    }
 
     if (!err)
         free_blkfront(dev);
 }
 
-static void blkfront_wait_slot(struct blkfront_dev *dev)
+/*
+ * Pick a queue with a free slot, round-robin.  Returns NULL if all
+ * rings are full or if starting nsegs more segments would go over
+ * the in-flight limit.
+ */
+static struct blk_queue *blkfront_pick_queue(struct blkfront_dev *dev, int nsegs)
 {
+    struct blk_queue *bq;
+    int i, q;
+
+    if (dev->inflight && dev->inflight + nsegs > BLK_MAX_INFLIGHT)
+        return NULL;
+
+    for (i = 0; i < dev->nqueues; i++) {
+        q = dev->nextqueue;
+        if (++dev->nextqueue == dev->nqueues)
+            dev->nextqueue = 0;
+        bq = &dev->queues[q];
+        if (!RING_FULL(&bq->ring))
+            return bq;
+    }
+    return NULL;
+}
+
+static struct blk_queue *blkfront_wait_slot(struct blkfront_dev *dev, int nsegs)
+{
+    struct blk_queue *bq;
+
     /* Wait for a slot */
-    if (RING_FULL(&dev->ring)) {
+    if ((bq = blkfront_pick_queue(dev, nsegs)) == NULL) {
 	unsigned long flags;
 	DEFINE_WAIT(w);
 	local_irq_save(flags);
 	while (1) {
 	    blkfront_aio_poll(dev);
-	    if (!RING_FULL(&dev->ring))
+	    if ((bq = blkfront_pick_queue(dev, nsegs)) != NULL)
 		break;
 	    /* Really no slot, go to sleep. */
 	    minios_add_waiter(w, blkfront_queue);
@@ -307,16 +549,28 @@ static void blkfront_wait_slot(struct blkfront_dev *dev)
 	minios_remove_waiter(w, blkfront_queue);
 	local_irq_restore(flags);
     }
+    return bq;
+}
+
+static void blkfront_push(struct blkfront_dev *dev, struct blk_queue *bq)
+{
+    int notify;
+
+    wmb();
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&bq->ring, notify);
+
+    if(notify) minios_notify_remote_via_evtchn(bq->evtchn);
 }
 
 /* Issue an aio */
 void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
 {
     struct blkfront_dev *dev = aiocbp->aio_dev;
+    struct blkif_request_segment seg, *segs = NULL;
     struct blkif_request *req;
+    struct blk_queue *bq;
     RING_IDX i;
-    int notify;
-    int n, j;
+    int n, j, nind;
     uintptr_t start, end;
 
     // Can't io at non-sector-aligned location
@@ -329,44 +583,88 @@ void blkfront_aio(struct blkfront_aiocb *aiocbp, int write)
     start = (uintptr_t)aiocbp->aio_buf & PAGE_MASK;
     end = ((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes + PAGE_SIZE - 1) & PAGE_MASK;
     aiocbp->n = n = (end - start) / PAGE_SIZE;
-
-    /* qemu's IDE max multsect is 16 (8KB) and SCSI max DMA was set to 32KB,
-     * so max 44KB can't happen */
-    ASSERT(n <= BLKIF_MAX_SEGMENTS_PER_REQUEST);
-
-    blkfront_wait_slot(dev);
-    i = dev->ring.req_prod_pvt;
-    req = RING_GET_REQUEST(&dev->ring, i);
-
-    req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
-    req->nr_segments = n;
-    req->handle = dev->handle;
-    req->id = (uintptr_t) aiocbp;
-    req->sector_number = aiocbp->aio_offset / 512;
-
-    for (j = 0; j < n; j++) {
-        req->seg[j].first_sect = 0;
-        req->seg[j].last_sect = PAGE_SIZE / 512 - 1;
+    aiocbp->is_write = write;
+
+    /* callers must split requests larger than what the backend takes */
+    ASSERT(n <= dev->info.max_segments);
+    nind = n > BLKIF_MAX_SEGMENTS_PER_REQUEST ? BLK_INDIRECT_PAGES(n) : 0;
+    aiocbp->nindirect = nind;
+
+    bq = blkfront_wait_slot(dev, n);
+    /* nothing blocks between here and the push, so the pages stay ours */
+    if (blkfront_reserve_pgrants(dev, nind + (dev->persistent ? n : 0))) {
+        minios_printk("blkfront: out of memory for bounce pages\n");
+        aiocbp->aio_cb(aiocbp, -BMK_ENOMEM);
+        return;
     }
-    req->seg[0].first_sect = ((uintptr_t)aiocbp->aio_buf & ~PAGE_MASK) / 512;
-    req->seg[n-1].last_sect = (((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes - 1) & ~PAGE_MASK) / 512;
-    for (j = 0; j < n; j++) {
-	uintptr_t data = start + j * PAGE_SIZE;
-        if (!write) {
-            /* Trigger CoW if needed */
-            *(char*)(data + (req->seg[j].first_sect << 9)) = 0;
-            barrier();
+    dev->inflight += n;
+    i = bq->ring.req_prod_pvt;
+    req = RING_GET_REQUEST(&bq->ring, i);
+
+    if (nind) {
+        struct blkif_request_indirect *ireq = (void *)req;
+
+        ireq->operation = BLKIF_OP_INDIRECT;
+        ireq->indirect_op = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+        ireq->nr_segments = n;
+        ireq->handle = dev->handle;
+        ireq->id = (uintptr_t) aiocbp;
+        ireq->sector_number = aiocbp->aio_offset / 512;
+        for (j = 0; j < nind; j++) {
+            aiocbp->indirect[j] = blkfront_get_pgrant(dev);
+            ireq->indirect_grefs[j] = aiocbp->indirect[j]->gref;
         }
-	aiocbp->gref[j] = req->seg[j].gref =
-            gnttab_grant_access(dev->dom, virtual_to_mfn(data), write);
+    } else {
+        req->operation = write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+        req->nr_segments = n;
+        req->handle = dev->handle;
+        req->id = (uintptr_t) aiocbp;
+        req->sector_number = aiocbp->aio_offset / 512;
     }
 
-    dev->ring.req_prod_pvt = i + 1;
+    for (j = 0; j < n; j++) {
+	uintptr_t data = start + j * PAGE_SIZE;
+
+        seg.first_sect = 0;
+        seg.last_sect = PAGE_SIZE / 512 - 1;
+        if (j == 0)
+            seg.first_sect = ((uintptr_t)aiocbp->aio_buf & ~PAGE_MASK) / 512;
+        if (j == n-1)
+            seg.last_sect = (((uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes - 1) & ~PAGE_MASK) / 512;
+
+        if (dev->persistent) {
+            struct blk_pgrant *pg = blkfront_get_pgrant(dev);
+
+            if (write) {
+                unsigned off = seg.first_sect << 9;
+
+                bmk_memcpy((char *)pg->page + off, (char *)data + off,
+                    (seg.last_sect + 1 - seg.first_sect) << 9);
+            }
+            aiocbp->pgrant[j] = pg;
+            seg.gref = pg->gref;
+        } else {
+            if (!write) {
+                /* Trigger CoW if needed */
+                *(char*)(data + (seg.first_sect << 9)) = 0;
+                barrier();
+            }
+            /* the page is the caller's, so the grant ends with the I/O */
+            seg.gref = aiocbp->gref[j] = gnttab_grant_access(dev->dom,
+                virtual_to_mfn(data), write);
+        }
 
-    wmb();
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
+        if (nind) {
+            if (j % BLK_SEGS_PER_INDIRECT_FRAME == 0)
+                segs = aiocbp->indirect[j / BLK_SEGS_PER_INDIRECT_FRAME]->page;
+            segs[j % BLK_SEGS_PER_INDIRECT_FRAME] = seg;
+        } else {
+            req->seg[j] = seg;
+        }
+    }
 
-    if(notify) minios_notify_remote_via_evtchn(dev->evtchn);
+    bq->ring.req_prod_pvt = i + 1;
+    blkfront_push(dev, bq);
 }
 
 static void blkfront_aio_cb(struct blkfront_aiocb *aiocbp, int ret)
@@ -381,8 +679,8 @@ void blkfront_io(struct blkfront_aiocb *aiocbp, int write)
 
     ASSERT(!aiocbp->aio_cb);
     aiocbp->aio_cb = blkfront_aio_cb;
-    blkfront_aio(aiocbp, write);
     aiocbp->data = NULL;
+    blkfront_aio(aiocbp, write);
 
     local_irq_save(flags);
     while (1) {
@@ -403,21 +701,19 @@ static void blkfront_push_operation(struct blkfront_dev *dev, uint8_t op, uint64
 {
     int i;
     struct blkif_request *req;
-    int notify;
+    struct blk_queue *bq;
 
-    blkfront_wait_slot(dev);
-    i = dev->ring.req_prod_pvt;
-    req = RING_GET_REQUEST(&dev->ring, i);
+    bq = blkfront_wait_slot(dev, 0);
+    i = bq->ring.req_prod_pvt;
+    req = RING_GET_REQUEST(&bq->ring, i);
     req->operation = op;
     req->nr_segments = 0;
     req->handle = dev->handle;
     req->id = id;
     /* Not needed anyway, but the backend will check it */
     req->sector_number = 0;
-    dev->ring.req_prod_pvt = i + 1;
-    wmb();
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->ring, notify);
-    if (notify) minios_notify_remote_via_evtchn(dev->evtchn);
+    bq->ring.req_prod_pvt = i + 1;
+    blkfront_push(dev, bq);
 }
 
 void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op)
@@ -426,6 +722,19 @@ void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op)
     blkfront_push_operation(dev, op, (uintptr_t) aiocbp);
 }
 
+static int blkfront_idle(struct blkfront_dev *dev)
+{
+    int q;
+
+    for (q = 0; q < dev->nqueues; q++) {
+        struct blk_queue *bq = &dev->queues[q];
+
+        if (RING_FREE_REQUESTS(&bq->ring) != RING_SIZE(&bq->ring))
+            return 0;
+    }
+    return 1;
+}
+
 void blkfront_sync(struct blkfront_dev *dev)
 {
     unsigned long flags;
@@ -443,7 +752,7 @@ void blkfront_sync(struct blkfront_dev *dev)
     local_irq_save(flags);
     while (1) {
 	blkfront_aio_poll(dev);
-	if (RING_FREE_REQUESTS(&dev->ring) == RING_SIZE(&dev->ring))
+	if (blkfront_idle(dev))
 	    break;
 
 	minios_add_waiter(w, blkfront_queue);
@@ -455,26 +764,60 @@ void blkfront_sync(struct blkfront_dev *dev)
     local_irq_restore(flags);
 }
 
-int blkfront_aio_poll(struct blkfront_dev *dev)
+static void blkfront_complete_rw(struct blkfront_dev *dev,
+    struct blkfront_aiocb *aiocbp, int write)
+{
+    uintptr_t start = (uintptr_t)aiocbp->aio_buf & PAGE_MASK;
+    uintptr_t end = (uintptr_t)aiocbp->aio_buf + aiocbp->aio_nbytes;
+    int j;
+
+    for (j = 0; j < aiocbp->n; j++) {
+        uintptr_t data = start + j * PAGE_SIZE;
+
+        if (dev->persistent) {
+            struct blk_pgrant *pg = aiocbp->pgrant[j];
+
+            if (!write) {
+                uintptr_t s = data, e = data + PAGE_SIZE;
+
+                if (s < (uintptr_t)aiocbp->aio_buf)
+                    s = (uintptr_t)aiocbp->aio_buf;
+                if (e > end)
+                    e = end;
+                bmk_memcpy((void *)s,
+                    (char *)pg->page + (s & ~PAGE_MASK), e - s);
+            }
+            blkfront_put_pgrant(dev, pg);
+        } else {
+            gnttab_end_access(aiocbp->gref[j]);
+        }
+    }
+    for (j = 0; j < aiocbp->nindirect; j++)
+        blkfront_put_pgrant(dev, aiocbp->indirect[j]);
+
+    dev->inflight -= aiocbp->n;
+}
+
+static int blkfront_queue_poll(struct blkfront_dev *dev, struct blk_queue *bq)
 {
     RING_IDX rp, cons;
     struct blkif_response *rsp;
     int more;
     int nr_consumed;
 
+    nr_consumed = 0;
 moretodo:
 
-    rp = dev->ring.sring->rsp_prod;
+    rp = bq->ring.sring->rsp_prod;
     rmb(); /* Ensure we see queued responses up to 'rp'. */
-    cons = dev->ring.rsp_cons;
+    cons = bq->ring.rsp_cons;
 
-    nr_consumed = 0;
     while ((cons != rp))
     {
         struct blkfront_aiocb *aiocbp;
         int status;
 
-	rsp = RING_GET_RESPONSE(&dev->ring, cons);
+	rsp = RING_GET_RESPONSE(&bq->ring, cons);
 	nr_consumed++;
 
         aiocbp = (void*) (uintptr_t) rsp->id;
@@ -486,14 +829,9 @@ moretodo:
         switch (rsp->operation) {
         case BLKIF_OP_READ:
         case BLKIF_OP_WRITE:
-        {
-            int j;
-
-            for (j = 0; j < aiocbp->n; j++)
-                gnttab_end_access(aiocbp->gref[j]);
-
+        case BLKIF_OP_INDIRECT:
+            blkfront_complete_rw(dev, aiocbp, aiocbp->is_write);
             break;
-        }
 
         case BLKIF_OP_WRITE_BARRIER:
         case BLKIF_OP_FLUSH_DISKCACHE:
@@ -503,17 +841,27 @@ moretodo:
             minios_printk("unrecognized block operation %d response\n", rsp->operation);
         }
 
-        dev->ring.rsp_cons = ++cons;
+        bq->ring.rsp_cons = ++cons;
         /* Nota: callback frees aiocbp itself */
         if (aiocbp && aiocbp->aio_cb)
             aiocbp->aio_cb(aiocbp, status ? -BMK_EIO : 0);
-        if (dev->ring.rsp_cons != cons)
+        if (bq->ring.rsp_cons != cons)
             /* We reentered, we must not continue here */
-            break;
+            return nr_consumed;
     }
 
-    RING_FINAL_CHECK_FOR_RESPONSES(&dev->ring, more);
+    RING_FINAL_CHECK_FOR_RESPONSES(&bq->ring, more);
     if (more) goto moretodo;
 
     return nr_consumed;
 }
+
+int blkfront_aio_poll(struct blkfront_dev *dev)
+{
+    int q, nr_consumed = 0;
+
+    for (q = 0; q < dev->nqueues; q++)
+        nr_consumed += blkfront_queue_poll(dev, &dev->queues[q]);
+
+    return nr_consumed;
+}
@@ -20,13 +20,15 @@
 #include <mini-os/gnttab.h>
 #include <mini-os/semaphore.h>
 
+#include <bmk-core/memalloc.h>
 #include <bmk-core/pgalloc.h>
+#include <bmk-core/queue.h>
 #include <bmk-core/string.h>
 
 #define NR_RESERVED_ENTRIES 8
 
 /* NR_GRANT_FRAMES must be less than or equal to that configured in Xen */
-#define NR_GRANT_FRAMES 4
+#define NR_GRANT_FRAMES 16
 #define NR_GRANT_ENTRIES (NR_GRANT_FRAMES * PAGE_SIZE / sizeof(grant_entry_t))
 
 static grant_entry_t *gnttab_table;
@@ -160,6 +162,198 @@ gnttab_alloc_and_grant(void **map)
     return gref;
 }
 
+/*
+ * Grant cache.  Keeps grants to frames alive after the I/O using
+ * them is done, so that the next I/O to the same frame can reuse
+ * the grant instead of going through the grant table again.  Only
+ * frames which are not in use by any I/O are evicted, least recently
+ * used first.  The caller must size the cache to be larger than the
+ * number of frames it can have in use at the same time.
+ *
+ * This relies on the backend not accessing a grant unless told to,
+ * i.e. grants are left live only towards a trusted backend.  Since
+ * the grant outlives the I/O, only frames owned by the driver may be
+ * cached, and the driver must gntcache_evict() a frame before giving
+ * it back to the page allocator.
+ */
+struct gntcache_ent {
+    unsigned long ge_mfn;
+    grant_ref_t ge_gref;
+    int ge_readonly;
+    int ge_refs;
+
+    LIST_ENTRY(gntcache_ent) ge_hash;
+    TAILQ_ENTRY(gntcache_ent) ge_lru;
+};
+
+struct gntcache {
+    domid_t gc_dom;
+    int gc_nent;
+    int gc_maxent;
+    unsigned long gc_hashmask;
+
+    struct gntcache_ent *gc_ents;
+    LIST_HEAD(, gntcache_ent) *gc_hash;
+    LIST_HEAD(, gntcache_ent) gc_free;
+    TAILQ_HEAD(, gntcache_ent) gc_lru;
+};
+
+static inline unsigned long
+gntcache_hash(struct gntcache *gc, unsigned long mfn, int readonly)
+{
+
+    return ((mfn << 1) | (readonly != 0)) & gc->gc_hashmask;
+}
+
+static struct gntcache_ent *
+gntcache_lookup(struct gntcache *gc, unsigned long mfn, int readonly)
+{
+    struct gntcache_ent *ge;
+
+    LIST_FOREACH(ge, &gc->gc_hash[gntcache_hash(gc, mfn, readonly)], ge_hash) {
+        if (ge->ge_mfn == mfn && ge->ge_readonly == readonly)
+            return ge;
+    }
+    return NULL;
+}
+
+struct gntcache *
+gntcache_create(domid_t domid, int maxent)
+{
+    struct gntcache *gc;
+    unsigned long nhash, i;
+
+    for (nhash = 1; nhash < (unsigned long)maxent; nhash <<= 1)
+        continue;
+
+    if ((gc = bmk_memcalloc(1, sizeof(*gc), BMK_MEMWHO_WIREDBMK)) == NULL)
+        return NULL;
+    gc->gc_ents = bmk_memcalloc(maxent, sizeof(*gc->gc_ents),
+        BMK_MEMWHO_WIREDBMK);
+    gc->gc_hash = bmk_memcalloc(nhash, sizeof(*gc->gc_hash),
+        BMK_MEMWHO_WIREDBMK);
+    if (gc->gc_ents == NULL || gc->gc_hash == NULL) {
+        bmk_memfree(gc->gc_hash, BMK_MEMWHO_WIREDBMK);
+        bmk_memfree(gc->gc_ents, BMK_MEMWHO_WIREDBMK);
+        bmk_memfree(gc, BMK_MEMWHO_WIREDBMK);
+        return NULL;
+    }
+    for (i = 0; i < nhash; i++)
+        LIST_INIT(&gc->gc_hash[i]);
+    LIST_INIT(&gc->gc_free);
+    TAILQ_INIT(&gc->gc_lru);
+    gc->gc_hashmask = nhash-1;
+    gc->gc_maxent = maxent;
+    gc->gc_dom = domid;
+
+    return gc;
+}
+
+/*
+ * Return a grant for the given frame, reusing a cached one if possible.
+ * Callable from interrupt context as long as a cached grant exists or
+ * the grant table is not exhausted.
+ */
+grant_ref_t
+gntcache_get(struct gntcache *gc, unsigned long mfn, int readonly)
+{
+    struct gntcache_ent *ge;
+    unsigned long flags;
+
+    readonly = readonly != 0;
+
+    local_irq_save(flags);
+    if ((ge = gntcache_lookup(gc, mfn, readonly)) != NULL) {
+        if (ge->ge_refs++ == 0)
+            TAILQ_REMOVE(&gc->gc_lru, ge, ge_lru);
+        local_irq_restore(flags);
+        return ge->ge_gref;
+    }
+
+    if ((ge = LIST_FIRST(&gc->gc_free)) != NULL) {
+        LIST_REMOVE(ge, ge_hash);
+    } else if (gc->gc_nent < gc->gc_maxent) {
+        ge = &gc->gc_ents[gc->gc_nent++];
+    } else {
+        ge = TAILQ_FIRST(&gc->gc_lru);
+        BUG_ON(ge == NULL);
+        TAILQ_REMOVE(&gc->gc_lru, ge, ge_lru);
+        LIST_REMOVE(ge, ge_hash);
+        /* if the backend is still holding it, we just leak the entry */
+        gnttab_end_access(ge->ge_gref);
+    }
+    ge->ge_mfn = mfn;
+    ge->ge_readonly = readonly;
+    ge->ge_refs = 1;
+    ge->ge_gref = gnttab_grant_access(gc->gc_dom, mfn, readonly);
+    LIST_INSERT_HEAD(&gc->gc_hash[gntcache_hash(gc, mfn, readonly)],
+        ge, ge_hash);
+    local_irq_restore(flags);
+
+    return ge->ge_gref;
+}
+
+/*
+ * Release a grant obtained from gntcache_get().  The grant stays
+ * live until evicted or the cache is destroyed.
+ */
+void
+gntcache_put(struct gntcache *gc, unsigned long mfn, int readonly)
+{
+    struct gntcache_ent *ge;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    ge = gntcache_lookup(gc, mfn, readonly != 0);
+    BUG_ON(ge == NULL || ge->ge_refs == 0);
+    if (--ge->ge_refs == 0)
+        TAILQ_INSERT_TAIL(&gc->gc_lru, ge, ge_lru);
+    local_irq_restore(flags);
+}
+
+/*
+ * End the cached grant for a frame, if there is one.  The frame must
+ * not be in use by any I/O.  Called before the frame leaves the
+ * driver, so that the backend loses access to it.
+ */
+void
+gntcache_evict(struct gntcache *gc, unsigned long mfn, int readonly)
+{
+    struct gntcache_ent *ge;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    if ((ge = gntcache_lookup(gc, mfn, readonly != 0)) != NULL) {
+        BUG_ON(ge->ge_refs != 0);
+        TAILQ_REMOVE(&gc->gc_lru, ge, ge_lru);
+        LIST_REMOVE(ge, ge_hash);
+        gnttab_end_access(ge->ge_gref);
+        LIST_INSERT_HEAD(&gc->gc_free, ge, ge_hash);
+    }
+    local_irq_restore(flags);
+}
+
+/*
+ * End all grants and free the cache.  Must be called only after
+ * the backend has disconnected.
+ */
+void
+gntcache_destroy(struct gntcache *gc)
+{
+    struct gntcache_ent *ge;
+    unsigned long i;
+
+    /* entries on the free list have already ended their grant */
+    for (i = 0; i <= gc->gc_hashmask; i++) {
+        LIST_FOREACH(ge, &gc->gc_hash[i], ge_hash)
+            gnttab_end_access(ge->ge_gref);
+    }
+
+    bmk_memfree(gc->gc_hash, BMK_MEMWHO_WIREDBMK);
+    bmk_memfree(gc->gc_ents, BMK_MEMWHO_WIREDBMK);
+    bmk_memfree(gc, BMK_MEMWHO_WIREDBMK);
+}
+
 static const char * const gnttabop_error_msgs[] = GNTTABOP_error_msgs;
 
 const char *
@@ -30,6 +30,8 @@
 #include <mini-os/hypervisor.h>
 #include <mini-os/events.h>
 
+#include <bmk-core/trace.h>
+
 #define active_evtchns(cpu,sh,idx)              \
     ((sh)->evtchn_pending[idx] &                \
      ~(sh)->evtchn_mask[idx])
@@ -53,6 +55,7 @@ void _minios_do_hypervisor_callback(struct pt_regs *regs)
     wmb();
 #endif
     l1 = xchg(&vcpu_info->evtchn_pending_sel, 0);
+    bmk_trace(BMK_TRACE_INTR, l1, 0);
     while ( l1 != 0 )
     {
         l1i = __ffs(l1);
@@ -68,6 +71,7 @@ void _minios_do_hypervisor_callback(struct pt_regs *regs)
         }
     }
 
+    bmk_trace(BMK_TRACE_INTREND, 0, 0);
     _minios_in_hypervisor_callback = 0;
 }
 
@@ -5,6 +5,13 @@
 #include <xen/io/blkif.h>
 #include <mini-os/types.h>
 struct blkfront_dev;
+struct blk_pgrant;
+
+/* max pages per request with indirect descriptors, i.e. 1MiB */
+#define BLKFRONT_MAX_SEGMENTS 256
+/* indirect pages per request, a page holds 512 segments */
+#define BLKFRONT_MAX_INDIRECT 1
+
 struct blkfront_aiocb
 {
     struct blkfront_dev *aio_dev;
@@ -15,8 +22,15 @@ struct blkfront_aiocb
     uint8_t is_write;
     void *data;
 
-    grant_ref_t gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    union {
+        /* persistent grants: bounce pages */
+        struct blk_pgrant *pgrant[BLKFRONT_MAX_SEGMENTS];
+        /* otherwise: grants to the caller's pages, ended on completion */
+        grant_ref_t gref[BLKFRONT_MAX_SEGMENTS];
+    };
+    struct blk_pgrant *indirect[BLKFRONT_MAX_INDIRECT];
     int n;
+    int nindirect;
 
     void (*aio_cb)(struct blkfront_aiocb *aiocb, int ret);
 };
@@ -30,6 +44,8 @@ struct blkfront_info
     enum blkfront_mode info;
     int barrier;
     int flush;
+    int max_segments;
+    int nslots;
 };
 struct blkfront_dev *blkfront_init(char *nodename, struct blkfront_info *info);
 void blkfront_aio(struct blkfront_aiocb *aiocbp, int write);
@@ -40,6 +56,7 @@ void blkfront_io(struct blkfront_aiocb *aiocbp, int write);
 #define blkfront_write(aiocbp) blkfront_io(aiocbp, 1)
 void blkfront_aio_push_operation(struct blkfront_aiocb *aiocbp, uint8_t op);
 int blkfront_aio_poll(struct blkfront_dev *dev);
+void blkfront_set_notify(struct blkfront_dev *dev, void (*notify)(struct blkfront_dev *, void *), void *arg);
 void blkfront_sync(struct blkfront_dev *dev);
 void blkfront_shutdown(struct blkfront_dev *dev);
 
@@ -11,6 +11,13 @@ grant_ref_t gnttab_grant_transfer(domid_t domid, unsigned long pfn);
 unsigned long gnttab_end_transfer(grant_ref_t gref);
 int gnttab_end_access(grant_ref_t ref);
 const char *gnttabop_error(int16_t status);
+
+struct gntcache;
+struct gntcache *gntcache_create(domid_t domid, int maxent);
+grant_ref_t gntcache_get(struct gntcache *gc, unsigned long mfn, int readonly);
+void gntcache_put(struct gntcache *gc, unsigned long mfn, int readonly);
+void gntcache_evict(struct gntcache *gc, unsigned long mfn, int readonly);
+void gntcache_destroy(struct gntcache *gc);
 void fini_gnttab(void);
 
 #endif /* !__MINIOS_GNTTAB_H__ */
@@ -3,11 +3,26 @@
 
 #include <mini-os/wait.h>
 struct netfront_dev;
-struct netfront_dev *netfront_init(char *nodename, void (*netif_rx)(struct netfront_dev *, unsigned char *data, int len), unsigned char rawmac[6], char **ip, void *priv);
+
+/* max TX/RX ring pairs per device */
+#define NETFRONT_MAXQUEUES 4
+
+struct netfront_txseg {
+	void *ts_base;
+	unsigned long ts_len;
+};
+
+struct netfront_dev *netfront_init(char *nodename, void *(*netif_rx)(struct netfront_dev *, int queue, void *page, unsigned char *data, int len), void (*netif_txdone)(struct netfront_dev *, int queue), unsigned char rawmac[6], char **ip, void *priv);
 void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len);
+int netfront_xmit_queue(struct netfront_dev *dev, int queue, const struct netfront_txseg *segs, int nsegs, void *cookie);
+void netfront_xmit_push(struct netfront_dev *dev, int queue);
+void *netfront_xmit_reap(struct netfront_dev *dev, int queue);
+void netfront_xmit_wait(struct netfront_dev *dev);
 void netfront_shutdown(struct netfront_dev *dev);
 
+int netfront_nqueues(struct netfront_dev *);
 void *netfront_get_private(struct netfront_dev *);
+void netfront_rxpage_release(struct netfront_dev *, void *);
 
 extern struct wait_queue_head netfront_queue;
 
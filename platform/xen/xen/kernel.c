@@ -44,6 +44,8 @@
 #include <xen/version.h>
 
 #include <bmk-core/core.h>
+#include <bmk-core/errno.h>
+#include <bmk-core/platform.h>
 #include <bmk-core/printf.h>
 
 uint8_t _minios_xen_features[XENFEAT_NR_SUBMAPS * 32];
@@ -94,6 +96,14 @@ bmk_platform_cpu_block(bmk_time_t until)
 	minios_force_evtchn_callback();
 }
 
+/* no per-CPU timer, bmk_sched_preempt() checks the slice on the clock */
+int
+bmk_platform_cpu_slicetimer(bmk_time_t until)
+{
+
+	return BMK_ENOSYS;
+}
+
 unsigned long
 bmk_platform_splhigh(void)
 {
@@ -110,6 +120,15 @@ bmk_platform_splx(unsigned long x)
 	local_irq_restore(x);
 }
 
+/* event channels are not counted */
+int
+bmk_platform_intr_dump(void (*out)(void *, const char *, unsigned long),
+	void *arg)
+{
+
+	return BMK_ENOSYS;
+}
+
 /*
  * INITIAL C ENTRY POINT.
  */
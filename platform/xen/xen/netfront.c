@@ -2,7 +2,33 @@
  * Copyright (c) 2006-2007 Jacob Gorm Hansen, University of Copenhagen.
  * Based on netfront.c from Xen Linux.
  *
- * Does not handle fragments or extras.
+ * Does not handle receive fragments or extras.
+ *
+ * Packets are transmitted as multi-slot requests (NETTXF_more_data).
+ * Large enough pieces of the caller's buffers are granted to the
+ * backend as-is, only small pieces are copied into per-slot bounce
+ * pages.  netfront_xmit_queue() only fills in the ring, the backend
+ * is notified once per batch by netfront_xmit_push().  Since the
+ * caller's memory is used until the backend is done with it, each
+ * packet carries a cookie which the caller gets back from
+ * netfront_xmit_reap() after completion.
+ *
+ * Grants for RX pages and TX frames are not ended after each I/O, but
+ * kept in a grant cache keyed on the MFN, so that when the same frame
+ * is used again (which, with the page pool in xenif, is the common
+ * case) no grant table operations are necessary.  netback never maps
+ * our grants (rx-copy and grant copy on tx), so this does not need
+ * the backend's cooperation.
+ *
+ * Received pages are handed to the netif_rx callback, which returns
+ * the page to put back into the RX ring.  This allows the callback
+ * to keep the page (loan it to the upper layers) and supply a fresh
+ * one instead of copying the data out.
+ *
+ * If the backend advertises multi-queue-max-queues, up to
+ * NETFRONT_MAXQUEUES TX/RX ring pairs are set up, each with its own
+ * event channel, and the callbacks are told which queue they are
+ * called for.  The caller picks the TX queue for each packet.
  */
 
 #include <mini-os/os.h>
@@ -29,17 +55,47 @@ DECLARE_WAIT_QUEUE_HEAD(netfront_queue);
 #define NET_RX_RING_SIZE __CONST_RING_SIZE(netif_rx, PAGE_SIZE)
 #define GRANT_INVALID_REF 0
 
+/* max slots per packet which any backend must accept */
+#define NET_TX_MAXSLOTS 18
+/* pieces shorter than this are copied instead of granted */
+#define NET_TX_COPYMAX 256
+#define NET_TX_NOPKT 0xffff
+
 struct net_buffer {
     void* page;
     grant_ref_t gref;
+    unsigned long mfn;
+    unsigned short pkt;
+    unsigned char cached; /* gref is from the grant cache */
 };
 
-struct netfront_dev {
-    domid_t dom;
+/*
+ * Grant cache entries, larger than what the rings can hold.  Only
+ * pages owned by the driver (rx pool pages, tx bounce pages) are
+ * granted through the cache.  Caller pages are granted per I/O.
+ */
+#define NET_GNTCACHE_SIZE (4*NET_RX_RING_SIZE)
+
+/* a transmitted packet which is waiting for its slots to complete */
+struct net_txpkt {
+    void *cookie;
+    unsigned short nslots;
+    unsigned short next;
+};
+
+/* one TX/RX ring pair */
+struct netfront_q {
+    struct netfront_dev *dev;
+    int id;
 
     unsigned short tx_freelist[NET_TX_RING_SIZE + 1];
     struct semaphore tx_sem;
 
+    struct net_txpkt tx_pkts[NET_TX_RING_SIZE];
+    unsigned short tx_pktfreelist[NET_TX_RING_SIZE + 1];
+    unsigned short tx_donehead;
+    struct semaphore tx_pktsem;
+
     struct net_buffer rx_buffers[NET_RX_RING_SIZE];
     struct net_buffer tx_buffers[NET_TX_RING_SIZE];
 
@@ -48,6 +104,15 @@ struct netfront_dev {
     grant_ref_t tx_ring_ref;
     grant_ref_t rx_ring_ref;
     evtchn_port_t evtchn;
+};
+
+struct netfront_dev {
+    domid_t dom;
+
+    struct netfront_q *queues;
+    int nqueues;
+
+    struct gntcache *gcache;
 
     char nodename[64];
 
@@ -57,11 +122,13 @@ struct netfront_dev {
     struct xenbus_event_queue events;
 
 
-    void (*netif_rx)(struct netfront_dev *, unsigned char* data, int len);
+    void *(*netif_rx)(struct netfront_dev *, int queue, void *page,
+        unsigned char *data, int len);
+    void (*netif_txdone)(struct netfront_dev *, int queue);
     void *netfront_priv;
 };
 
-void init_rx_buffers(struct netfront_dev *dev);
+void init_rx_buffers(struct netfront_q *q);
 
 static inline void add_id_to_freelist(unsigned int id,unsigned short* freelist)
 {
@@ -81,84 +148,86 @@ static inline int xennet_rxidx(RING_IDX idx)
     return idx & (NET_RX_RING_SIZE - 1);
 }
 
-void network_rx(struct netfront_dev *dev)
+void network_rx(struct netfront_q *q)
 {
+    struct netfront_dev *dev = q->dev;
     RING_IDX rp,cons,req_prod;
     int nr_consumed, more, i, notify;
 
     nr_consumed = 0;
 moretodo:
-    rp = dev->rx.sring->rsp_prod;
+    rp = q->rx.sring->rsp_prod;
     rmb(); /* Ensure we see queued responses up to 'rp'. */
 
-    for (cons = dev->rx.rsp_cons; cons != rp; nr_consumed++, cons++)
+    for (cons = q->rx.rsp_cons; cons != rp; nr_consumed++, cons++)
     {
         struct net_buffer* buf;
         unsigned char* page;
         int id;
 
-        struct netif_rx_response *rx = RING_GET_RESPONSE(&dev->rx, cons);
+        struct netif_rx_response *rx = RING_GET_RESPONSE(&q->rx, cons);
 
         id = rx->id;
         BUG_ON(id >= NET_RX_RING_SIZE);
 
-        buf = &dev->rx_buffers[id];
+        buf = &q->rx_buffers[id];
         page = (unsigned char*)buf->page;
-        gnttab_end_access(buf->gref);
+        gntcache_put(dev->gcache, buf->mfn, 0);
 
         if (rx->status > NETIF_RSP_NULL)
         {
-		dev->netif_rx(dev, page+rx->offset, rx->status);
+		buf->page = dev->netif_rx(dev, q->id, page, page+rx->offset,
+		    rx->status);
         }
     }
-    dev->rx.rsp_cons=cons;
+    q->rx.rsp_cons=cons;
 
-    RING_FINAL_CHECK_FOR_RESPONSES(&dev->rx,more);
+    RING_FINAL_CHECK_FOR_RESPONSES(&q->rx,more);
     if(more) goto moretodo;
 
-    req_prod = dev->rx.req_prod_pvt;
+    req_prod = q->rx.req_prod_pvt;
 
     for(i=0; i<nr_consumed; i++)
     {
         int id = xennet_rxidx(req_prod + i);
-        netif_rx_request_t *req = RING_GET_REQUEST(&dev->rx, req_prod + i);
-        struct net_buffer* buf = &dev->rx_buffers[id];
+        netif_rx_request_t *req = RING_GET_REQUEST(&q->rx, req_prod + i);
+        struct net_buffer* buf = &q->rx_buffers[id];
         void* page = buf->page;
 
         /* We are sure to have free gnttab entries since they got released above */
-        buf->gref = req->gref = 
-            gnttab_grant_access(dev->dom,virt_to_mfn(page),0);
+        buf->mfn = virt_to_mfn(page);
+        buf->gref = req->gref = gntcache_get(dev->gcache, buf->mfn, 0);
 
         req->id = id;
     }
 
     wmb();
 
-    dev->rx.req_prod_pvt = req_prod + i;
+    q->rx.req_prod_pvt = req_prod + i;
     
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->rx, notify);
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&q->rx, notify);
     if (notify)
-        minios_notify_remote_via_evtchn(dev->evtchn);
+        minios_notify_remote_via_evtchn(q->evtchn);
 
 }
 
-void network_tx_buf_gc(struct netfront_dev *dev)
+void network_tx_buf_gc(struct netfront_q *q)
 {
-
-
+    struct netfront_dev *dev = q->dev;
     RING_IDX cons, prod;
     unsigned short id;
+    int ndone = 0;
 
     do {
-        prod = dev->tx.sring->rsp_prod;
+        prod = q->tx.sring->rsp_prod;
         rmb(); /* Ensure we see responses up to 'rp'. */
 
-        for (cons = dev->tx.rsp_cons; cons != prod; cons++) 
+        for (cons = q->tx.rsp_cons; cons != prod; cons++) 
         {
             struct netif_tx_response *txrsp;
             struct net_buffer *buf;
 
-            txrsp = RING_GET_RESPONSE(&dev->tx, cons);
+            txrsp = RING_GET_RESPONSE(&q->tx, cons);
             if (txrsp->status == NETIF_RSP_NULL)
                 continue;
 
@@ -167,15 +236,30 @@ void network_tx_buf_gc(struct netfront_dev *dev)
 
             id  = txrsp->id;
             BUG_ON(id >= NET_TX_RING_SIZE);
-            buf = &dev->tx_buffers[id];
-            gnttab_end_access(buf->gref);
+            buf = &q->tx_buffers[id];
+            if (buf->cached)
+                gntcache_put(dev->gcache, buf->mfn, 1);
+            else
+                gnttab_end_access(buf->gref);
             buf->gref=GRANT_INVALID_REF;
 
-	    add_id_to_freelist(id,dev->tx_freelist);
-	    up(&dev->tx_sem);
+            /* last slot of a packet?  hand it over for reaping */
+            if (buf->pkt != NET_TX_NOPKT) {
+                struct net_txpkt *pkt = &q->tx_pkts[buf->pkt];
+
+                if (--pkt->nslots == 0) {
+                    pkt->next = q->tx_donehead;
+                    q->tx_donehead = buf->pkt;
+                    ndone++;
+                }
+                buf->pkt = NET_TX_NOPKT;
+            }
+
+	    add_id_to_freelist(id,q->tx_freelist);
+	    up(&q->tx_sem);
         }
 
-        dev->tx.rsp_cons = prod;
+        q->tx.rsp_cons = prod;
 
         /*
          * Set a new event, then check for race with update of tx_cons.
@@ -185,102 +269,108 @@ void network_tx_buf_gc(struct netfront_dev *dev)
          * data is outstanding: in such cases notification from Xen is
          * likely to be the only kick that we'll get.
          */
-        dev->tx.sring->rsp_event =
-            prod + ((dev->tx.sring->req_prod - prod) >> 1) + 1;
+        q->tx.sring->rsp_event =
+            prod + ((q->tx.sring->req_prod - prod) >> 1) + 1;
         mb();
-    } while ((cons == prod) && (prod != dev->tx.sring->rsp_prod));
-
+    } while ((cons == prod) && (prod != q->tx.sring->rsp_prod));
 
+    if (ndone && dev->netif_txdone)
+        dev->netif_txdone(dev, q->id);
 }
 
 void netfront_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
     int flags;
-    struct netfront_dev *dev = data;
+    struct netfront_q *q = data;
 
     local_irq_save(flags);
 
-    network_tx_buf_gc(dev);
-    network_rx(dev);
+    network_tx_buf_gc(q);
+    network_rx(q);
 
     local_irq_restore(flags);
 }
 
 
-static void free_netfront(struct netfront_dev *dev)
+static void free_queue(struct netfront_q *q)
 {
     int i;
 
+    netfront_xmit_push(q->dev, q->id);
     for(i=0;i<NET_TX_RING_SIZE;i++)
-	down(&dev->tx_sem);
+	down(&q->tx_sem);
 
-    minios_mask_evtchn(dev->evtchn);
+    minios_mask_evtchn(q->evtchn);
 
-    bmk_memfree(dev->mac, BMK_MEMWHO_WIREDBMK);
-    bmk_memfree(dev->backend, BMK_MEMWHO_WIREDBMK);
+    gnttab_end_access(q->rx_ring_ref);
+    gnttab_end_access(q->tx_ring_ref);
 
-    gnttab_end_access(dev->rx_ring_ref);
-    gnttab_end_access(dev->tx_ring_ref);
+    bmk_pgfree_one(q->rx.sring);
+    bmk_pgfree_one(q->tx.sring);
 
-    bmk_pgfree_one(dev->rx.sring);
-    bmk_pgfree_one(dev->tx.sring);
+    minios_unbind_evtchn(q->evtchn);
+}
 
-    minios_unbind_evtchn(dev->evtchn);
+static void free_queue_buffers(struct netfront_q *q)
+{
+    int i;
 
-    for(i=0;i<NET_RX_RING_SIZE;i++) {
-	gnttab_end_access(dev->rx_buffers[i].gref);
-	bmk_pgfree_one(dev->rx_buffers[i].page);
-    }
+    for(i=0;i<NET_RX_RING_SIZE;i++)
+	bmk_pgfree_one(q->rx_buffers[i].page);
 
     for(i=0;i<NET_TX_RING_SIZE;i++)
-	if (dev->tx_buffers[i].page)
-	    bmk_pgfree_one(dev->tx_buffers[i].page);
+	if (q->tx_buffers[i].page)
+	    bmk_pgfree_one(q->tx_buffers[i].page);
+}
+
+static void free_netfront(struct netfront_dev *dev)
+{
+    int i;
+
+    for (i = 0; i < dev->nqueues; i++)
+        free_queue(&dev->queues[i]);
+
+    bmk_memfree(dev->mac, BMK_MEMWHO_WIREDBMK);
+    bmk_memfree(dev->backend, BMK_MEMWHO_WIREDBMK);
+
+    /* the grants must be gone before the pages are */
+    if (dev->gcache)
+        gntcache_destroy(dev->gcache);
 
+    for (i = 0; i < dev->nqueues; i++)
+        free_queue_buffers(&dev->queues[i]);
+
+    bmk_memfree(dev->queues, BMK_MEMWHO_WIREDBMK);
     bmk_memfree(dev, BMK_MEMWHO_WIREDBMK);
 }
 
-struct netfront_dev *netfront_init(char *_nodename, void (*thenetif_rx)(struct netfront_dev *, unsigned char* data, int len), unsigned char rawmac[6], char **ip, void *priv)
+static void setup_queue(struct netfront_dev *dev, struct netfront_q *q, int id)
 {
-    xenbus_transaction_t xbt;
-    char* err;
-    char* message=NULL;
     struct netif_tx_sring *txs;
     struct netif_rx_sring *rxs;
-    int retry=0;
     int i;
-    char* msg = NULL;
-    char path[64];
-    struct netfront_dev *dev;
-    static int netfrontends = 0;
-
-    dev = bmk_memcalloc(1, sizeof(*dev), BMK_MEMWHO_WIREDBMK);
-    dev->netfront_priv = priv;
 
-    if (!_nodename)
-        bmk_snprintf(dev->nodename, sizeof(dev->nodename),
-	    "device/vif/%d", netfrontends);
-    else
-        bmk_strncpy(dev->nodename, _nodename, sizeof(dev->nodename)-1);
-    netfrontends++;
+    q->dev = dev;
+    q->id = id;
 
-    minios_printk("net TX ring size %d\n", NET_TX_RING_SIZE);
-    minios_printk("net RX ring size %d\n", NET_RX_RING_SIZE);
-    init_SEMAPHORE(&dev->tx_sem, NET_TX_RING_SIZE);
+    init_SEMAPHORE(&q->tx_sem, NET_TX_RING_SIZE);
+    init_SEMAPHORE(&q->tx_pktsem, NET_TX_RING_SIZE);
     for(i=0;i<NET_TX_RING_SIZE;i++)
     {
-	add_id_to_freelist(i,dev->tx_freelist);
-        dev->tx_buffers[i].page = NULL;
+	add_id_to_freelist(i,q->tx_freelist);
+	add_id_to_freelist(i,q->tx_pktfreelist);
+        q->tx_buffers[i].page = NULL;
+        q->tx_buffers[i].pkt = NET_TX_NOPKT;
     }
+    q->tx_donehead = NET_TX_NOPKT;
 
     for(i=0;i<NET_RX_RING_SIZE;i++)
     {
 	/* TODO: that's a lot of memory */
-        dev->rx_buffers[i].page = bmk_pgalloc_one();
+        q->rx_buffers[i].page = bmk_pgalloc_one();
     }
 
-    bmk_snprintf(path, sizeof(path), "%s/backend-id", dev->nodename);
-    dev->dom = xenbus_read_integer(path);
-        minios_evtchn_alloc_unbound(dev->dom, netfront_handler, dev, &dev->evtchn);
+    minios_evtchn_alloc_unbound(dev->dom, netfront_handler, q, &q->evtchn);
 
     txs = bmk_pgalloc_one();
     rxs = bmk_pgalloc_one();
@@ -290,15 +380,129 @@ struct netfront_dev *netfront_init(char *_nodename, void (*thenetif_rx)(struct n
 
     SHARED_RING_INIT(txs);
     SHARED_RING_INIT(rxs);
-    FRONT_RING_INIT(&dev->tx, txs, PAGE_SIZE);
-    FRONT_RING_INIT(&dev->rx, rxs, PAGE_SIZE);
+    FRONT_RING_INIT(&q->tx, txs, PAGE_SIZE);
+    FRONT_RING_INIT(&q->rx, rxs, PAGE_SIZE);
+
+    q->tx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(txs),0);
+    q->rx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(rxs),0);
+
+    init_rx_buffers(q);
+}
+
+/*
+ * Number of queues to use: what the backend supports, capped by
+ * what we support.  Backends without multi-queue get one queue,
+ * configured with the old single-ring keys.
+ */
+static int negotiate_queues(struct netfront_dev *dev)
+{
+    char path[bmk_strlen(dev->backend) + 1 + 22 + 1];
+    char *err, *val;
+    unsigned long n;
+
+    bmk_snprintf(path, sizeof(path), "%s/multi-queue-max-queues",
+        dev->backend);
+    if ((err = xenbus_read(XBT_NIL, path, &val)) != NULL) {
+        bmk_memfree(err, BMK_MEMWHO_WIREDBMK);
+        return 1;
+    }
+    n = bmk_strtoul(val, NULL, 10);
+    bmk_memfree(val, BMK_MEMWHO_WIREDBMK);
+
+    if (n < 1)
+        n = 1;
+    if (n > NETFRONT_MAXQUEUES)
+        n = NETFRONT_MAXQUEUES;
+    return n;
+}
+
+static char *write_queue(xenbus_transaction_t xbt, struct netfront_q *q,
+    const char **message)
+{
+    struct netfront_dev *dev = q->dev;
+    char node[sizeof(dev->nodename) + 16];
+    char *err;
+
+    if (dev->nqueues == 1)
+        bmk_strcpy(node, dev->nodename);
+    else
+        bmk_snprintf(node, sizeof(node), "%s/queue-%d", dev->nodename, q->id);
+
+    err = xenbus_printf(xbt, node, "tx-ring-ref","%u",
+                q->tx_ring_ref);
+    if (err) {
+        *message = "writing tx ring-ref";
+        return err;
+    }
+    err = xenbus_printf(xbt, node, "rx-ring-ref","%u",
+                q->rx_ring_ref);
+    if (err) {
+        *message = "writing rx ring-ref";
+        return err;
+    }
+    err = xenbus_printf(xbt, node,
+                "event-channel", "%u", q->evtchn);
+    if (err) {
+        *message = "writing event-channel";
+        return err;
+    }
+    return NULL;
+}
+
+struct netfront_dev *netfront_init(char *_nodename, void *(*thenetif_rx)(struct netfront_dev *, int queue, void *page, unsigned char* data, int len), void (*thenetif_txdone)(struct netfront_dev *, int queue), unsigned char rawmac[6], char **ip, void *priv)
+{
+    xenbus_transaction_t xbt;
+    char* err = NULL;
+    const char* message=NULL;
+    int retry=0;
+    int i, nqueues;
+    char* msg = NULL;
+    char path[64];
+    struct netfront_dev *dev;
+    static int netfrontends = 0;
+
+    if ((dev = bmk_memcalloc(1, sizeof(*dev), BMK_MEMWHO_WIREDBMK)) == NULL) {
+        minios_printk("%s: out of memory\n", __func__);
+        return NULL;
+    }
+    dev->netfront_priv = priv;
 
-    dev->tx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(txs),0);
-    dev->rx_ring_ref = gnttab_grant_access(dev->dom,virt_to_mfn(rxs),0);
+    if (!_nodename)
+        bmk_snprintf(dev->nodename, sizeof(dev->nodename),
+	    "device/vif/%d", netfrontends);
+    else
+        bmk_strncpy(dev->nodename, _nodename, sizeof(dev->nodename)-1);
+    netfrontends++;
+
+    bmk_snprintf(path, sizeof(path), "%s/backend-id", dev->nodename);
+    dev->dom = xenbus_read_integer(path);
+
+    bmk_snprintf(path, sizeof(path), "%s/backend", dev->nodename);
+    msg = xenbus_read(XBT_NIL, path, &dev->backend);
+    if (dev->backend == NULL) {
+        minios_printk("%s: backend failed\n", __func__);
+        goto error;
+    }
+
+    nqueues = negotiate_queues(dev);
+    minios_printk("net TX ring size %d\n", NET_TX_RING_SIZE);
+    minios_printk("net RX ring size %d\n", NET_RX_RING_SIZE);
+    minios_printk("net queues %d\n", nqueues);
 
-    init_rx_buffers(dev);
+    dev->gcache = gntcache_create(dev->dom, nqueues * NET_GNTCACHE_SIZE);
+    dev->queues = bmk_memcalloc(nqueues, sizeof(*dev->queues),
+        BMK_MEMWHO_WIREDBMK);
+    if (dev->gcache == NULL || dev->queues == NULL) {
+        minios_printk("%s: out of memory\n", __func__);
+        goto error;
+    }
+    for (i = 0; i < nqueues; i++) {
+        setup_queue(dev, &dev->queues[i], i);
+        dev->nqueues++;
+    }
 
     dev->netif_rx = thenetif_rx;
+    dev->netif_txdone = thenetif_txdone;
 
     xenbus_event_queue_init(&dev->events);
 
@@ -309,23 +513,17 @@ again:
         bmk_memfree(err, BMK_MEMWHO_WIREDBMK);
     }
 
-    err = xenbus_printf(xbt, dev->nodename, "tx-ring-ref","%u",
-                dev->tx_ring_ref);
-    if (err) {
-        message = "writing tx ring-ref";
-        goto abort_transaction;
-    }
-    err = xenbus_printf(xbt, dev->nodename, "rx-ring-ref","%u",
-                dev->rx_ring_ref);
-    if (err) {
-        message = "writing rx ring-ref";
-        goto abort_transaction;
+    if (dev->nqueues > 1) {
+        err = xenbus_printf(xbt, dev->nodename, "multi-queue-num-queues",
+                    "%u", dev->nqueues);
+        if (err) {
+            message = "writing multi-queue-num-queues";
+            goto abort_transaction;
+        }
     }
-    err = xenbus_printf(xbt, dev->nodename,
-                "event-channel", "%u", dev->evtchn);
-    if (err) {
-        message = "writing event-channel";
-        goto abort_transaction;
+    for (i = 0; i < dev->nqueues; i++) {
+        if ((err = write_queue(xbt, &dev->queues[i], &message)) != NULL)
+            goto abort_transaction;
     }
     err = xenbus_printf(xbt, dev->nodename, "feature-no-csum-offload", "%u", 1);
     if (err) {
@@ -364,12 +562,10 @@ abort_transaction:
 
 done:
 
-    bmk_snprintf(path, sizeof(path), "%s/backend", dev->nodename);
-    msg = xenbus_read(XBT_NIL, path, &dev->backend);
     bmk_snprintf(path, sizeof(path), "%s/mac", dev->nodename);
     msg = xenbus_read(XBT_NIL, path, &dev->mac);
 
-    if ((dev->backend == NULL) || (dev->mac == NULL)) {
+    if (dev->mac == NULL) {
         minios_printk("%s: backend/mac failed\n", __func__);
         goto error;
     }
@@ -400,7 +596,8 @@ done:
         }
     }
 
-    minios_unmask_evtchn(dev->evtchn);
+    for (i = 0; i < dev->nqueues; i++)
+        minios_unmask_evtchn(dev->queues[i].evtchn);
 
     if (rawmac) {
 	char *p;
@@ -432,9 +629,11 @@ void netfront_shutdown(struct netfront_dev *dev)
 {
     char* err = NULL;
     XenbusState state;
+    int i;
 
     char path[bmk_strlen(dev->backend) + 1 + 5 + 1];
     char nodename[bmk_strlen(dev->nodename) + 1 + 5 + 1];
+    char key[sizeof(dev->nodename) + 32];
 
     minios_printk("close network: backend at %s\n",dev->backend);
 
@@ -476,21 +675,31 @@ close:
     if (err) bmk_memfree(err, BMK_MEMWHO_WIREDBMK);
     xenbus_unwatch_path_token(XBT_NIL, path, path);
 
-    bmk_snprintf(path, sizeof(path), "%s/tx-ring-ref", nodename);
-    xenbus_rm(XBT_NIL, path);
-    bmk_snprintf(path, sizeof(path), "%s/rx-ring-ref", nodename);
-    xenbus_rm(XBT_NIL, path);
-    bmk_snprintf(path, sizeof(path), "%s/event-channel", nodename);
-    xenbus_rm(XBT_NIL, path);
-    bmk_snprintf(path, sizeof(path), "%s/request-rx-copy", nodename);
-    xenbus_rm(XBT_NIL, path);
+    if (dev->nqueues > 1) {
+        for (i = 0; i < dev->nqueues; i++) {
+            bmk_snprintf(key, sizeof(key), "%s/queue-%d", dev->nodename, i);
+            xenbus_rm(XBT_NIL, key);
+        }
+        bmk_snprintf(key, sizeof(key), "%s/multi-queue-num-queues",
+            dev->nodename);
+        xenbus_rm(XBT_NIL, key);
+    } else {
+        bmk_snprintf(key, sizeof(key), "%s/tx-ring-ref", dev->nodename);
+        xenbus_rm(XBT_NIL, key);
+        bmk_snprintf(key, sizeof(key), "%s/rx-ring-ref", dev->nodename);
+        xenbus_rm(XBT_NIL, key);
+        bmk_snprintf(key, sizeof(key), "%s/event-channel", dev->nodename);
+        xenbus_rm(XBT_NIL, key);
+    }
+    bmk_snprintf(key, sizeof(key), "%s/request-rx-copy", dev->nodename);
+    xenbus_rm(XBT_NIL, key);
 
     if (!err)
         free_netfront(dev);
 }
 
 
-void init_rx_buffers(struct netfront_dev *dev)
+void init_rx_buffers(struct netfront_q *q)
 {
     int i, requeue_idx;
     netif_rx_request_t *req;
@@ -499,74 +708,276 @@ void init_rx_buffers(struct netfront_dev *dev)
     /* Rebuild the RX buffer freelist and the RX ring itself. */
     for (requeue_idx = 0, i = 0; i < NET_RX_RING_SIZE; i++) 
     {
-        struct net_buffer* buf = &dev->rx_buffers[requeue_idx];
-        req = RING_GET_REQUEST(&dev->rx, requeue_idx);
+        struct net_buffer* buf = &q->rx_buffers[requeue_idx];
+        req = RING_GET_REQUEST(&q->rx, requeue_idx);
 
-        buf->gref = req->gref = 
-            gnttab_grant_access(dev->dom,virt_to_mfn(buf->page),0);
+        buf->mfn = virt_to_mfn(buf->page);
+        buf->gref = req->gref = gntcache_get(q->dev->gcache, buf->mfn, 0);
 
         req->id = requeue_idx;
 
         requeue_idx++;
     }
 
-    dev->rx.req_prod_pvt = requeue_idx;
+    q->rx.req_prod_pvt = requeue_idx;
 
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->rx, notify);
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&q->rx, notify);
 
     if (notify) 
-        minios_notify_remote_via_evtchn(dev->evtchn);
+        minios_notify_remote_via_evtchn(q->evtchn);
 
-    dev->rx.sring->rsp_event = dev->rx.rsp_cons + 1;
+    q->rx.sring->rsp_event = q->rx.rsp_cons + 1;
 }
 
 
-void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
+/*
+ * Walk the packet in page-sized pieces and either count the slots
+ * it needs (ids == NULL) or fill them in.  Pieces shorter than
+ * NET_TX_COPYMAX, or everything if copyall is set, are packed into
+ * bounce pages.  Requests are filled starting at the private
+ * producer index, which is advanced by the caller.
+ */
+static int
+netfront_tx_slots(struct netfront_q *q,
+    const struct netfront_txseg *segs, int nsegs, int copyall,
+    unsigned short *ids)
 {
-    int flags;
-    struct netif_tx_request *tx;
-    RING_IDX i;
-    int notify;
-    unsigned short id;
-    struct net_buffer* buf;
-    void* page;
+    struct netif_tx_request *tx = NULL;
+    struct net_buffer *buf = NULL;
+    unsigned long room = 0, off, chunk, c;
+    unsigned char *p;
+    unsigned long len;
+    int i, nslots = 0;
+
+    for (i = 0; i < nsegs; i++) {
+        p = segs[i].ts_base;
+        len = segs[i].ts_len;
+        while (len) {
+            off = (unsigned long)p & (PAGE_SIZE-1);
+            chunk = PAGE_SIZE - off;
+            if (chunk > len)
+                chunk = len;
+
+            if (!copyall && chunk >= NET_TX_COPYMAX) {
+                if (ids) {
+                    buf = &q->tx_buffers[ids[nslots]];
+                    tx = RING_GET_REQUEST(&q->tx,
+                        q->tx.req_prod_pvt + nslots);
+                    buf->mfn = virt_to_mfn(p);
+                    buf->gref = tx->gref = gnttab_grant_access(q->dev->dom,
+                        buf->mfn, 1);
+                    buf->cached = 0;
+                    tx->offset = off;
+                    tx->size = chunk;
+                }
+                nslots++;
+                room = 0;
+                p += chunk;
+                len -= chunk;
+                continue;
+            }
+
+            /* copy, possibly spilling over into a new bounce page */
+            while (chunk) {
+                if (room == 0) {
+                    if (ids) {
+                        buf = &q->tx_buffers[ids[nslots]];
+                        if (!buf->page)
+                            buf->page = bmk_pgalloc_one();
+                        tx = RING_GET_REQUEST(&q->tx,
+                            q->tx.req_prod_pvt + nslots);
+                        buf->mfn = virt_to_mfn(buf->page);
+                        buf->gref = tx->gref = gntcache_get(q->dev->gcache,
+                            buf->mfn, 1);
+                        buf->cached = 1;
+                        tx->offset = 0;
+                        tx->size = 0;
+                    }
+                    nslots++;
+                    room = PAGE_SIZE;
+                }
+                c = chunk < room ? chunk : room;
+                if (ids) {
+                    bmk_memcpy((char *)buf->page + tx->size, p, c);
+                    tx->size += c;
+                }
+                room -= c;
+                chunk -= c;
+                p += c;
+                len -= c;
+            }
+        }
+    }
 
-    BUG_ON(len > PAGE_SIZE);
+    return nslots;
+}
+
+static void
+netfront_tx_reserve(struct netfront_q *q, struct semaphore *sem)
+{
+
+    /* make sure the backend sees what we're waiting for */
+    if (!trydown(sem)) {
+        netfront_xmit_push(q->dev, q->id);
+        down(sem);
+    }
+}
+
+/*
+ * Queue a packet consisting of nsegs segments for transmission
+ * on the given queue.  Packets of one flow should always go to the
+ * same queue, since there is no ordering between queues.  If cookie
+ * is NULL, the data is copied and the caller may reuse the buffers
+ * right away.  Otherwise the buffers may be granted to the backend
+ * directly, and must stay intact until cookie is returned by
+ * netfront_xmit_reap().  The packet is not guaranteed to be seen by
+ * the backend before netfront_xmit_push() is called.
+ *
+ * Returns 0 on success or -1 if the packet is too large to send.
+ */
+int
+netfront_xmit_queue(struct netfront_dev *dev, int queue,
+    const struct netfront_txseg *segs, int nsegs, void *cookie)
+{
+    struct netfront_q *q = &dev->queues[queue];
+    unsigned short ids[NET_TX_MAXSLOTS];
+    struct netif_tx_request *tx;
+    unsigned long tlen;
+    unsigned short pktid = NET_TX_NOPKT;
+    int copyall, nslots, flags, i;
+
+    for (tlen = 0, i = 0; i < nsegs; i++)
+        tlen += segs[i].ts_len;
+    if (tlen == 0 || tlen > 0xffff)
+        return -1;
+
+    copyall = (cookie == NULL);
+    nslots = netfront_tx_slots(q, segs, nsegs, copyall, NULL);
+    if (nslots > NET_TX_MAXSLOTS) {
+        copyall = 1;
+        nslots = netfront_tx_slots(q, segs, nsegs, copyall, NULL);
+        BUG_ON(nslots > NET_TX_MAXSLOTS);
+    }
 
-    down(&dev->tx_sem);
+    if (cookie)
+        netfront_tx_reserve(q, &q->tx_pktsem);
+    for (i = 0; i < nslots; i++)
+        netfront_tx_reserve(q, &q->tx_sem);
 
     local_irq_save(flags);
-    id = get_id_from_freelist(dev->tx_freelist);
+    for (i = 0; i < nslots; i++)
+        ids[i] = get_id_from_freelist(q->tx_freelist);
+    if (cookie)
+        pktid = get_id_from_freelist(q->tx_pktfreelist);
     local_irq_restore(flags);
 
-    buf = &dev->tx_buffers[id];
-    page = buf->page;
-    if (!page)
-	page = buf->page = bmk_pgalloc_one();
+    if (cookie) {
+        q->tx_pkts[pktid].cookie = cookie;
+        q->tx_pkts[pktid].nslots = nslots;
+    }
+
+    netfront_tx_slots(q, segs, nsegs, copyall, ids);
+    for (i = 0; i < nslots; i++) {
+        tx = RING_GET_REQUEST(&q->tx, q->tx.req_prod_pvt + i);
+        tx->id = ids[i];
+        tx->flags = (i == nslots-1) ? 0 : NETTXF_more_data;
+        q->tx_buffers[ids[i]].pkt = pktid;
+    }
 
-    i = dev->tx.req_prod_pvt;
-    tx = RING_GET_REQUEST(&dev->tx, i);
+    /* the first slot gives the size of the entire packet */
+    tx = RING_GET_REQUEST(&q->tx, q->tx.req_prod_pvt);
+    tx->size = tlen;
 
-    bmk_memcpy(page,data,len);
+    q->tx.req_prod_pvt += nslots;
 
-    buf->gref = 
-        tx->gref = gnttab_grant_access(dev->dom,virt_to_mfn(page),1);
+    return 0;
+}
 
-    tx->offset=0;
-    tx->size = len;
-    tx->flags=0;
-    tx->id = id;
-    dev->tx.req_prod_pvt = i + 1;
+/*
+ * Make queued packets visible to the backend and notify it if needed.
+ */
+void
+netfront_xmit_push(struct netfront_dev *dev, int queue)
+{
+    struct netfront_q *q = &dev->queues[queue];
+    int flags;
+    int notify;
 
     wmb();
 
-    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&dev->tx, notify);
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&q->tx, notify);
+
+    if(notify) minios_notify_remote_via_evtchn(q->evtchn);
+
+    local_irq_save(flags);
+    network_tx_buf_gc(q);
+    local_irq_restore(flags);
+}
 
-    if(notify) minios_notify_remote_via_evtchn(dev->evtchn);
+/*
+ * Return the cookie of a completed packet, or NULL if there are none.
+ */
+void *
+netfront_xmit_reap(struct netfront_dev *dev, int queue)
+{
+    struct netfront_q *q = &dev->queues[queue];
+    struct net_txpkt *pkt;
+    unsigned short pktid;
+    void *cookie = NULL;
+    int flags;
 
     local_irq_save(flags);
-    network_tx_buf_gc(dev);
+    if ((pktid = q->tx_donehead) != NET_TX_NOPKT) {
+        pkt = &q->tx_pkts[pktid];
+        q->tx_donehead = pkt->next;
+        cookie = pkt->cookie;
+        pkt->cookie = NULL;
+        add_id_to_freelist(pktid, q->tx_pktfreelist);
+    }
     local_irq_restore(flags);
+
+    if (cookie)
+        up(&q->tx_pktsem);
+    return cookie;
+}
+
+/*
+ * Wait until the backend has completed all queued packets on all
+ * queues.
+ */
+void
+netfront_xmit_wait(struct netfront_dev *dev)
+{
+    struct netfront_q *q;
+    int i, j;
+
+    for (j = 0; j < dev->nqueues; j++) {
+        q = &dev->queues[j];
+        netfront_xmit_push(dev, j);
+        for (i = 0; i < NET_TX_RING_SIZE; i++)
+            down(&q->tx_sem);
+        for (i = 0; i < NET_TX_RING_SIZE; i++)
+            up(&q->tx_sem);
+    }
+}
+
+void netfront_xmit(struct netfront_dev *dev, unsigned char* data,int len)
+{
+    struct netfront_txseg seg;
+
+    BUG_ON(len > PAGE_SIZE);
+
+    seg.ts_base = data;
+    seg.ts_len = len;
+    netfront_xmit_queue(dev, 0, &seg, 1, NULL);
+    netfront_xmit_push(dev, 0);
+}
+
+int
+netfront_nqueues(struct netfront_dev *dev)
+{
+
+	return dev->nqueues;
 }
 
 void *
@@ -576,3 +987,14 @@ netfront_get_private(struct netfront_dev *dev)
 	return dev->netfront_priv;
 }
 
+
+/*
+ * A page handed out by netif_rx is leaving the driver for good.
+ * End its grant so that the backend can no longer write to it.
+ */
+void
+netfront_rxpage_release(struct netfront_dev *dev, void *page)
+{
+
+	gntcache_evict(dev->gcache, virt_to_mfn(page), 0);
+}
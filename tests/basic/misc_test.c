@@ -1,12 +1,20 @@
 #include <sys/param.h>
+#include <sys/event.h>
 #include <sys/times.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <rumprun/tester.h>
@@ -115,6 +123,374 @@ test_mmap_anon(void)
 	return rv;
 }
 
+/*
+ * Reserve address space with PROT_NONE and commit part of it with
+ * MAP_FIXED, like language runtimes do.
+ */
+static int
+test_mmap_fixed(void)
+{
+	const long pagesize = sysconf(_SC_PAGESIZE);
+	uint8_t *v, *p;
+	int i, rv = 0;
+
+	printf("testing mmap(MAP_FIXED) in a reservation ... ");
+	v = mmap(NULL, 16*pagesize, PROT_NONE, MAP_ANON, -1, 0);
+	if (v == MAP_FAILED) {
+		rv = errno;
+		goto out;
+	}
+	p = mmap(v + 4*pagesize, 4*pagesize, PROT_READ|PROT_WRITE,
+	    MAP_ANON|MAP_FIXED, -1, 0);
+	if (p != v + 4*pagesize) {
+		rv = p == MAP_FAILED ? errno : EINVAL;
+		goto out;
+	}
+	for (i = 0; i < 4*pagesize; i++) {
+		if (p[i] != 0) {
+			rv = EINVAL;
+			goto out;
+		}
+	}
+	memset(p, 'a', 4*pagesize);
+	rv = munmap(v, 16*pagesize);
+ out:
+	prfres(rv);
+
+	return rv;
+}
+
+/*
+ * Map a file and check that it reads the same as read() says,
+ * also after telling the kernel we don't need the pages.
+ */
+static int
+test_mmap_file(void)
+{
+	const char *path = "/etc/passwd";
+	struct stat sb;
+	char *buf = NULL, *v = MAP_FAILED;
+	int fd, rv = 0;
+
+	printf("testing mmap() of a file ... ");
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if ((buf = malloc(sb.st_size)) == NULL
+	    || read(fd, buf, sb.st_size) != sb.st_size) {
+		rv = EIO;
+		goto out;
+	}
+
+	v = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (v == MAP_FAILED) {
+		rv = errno;
+		goto out;
+	}
+	if (memcmp(v, buf, sb.st_size) != 0) {
+		rv = EINVAL;
+		goto out;
+	}
+	if (madvise(v, sb.st_size, MADV_DONTNEED) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if (memcmp(v, buf, sb.st_size) != 0)
+		rv = EINVAL;
+
+ out:
+	if (v != MAP_FAILED)
+		munmap(v, sb.st_size);
+	if (fd != -1)
+		close(fd);
+	free(buf);
+	prfres(rv);
+
+	return rv;
+}
+
+/*
+ * write() to a file from a mapping of the same file.  The first touch
+ * of the mapping happens inside write(), with the vnode locked.
+ */
+static int
+test_mmap_selfwrite(void)
+{
+	const char *path = "/tmp/mmapself";
+	const long pagesize = sysconf(_SC_PAGESIZE);
+	uint8_t *buf = NULL, *v = MAP_FAILED;
+	int fd = -1, rv = 0;
+
+	printf("testing write() to a file from its own mapping ... ");
+	if ((buf = malloc(pagesize)) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	memset(buf, 'm', pagesize);
+	if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if (write(fd, buf, pagesize) != pagesize) {
+		rv = EIO;
+		goto out;
+	}
+
+	v = mmap(NULL, pagesize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (v == MAP_FAILED) {
+		rv = errno;
+		goto out;
+	}
+	if (pwrite(fd, v, pagesize, 2*pagesize) != pagesize) {
+		rv = EIO;
+		goto out;
+	}
+
+	memset(buf, 0, pagesize);
+	if (pread(fd, buf, pagesize, 2*pagesize) != pagesize) {
+		rv = EIO;
+		goto out;
+	}
+	if (memcmp(v, buf, pagesize) != 0 || buf[0] != 'm')
+		rv = EINVAL;
+
+ out:
+	if (v != MAP_FAILED)
+		munmap(v, pagesize);
+	if (fd != -1) {
+		close(fd);
+		unlink(path);
+	}
+	free(buf);
+	prfres(rv);
+
+	return rv;
+}
+
+static int64_t
+tsns(const struct timespec *ts)
+{
+
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/*
+ * Spin for a while and check that the CPU time clocks and getrusage()
+ * noticed, and that sleeping counts as a voluntary context switch.
+ */
+static int
+test_cputime(void)
+{
+	struct timespec wall0, wall1, thr0, thr1, ts;
+	struct rusage ru0, ru1;
+	int64_t spun;
+	int rv = 0;
+
+	printf("testing CPU time accounting ... ");
+	if (getrusage(RUSAGE_SELF, &ru0) == -1
+	    || clock_gettime(CLOCK_THREAD_CPUTIME_ID, &thr0) == -1) {
+		rv = errno;
+		goto out;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &wall0);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &wall1);
+	} while (tsns(&wall1) - tsns(&wall0) < 50*1000*1000);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &thr1);
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000*1000;
+	nanosleep(&ts, NULL);
+	getrusage(RUSAGE_SELF, &ru1);
+
+	/* we were alone, so we should have got nearly all of it */
+	spun = tsns(&thr1) - tsns(&thr0);
+	if (spun < 40*1000*1000 || spun > tsns(&wall1) - tsns(&wall0)) {
+		rv = EINVAL;
+		goto out;
+	}
+	if (timercmp(&ru1.ru_utime, &ru0.ru_utime, <=)
+	    || ru1.ru_nvcsw <= ru0.ru_nvcsw)
+		rv = EINVAL;
+
+ out:
+	prfres(rv);
+
+	return rv;
+}
+
+/*
+ * Put the page allocator under pressure and check that /dev/pgpress
+ * follows.  Allocate until the level goes up, which happens above
+ * the high watermark or at the latest when an allocation fails, and
+ * check that both a kevent and a non-blocking read report it.  Then
+ * free everything and check that the level drops back to none.
+ */
+#define PGPRESS_CHUNK (512*1024)
+#define PGPRESS_NWAIT 50	/* in 100ms steps */
+
+static int
+test_pgpress(void)
+{
+	struct timespec ts = { 0, 0 }, wait = { 5, 0 };
+	struct timespec pause = { 0, 100*1000*1000 };
+	struct kevent kev;
+	void *chunks = NULL, *p;
+	int fd, kq = -1, level, nev, i, rv = 0;
+
+	printf("testing /dev/pgpress ... ");
+	if ((fd = open("/dev/pgpress", O_RDONLY | O_NONBLOCK)) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if ((kq = kqueue()) == -1) {
+		rv = errno;
+		goto out;
+	}
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, 0);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1) {
+		rv = errno;
+		goto out;
+	}
+
+	/* we must start without pressure to see it come and go */
+	if (read(fd, &level, sizeof(level)) != -1 || errno != EAGAIN) {
+		rv = EBUSY;
+		goto out;
+	}
+
+	/* the level is set by a kernel thread, so let it run */
+	nev = 0;
+	while ((p = malloc(PGPRESS_CHUNK)) != NULL) {
+		*(void **)p = chunks;
+		chunks = p;
+		sched_yield();
+		if ((nev = kevent(kq, NULL, 0, &kev, 1, &ts)) != 0)
+			break;
+	}
+	if (p == NULL)
+		nev = kevent(kq, NULL, 0, &kev, 1, &wait);
+	if (nev == -1) {
+		rv = errno;
+		goto out;
+	}
+	if (nev == 0 || kev.data <= 0) {
+		rv = ETIMEDOUT;
+		goto out;
+	}
+	if (read(fd, &level, sizeof(level)) != sizeof(level) || level <= 0) {
+		rv = EINVAL;
+		goto out;
+	}
+
+	while ((p = chunks) != NULL) {
+		chunks = *(void **)p;
+		free(p);
+	}
+	for (i = 0; i < PGPRESS_NWAIT; i++) {
+		if (read(fd, &level, sizeof(level)) == -1 && errno == EAGAIN)
+			break;
+		nanosleep(&pause, NULL);
+	}
+	if (i == PGPRESS_NWAIT)
+		rv = ETIMEDOUT;
+
+ out:
+	while ((p = chunks) != NULL) {
+		chunks = *(void **)p;
+		free(p);
+	}
+	if (kq != -1)
+		close(kq);
+	if (fd != -1)
+		close(fd);
+	prfres(rv);
+
+	return rv;
+}
+
+/* not in an installed header */
+int rumprun_acct_dump(const char *);
+
+#define NLWPCPU 8
+static pthread_mutex_t lwpcpu_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lwpcpu_cv = PTHREAD_COND_INITIALIZER;
+static int lwpcpu_go;
+
+static void *
+lwpcpu_thread(void *arg)
+{
+
+	pthread_mutex_lock(&lwpcpu_mtx);
+	while (!lwpcpu_go)
+		pthread_cond_wait(&lwpcpu_cv, &lwpcpu_mtx);
+	pthread_mutex_unlock(&lwpcpu_mtx);
+	return NULL;
+}
+
+/*
+ * Application threads are spread over the CPUs when created.  Start
+ * a few and check from the scheduler accounting dump, which lists
+ * each thread's CPU, that some of them went to secondary CPUs.
+ */
+static int
+test_lwpcpu(void)
+{
+	const char *path = "/tmp/acct";
+	pthread_t thr[NLWPCPU];
+	char line[256], name[64];
+	int ncpu = 0, nlwp = 0, nap = 0, cpu, i, n, rv = 0;
+	FILE *f;
+
+	printf("testing that threads run on all CPUs ... ");
+	for (n = 0; n < NLWPCPU; n++) {
+		if (pthread_create(&thr[n], NULL, lwpcpu_thread, NULL) != 0) {
+			rv = EINVAL;
+			break;
+		}
+	}
+
+	name[0] = '\0';
+	if (rv == 0 && rumprun_acct_dump(path) == 0
+	    && (f = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (sscanf(line, "sched.ncpu = %d", &ncpu) == 1)
+				continue;
+			if (sscanf(line, "sched.thread.%*[^.].name = %63s",
+			    name) == 1)
+				continue;
+			if (sscanf(line, "sched.thread.%*[^.].cpu = %d",
+			    &cpu) == 1 && strcmp(name, "lwp") == 0) {
+				nlwp++;
+				if (cpu != 0)
+					nap++;
+			}
+		}
+		fclose(f);
+		unlink(path);
+	} else {
+		rv = EINVAL;
+	}
+
+	pthread_mutex_lock(&lwpcpu_mtx);
+	lwpcpu_go = 1;
+	pthread_cond_broadcast(&lwpcpu_cv);
+	pthread_mutex_unlock(&lwpcpu_mtx);
+	for (i = 0; i < n; i++)
+		pthread_join(thr[i], NULL);
+	lwpcpu_go = 0;
+
+	if (rv == 0) {
+		printf("%d cpus, %d/%d threads on secondary cpus ",
+		    ncpu, nap, nlwp);
+		if (nlwp < NLWPCPU || (ncpu > 1 && nap == 0))
+			rv = EINVAL;
+	}
+	prfres(rv);
+	return rv;
+}
+
 static int
 test_etcpasswd(void)
 {
@@ -134,6 +510,12 @@ rumprun_test(int argc, char *argv[])
 	rv += test_times();
 	rv += test_pthread_in_ctor();
 	rv += test_mmap_anon();
+	rv += test_mmap_fixed();
+	rv += test_mmap_file();
+	rv += test_mmap_selfwrite();
+	rv += test_cputime();
+	rv += test_pgpress();
+	rv += test_lwpcpu();
 	rv += test_etcpasswd();
 
 	return rv;
@@ -0,0 +1,158 @@
+/*
+ * Mutex/condvar ping-pong between pthreads.  Every handoff goes
+ * through _lwp_park()/_lwp_unpark(), and the broadcast rounds through
+ * _lwp_unpark_all(), with enough threads around that looking up an
+ * lwp by id shows up in the numbers if it is not O(1).
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <rumprun/tester.h>
+
+#define PINGPONG_ROUNDS 100000
+#define BCAST_THREADS 256
+#define BCAST_ROUNDS 200
+#define THREAD_STACKSIZE (32*1024)
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t donecv = PTHREAD_COND_INITIALIZER;
+
+static int turn;
+static int generation, ndone;
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+	    + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *
+pongthread(void *arg)
+{
+	int i;
+
+	pthread_mutex_lock(&mtx);
+	for (i = 0; i < PINGPONG_ROUNDS; i++) {
+		while (turn != 1)
+			pthread_cond_wait(&cv, &mtx);
+		turn = 0;
+		pthread_cond_signal(&cv);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return NULL;
+}
+
+static int
+test_pingpong(pthread_attr_t *attr)
+{
+	struct timespec start;
+	pthread_t pt;
+	double t;
+	int i;
+
+	printf("mutex/condvar ping-pong, %d rounds ... ", PINGPONG_ROUNDS);
+	fflush(stdout);
+	if (pthread_create(&pt, attr, pongthread, NULL) != 0)
+		errx(1, "pthread_create()");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&mtx);
+	for (i = 0; i < PINGPONG_ROUNDS; i++) {
+		turn = 1;
+		pthread_cond_signal(&cv);
+		while (turn != 0)
+			pthread_cond_wait(&cv, &mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+	t = elapsed(&start);
+
+	if (pthread_join(pt, NULL) != 0)
+		errx(1, "pthread_join()");
+	printf("%.0f round trips/s\n", PINGPONG_ROUNDS / t);
+
+	return 0;
+}
+
+static void *
+bcastthread(void *arg)
+{
+	int gen = 0;
+
+	pthread_mutex_lock(&mtx);
+	while (gen < BCAST_ROUNDS) {
+		while (generation == gen)
+			pthread_cond_wait(&cv, &mtx);
+		gen = generation;
+		if (++ndone == BCAST_THREADS)
+			pthread_cond_signal(&donecv);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return NULL;
+}
+
+static int
+test_broadcast(pthread_attr_t *attr)
+{
+	pthread_t pt[BCAST_THREADS];
+	struct timespec start;
+	double t;
+	int i;
+
+	printf("condvar broadcast to %d threads, %d rounds ... ",
+	    BCAST_THREADS, BCAST_ROUNDS);
+	fflush(stdout);
+	for (i = 0; i < BCAST_THREADS; i++) {
+		if (pthread_create(&pt[i], attr, bcastthread, NULL) != 0)
+			errx(1, "pthread_create()");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&mtx);
+	for (i = 0; i < BCAST_ROUNDS; i++) {
+		ndone = 0;
+		generation++;
+		pthread_cond_broadcast(&cv);
+		while (ndone != BCAST_THREADS)
+			pthread_cond_wait(&donecv, &mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+	t = elapsed(&start);
+
+	for (i = 0; i < BCAST_THREADS; i++) {
+		if (pthread_join(pt[i], NULL) != 0)
+			errx(1, "pthread_join()");
+	}
+	printf("%.1f us/wakeup\n", t * 1e6 / (BCAST_ROUNDS * BCAST_THREADS));
+
+	return 0;
+}
+
+int
+rumprun_test(int argc, char *argv[])
+{
+	pthread_attr_t attr;
+	int rv = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACKSIZE);
+
+	rv += test_pingpong(&attr);
+	rv += test_broadcast(&attr);
+
+	pthread_attr_destroy(&attr);
+
+	return rv;
+}
@@ -0,0 +1,81 @@
+/*
+ * nanosleep() accuracy: how late do we wake up for a range of sleep
+ * lengths.  Sleeping less than asked for is an error.
+ *
+ * The test ends with a few seconds of doing nothing at all.  To see
+ * what an idle guest costs, watch the CPU usage of the hypervisor
+ * process (e.g. qemu under KVM) from the host during that time.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <rumprun/tester.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define SLEEP_TOTAL (200*1000*1000LL)	/* per sleep length */
+#define SLEEP_MAXITER 2000
+#define IDLE_SEC 3
+
+static int64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int
+test_sleep(int64_t nsec)
+{
+	struct timespec ts;
+	int64_t start, late, sum = 0, max = 0;
+	int i, n, rv = 0;
+
+	n = SLEEP_TOTAL / nsec;
+	if (n > SLEEP_MAXITER)
+		n = SLEEP_MAXITER;
+
+	printf("nanosleep(%6lld us) x %4d ... ", (long long)nsec / 1000, n);
+	fflush(stdout);
+	ts.tv_sec = nsec / NSEC_PER_SEC;
+	ts.tv_nsec = nsec % NSEC_PER_SEC;
+	for (i = 0; i < n; i++) {
+		start = now();
+		if (nanosleep(&ts, NULL) != 0)
+			err(1, "nanosleep");
+		late = now() - start - nsec;
+		if (late < 0)
+			rv = 1;
+		sum += late;
+		if (late > max)
+			max = late;
+	}
+	printf("late by %.1f us on average, %.1f us at most%s\n",
+	    sum / 1000.0 / n, max / 1000.0, rv ? ", EARLY WAKEUP" : "");
+
+	return rv;
+}
+
+int
+rumprun_test(int argc, char *argv[])
+{
+	struct timespec ts = { IDLE_SEC, 0 };
+	int rv = 0;
+
+	rv += test_sleep(10*1000);
+	rv += test_sleep(100*1000);
+	rv += test_sleep(1000*1000);
+	rv += test_sleep(10*1000*1000);
+	rv += test_sleep(100*1000*1000);
+
+	printf("idling for %d seconds\n", IDLE_SEC);
+	nanosleep(&ts, NULL);
+
+	return rv;
+}
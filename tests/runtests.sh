@@ -34,13 +34,15 @@ export RUMPRUN_WARNING_STFU=please
 
 # TODO: use a more scalable way of specifying tests
 TESTS='hello/hello.bin basic/ctor_test.bin basic/pthread_test.bin
-	basic/tls_test.bin basic/misc_test.bin'
+	basic/tls_test.bin basic/misc_test.bin basic/pingpong_test.bin
+	basic/sleep_test.bin'
 [ -x hello/hellopp.bin ] && TESTS="${TESTS} hello/hellopp.bin"
 
 STARTMAGIC='=== FOE RUMPRUN 12345 TES-TER 54321 ==='
 ENDMAGIC='=== RUMPRUN 12345 TES-TER 54321 EOF ==='
 
 OPT_SUDO=
+OPT_SMP=
 
 die ()
 {
@@ -74,7 +76,13 @@ runguest ()
 	# img2=$3
 
 	[ -n "${img1}" ] || die runtest without a disk image
-	cookie=$(${RUMPRUN} ${OPT_SUDO} ${STACK} -b ${img1} ${testprog} __test)
+	if [ -n "${OPT_SMP}" ]; then
+		cookie=$(${RUMPRUN} ${OPT_SUDO} ${STACK} -g "-smp ${OPT_SMP}" \
+		    -b ${img1} ${testprog} __test)
+	else
+		cookie=$(${RUMPRUN} ${OPT_SUDO} ${STACK} \
+		    -b ${img1} ${testprog} __test)
+	fi
 	if [ $? -ne 0 -o -z "${cookie}" ]; then
 		TEST_RESULT=ERROR
 		TEST_ECODE=-2
@@ -144,6 +152,13 @@ fi
 STACK=$1
 [ ${STACK} != none ] || exit 0
 
+# run hw guests with two CPUs, so that SMP gets exercised
+case ${STACK} in
+kvm|qemu)
+	OPT_SMP=2
+	;;
+esac
+
 TESTDIR=$(mktemp -d testrun.XXXXXX)
 [ $? -eq 0 ] || die failed to create datadir for testrun
 